@@ -53,6 +53,131 @@ exm_path <- function(path)
   else .Call("Rexm_set_path", as.character(path), PACKAGE="exm")
 }
 
+#' Load or reload the exm allocation policy
+#'
+#' Replace the allocation policy rules in effect (see EXM_POLICY in the exm
+#' library documentation) without restarting R. The rules only affect new
+#' allocations.
+#' @param path Policy file to load. If missing, reload the current file;
+#'   the empty string "" removes all rules.
+#' @return The number of rules in effect, or -1 if the file could not be read
+#'   or parsed (the rules in effect are then unchanged).
+#' @examples
+#' \dontrun{
+#' exm_policy("~/exm.policy")
+#' }
+#' @export
+exm_policy <- function(path)
+{
+  if(missing(path)) .Call("Rexm_policy", NULL, PACKAGE="exm")
+  else .Call("Rexm_policy", path.expand(as.character(path)), PACKAGE="exm")
+}
+
+#' Keep an out-of-core object for later sessions
+#'
+#' Give the exm backing file of a numeric or integer vector a stable name and
+#' keep it when the vector is garbage collected or R exits, so that a later
+#' session can reopen it instantly with \code{\link{exm_attach}}, without
+#' reading the data.
+#' @param object A numeric or integer vector held by exm (see
+#'   \code{\link{exm_lookup}}), or a vector returned by \code{exm_attach}
+#' @param name Name to keep it under: a file name in the exm data path, or a
+#'   path. \code{NULL} makes the object temporary again.
+#' @return 0 on success, -1 on error.
+#' @examples
+#' \dontrun{
+#' x <- runif(5e8)
+#' exm_persist(x, "x")
+#' # In a later session
+#' x <- exm_attach("x")
+#' }
+#' @export
+exm_persist <- function(object, name)
+{
+  if(!is.null(name)) name <- as.character(name)
+  .Call("Rexm_persist", object, name, PACKAGE="exm")
+}
+
+#' Reopen an object kept with exm_persist
+#'
+#' Map a vector kept with \code{\link{exm_persist}} back into memory in
+#' constant time. The result is backed by the kept file: its data is read
+#' from the file as it is used, and the file stays when the result is garbage
+#' collected. Attach in the same R version that kept the object.
+#' @param name Name given to \code{exm_persist}
+#' @return The numeric or integer vector.
+#' @export
+exm_attach <- function(name)
+{
+  .Call("Rexm_attach", as.character(name), PACKAGE="exm")
+}
+
+#' Map a binary data file as a vector
+#'
+#' Present a file of raw doubles or integers in native byte order (no R
+#' header) as a numeric or integer vector, without reading or copying it:
+#' the data is read from the file as it is used. By default the mapping is
+#' copy on write and the file never changes; with \code{shared=TRUE} changes
+#' made in place (by C code, say) are written to the file. The file stays
+#' when the vector is garbage collected.
+#' @param path File path
+#' @param type Element type, "double" or "integer"
+#' @param offset Byte offset of the first element in the file, a multiple of
+#'   the page size
+#' @param length Number of elements, or \code{NA} for the rest of the file
+#' @param shared Write changes through to the file
+#' @return The numeric or integer vector.
+#' @examples
+#' \dontrun{
+#' writeBin(runif(1e6), "x.bin")
+#' x <- exm_map_file("x.bin")
+#' }
+#' @export
+exm_map_file <- function(path, type=c("double", "integer"), offset=0,
+                         length=NA, shared=FALSE)
+{
+  type <- as.integer(match.arg(type) == "integer")
+  length <- if(is.na(length)) -1 else as.numeric(length)
+  .Call("Rexm_map_file", path.expand(as.character(path)), type,
+        as.numeric(offset), length, as.integer(shared), PACKAGE="exm")
+}
+
+#' exm statistics
+#'
+#' Report what exm has done in this R session.
+#' @param what One of "counters" (event counts, bytes in allocations and
+#'   backing files, time spent waiting for the exm lock, the allocation
+#'   threshold in effect and why it last changed), "latency" (latency
+#'   histograms of the malloc, free, realloc and fork calls that involved exm,
+#'   non-empty buckets only) or "maps" (the current exm allocations with
+#'   their backing files and resident bytes).
+#' @return A data frame.
+#' @examples
+#' \dontrun{
+#' x <- runif(5e8)
+#' exm_stats()
+#' exm_stats("maps")
+#' }
+#' @export
+exm_stats <- function(what=c("counters", "latency", "maps"))
+{
+  what <- match.arg(what)
+  if(what == "maps")
+  {
+    m <- .Call("Rexm_maps", PACKAGE="exm")
+    return(data.frame(address=m[[1]], path=m[[2]], length=m[[3]],
+                      resident=m[[4]], tier=m[[5]], stringsAsFactors=FALSE))
+  }
+  s <- .Call("Rexm_stats", PACKAGE="exm")
+  if(what == "counters")
+    return(data.frame(counter=names(s[[1]]), value=unname(s[[1]]),
+                      stringsAsFactors=FALSE))
+  h <- s[[2]]
+  i <- which(h > 0, arr.ind=TRUE)
+  data.frame(operation=c("malloc", "free", "realloc", "fork")[i[, 1]],
+             below_ns=2^(i[, 2] - 1), count=h[i], stringsAsFactors=FALSE)
+}
+
 #' Lookup the exm backing file for an object
 #' @param object Any R object
 #' @export
@@ -1,8 +1,12 @@
 #include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include <R.h>
 #define USE_RINTERNALS
 #include <Rinternals.h>
+#include <R_ext/Altrep.h>
+#include <R_ext/Rdynload.h>
 
 /*
  * exm_cow
@@ -208,3 +212,405 @@ Rexm_version ()
   UNPROTECT (1);
   return VAL;
 }
+
+/*
+ * exm_policy
+ * INPUT S SEXP   Policy file path, "" to remove all rules, or R_NilValue to
+ *                reload the current file
+ * OUTPUT  SEXP   Number of rules in effect, -1 on error
+ */
+SEXP
+Rexm_policy (SEXP S)
+{
+  void *handle;
+  int (*policy)(const char *);
+  char *derror;
+  const char *path = NULL;
+
+  handle = dlopen (NULL, RTLD_LAZY);
+  if (!handle) {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlerror ();
+  policy = (int (*)(const char *))dlsym(handle, "exm_policy");
+  if ((derror = dlerror ()) != NULL)  {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlclose (handle);
+  if (S != R_NilValue)
+    path = CHAR (STRING_ELT (S, 0));
+  return ScalarInteger((*policy)(path));
+}
+
+/*
+ * Attached persistent vectors
+ *
+ * exm_persist keeps the exm allocation holding an R vector, header and all,
+ * under a name. exm_attach maps it back in a later session and presents its
+ * data, in place, as an ALTREP vector whose data1 is an external pointer to
+ * the allocation; the finalizer frees (unmaps) it and the files stay. The
+ * stored header supplies the type and length, so attach in the same R
+ * version that persisted the vector.
+ */
+static R_altrep_class_t exm_real_class, exm_integer_class;
+
+static SEXP
+attached (SEXP x)
+{
+  return (SEXP) R_ExternalPtrAddr (R_altrep_data1 (x));
+}
+
+static R_xlen_t
+attached_length (SEXP x)
+{
+  return XLENGTH (attached (x));
+}
+
+static void *
+attached_dataptr (SEXP x, Rboolean writeable)
+{
+  return DATAPTR (attached (x));
+}
+
+static const void *
+attached_dataptr_or_null (SEXP x)
+{
+  return DATAPTR (attached (x));
+}
+
+static void
+attached_finalize (SEXP ptr)
+{
+  void *p = R_ExternalPtrAddr (ptr);
+  if (p)
+    free (p);
+  R_ClearExternalPtr (ptr);
+}
+
+/* The exm allocation holding object: the object itself, or for an attached
+ * vector the allocation it was attached from
+ */
+static void *
+allocation (SEXP OBJECT)
+{
+  if (ALTREP (OBJECT) && (R_altrep_inherits (OBJECT, exm_real_class)
+                          || R_altrep_inherits (OBJECT, exm_integer_class)))
+    return (void *) attached (OBJECT);
+  return (void *) OBJECT;
+}
+
+/*
+ * exm_persist
+ * INPUT OBJECT SEXP  An R object held in an exm allocation
+ *       NAME   SEXP  Name to keep it under, or R_NilValue to stop
+ * OUTPUT       SEXP  0 on success, -1 on error
+ */
+SEXP
+Rexm_persist (SEXP OBJECT, SEXP NAME)
+{
+  void *handle;
+  int (*persist)(void *, const char *);
+  char *derror;
+  const char *name = NULL;
+
+  handle = dlopen (NULL, RTLD_LAZY);
+  if (!handle) {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlerror ();
+  persist = (int (*)(void *, const char *))dlsym(handle, "exm_persist");
+  if ((derror = dlerror ()) != NULL)  {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlclose (handle);
+  if (NAME != R_NilValue)
+    name = CHAR (STRING_ELT (NAME, 0));
+  return ScalarInteger((*persist)(allocation (OBJECT), name));
+}
+
+/*
+ * exm_attach
+ * INPUT NAME SEXP  Name given to exm_persist
+ * OUTPUT     SEXP  Numeric or integer vector mapped from the allocation
+ */
+SEXP
+Rexm_attach (SEXP NAME)
+{
+  SEXP VAL, PTR;
+  void *handle, *p;
+  void *(*attach)(const char *);
+  char *derror;
+  int type;
+
+  handle = dlopen (NULL, RTLD_LAZY);
+  if (!handle) {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlerror ();
+  attach = (void *(*)(const char *))dlsym(handle, "exm_attach");
+  if ((derror = dlerror ()) != NULL)  {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlclose (handle);
+  p = (*attach)(CHAR (STRING_ELT (NAME, 0)));
+  if (!p)
+    error ("no persistent exm object named %s\n", CHAR (STRING_ELT (NAME, 0)));
+  type = TYPEOF ((SEXP) p);
+  if (type != REALSXP && type != INTSXP) {
+      free (p);
+      error ("only numeric and integer vectors can be attached\n");
+  }
+  PROTECT (PTR = R_MakeExternalPtr (p, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx (PTR, attached_finalize, TRUE);
+  VAL = R_new_altrep (type == REALSXP ? exm_real_class : exm_integer_class,
+                      PTR, R_NilValue);
+  UNPROTECT (1);
+  return VAL;
+}
+
+/*
+ * Mapped data files
+ *
+ * exm_map_file maps a file of raw doubles or integers (no R header) as an
+ * exm allocation and presents it, in place, as an ALTREP vector: data1 is an
+ * external pointer to the mapping, data2 the length in elements. The
+ * finalizer frees (unmaps) the mapping and the file stays.
+ */
+static R_altrep_class_t exm_file_real_class, exm_file_integer_class;
+
+static R_xlen_t
+mapped_length (SEXP x)
+{
+  return (R_xlen_t) REAL (R_altrep_data2 (x))[0];
+}
+
+static void *
+mapped_dataptr (SEXP x, Rboolean writeable)
+{
+  return R_ExternalPtrAddr (R_altrep_data1 (x));
+}
+
+static const void *
+mapped_dataptr_or_null (SEXP x)
+{
+  return R_ExternalPtrAddr (R_altrep_data1 (x));
+}
+
+/*
+ * exm_map_file
+ * INPUT PATH   SEXP  File path
+ *       TYPE   SEXP  INTEGER 0 for doubles, 1 for integers
+ *       OFFSET SEXP  REAL byte offset, a multiple of the page size
+ *       LENGTH SEXP  REAL number of elements, negative for the rest of the file
+ *       SHARED SEXP  INTEGER nonzero to write changes through to the file
+ * OUTPUT       SEXP  Numeric or integer vector mapped from the file
+ */
+SEXP
+Rexm_map_file (SEXP PATH, SEXP TYPE, SEXP OFFSET, SEXP LENGTH, SEXP SHARED)
+{
+  SEXP VAL, PTR, LEN;
+  void *handle, *p;
+  void *(*map_file)(const char *, off_t, size_t, int);
+  size_t (*size)(void *);
+  char *derror;
+  int real = INTEGER (TYPE)[0] == 0;
+  size_t width = real ? sizeof (double) : sizeof (int), len = 0;
+
+  handle = dlopen (NULL, RTLD_LAZY);
+  if (!handle) {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlerror ();
+  map_file = (void *(*)(const char *, off_t, size_t, int))dlsym(handle,
+    "exm_map_file");
+  size = (size_t (*)(void *))dlsym(handle, "exm_size");
+  if ((derror = dlerror ()) != NULL)  {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlclose (handle);
+  if (REAL (LENGTH)[0] >= 0)
+    len = (size_t) REAL (LENGTH)[0] * width;
+/* EXM_MAP_SHARED (2) or EXM_MAP_PRIVATE (1), see libexm.h */
+  p = (*map_file)(CHAR (STRING_ELT (PATH, 0)), (off_t) REAL (OFFSET)[0], len,
+                  INTEGER (SHARED)[0] ? 2 : 1);
+  if (!p)
+    error ("unable to map %s\n", CHAR (STRING_ELT (PATH, 0)));
+  PROTECT (PTR = R_MakeExternalPtr (p, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx (PTR, attached_finalize, TRUE);
+  PROTECT (LEN = ScalarReal ((double) ((*size)(p) / width)));
+  VAL = R_new_altrep (real ? exm_file_real_class : exm_file_integer_class,
+                      PTR, LEN);
+  UNPROTECT (2);
+  return VAL;
+}
+
+/*
+ * Statistics
+ *
+ * A copy of struct exm_stats from libexm.h, which the package does not
+ * include; keep the two in step.
+ */
+#define EXM_OPS 4
+#define EXM_STATS_BUCKETS 40
+#define EXM_STATS_COUNTERS 25
+
+struct exm_stats
+{
+  uint64_t counters[EXM_STATS_COUNTERS];
+  uint64_t latency[EXM_OPS][EXM_STATS_BUCKETS];
+};
+
+static const char *stats_names[EXM_STATS_COUNTERS] = {
+  "allocations", "frees", "reallocs", "realloc_moves", "forks", "fork_remaps",
+  "memcpy_fast", "zerocopy_in", "zerocopy_out", "compressed_raw",
+  "compressed_stored", "decompressions", "decompress_ns", "lock_waits",
+  "lock_wait_ns", "maps", "bytes_mapped", "file_bytes", "peak_file_bytes",
+  "threshold", "threshold_reason", "threshold_changes", "mem_limit",
+  "mem_avail", "mem_psi"
+};
+
+/*
+ * exm_stats
+ * OUTPUT SEXP  List of a named numeric vector of counters and a numeric
+ *              matrix of latency histograms (operations by buckets)
+ */
+SEXP
+Rexm_stats ()
+{
+  SEXP VAL, COUNTERS, NAMES, LATENCY;
+  void *handle;
+  int (*stats)(struct exm_stats *);
+  char *derror;
+  struct exm_stats s;
+  int i, j;
+
+  handle = dlopen (NULL, RTLD_LAZY);
+  if (!handle) {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlerror ();
+  stats = (int (*)(struct exm_stats *))dlsym(handle, "exm_stats");
+  if ((derror = dlerror ()) != NULL)  {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlclose (handle);
+  if ((*stats)(&s) < 0)
+    error ("exm_stats failed\n");
+  PROTECT (VAL = allocVector (VECSXP, 2));
+  PROTECT (COUNTERS = allocVector (REALSXP, EXM_STATS_COUNTERS));
+  PROTECT (NAMES = allocVector (STRSXP, EXM_STATS_COUNTERS));
+  for (i = 0; i < EXM_STATS_COUNTERS; ++i) {
+      REAL (COUNTERS)[i] = (double) s.counters[i];
+      SET_STRING_ELT (NAMES, i, mkChar (stats_names[i]));
+  }
+  setAttrib (COUNTERS, R_NamesSymbol, NAMES);
+  PROTECT (LATENCY = allocMatrix (REALSXP, EXM_OPS, EXM_STATS_BUCKETS));
+  for (i = 0; i < EXM_OPS; ++i)
+    for (j = 0; j < EXM_STATS_BUCKETS; ++j)
+      REAL (LATENCY)[i + j * EXM_OPS] = (double) s.latency[i][j];
+  SET_VECTOR_ELT (VAL, 0, COUNTERS);
+  SET_VECTOR_ELT (VAL, 1, LATENCY);
+  UNPROTECT (4);
+  return VAL;
+}
+
+/*
+ * exm_maps
+ * OUTPUT SEXP  List of address, path, length, resident bytes and tier
+ *              vectors, one element per exm allocation
+ */
+SEXP
+Rexm_maps ()
+{
+  SEXP VAL, ADDR, PATH, LEN, RES, TIER;
+  void *handle, *p;
+  void *(*info)(int, size_t *, size_t *, int *);
+  char * (*flookup)(void *);
+  char *derror, *s, buf[32];
+  size_t length, resident;
+  int i, n, tier;
+
+  handle = dlopen (NULL, RTLD_LAZY);
+  if (!handle) {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlerror ();
+  info = (void *(*)(int, size_t *, size_t *, int *))dlsym(handle,
+    "exm_map_info");
+  flookup = (char *(*)(void *))dlsym(handle, "exm_lookup");
+  if ((derror = dlerror ()) != NULL)  {
+      error ("%s\n", dlerror ());
+      return R_NilValue;
+  }
+  dlclose (handle);
+  for (n = 0; (*info)(n, NULL, NULL, NULL); ++n);
+  PROTECT (ADDR = allocVector (STRSXP, n));
+  PROTECT (PATH = allocVector (STRSXP, n));
+  PROTECT (LEN = allocVector (REALSXP, n));
+  PROTECT (RES = allocVector (REALSXP, n));
+  PROTECT (TIER = allocVector (INTSXP, n));
+/* Allocations may come and go meanwhile; missing ones read as NA */
+  for (i = 0; i < n; ++i) {
+      p = (*info)(i, &length, &resident, &tier);
+      if (!p) {
+          SET_STRING_ELT (ADDR, i, NA_STRING);
+          SET_STRING_ELT (PATH, i, NA_STRING);
+          REAL (LEN)[i] = REAL (RES)[i] = NA_REAL;
+          INTEGER (TIER)[i] = NA_INTEGER;
+          continue;
+      }
+      snprintf (buf, sizeof (buf), "%p", p);
+      SET_STRING_ELT (ADDR, i, mkChar (buf));
+      s = (*flookup)(p);
+      SET_STRING_ELT (PATH, i, s ? mkChar (s) : NA_STRING);
+      free (s);
+      REAL (LEN)[i] = (double) length;
+      REAL (RES)[i] = (double) resident;
+      INTEGER (TIER)[i] = tier;
+  }
+  PROTECT (VAL = allocVector (VECSXP, 5));
+  SET_VECTOR_ELT (VAL, 0, ADDR);
+  SET_VECTOR_ELT (VAL, 1, PATH);
+  SET_VECTOR_ELT (VAL, 2, LEN);
+  SET_VECTOR_ELT (VAL, 3, RES);
+  SET_VECTOR_ELT (VAL, 4, TIER);
+  UNPROTECT (6);
+  return VAL;
+}
+
+void
+R_init_exm (DllInfo *dll)
+{
+  exm_real_class = R_make_altreal_class ("exm_real", "exm", dll);
+  R_set_altrep_Length_method (exm_real_class, attached_length);
+  R_set_altvec_Dataptr_method (exm_real_class, attached_dataptr);
+  R_set_altvec_Dataptr_or_null_method (exm_real_class,
+                                       attached_dataptr_or_null);
+  exm_integer_class = R_make_altinteger_class ("exm_integer", "exm", dll);
+  R_set_altrep_Length_method (exm_integer_class, attached_length);
+  R_set_altvec_Dataptr_method (exm_integer_class, attached_dataptr);
+  R_set_altvec_Dataptr_or_null_method (exm_integer_class,
+                                       attached_dataptr_or_null);
+  exm_file_real_class = R_make_altreal_class ("exm_file_real", "exm", dll);
+  R_set_altrep_Length_method (exm_file_real_class, mapped_length);
+  R_set_altvec_Dataptr_method (exm_file_real_class, mapped_dataptr);
+  R_set_altvec_Dataptr_or_null_method (exm_file_real_class,
+                                       mapped_dataptr_or_null);
+  exm_file_integer_class = R_make_altinteger_class ("exm_file_integer", "exm",
+                                                    dll);
+  R_set_altrep_Length_method (exm_file_integer_class, mapped_length);
+  R_set_altvec_Dataptr_method (exm_file_integer_class, mapped_dataptr);
+  R_set_altvec_Dataptr_or_null_method (exm_file_integer_class,
+                                       mapped_dataptr_or_null);
+}
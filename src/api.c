@@ -7,37 +7,174 @@
 */
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
-#include <omp.h>
 
 #include "uthash.h"
 #include "exm.h"
+#include "libexm.h"
+#include "trace.h"
 
 /* exm_path is initialized in exm.c:exm_init() */
 char exm_data_path[EXM_MAX_PATH_LEN];
 size_t exm_alloc_threshold = 2147483648;
 int exm_child_cow = 1;
+struct map *flexmap;
+struct rlock lock = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+__thread char exm_self __attribute__ ((tls_model ("initial-exec")));
+uintptr_t exm_map_lo = UINTPTR_MAX, exm_map_hi;
 
 /* The next functions allow applications to inspect and change default
- * settings. The application must dynamically locate them with dlsym after
- * the library is loaded. They represent the exm API, such as it is.
+ * settings. They represent the exm API, such as it is. Applications include
+ * libexm.h and link with the shim library (see shim.c), or locate them with
+ * dlsym after the library is loaded.
  *
  * API functions defined below include:
+ * void * exm_malloc(size_t size, int flags)
+ * void * exm_calloc(size_t count, size_t size, int flags)
+ * void exm_free(void *ptr)
+ * void * exm_reserve(size_t max_size, int flags)   (see reserve.c)
+ * int exm_commit(void *ptr, size_t size)           (see reserve.c)
+ * int exm_persist(void *addr, const char *name)    (see persist.c)
+ * void * exm_attach(const char *name)              (see persist.c)
+ * int exm_publish(void *addr, const char *name, int mode)
+ *                                                  (see share.c)
+ * void * exm_attach_shared(const char *name, int readonly)
+ *                                                  (see share.c)
+ * void * exm_map_file(const char *path, off_t offset, size_t len,
+ *                     int mode)                    (see mapfile.c)
+ * int exm_snapshot(void *addr, const char *dest)   (see snapshot.c)
+ * ssize_t exm_snapshot_incremental(void *addr)     (see snapshot.c)
  * double exm_version()
  * size_t exm_threshold(size_t j)
  * char * exm_path(char *path)
+ * int exm_tier_policy(int j)                       (see tier.c)
+ * size_t exm_stripe(ssize_t j)                     (see stripe.c)
+ * int exm_threshold_auto(int on, size_t headroom)  (see pressure.c)
+ * const char * exm_threshold_reason()              (see pressure.c)
+ * int exm_demote(int j)                            (see demote.c)
+ * int exm_migrate(void *addr, int to_file)         (see demote.c)
+ * int exm_policy(const char *path)                (see policy.c)
+ * size_t exm_threshold_local(ssize_t j)            (see local.c)
+ * int exm_policy_push(size_t t, const char *actions)
+ *                                                  (see local.c)
+ * int exm_policy_pop()                             (see local.c)
+ * int exm_learn(int j)                             (see site.c)
+ * int exm_lazy(int j)                              (see lazy.c)
+ * size_t exm_zerocopy(ssize_t j)                   (see io.c)
+ * size_t exm_pager(ssize_t j)                      (see pager.c)
+ * int exm_trace_file(const char *path)             (see trace.c)
+ * int exm_profile(int j)                           (see profile.c)
+ * int exm_profile_report(const char *path)         (see profile.c)
+ * int exm_stats(struct exm_stats *s)               (see stats.c)
+ * void * exm_map_info(int i, size_t *length, size_t *resident, int *tier)
+ *                                                  (see stats.c)
+ * size_t exm_zerocopy_info(size_t *in, size_t *out)
+ *                                                  (see io.c)
+ * size_t exm_pager_info(size_t *in, size_t *out)   (see pager.c)
+ * uint64_t exm_site_info(int i, unsigned long *n, double *lifetime,
+ *                        double *intensity)        (see site.c)
+ * char * exm_tier_info(int i, size_t *allocated, size_t *capacity,
+ *                      size_t *avail)              (see tier.c)
  * char * exm_lookup(void *addr)
+ * size_t exm_size(void *addr)
  * int exm_madvise(void *addr, int advice)
  * int exm_child_cow(int j)
  */
 
+/* Translate exm_malloc flags (see libexm.h) into creation hints */
+void
+exm_flag_hints (int flags, struct hints *h)
+{
+  exm_hints_init (h);
+  h->backend = EXM_BACKEND_EXM;
+  if (flags & EXM_SEQUENTIAL)
+    h->advice = MADV_SEQUENTIAL;
+  else if (flags & EXM_RANDOM)
+    h->advice = MADV_RANDOM;
+  else if (flags & EXM_READ_MOSTLY)
+    h->advice = MADV_WILLNEED;
+  if (flags & EXM_PREFAULT)
+    h->prefault = 1;
+  if (flags & EXM_COMPRESS)
+    h->compress = 1;
+  if (flags & EXM_HUGEPAGES)
+    h->hugepages = 1;
+  else if (flags & EXM_NOHUGEPAGES)
+    h->hugepages = 0;
+  if ((flags >> 16) & 0xff)
+    h->tier = ((flags >> 16) & 0xff) - 1;
+  else if (flags & EXM_TEMPORARY)
+    {
+      exm_lock ();
+      h->tier = exm_tier_memory ();
+      exm_unlock ();
+    }
+}
+
+/* Allocate size bytes out of core regardless of the threshold
+ * INPUT size: bytes to allocate
+ *       flags: hints from libexm.h (EXM_SEQUENTIAL, EXM_PREFAULT, ...),
+ *              applied when the mapping is created
+ * OUTPUT (return value): zero-filled memory that may be released with
+ *        exm_free or free, or NULL on error (errno set)
+ */
+void *
+exm_malloc (size_t size, int flags)
+{
+  struct hints h;
+  void *p;
+  if (!exm_ready ())
+    {
+      errno = EAGAIN;
+      return NULL;
+    }
+  exm_flag_hints (flags, &h);
+  p = exm_alloc (size > 0 ? size : 1, 1, 0, &h, NULL);
+  if (exm_trace_mode && p && size >= exm_trace_min)
+    exm_trace_event (EXM_TRACE_MALLOC, p, NULL, size, 1);
+  return p;
+}
+
+/* Allocate count * size zero-filled bytes out of core, see exm_malloc */
+void *
+exm_calloc (size_t count, size_t size, int flags)
+{
+  struct hints h;
+  void *p;
+  if (size > 0 && count > SIZE_MAX / size)
+    {
+      errno = ENOMEM;
+      return NULL;
+    }
+  if (!exm_ready ())
+    {
+      errno = EAGAIN;
+      return NULL;
+    }
+  exm_flag_hints (flags, &h);
+  p = exm_alloc (count * size > 0 ? count * size : 1, 1, 0, &h, NULL);
+  if (exm_trace_mode && p && count * size >= exm_trace_min)
+    exm_trace_event (EXM_TRACE_CALLOC, p, NULL, count * size, 1);
+  return p;
+}
+
+/* Release memory from exm_malloc or exm_calloc, same as free */
+void
+exm_free (void *ptr)
+{
+  free (ptr);
+}
+
 /* Return the exm library version
  * OUTPUT (return value): double version major.minor
  */
 double
-exm_version (char *v)
+exm_version ()
 {
   return EXM_VERSION;
 }
@@ -61,29 +198,38 @@ exm_version (char *v)
 int
 exm_cow (int j)
 {
-  omp_set_nest_lock (&lock);
+  exm_lock ();
   exm_child_cow = j;
-  omp_unset_nest_lock (&lock);
+  exm_unlock ();
   return exm_child_cow;
 }
 
 /* Set and get threshold size.
- * INPUT j: proposed new exm_threshold size
- * OUTPUT (return value): exm_threshold size
+ * INPUT j: proposed new exm_threshold size, or zero to query. Setting a size
+ * turns off the memory-pressure-driven auto mode (see pressure.c).
+ * OUTPUT (return value): exm_threshold size, in auto mode the threshold
+ * currently in effect (see exm_threshold_reason for why it last changed)
  */
 size_t
 exm_threshold (size_t j)
 {
+  size_t t;
+  int on;
   if (j > 0)
     {
-      omp_set_nest_lock (&lock);
+      exm_lock ();
       exm_alloc_threshold = j;
-      omp_unset_nest_lock (&lock);
+      on = exm_auto;
+      exm_unlock ();
+      if (on)
+        exm_threshold_auto (0, 0);
     }
-  return exm_alloc_threshold;
+  exm_pressure_state (&t, NULL, NULL, NULL, NULL, NULL);
+  return t;
 }
 
-/* Set madvise option for an exm-allocated region
+/* Set madvise option for an exm-allocated region (including all stripes of a
+ * striped allocation)
  * INPUT
  * addr: exm-allocated pointer address
  * advice: one of the madvise options MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL
@@ -95,38 +241,49 @@ exm_madvise (void *addr, int advice)
 {
   int j = -1;
   struct map *x;
-  omp_set_nest_lock (&lock);
+  exm_lock ();
   HASH_FIND_PTR (flexmap, &addr, x);
   if (x)
     j = madvise (x->addr, x->length, advice);
-  omp_unset_nest_lock (&lock);
+  exm_unlock ();
   return j;
 }
 
 /* Set/retrieve the file directory path character string
- * INPUT p, a proposed new path string or NULL
- * Returns string with path set. When input is NULL, allocates output
- * and it is up to the caller to free the returned copy!!
+ * INPUT p, a proposed new path string or NULL. The path may be an ordered,
+ * colon-separated list of tier directories with optional capacities, for
+ * instance "/mnt/fast@64G:/mnt/slow", see tier.c.
+ * Returns string with path set, or NULL if p could not be parsed. When input
+ * is NULL, allocates output and it is up to the caller to free the returned
+ * copy!!
  */
 char *
 exm_path (char *p)
 {
-  omp_set_nest_lock (&lock);
+  exm_lock ();
   if (p == NULL)
     {
       p = strndup (exm_data_path, EXM_MAX_PATH_LEN);
     }
+  else if (exm_tier_parse (p) < 0)
+    {
+      p = NULL;
+    }
   else
     {
       memset (exm_data_path, 0, EXM_MAX_PATH_LEN);
       snprintf (exm_data_path, EXM_MAX_PATH_LEN, "%s", p);
+      exm_policy_resolve ();
     }
-  omp_unset_nest_lock (&lock);
+  exm_unlock ();
   return p;
 }
 
-/* Lookup an address, returning NULL if the address is not found or a strdup
- * locally-allocated copy of the backing file path for the address. No guarantee
+/* Lookup an address, returning NULL if the address is not found (or is held
+ * in anonymous memory in demote mode, see demote.c) or a strdup
+ * locally-allocated copy of the backing file path for the address. Striped
+ * allocations return a colon-separated list of their stripe files in address
+ * order. No guarantee
  * is made that the address or backing file will be valid after this call, so
  * it's really up to the caller to make sure free is not called on the address
  * simultaneously with this call. CALLER'S RESPONSIBILITY TO FREE RESULT!
@@ -136,14 +293,30 @@ exm_lookup (void *addr)
 {
   char *f = NULL;
   struct map *x;
-  omp_set_nest_lock (&lock);
+  exm_lock ();
   HASH_FIND_PTR (flexmap, &addr, x);
-  if (x)
+  if (x && x->nstripes > 0)
+    f = exm_stripe_paths (x);
+  else if (x && x->kind != EXM_ANON && x->path[0])
     f = strndup (x->path, EXM_MAX_PATH_LEN);
-  omp_unset_nest_lock (&lock);
+  exm_unlock ();
   return f;
 }
 
+/* Length of the exm allocation at addr, zero if addr is not one */
+size_t
+exm_size (void *addr)
+{
+  size_t n = 0;
+  struct map *x;
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &addr, x);
+  if (x)
+    n = x->length;
+  exm_unlock ();
+  return n;
+}
+
 /* Debugging function that iterates over hash table, printing entries
  * to stderr in order.
  */
@@ -151,10 +324,11 @@ void
 exm_debug_list ()
 {
   struct map *m, *tmp;
-  omp_set_nest_lock (&lock);
+  exm_lock ();
   HASH_ITER (hh, flexmap, m, tmp)
   {
-    fprintf(stderr, "%p, %lu, %s\n", m->addr, m->length, m->path);
+    fprintf(stderr, "%p, %lu, %s, tier %d\n", m->addr, m->length, m->path,
+            m->tier);
   }
-  omp_unset_nest_lock (&lock);
+  exm_unlock ();
 }
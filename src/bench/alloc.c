@@ -0,0 +1,419 @@
+/* Allocator overhead: latency of the interposed calls below and above the
+ * exm threshold, compared with plain glibc and with an earlier run.
+ *
+ * Usage (see the bench target in the Makefile, which runs it twice, without
+ * and under libexm.so):
+ * alloc [-q] [-t max threads] [-g glibc.csv] [-b baseline.csv [-r ratio]] [dir]
+ *
+ * Each benchmark is timed as the best of three repeats and printed as a CSV
+ * row: allocator (exm or glibc), benchmark, parameter, iterations and
+ * nanoseconds per operation.
+ *
+ *   small_*     malloc/free, calloc/free and realloc of 64 byte blocks, below
+ *               the threshold (the cost of the interposed fast path)
+ *   large_*     the same with 4M blocks, above a 1M threshold, so exm
+ *               backing files in dir (default /tmp, a tmpfs is fine)
+ *   realloc_growth  a block grown by doubling from 4K to 64M, per sequence
+ *   memcpy_small    256 byte copies between heap blocks
+ *   fork_maps   fork and wait of a child with 32 touched 1M allocations,
+ *               under each exm_child_cow mode (param cow0, cow1, cow2)
+ *   threads     small and large malloc/free loops in 1, 2, 4, ... threads,
+ *               up to -t (default the number of CPUs), wall time per op
+ *
+ * -g adds a column with the ratio to the matching row of a glibc run. -b
+ * adds one with the ratio to a baseline run; with -r, rows slower than ratio
+ * times the baseline are listed on stderr and the exit status is 1. -q runs
+ * fewer iterations.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "libexm.h"
+
+#define SMALL 64
+#define LARGE ((size_t) 4 << 20)
+#define FORK_MAPS 32
+#define MAXROWS 64
+
+struct row
+{
+  char name[32], param[16];
+  double ns;
+};
+
+static const char *allocator;
+static long scale = 1;
+static struct row glibc[MAXROWS], base[MAXROWS];
+static int nglibc, nbase, regressions;
+static double ratio;
+
+/* Called through a pointer so that the compiler does not expand the copy
+ * inline; the call then goes to the interposed memcpy
+ */
+static void *(*volatile copy) (void *, const void *, size_t) = memcpy;
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Read the rows of an earlier run
+ * OUTPUT (return value): number of rows, -1 if the file can't be read
+ */
+static int
+load (const char *path, struct row *r)
+{
+  char line[256];
+  int n = 0;
+  FILE *f = fopen (path, "r");
+  if (!f)
+    return -1;
+  while (n < MAXROWS && fgets (line, sizeof (line), f))
+    if (sscanf (line, "%*[^,],%31[^,],%15[^,],%*[^,],%lf", r[n].name,
+                r[n].param, &r[n].ns) == 3)
+      n++;
+  fclose (f);
+  return n;
+}
+
+static double
+match (struct row *r, int n, const char *name, const char *param)
+{
+  int i;
+  for (i = 0; i < n; ++i)
+    if (!strcmp (r[i].name, name) && !strcmp (r[i].param, param))
+      return r[i].ns;
+  return 0;
+}
+
+static void
+report (const char *name, const char *param, long iterations, double ns)
+{
+  double g = match (glibc, nglibc, name, param);
+  double b = match (base, nbase, name, param);
+  printf ("%s,%s,%s,%ld,%.1f", allocator, name, param, iterations, ns);
+  if (nglibc > 0)
+    printf (g > 0 ? ",%.2f" : ",", ns / g);
+  if (nbase > 0)
+    printf (b > 0 ? ",%.2f" : ",", ns / b);
+  printf ("\n");
+  fflush (stdout);
+  if (ratio > 0 && b > 0 && ns > ratio * b)
+    {
+      fprintf (stderr, "regression: %s %s %.1f ns, baseline %.1f ns\n", name,
+               param, ns, b);
+      regressions++;
+    }
+}
+
+/* One repeat of a benchmark: n operations, returns ns per operation */
+typedef double (*bench) (long n);
+
+static double
+small_malloc (long n)
+{
+  double t = now ();
+  long i;
+  void *x;
+  for (i = 0; i < n; ++i)
+    {
+      x = malloc (SMALL);
+      *(volatile char *) x = 1;
+      free (x);
+    }
+  return (now () - t) * 1e9 / n;
+}
+
+static double
+small_calloc (long n)
+{
+  double t = now ();
+  long i;
+  void *x;
+  for (i = 0; i < n; ++i)
+    {
+      x = calloc (1, SMALL);
+      *(volatile char *) x = 1;
+      free (x);
+    }
+  return (now () - t) * 1e9 / n;
+}
+
+static double
+small_realloc (long n)
+{
+  double t = now ();
+  long i;
+  void *x;
+  for (i = 0; i < n; ++i)
+    {
+      x = malloc (SMALL);
+      x = realloc (x, 2 * SMALL);
+      *(volatile char *) x = 1;
+      free (x);
+    }
+  return (now () - t) * 1e9 / n;
+}
+
+static double
+large_malloc (long n)
+{
+  double t = now ();
+  long i;
+  void *x;
+  for (i = 0; i < n; ++i)
+    {
+      x = malloc (LARGE);
+      *(volatile char *) x = 1;
+      free (x);
+    }
+  return (now () - t) * 1e9 / n;
+}
+
+static double
+large_calloc (long n)
+{
+  double t = now ();
+  long i;
+  void *x;
+  for (i = 0; i < n; ++i)
+    {
+      x = calloc (1, LARGE);
+      *(volatile char *) x = 1;
+      free (x);
+    }
+  return (now () - t) * 1e9 / n;
+}
+
+static double
+large_realloc (long n)
+{
+  double t = now ();
+  long i;
+  void *x;
+  for (i = 0; i < n; ++i)
+    {
+      x = malloc (LARGE);
+      *(volatile char *) x = 1;
+      x = realloc (x, 2 * LARGE);
+      *(volatile char *) x = 1;
+      free (x);
+    }
+  return (now () - t) * 1e9 / n;
+}
+
+static double
+realloc_growth (long n)
+{
+  double t = now ();
+  size_t size;
+  long i;
+  char *x;
+  for (i = 0; i < n; ++i)
+    {
+      x = NULL;
+      for (size = 4096; size <= ((size_t) 64 << 20); size *= 2)
+        {
+          x = realloc (x, size);
+          if (!x)
+            exit (1);
+          x[size - 1] = 1;
+        }
+      free (x);
+    }
+  return (now () - t) * 1e9 / n;
+}
+
+static double
+memcpy_small (long n)
+{
+  char *a = malloc (256), *b = malloc (256);
+  double t;
+  long i;
+  memset (a, 1, 256);
+  t = now ();
+  for (i = 0; i < n; ++i)
+    copy (b, a, 256);
+  t = (now () - t) * 1e9 / n;
+  free (a);
+  free (b);
+  return t;
+}
+
+static double
+fork_maps (long n)
+{
+  char *x[FORK_MAPS];
+  double t;
+  long i;
+  int j, status;
+  pid_t pid;
+  for (j = 0; j < FORK_MAPS; ++j)
+    {
+      x[j] = malloc ((size_t) 1 << 20);
+      memset (x[j], j, (size_t) 1 << 20);
+    }
+  fflush (stdout);
+  t = now ();
+  for (i = 0; i < n; ++i)
+    {
+      pid = fork ();
+      if (pid == 0)
+        exit (0);               /* exit, not _exit: exm cleans up the child */
+      if (pid < 0 || waitpid (pid, &status, 0) < 0)
+        exit (1);
+    }
+  t = (now () - t) * 1e9 / n;
+  for (j = 0; j < FORK_MAPS; ++j)
+    free (x[j]);
+  return t;
+}
+
+static void
+run (const char *name, const char *param, bench f, long n)
+{
+  double best = 0, ns;
+  int r;
+  n = n / scale > 0 ? n / scale : 1;
+  f (n > 10 ? n / 10 : 1);      /* warm up */
+  for (r = 0; r < 3; ++r)
+    {
+      ns = f (n);
+      if (r == 0 || ns < best)
+        best = ns;
+    }
+  report (name, param, n, best);
+}
+
+struct worker
+{
+  long n;
+  size_t size;
+};
+
+static void *
+loop (void *arg)
+{
+  struct worker *w = (struct worker *) arg;
+  long i;
+  void *x;
+  for (i = 0; i < w->n; ++i)
+    {
+      x = malloc (w->size);
+      *(volatile char *) x = 1;
+      free (x);
+    }
+  return NULL;
+}
+
+/* Wall time per operation of k threads each running n operations */
+static double
+threads (int k, long n, size_t size)
+{
+  pthread_t id[256];
+  struct worker w;
+  double t;
+  int i;
+  w.n = n;
+  w.size = size;
+  t = now ();
+  for (i = 0; i < k; ++i)
+    pthread_create (&id[i], NULL, loop, &w);
+  for (i = 0; i < k; ++i)
+    pthread_join (id[i], NULL);
+  return (now () - t) * 1e9 / (n * k);
+}
+
+int
+main (int argc, char **argv)
+{
+  int c, k, cow, maxthreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  const char *dir = "/tmp";
+  char param[16];
+  long n;
+
+  while ((c = getopt (argc, argv, "qt:g:b:r:")) != -1)
+    switch (c)
+      {
+      case 'q':
+        scale = 10;
+        break;
+      case 't':
+        maxthreads = atoi (optarg);
+        break;
+      case 'g':
+        nglibc = load (optarg, glibc);
+        if (nglibc < 0)
+          perror (optarg);
+        break;
+      case 'b':
+        nbase = load (optarg, base);
+        if (nbase < 0)
+          perror (optarg);
+        break;
+      case 'r':
+        ratio = atof (optarg);
+        break;
+      default:
+        fprintf (stderr, "usage: alloc [-q] [-t max threads] [-g glibc.csv] "
+                 "[-b baseline.csv [-r ratio]] [dir]\n");
+        return 1;
+      }
+  if (optind < argc)
+    dir = argv[optind];
+  if (maxthreads < 1)
+    maxthreads = 1;
+  if (maxthreads > 256)
+    maxthreads = 256;
+
+  allocator = exm_version () > 0 ? "exm" : "glibc";
+  if (exm_version () > 0)
+    {
+      exm_threshold ((size_t) 1 << 20);
+      if (!exm_path ((char *) dir))
+        {
+          fprintf (stderr, "can't use %s\n", dir);
+          return 1;
+        }
+    }
+
+  printf ("allocator,benchmark,param,iterations,ns_per_op%s%s\n",
+          nglibc > 0 ? ",glibc_ratio" : "", nbase > 0 ? ",baseline_ratio" : "");
+  run ("small_malloc_free", "64", small_malloc, 2000000);
+  run ("small_calloc_free", "64", small_calloc, 2000000);
+  run ("small_realloc", "64", small_realloc, 1000000);
+  run ("memcpy_small", "256", memcpy_small, 2000000);
+  run ("large_malloc_free", "4M", large_malloc, 2000);
+  run ("large_calloc_free", "4M", large_calloc, 2000);
+  run ("large_realloc", "4M", large_realloc, 1000);
+  run ("realloc_growth", "4K-64M", realloc_growth, 20);
+  if (exm_version () > 0)
+    for (cow = 0; cow <= 2; ++cow)
+      {
+        exm_cow (cow);
+        snprintf (param, sizeof (param), "cow%d", cow);
+        run ("fork_maps", param, fork_maps, 100);
+      }
+  else
+    run ("fork_maps", "cow1", fork_maps, 100);
+  if (exm_version () > 0)
+    exm_cow (1);
+  for (k = 1; k <= maxthreads; k *= 2)
+    {
+      snprintf (param, sizeof (param), "%d", k);
+      n = 500000 / scale;
+      report ("threads_small", param, n, threads (k, n, SMALL));
+      n = 500 / scale > 0 ? 500 / scale : 1;
+      report ("threads_large", param, n, threads (k, n, LARGE));
+    }
+  return regressions > 0;
+}
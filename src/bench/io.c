@@ -0,0 +1,128 @@
+/* Reading a file into an exm allocation and writing it back out, with and
+ * without the zero-copy I/O wrappers (see io.c).
+ *
+ * Usage (under libexm.so, see the bench target in the Makefile):
+ * io [-s bytes] [dir]
+ *
+ * The program writes a data file of the given size (default 1 GiB) in dir
+ * (default /tmp), then for each mode reads it into a new exm allocation with
+ * read() (ingest) and writes the allocation to a second file with write()
+ * and fsync() (save), reporting both times. The page cache is not dropped
+ * between runs, so the source file is usually cached; the saving is in the
+ * copies through mapped pages and the backing file's writeback.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "libexm.h"
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Move size bytes between fd and buf with read (in) or write (out)
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+transfer (int fd, char *buf, size_t size, int in)
+{
+  size_t done = 0;
+  ssize_t s;
+  while (done < size)
+    {
+      s = in ? read (fd, buf + done, size - done)
+        : write (fd, buf + done, size - done);
+      if (s <= 0)
+        return -1;
+      done += (size_t) s;
+    }
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t size = (size_t) 1 << 30, i;
+  char src[4096], dest[4096], block[65536];
+  const char *dir;
+  double t, ingest, save;
+  int c, fd, mode;
+  char *x;
+
+  while ((c = getopt (argc, argv, "s:")) != -1)
+    switch (c)
+      {
+      case 's':
+        size = strtoull (optarg, NULL, 0);
+        break;
+      default:
+        fprintf (stderr, "usage: io [-s bytes] [dir]\n");
+        return 1;
+      }
+  dir = optind < argc ? argv[optind] : "/tmp";
+  snprintf (src, sizeof (src), "%s/exm_bench_io.in", dir);
+  snprintf (dest, sizeof (dest), "%s/exm_bench_io.out", dir);
+  for (i = 0; i < sizeof (block); ++i)
+    block[i] = (char) i;
+  fd = open (src, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  for (i = 0; fd >= 0 && i < size; i += sizeof (block))
+    if (transfer (fd, block, size - i < sizeof (block) ? size - i
+                  : sizeof (block), 0) < 0)
+      break;
+  if (fd < 0 || i < size)
+    {
+      fprintf (stderr, "writing %s failed\n", src);
+      return 1;
+    }
+  fsync (fd);
+  close (fd);
+
+  printf ("mode,bytes,ingest_s,save_s,zerocopy_bytes\n");
+  for (mode = 0; mode < 2; ++mode)
+    {
+      exm_zerocopy (mode ? 1 << 20 : 0);
+      x = (char *) exm_malloc (size, EXM_SEQUENTIAL);
+      if (!x)
+        {
+          fprintf (stderr, "allocation failed\n");
+          return 1;
+        }
+      t = now ();
+      fd = open (src, O_RDONLY);
+      if (fd < 0 || transfer (fd, x, size, 1) < 0)
+        {
+          fprintf (stderr, "ingest failed\n");
+          return 1;
+        }
+      close (fd);
+      ingest = now () - t;
+      if (memcmp (x + size / 2 - size / 2 % sizeof (block), block,
+                  size < sizeof (block) ? size : sizeof (block)) != 0)
+        fprintf (stderr, "ingested data differs\n");
+      t = now ();
+      fd = open (dest, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+      if (fd < 0 || transfer (fd, x, size, 0) < 0 || fsync (fd) < 0)
+        {
+          fprintf (stderr, "save failed\n");
+          return 1;
+        }
+      close (fd);
+      save = now () - t;
+      printf ("%s,%lu,%.6f,%.6f,%lu\n", mode ? "zerocopy" : "copy",
+              (unsigned long) size, ingest, save,
+              (unsigned long) exm_zerocopy_info (NULL, NULL));
+      exm_free (x);
+      unlink (dest);
+    }
+  unlink (src);
+  return 0;
+}
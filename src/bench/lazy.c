@@ -0,0 +1,97 @@
+/* Cost of many large allocations of which few are used, with and without
+ * lazy materialization (see lazy.c).
+ *
+ * Usage (under libexm.so, see the bench target in the Makefile):
+ * lazy [-n count] [-s size] [-t touched]
+ *
+ * For each mode (eager, lazy) the program allocates count buffers of size
+ * bytes with exm_malloc, writes every byte of the first touched of them,
+ * counts the allocations that have a backing file, and frees them all,
+ * timing each step. Defaults: 100 buffers of 16M, 10 touched.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "libexm.h"
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t size = (size_t) 16 << 20;
+  int count = 100, touched = 10, c, i, mode, files;
+  double t0, t1, t2, t3;
+  char **x, *p;
+
+  while ((c = getopt (argc, argv, "n:s:t:")) != -1)
+    switch (c)
+      {
+      case 'n':
+        count = atoi (optarg);
+        break;
+      case 's':
+        size = strtoull (optarg, NULL, 0);
+        break;
+      case 't':
+        touched = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "usage: lazy [-n count] [-s size] [-t touched]\n");
+        return 1;
+      }
+  if (count < 1 || touched < 0 || touched > count)
+    {
+      fprintf (stderr, "need 0 <= touched <= count and count > 0\n");
+      return 1;
+    }
+  x = (char **) calloc (count, sizeof (char *));
+  if (!x)
+    return 1;
+
+  printf ("mode,count,size,touched,files,alloc_s,touch_s,free_s\n");
+  for (mode = 0; mode < 2; ++mode)
+    {
+      exm_lazy (mode);
+      t0 = now ();
+      for (i = 0; i < count; ++i)
+        {
+          x[i] = (char *) exm_malloc (size, 0);
+          if (!x[i])
+            {
+              fprintf (stderr, "allocation %d failed\n", i);
+              return 1;
+            }
+        }
+      t1 = now ();
+      for (i = 0; i < touched; ++i)
+        memset (x[i], i + 1, size);
+      t2 = now ();
+      files = 0;
+      for (i = 0; i < count; ++i)
+        {
+          p = exm_lookup (x[i]);
+          files += p != NULL;
+          free (p);
+        }
+      t3 = now ();
+      for (i = 0; i < count; ++i)
+        exm_free (x[i]);
+      printf ("%s,%d,%lu,%d,%d,%.6f,%.6f,%.6f\n", mode ? "lazy" : "eager",
+              count, (unsigned long) size, touched, files, t1 - t0, t2 - t1,
+              now () - t3);
+    }
+  exm_lazy (0);
+  free (x);
+  return 0;
+}
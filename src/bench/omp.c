@@ -0,0 +1,250 @@
+/* OpenMP kernels over exm operands: does exm keep multithreaded programs
+ * (like those linked to OpenMP BLAS) scaling as they do without it?
+ *
+ * Usage (see the bench target in the Makefile, which runs it twice, without
+ * and under libexm.so):
+ * omp [-n size] [-t max threads] [-g glibc.csv [-r margin]] [dir]
+ *
+ * GEMM (C = A B, n x n doubles, default n = 1024) and GEMV (y = A x, 8n x n,
+ * 20 passes) with operands above a 1M threshold, so exm mappings in dir
+ * (default /tmp). Like BLAS, each thread packs its blocks into small scratch
+ * buffers with malloc, memcpy and free, so the interposed calls run from
+ * every thread all the time. Kernels run on 1, 2, 4, ... threads up to -t
+ * (default the number of CPUs) and each row of the CSV output gives the best
+ * of three times, GFLOP/s and the speedup over one thread.
+ *
+ * -g adds the ratio of the glibc run's speedup to this one's at the same
+ * thread count; with -r, rows whose ratio exceeds margin (for instance 1.1,
+ * scaling within 10% of glibc's) are listed on stderr and the exit status is
+ * 1.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <omp.h>
+
+#include "libexm.h"
+
+#define BLOCK 64
+#define MAXROWS 64
+
+struct row
+{
+  char kernel[16];
+  int threads;
+  double speedup;
+};
+
+static struct row glibc[MAXROWS];
+static int nglibc, failures;
+static double margin;
+
+/* Called through a pointer so that the compiler does not expand the copy
+ * inline; the call then goes to the interposed memcpy
+ */
+static void *(*volatile copy) (void *, const void *, size_t) = memcpy;
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int
+load (const char *path)
+{
+  char line[256];
+  int n = 0;
+  FILE *f = fopen (path, "r");
+  if (!f)
+    return -1;
+  while (n < MAXROWS && fgets (line, sizeof (line), f))
+    if (sscanf (line, "%*[^,],%15[^,],%d,%*[^,],%*[^,],%lf",
+                glibc[n].kernel, &glibc[n].threads, &glibc[n].speedup) == 3)
+      n++;
+  fclose (f);
+  return n;
+}
+
+/* C = A B, packing each block of B with malloc and memcpy */
+static void
+gemm (const double *A, const double *B, double *C, int n)
+{
+  int nb = n / BLOCK;
+#pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < nb * nb; ++t)
+    {
+      int bi = t / nb, bj = t % nb;
+      double *c = malloc (BLOCK * BLOCK * sizeof (double));
+      memset (c, 0, BLOCK * BLOCK * sizeof (double));
+      for (int bk = 0; bk < nb; ++bk)
+        {
+          double *b = malloc (BLOCK * BLOCK * sizeof (double));
+          for (int k = 0; k < BLOCK; ++k)
+            copy (b + k * BLOCK, B + (size_t) (bk * BLOCK + k) * n
+                  + bj * BLOCK, BLOCK * sizeof (double));
+          for (int i = 0; i < BLOCK; ++i)
+            for (int k = 0; k < BLOCK; ++k)
+              {
+                double a = A[(size_t) (bi * BLOCK + i) * n + bk * BLOCK + k];
+                for (int j = 0; j < BLOCK; ++j)
+                  c[i * BLOCK + j] += a * b[k * BLOCK + j];
+              }
+          free (b);
+        }
+      for (int i = 0; i < BLOCK; ++i)
+        copy (C + (size_t) (bi * BLOCK + i) * n + bj * BLOCK, c + i * BLOCK,
+              BLOCK * sizeof (double));
+      free (c);
+    }
+}
+
+/* y = A x, A m x n, copying x into per-block scratch */
+static void
+gemv (const double *A, const double *x, double *y, int m, int n)
+{
+#pragma omp parallel for schedule(static)
+  for (int bi = 0; bi < m / BLOCK; ++bi)
+    {
+      double *v = malloc (n * sizeof (double));
+      copy (v, x, n * sizeof (double));
+      for (int i = bi * BLOCK; i < (bi + 1) * BLOCK; ++i)
+        {
+          double s = 0;
+          for (int j = 0; j < n; ++j)
+            s += A[(size_t) i * n + j] * v[j];
+          y[i] = s;
+        }
+      free (v);
+    }
+}
+
+static void
+report (const char *allocator, const char *kernel, int threads, double t,
+        double flops, double base)
+{
+  double speedup = base / t, g = 0;
+  int i;
+  for (i = 0; i < nglibc; ++i)
+    if (!strcmp (glibc[i].kernel, kernel) && glibc[i].threads == threads)
+      g = glibc[i].speedup;
+  printf ("%s,%s,%d,%.4f,%.2f,%.2f", allocator, kernel, threads, t,
+          flops / t / 1e9, speedup);
+  if (nglibc > 0)
+    printf (g > 0 ? ",%.2f" : ",", g / speedup);
+  printf ("\n");
+  fflush (stdout);
+  if (margin > 0 && g > 0 && g / speedup > margin)
+    {
+      fprintf (stderr, "scaling: %s on %d threads %.2fx, glibc %.2fx\n",
+               kernel, threads, speedup, g);
+      failures++;
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  int n = 1024, c, k, r, p, maxthreads = omp_get_num_procs ();
+  const char *allocator = exm_version () > 0 ? "exm" : "glibc";
+  const char *dir = "/tmp";
+  double *A, *B, *C, *x, *y, t, best, base[2] = { 0, 0 };
+  size_t i;
+
+  while ((c = getopt (argc, argv, "n:t:g:r:")) != -1)
+    switch (c)
+      {
+      case 'n':
+        n = atoi (optarg) / BLOCK * BLOCK;
+        break;
+      case 't':
+        maxthreads = atoi (optarg);
+        break;
+      case 'g':
+        nglibc = load (optarg);
+        if (nglibc < 0)
+          perror (optarg);
+        break;
+      case 'r':
+        margin = atof (optarg);
+        break;
+      default:
+        fprintf (stderr, "usage: omp [-n size] [-t max threads] "
+                 "[-g glibc.csv [-r margin]] [dir]\n");
+        return 1;
+      }
+  if (optind < argc)
+    dir = argv[optind];
+  if (n < BLOCK)
+    n = BLOCK;
+  if (maxthreads < 1)
+    maxthreads = 1;
+  if (exm_version () > 0)
+    {
+      exm_threshold ((size_t) 1 << 20);
+      if (!exm_path ((char *) dir))
+        {
+          fprintf (stderr, "can't use %s\n", dir);
+          return 1;
+        }
+    }
+
+  A = malloc ((size_t) 8 * n * n * sizeof (double));
+  B = malloc ((size_t) n * n * sizeof (double));
+  C = malloc ((size_t) n * n * sizeof (double));
+  x = malloc (n * sizeof (double));
+  y = malloc ((size_t) 8 * n * sizeof (double));
+  if (!A || !B || !C || !x || !y)
+    return 1;
+  for (i = 0; i < (size_t) 8 * n * n; ++i)
+    A[i] = (double) (i % 13) / 13;
+  for (i = 0; i < (size_t) n * n; ++i)
+    B[i] = (double) (i % 7) / 7;
+  for (i = 0; i < (size_t) n; ++i)
+    x[i] = 1.0 / (i + 1);
+
+  printf ("allocator,kernel,threads,seconds,gflops,speedup%s\n",
+          nglibc > 0 ? ",glibc_ratio" : "");
+/* 1, 2, 4, ... and maxthreads */
+  for (k = 1; k <= maxthreads;
+       k = 2 * k > maxthreads && k < maxthreads ? maxthreads : 2 * k)
+    {
+      omp_set_num_threads (k);
+      best = 0;
+      for (r = 0; r < 3; ++r)
+        {
+          t = now ();
+          gemm (A, B, C, n);
+          t = now () - t;
+          if (r == 0 || t < best)
+            best = t;
+        }
+      if (k == 1)
+        base[0] = best;
+      report (allocator, "gemm", k, best, 2.0 * n * n * n, base[0]);
+      best = 0;
+      for (r = 0; r < 3; ++r)
+        {
+          t = now ();
+          for (p = 0; p < 20; ++p)
+            gemv (A, x, y, 8 * n, n);
+          t = now () - t;
+          if (r == 0 || t < best)
+            best = t;
+        }
+      if (k == 1)
+        base[1] = best;
+      report (allocator, "gemv", k, best, 20 * 2.0 * 8 * n * n, base[1]);
+    }
+  free (A);
+  free (B);
+  free (C);
+  free (x);
+  free (y);
+  return failures > 0;
+}
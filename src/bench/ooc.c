@@ -0,0 +1,685 @@
+/* Out-of-core workloads under a memory cap, with exm, exm with access hints
+ * and huge pages, exm's pager, swap, and a plain mmap of a file.
+ *
+ * Usage (see the bench-ooc target in the Makefile):
+ * ooc [-w workloads] [-m modes] [-s bytes] [-c cap] [-l libexm.so] [dir]
+ *
+ * Workloads (-w, comma-separated, default all), each over about -s bytes of
+ * data (default 1G), only the compute phase timed:
+ *
+ *   gemm     C = A B on n x n doubles, a band of rows of C (B read per row)
+ *   gemv     y = A x with A 4096 columns wide, 3 passes
+ *   sort     64-bit keys sorted in runs of cap/4, then merged into a second
+ *            array
+ *   join     hash join: build a table from R, probe it with S
+ *   scan     filtered sum over a table of 8 double columns, a different pair
+ *            of columns in each of 4 passes
+ *   gather   random reads of doubles, 4 per page of data
+ *
+ * Modes (-m, comma-separated, default all):
+ *
+ *   exm      libexm.so with a 1M threshold, default settings
+ *   tuned    libexm.so, data from exm_malloc with the workload's access hint
+ *            (EXM_SEQUENTIAL or EXM_RANDOM) and EXM_HUGEPAGES
+ *   pager    libexm.so in pager mode (see pager.c) with 7/8 of the cap as
+ *            its RAM budget, which it keeps by itself, data from exm_malloc
+ *            with the workload's access hint
+ *   swap     plain malloc, anonymous memory paged to swap (skipped when no
+ *            swap is configured)
+ *   mmap     plain MAP_SHARED mmap of an unlinked file in dir
+ *
+ * Each case runs in a child process capped at -c bytes (default half of -s).
+ * The cap is a cgroup v2 memory.max when a child cgroup of our own can be
+ * made (run as root or in a delegated cgroup); otherwise the child keeps
+ * its resident set under the cap itself, paging out its data regions with
+ * MADV_PAGEOUT. That budget only bounds the resident set: evicted file pages
+ * may stay in the page cache, so faults and device reads understate those of
+ * a real cap. The cap column says which was used.
+ *
+ * Output is CSV: workload, mode, data bytes, cap, cap kind, seconds,
+ * throughput and its unit, major faults, and bytes read and written to the
+ * block devices (/proc/self/io, -1 if unreadable) during the compute phase.
+ * Backing files go in dir (default /tmp, which should not be a tmpfs for
+ * meaningful fault and I/O numbers). libexm.so is -l, else
+ * $EXM_HOME/libexm.so.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libexm.h"
+
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+#define CGROUP "/sys/fs/cgroup"
+#define MAXREGIONS 16
+#define CHUNK ((size_t) 64 << 20)       /* budget page-out step */
+
+enum
+{ EXM, TUNED, PAGER, SWAP, MMAP, NMODES };
+static const char *modes[] = { "exm", "tuned", "pager", "swap", "mmap" };
+static const char *workloads[] =
+  { "gemm", "gemv", "sort", "join", "scan", "gather" };
+#define NWORKLOADS 6
+
+struct region
+{
+  char *addr;
+  size_t length;
+};
+
+struct io
+{
+  double t;
+  long majflt;
+  long long read, written;
+};
+
+static int mode;
+static size_t cap;
+static const char *dir = "/tmp";
+static struct region regions[MAXREGIONS];
+static int nregions;
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static uint64_t
+xorshift (uint64_t * s)
+{
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+static void
+sample (struct io *s)
+{
+  struct rusage u;
+  char line[128];
+  long long v;
+  FILE *f;
+  s->t = now ();
+  getrusage (RUSAGE_SELF, &u);
+  s->majflt = u.ru_majflt;
+  s->read = s->written = -1;
+  f = fopen ("/proc/self/io", "r");
+  if (!f)
+    return;
+  while (fgets (line, sizeof (line), f))
+    if (sscanf (line, "read_bytes: %lld", &v) == 1)
+      s->read = v;
+    else if (sscanf (line, "write_bytes: %lld", &v) == 1)
+      s->written = v;
+  fclose (f);
+}
+
+/* A data array of size bytes in the current mode; hint is EXM_SEQUENTIAL or
+ * EXM_RANDOM
+ */
+static void *
+data (size_t size, int hint)
+{
+  char path[4096];
+  void *x = NULL;
+  int fd;
+  switch (mode)
+    {
+    case EXM:
+    case SWAP:
+      x = malloc (size);
+      break;
+    case TUNED:
+      x = exm_malloc (size, hint | EXM_HUGEPAGES);
+      break;
+    case PAGER:
+      x = exm_malloc (size, hint);
+      break;
+    case MMAP:
+      snprintf (path, sizeof (path), "%s/ooc-XXXXXX", dir);
+      fd = mkstemp (path);
+      if (fd < 0)
+        break;
+      unlink (path);
+      if (ftruncate (fd, (off_t) size) == 0)
+        x = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close (fd);
+      if (x == MAP_FAILED)
+        x = NULL;
+      break;
+    }
+  if (!x)
+    {
+      fprintf (stderr, "can't allocate %lu bytes\n", (unsigned long) size);
+      exit (2);
+    }
+  if (nregions < MAXREGIONS)
+    {
+      regions[nregions].addr = (char *) x;
+      regions[nregions++].length = size;
+    }
+  return x;
+}
+
+static size_t
+resident ()
+{
+  long pages = 0, rss = 0;
+  FILE *f = fopen ("/proc/self/statm", "r");
+  if (f)
+    {
+      if (fscanf (f, "%ld %ld", &pages, &rss) != 2)
+        rss = 0;
+      fclose (f);
+    }
+  return (size_t) rss * (size_t) sysconf (_SC_PAGESIZE);
+}
+
+/* Self-imposed cap: page out the data regions, a chunk at a time in turn,
+ * while the resident set is over the cap
+ */
+static void *
+budget (void *arg)
+{
+  struct timespec t = { 0, 20000000 };
+  size_t off = 0, n;
+  int r = 0, i;
+  (void) arg;
+  for (;;)
+    {
+      for (i = 0; i < 1024 && nregions > 0 && resident () > cap; ++i)
+        {
+          if (r >= nregions)
+            r = 0;
+          n = regions[r].length - off < CHUNK ? regions[r].length - off
+            : CHUNK;
+          madvise (regions[r].addr + off, n, MADV_PAGEOUT);
+          off += n;
+          if (off >= regions[r].length)
+            {
+              off = 0;
+              r++;
+            }
+        }
+      nanosleep (&t, NULL);
+    }
+  return NULL;
+}
+
+/* Each workload allocates and fills its data, then runs its compute phase
+ * between the two samples. OUTPUT (return value): work done in the unit
+ * named by *unit per second of compute.
+ */
+static double
+gemm (size_t size, const char **unit, struct io *a, struct io *b)
+{
+  size_t n = (size_t) sqrt ((double) size / 3 / sizeof (double)), i, j, k;
+  size_t rows = (size_t) (4e9 / (2.0 * n * n));
+  double *A = data (n * n * sizeof (double), EXM_SEQUENTIAL);
+  double *B = data (n * n * sizeof (double), EXM_SEQUENTIAL);
+  double *C = data (n * n * sizeof (double), EXM_SEQUENTIAL);
+  double aik;
+  if (rows < 1)
+    rows = 1;
+  if (rows > n)
+    rows = n;
+  for (i = 0; i < n * n; ++i)
+    {
+      A[i] = (double) (i % 7);
+      B[i] = (double) (i % 5);
+      C[i] = 0;
+    }
+  sample (a);
+  for (i = 0; i < rows; ++i)
+    for (k = 0; k < n; ++k)
+      {
+        aik = A[i * n + k];
+        for (j = 0; j < n; ++j)
+          C[i * n + j] += aik * B[k * n + j];
+      }
+  sample (b);
+  *unit = "GFLOP/s";
+  return 2.0 * rows * n * n / (b->t - a->t) / 1e9;
+}
+
+static double
+gemv (size_t size, const char **unit, struct io *a, struct io *b)
+{
+  size_t cols = 4096, rows = size / sizeof (double) / cols, i, j;
+  double *A = data (rows * cols * sizeof (double), EXM_SEQUENTIAL);
+  double *x = malloc (cols * sizeof (double)), *y =
+    malloc (rows * sizeof (double)), s;
+  int p;
+  for (i = 0; i < rows * cols; ++i)
+    A[i] = (double) (i % 11);
+  for (j = 0; j < cols; ++j)
+    x[j] = 1.0 / (j + 1);
+  sample (a);
+  for (p = 0; p < 3; ++p)
+    for (i = 0; i < rows; ++i)
+      {
+        s = 0;
+        for (j = 0; j < cols; ++j)
+          s += A[i * cols + j] * x[j];
+        y[i] = s;
+      }
+  sample (b);
+  *unit = "GB/s";
+  return 3.0 * rows * cols * sizeof (double) / (b->t - a->t) / 1e9;
+}
+
+static int
+cmp (const void *x, const void *y)
+{
+  uint64_t a = *(const uint64_t *) x, b = *(const uint64_t *) y;
+  return a < b ? -1 : a > b;
+}
+
+static double
+sort (size_t size, const char **unit, struct io *a, struct io *b)
+{
+  size_t n = size / 2 / sizeof (uint64_t), run = cap / 4 / sizeof (uint64_t);
+  uint64_t *in = data (n * sizeof (uint64_t), EXM_SEQUENTIAL);
+  uint64_t *out = data (n * sizeof (uint64_t), EXM_SEQUENTIAL);
+  uint64_t s = 88172645463325252ULL;
+  size_t i, k, nruns, *head;
+  int best;
+  if (run < ((size_t) 1 << 17))
+    run = (size_t) 1 << 17;
+  nruns = (n + run - 1) / run;
+  head = calloc (nruns, sizeof (size_t));
+  for (i = 0; i < n; ++i)
+    in[i] = xorshift (&s);
+  sample (a);
+  for (k = 0; k < nruns; ++k)
+    {
+      head[k] = k * run;
+      qsort (in + head[k], k == nruns - 1 ? n - head[k] : run,
+             sizeof (uint64_t), cmp);
+    }
+  for (i = 0; i < n; ++i)
+    {
+      best = -1;
+      for (k = 0; k < nruns; ++k)
+        if (head[k] < (k == nruns - 1 ? n : (k + 1) * run)
+            && (best < 0 || in[head[k]] < in[head[best]]))
+          best = (int) k;
+      out[i] = in[head[best]++];
+    }
+  sample (b);
+  for (i = 1; i < n; ++i)
+    if (out[i - 1] > out[i])
+      {
+        fprintf (stderr, "sort: output not sorted\n");
+        exit (2);
+      }
+  free (head);
+  *unit = "Mkeys/s";
+  return n / (b->t - a->t) / 1e6;
+}
+
+struct tuple
+{
+  uint64_t key, value;
+};
+
+static double
+join (size_t size, const char **unit, struct io *a, struct io *b)
+{
+  size_t nr = size / 4 / sizeof (struct tuple), ns = nr, slots = 2 * nr;
+  struct tuple *R = data (nr * sizeof (struct tuple), EXM_SEQUENTIAL);
+  struct tuple *S = data (ns * sizeof (struct tuple), EXM_SEQUENTIAL);
+  struct tuple *T = data (slots * sizeof (struct tuple), EXM_RANDOM);
+  uint64_t s = 2463534242ULL, h, matches = 0;
+  size_t i;
+  for (i = 0; i < nr; ++i)
+    {
+      R[i].key = i * 2 + 1;
+      R[i].value = i;
+    }
+  for (i = 0; i < ns; ++i)
+    {
+      S[i].key = (xorshift (&s) % (2 * nr)) + 1;
+      S[i].value = i;
+    }
+  for (i = 0; i < slots; ++i)
+    T[i].key = 0;
+  sample (a);
+  for (i = 0; i < nr; ++i)
+    {
+      h = (R[i].key * 0x9e3779b97f4a7c15ULL) % slots;
+      while (T[h].key)
+        h = h + 1 == slots ? 0 : h + 1;
+      T[h] = R[i];
+    }
+  for (i = 0; i < ns; ++i)
+    {
+      h = (S[i].key * 0x9e3779b97f4a7c15ULL) % slots;
+      while (T[h].key && T[h].key != S[i].key)
+        h = h + 1 == slots ? 0 : h + 1;
+      matches += T[h].key == S[i].key;
+    }
+  sample (b);
+  if (matches == 0 || matches > ns)
+    {
+      fprintf (stderr, "join: %lu matches\n", (unsigned long) matches);
+      exit (2);
+    }
+  *unit = "Mtuples/s";
+  return (nr + ns) / (b->t - a->t) / 1e6;
+}
+
+static double
+scan (size_t size, const char **unit, struct io *a, struct io *b)
+{
+  size_t rows = size / 8 / sizeof (double), i;
+  double *col[8], sum = 0;
+  int c, p;
+  for (c = 0; c < 8; ++c)
+    {
+      col[c] = data (rows * sizeof (double), EXM_SEQUENTIAL);
+      for (i = 0; i < rows; ++i)
+        col[c][i] = (double) ((i * (c + 3)) % 101) / 100;
+    }
+  sample (a);
+  for (p = 0; p < 4; ++p)
+    for (i = 0; i < rows; ++i)
+      if (col[2 * p][i] < 0.5)
+        sum += col[2 * p + 1][i];
+  sample (b);
+  if (sum < 0)
+    exit (2);
+  *unit = "GB/s";
+  return 8.0 * rows * sizeof (double) / (b->t - a->t) / 1e9;
+}
+
+static double
+gather (size_t size, const char **unit, struct io *a, struct io *b)
+{
+  size_t n = size / sizeof (double), count, i;
+  double *x = data (n * sizeof (double), EXM_RANDOM), sum = 0;
+  uint64_t s = 1181783497276652981ULL;
+  count = size / (size_t) sysconf (_SC_PAGESIZE) * 4;
+  for (i = 0; i < n; ++i)
+    x[i] = (double) (i & 1023);
+  sample (a);
+  for (i = 0; i < count; ++i)
+    sum += x[xorshift (&s) % n];
+  sample (b);
+  if (sum < 0)
+    exit (2);
+  *unit = "Mreads/s";
+  return count / (b->t - a->t) / 1e6;
+}
+
+/* Run one case in this process and print its row */
+static int
+run (int w, size_t size, const char *kind)
+{
+  double (*f[]) (size_t, const char **, struct io *, struct io *) =
+    { gemm, gemv, sort, join, scan, gather };
+  const char *unit = "";
+  struct io a, b;
+  pthread_t id;
+  double x;
+
+  if (mode == EXM || mode == TUNED || mode == PAGER)
+    {
+      if (exm_version () <= 0)
+        {
+          fprintf (stderr, "libexm.so is not loaded\n");
+          return 2;
+        }
+      exm_threshold ((size_t) 1 << 20);
+    }
+  if (mode == PAGER)
+    exm_pager ((ssize_t) (cap / 8 * 7));
+  if (!strcmp (kind, "budget") && mode != PAGER)
+    pthread_create (&id, NULL, budget, NULL);
+  x = f[w] (size, &unit, &a, &b);
+  printf ("%s,%s,%lu,%lu,%s,%.3f,%.3f,%s,%ld,%lld,%lld,ok\n", workloads[w],
+          modes[mode], (unsigned long) size, (unsigned long) cap, kind,
+          b.t - a.t, x, unit, b.majflt - a.majflt,
+          a.read < 0 ? -1 : b.read - a.read,
+          a.written < 0 ? -1 : b.written - a.written);
+  fflush (stdout);
+  return 0;
+}
+
+/* Make a cgroup v2 child of our cgroup with memory.max = cap
+ * OUTPUT (return value): 0 and its path in path, or -1
+ */
+static int
+cgroup (char *path, size_t len)
+{
+  char line[4096], file[8300];
+  FILE *f;
+  int fd, ok = 0;
+  ssize_t n;
+
+  f = fopen ("/proc/self/cgroup", "r");
+  if (!f)
+    return -1;
+  while (!ok && fgets (line, sizeof (line), f))
+    ok = !strncmp (line, "0::", 3);
+  fclose (f);
+  if (!ok)
+    return -1;
+  line[strcspn (line, "\n")] = 0;
+  snprintf (path, len, "%s%s/exm-bench.%d", CGROUP,
+            strcmp (line + 3, "/") ? line + 3 : "", (int) getpid ());
+  if (mkdir (path, 0755) < 0)
+    return -1;
+  snprintf (file, sizeof (file), "%s/memory.max", path);
+  fd = open (file, O_WRONLY);
+  if (fd >= 0)
+    {
+      snprintf (line, sizeof (line), "%lu", (unsigned long) cap);
+      n = write (fd, line, strlen (line));
+      close (fd);
+      if (n == (ssize_t) strlen (line))
+        return 0;
+    }
+  rmdir (path);
+  return -1;
+}
+
+/* Bytes, with an optional K, M or G suffix */
+static size_t
+bytes (const char *s)
+{
+  char *e;
+  size_t n = strtoull (s, &e, 0);
+  switch (*e)
+    {
+    case 'G':
+    case 'g':
+      n <<= 10;
+    case 'M':
+    case 'm':
+      n <<= 10;
+    case 'K':
+    case 'k':
+      n <<= 10;
+    }
+  return n;
+}
+
+static int
+has_swap ()
+{
+  char line[128];
+  long kb = 0;
+  FILE *f = fopen ("/proc/meminfo", "r");
+  if (!f)
+    return 0;
+  while (fgets (line, sizeof (line), f))
+    if (sscanf (line, "SwapTotal: %ld", &kb) == 1)
+      break;
+  fclose (f);
+  return kb > 0;
+}
+
+static int
+listed (const char *list, const char *name)
+{
+  size_t n = strlen (name);
+  const char *s;
+  for (s = list; (s = strstr (s, name)); s += n)
+    if ((s == list || s[-1] == ',') && (s[n] == ',' || s[n] == 0))
+      return 1;
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *wlist = "gemm,gemv,sort,join,scan,gather",
+    *mlist = "exm,tuned,pager,swap,mmap", *lib = NULL, *one = NULL, *kind;
+  char group[8200], file[8300], s[32], c1[32], c2[32], libpath[4096];
+  char *args[16];
+  size_t size = (size_t) 1 << 30;
+  int c, w, m, fd, status, swap;
+  pid_t pid;
+
+  while ((c = getopt (argc, argv, "w:m:s:c:l:x:")) != -1)
+    switch (c)
+      {
+      case 'w':
+        wlist = optarg;
+        break;
+      case 'm':
+        mlist = optarg;
+        break;
+      case 's':
+        size = bytes (optarg);
+        break;
+      case 'c':
+        cap = bytes (optarg);
+        break;
+      case 'l':
+        lib = optarg;
+        break;
+      case 'x':                /* internal: workload,mode,cap kind */
+        one = optarg;
+        break;
+      default:
+        fprintf (stderr, "usage: ooc [-w workloads] [-m modes] [-s bytes] "
+                 "[-c cap] [-l libexm.so] [dir]\n");
+        return 1;
+      }
+  if (optind < argc)
+    dir = argv[optind];
+  if (cap == 0)
+    cap = size / 2;
+  if (size < ((size_t) 16 << 20))
+    {
+      fprintf (stderr, "need at least 16M of data\n");
+      return 1;
+    }
+
+  if (one)
+    {
+      if (sscanf (one, "%d,%d,%31s", &w, &mode, s) != 3 || w < 0
+          || w >= NWORKLOADS || mode < 0 || mode >= NMODES)
+        return 1;
+      return run (w, size, s);
+    }
+
+  if (!lib)
+    {
+      snprintf (libpath, sizeof (libpath), "%s/libexm.so",
+                getenv ("EXM_HOME") ? getenv ("EXM_HOME") : ".");
+      lib = libpath;
+    }
+  if (access (lib, R_OK) < 0)
+    {
+      perror (lib);
+      return 1;
+    }
+  kind = cgroup (group, sizeof (group)) == 0 ? "cgroup" : "budget";
+  swap = has_swap ();
+  printf ("workload,mode,bytes,cap,cap_kind,seconds,throughput,unit,"
+          "major_faults,read_bytes,write_bytes,status\n");
+  fflush (stdout);
+  for (w = 0; w < NWORKLOADS; ++w)
+    for (m = 0; m < NMODES; ++m)
+      {
+        if (!listed (wlist, workloads[w]) || !listed (mlist, modes[m]))
+          continue;
+        if (m == SWAP && !swap)
+          {
+            printf ("%s,%s,%lu,%lu,%s,,,,,,,skipped: no swap\n",
+                    workloads[w], modes[m], (unsigned long) size,
+                    (unsigned long) cap, kind);
+            continue;
+          }
+        snprintf (s, sizeof (s), "%lu", (unsigned long) size);
+        snprintf (c1, sizeof (c1), "%lu", (unsigned long) cap);
+        snprintf (c2, sizeof (c2), "%d,%d,%s", w, m, kind);
+        args[0] = argv[0];
+        args[1] = "-s";
+        args[2] = s;
+        args[3] = "-c";
+        args[4] = c1;
+        args[5] = "-x";
+        args[6] = c2;
+        args[7] = (char *) dir;
+        args[8] = NULL;
+        fflush (stdout);
+        pid = fork ();
+        if (pid == 0)
+          {
+            if (!strcmp (kind, "cgroup"))
+              {
+                snprintf (file, sizeof (file), "%s/cgroup.procs", group);
+                fd = open (file, O_WRONLY);
+                snprintf (s, sizeof (s), "%d", (int) getpid ());
+                if (fd < 0 || write (fd, s, strlen (s)) < 0)
+                  _exit (2);
+                close (fd);
+              }
+            if (m == EXM || m == TUNED || m == PAGER)
+              {
+                setenv ("LD_PRELOAD", lib, 1);
+                setenv ("EXM_PATH", dir, 1);
+              }
+            else
+              unsetenv ("LD_PRELOAD");
+            execv ("/proc/self/exe", args);
+            _exit (2);
+          }
+        if (pid < 0 || waitpid (pid, &status, 0) < 0)
+          return 1;
+        if (WIFSIGNALED (status) || WEXITSTATUS (status) != 0)
+          printf ("%s,%s,%lu,%lu,%s,,,,,,,%s %d\n", workloads[w], modes[m],
+                  (unsigned long) size, (unsigned long) cap, kind,
+                  WIFSIGNALED (status) ? "killed by signal" : "failed",
+                  WIFSIGNALED (status) ? WTERMSIG (status)
+                  : WEXITSTATUS (status));
+        fflush (stdout);
+      }
+  if (!strcmp (kind, "cgroup"))
+    rmdir (group);
+  return 0;
+}
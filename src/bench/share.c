@@ -0,0 +1,163 @@
+/* Handing a large buffer to another process: publishing it (see share.c)
+ * against writing it to a file that the other process reads back.
+ *
+ * Usage (under libexm.so, see the bench target in the Makefile):
+ * share [-s bytes] [dir]
+ *
+ * The producer fills an exm allocation of the given size (default 1 GiB) and
+ * forks a consumer, which sums the data as unsigned longs, so that it touches
+ * every byte. The consumer only uses the name, as an unrelated process
+ * would. Method "publish" calls exm_publish and the consumer maps the buffer
+ * with exm_attach_shared; method "file" writes the buffer to a file in dir
+ * (default /tmp) and the consumer reads it into a malloc buffer. The program
+ * reports the producer's handoff time and the consumer's time for each.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "libexm.h"
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static unsigned long
+sum (const unsigned long *x, size_t n)
+{
+  unsigned long s = 0;
+  size_t i;
+  for (i = 0; i < n; ++i)
+    s += x[i];
+  return s;
+}
+
+/* Consumer of method "publish"
+ * OUTPUT (return value): exit status
+ */
+static int
+consume_published (const char *name, unsigned long expect)
+{
+  unsigned long *y = (unsigned long *) exm_attach_shared (name, 1);
+  int j;
+  if (!y)
+    return 1;
+  j = sum (y, exm_size (y) / sizeof (unsigned long)) == expect ? 0 : 2;
+  free (y);
+  return j;
+}
+
+/* Consumer of method "file"
+ * OUTPUT (return value): exit status
+ */
+static int
+consume_file (const char *path, size_t size, unsigned long expect)
+{
+  unsigned long *y = (unsigned long *) malloc (size);
+  size_t done = 0;
+  ssize_t s;
+  int fd = open (path, O_RDONLY), j;
+  if (fd < 0 || !y)
+    return 1;
+  while (done < size && (s = read (fd, (char *) y + done, size - done)) > 0)
+    done += (size_t) s;
+  close (fd);
+  j = done == size && sum (y, size / sizeof (unsigned long)) == expect ? 0 : 2;
+  free (y);
+  return j;
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t size = (size_t) 1 << 30, n, i, done;
+  unsigned long *x, expect;
+  char path[4096];
+  const char *dir;
+  double t, handoff;
+  ssize_t s;
+  int c, fd, status;
+  pid_t p;
+
+  while ((c = getopt (argc, argv, "s:")) != -1)
+    switch (c)
+      {
+      case 's':
+        size = strtoull (optarg, NULL, 0);
+        break;
+      default:
+        fprintf (stderr, "usage: share [-s bytes] [dir]\n");
+        return 1;
+      }
+  dir = optind < argc ? argv[optind] : "/tmp";
+  n = size / sizeof (unsigned long);
+  size = n * sizeof (unsigned long);
+  x = (unsigned long *) exm_malloc (size, EXM_SEQUENTIAL);
+  if (!x)
+    {
+      fprintf (stderr, "allocation failed\n");
+      return 1;
+    }
+  for (i = 0; i < n; ++i)
+    x[i] = i;
+  expect = sum (x, n);
+  printf ("method,bytes,handoff_s,consumer_s\n");
+
+/* publish */
+  snprintf (path, sizeof (path), "%s/exm_bench_share", dir);
+  t = now ();
+  if (exm_publish (x, path, 0) < 0)
+    {
+      fprintf (stderr, "exm_publish failed (run under libexm.so)\n");
+      return 1;
+    }
+  handoff = now () - t;
+  fflush (stdout);
+  t = now ();
+  p = fork ();
+  if (p == 0)
+    exit (consume_published (path, expect));
+  waitpid (p, &status, 0);
+  t = now () - t;
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    fprintf (stderr, "publish consumer failed\n");
+  printf ("publish,%lu,%.6f,%.6f\n", (unsigned long) size, handoff, t);
+
+/* file */
+  snprintf (path, sizeof (path), "%s/exm_bench_share.bin", dir);
+  t = now ();
+  fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  for (done = 0; fd >= 0 && done < size; done += (size_t) s)
+    if ((s = write (fd, (char *) x + done, size - done)) <= 0)
+      break;
+  if (fd < 0 || done < size || fsync (fd) < 0)
+    {
+      fprintf (stderr, "writing %s failed\n", path);
+      return 1;
+    }
+  close (fd);
+  handoff = now () - t;
+  fflush (stdout);
+  t = now ();
+  p = fork ();
+  if (p == 0)
+    exit (consume_file (path, size, expect));
+  waitpid (p, &status, 0);
+  t = now () - t;
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    fprintf (stderr, "file consumer failed\n");
+  printf ("file,%lu,%.6f,%.6f\n", (unsigned long) size, handoff, t);
+  unlink (path);
+
+  exm_free (x);
+  return 0;
+}
@@ -0,0 +1,105 @@
+/* Checkpointing an iterative solver with full and incremental snapshots
+ * (see snapshot.c).
+ *
+ * Usage (under libexm.so, see the bench target in the Makefile):
+ * snapshot [-n doubles] [-i iterations] [dir]
+ *
+ * The solver finds the fixed point of x = cos(x) for every element with a
+ * damped iteration x += d (cos(x) - x), where the damping d grows along the
+ * vector, so the vector converges from the end to the start and each
+ * iteration writes only the elements that have not converged yet, as
+ * solvers with local convergence do. The state is checkpointed into dir
+ * (default /tmp) after every iteration with exm_snapshot_incremental; the
+ * program reports the fraction of pages each checkpoint wrote and its time,
+ * next to the time of a full snapshot.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "libexm.h"
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t n = (size_t) 1 << 25, i, changed, pages;
+  int c, it, iterations = 200;
+  double t, full, d, y, *x;
+  char dest[4096];
+  ssize_t written;
+
+  while ((c = getopt (argc, argv, "n:i:")) != -1)
+    switch (c)
+      {
+      case 'n':
+        n = strtoull (optarg, NULL, 0);
+        break;
+      case 'i':
+        iterations = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "usage: snapshot [-n doubles] [-i iterations] "
+                 "[dir]\n");
+        return 1;
+      }
+  snprintf (dest, sizeof (dest), "%s/exm_bench_snapshot",
+            optind < argc ? argv[optind] : "/tmp");
+  x = (double *) exm_malloc (n * sizeof (double), EXM_SEQUENTIAL);
+  if (!x)
+    {
+      fprintf (stderr, "allocation failed\n");
+      return 1;
+    }
+  for (i = 0; i < n; ++i)
+    x[i] = 0;
+  pages = (n * sizeof (double) + sysconf (_SC_PAGESIZE) - 1)
+    / sysconf (_SC_PAGESIZE);
+
+  t = now ();
+  if (exm_snapshot (x, dest) < 0)
+    {
+      fprintf (stderr, "exm_snapshot failed (run under libexm.so)\n");
+      return 1;
+    }
+  full = now () - t;
+  printf ("# %lu doubles, %lu pages, full snapshot %.6f s\n",
+          (unsigned long) n, (unsigned long) pages, full);
+  printf ("iteration,changed,pages_written,fraction,snapshot_s\n");
+  for (it = 1; it <= iterations; ++it)
+    {
+      changed = 0;
+      for (i = 0; i < n; ++i)
+        {
+          d = 0.02 + 0.98 * (double) i / (double) n;
+          y = x[i] + d * (cos (x[i]) - x[i]);
+          if (fabs (y - x[i]) > 1e-9)
+            {
+              x[i] = y;
+              changed++;
+            }
+        }
+      t = now ();
+      written = exm_snapshot_incremental (x);
+      t = now () - t;
+      printf ("%d,%lu,%ld,%.4f,%.6f\n", it, (unsigned long) changed,
+              (long) written, (double) written / (double) pages, t);
+      if (changed == 0)
+        break;
+    }
+  exm_snapshot (x, NULL);
+  exm_free (x);
+  unlink (dest);
+  return 0;
+}
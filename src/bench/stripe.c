@@ -0,0 +1,157 @@
+/* Sequential scan throughput of one large exm allocation striped over 1, 2
+ * and 4 backing directories.
+ *
+ * Usage (under libexm.so, see the bench target in the Makefile):
+ * stripe [-s size] [-S stripe] dir1 [dir2 [dir3 [dir4]]]
+ *
+ * For each directory count n in 1, 2, 4, up to the number of distinct
+ * directories given, the program allocates one buffer striped round-robin
+ * across the first n directories, writes it sequentially, flushes it and
+ * drops it from the page cache, then times a sequential read scan. Counts
+ * with too few distinct directories would stripe over the same device more
+ * than once, they are skipped with a note on stderr.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+check_error ()
+{
+  char *derror;
+  if ((derror = dlerror ()) == NULL)
+    return;
+  fprintf (stderr, "%s (run under libexm.so)\n", derror);
+  exit (1);
+}
+
+/* Drop the backing files of x from the page cache */
+static void
+drop (char *paths)
+{
+  char *p, *save = NULL;
+  int fd;
+  for (p = strtok_r (paths, ":", &save); p; p = strtok_r (NULL, ":", &save))
+    {
+      fd = open (p, O_RDONLY);
+      if (fd < 0)
+        continue;
+      fdatasync (fd);
+      posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+      close (fd);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t size = (size_t) 1 << 30, stripe = (size_t) 64 << 20, i;
+  size_t (*exm_threshold) (size_t);
+  size_t (*exm_stripe) (ssize_t);
+  char *(*exm_path) (char *);
+  char *(*exm_lookup) (void *);
+  char spec[8192], *paths, *dirs[4];
+  int c, n, k, ndirs = 0;
+  double t, sum;
+  volatile double sink;
+  double *x;
+
+  while ((c = getopt (argc, argv, "s:S:")) != -1)
+    switch (c)
+      {
+      case 's':
+        size = strtoull (optarg, NULL, 0);
+        break;
+      case 'S':
+        stripe = strtoull (optarg, NULL, 0);
+        break;
+      default:
+        fprintf (stderr, "usage: %s [-s size] [-S stripe] dir...\n", argv[0]);
+        return 1;
+      }
+  for (; optind < argc; ++optind)
+    {
+      for (k = 0; k < ndirs && strcmp (dirs[k], argv[optind]) != 0; ++k);
+      if (k == ndirs && ndirs < 4)
+        dirs[ndirs++] = argv[optind];
+    }
+  if (ndirs < 1)
+    {
+      fprintf (stderr, "usage: %s [-s size] [-S stripe] dir...\n", argv[0]);
+      return 1;
+    }
+  exm_threshold = (size_t (*)(size_t)) dlsym (RTLD_DEFAULT, "exm_threshold");
+  check_error ();
+  exm_stripe = (size_t (*)(ssize_t)) dlsym (RTLD_DEFAULT, "exm_stripe");
+  check_error ();
+  exm_path = (char *(*)(char *)) dlsym (RTLD_DEFAULT, "exm_path");
+  check_error ();
+  exm_lookup = (char *(*)(void *)) dlsym (RTLD_DEFAULT, "exm_lookup");
+  check_error ();
+
+  (*exm_threshold) (stripe);
+  (*exm_stripe) (stripe);
+  printf ("dirs,bytes,stripe,write_GBps,scan_GBps\n");
+  for (n = 1; n <= 4; n *= 2)
+    {
+      if (n > ndirs)
+        {
+          fprintf (stderr, "skipping %d dirs: only %d distinct directories "
+                   "given\n", n, ndirs);
+          continue;
+        }
+      spec[0] = 0;
+      for (k = 0; k < n; ++k)
+        {
+          if (k > 0)
+            strcat (spec, ":");
+          strncat (spec, dirs[k], 1024);
+        }
+      (*exm_path) (spec);
+      x = (double *) malloc (size);
+      if (!x)
+        {
+          perror ("malloc");
+          return 1;
+        }
+      t = now ();
+      for (i = 0; i < size / sizeof (double); ++i)
+        x[i] = (double) i;
+      msync (x, size, MS_SYNC);
+      t = now () - t;
+      printf ("%d,%lu,%lu,%.3f,", n, size, stripe, size / t / 1e9);
+      madvise (x, size, MADV_DONTNEED);
+      paths = (*exm_lookup) (x);
+      if (paths)
+        {
+          drop (paths);
+          free (paths);
+        }
+      t = now ();
+      sum = 0;
+      for (i = 0; i < size / sizeof (double); i += 512)
+        sum += x[i];
+      t = now () - t;
+      sink = sum;
+      printf ("%.3f\n", size / t / 1e9);
+      fflush (stdout);
+      free (x);
+    }
+  (void) sink;
+  return 0;
+}
@@ -0,0 +1,588 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Live demotion and promotion
+ *
+ * In demote mode (EXM_DEMOTE=1 or exm_demote) allocations above the threshold
+ * start out as anonymous memory (kind EXM_ANON) tracked in flexmap. A
+ * background thread wakes every exm_demote_interval milliseconds and
+ *
+ * 1. estimates how hot each anonymous or demoted allocation is from the
+ *    "Referenced" bytes the kernel reports in /proc/self/smaps, clearing the
+ *    referenced bits afterwards (/proc/self/clear_refs), and keeps an
+ *    exponentially decaying heat value per map. clear_refs has no address
+ *    range: it clears the bits of the whole process, which costs a page
+ *    table walk over all of it each interval and hides recent accesses from
+ *    the kernel's reclaim and from other users of the bits (a profiler, or
+ *    exm's own heatmap profile, see profile.c);
+ * 2. when memory is under pressure (see pressure.c), demotes the coldest
+ *    anonymous allocation: its touched pages are written to a new backing
+ *    file which is then mapped with MAP_FIXED over the same address range
+ *    (kind EXM_DEMOTED);
+ * 3. when memory is plentiful (more than twice the headroom available beyond
+ *    the allocation's size), promotes the hottest demoted allocation back to
+ *    anonymous memory by reading its file into fresh anonymous pages and
+ *    moving them over the range with mremap, then removing the file.
+ *
+ * While an allocation migrates it is write-protected, and writers that fault
+ * on it wait in the fault handler (see fault.c) until the new mapping is in
+ * place, so the application does not notice. Writes by the kernel do not
+ * fault into the handler: the read, pread and fread wrappers of io.c wait
+ * for the migration before the system call instead, but other system calls
+ * writing into a migrating allocation (readv, recv, ...) fail with EFAULT. At most one allocation migrates
+ * at a time. Reading smaps and moving the data can take long, so the thread
+ * does both without the lock: it samples a copy of the candidate list, and
+ * marks the allocation it moves (moving), which free, realloc, fork and
+ * exm_migrate wait for (exm_demote_wait) and the memcpy fast path avoids.
+ *
+ * The background thread does not survive fork; it is restarted in children
+ * that inherit anonymous allocations.
+ */
+
+int exm_demote_mode = 0;
+long exm_demote_interval = 1000;        /* milliseconds */
+
+#define EXM_DEMOTE_SAMPLE 256   /* Most allocations sampled per interval */
+
+/* An allocation sampled without the lock */
+struct sample
+{
+  uintptr_t addr;
+  size_t length;
+  size_t refs;                  /* Referenced bytes in the last interval */
+};
+
+static int running = 0;
+static pthread_t thread;
+static struct map *moving;      /* Migrating without the lock, or NULL */
+static struct sample samples[EXM_DEMOTE_SAMPLE];
+static int nsamples;
+
+static size_t
+page_size ()
+{
+  return (size_t) sysconf (_SC_PAGESIZE);
+}
+
+/* Fault callback for migrating maps: wait until the migration finishes */
+static int
+wait_migration (void *addr __attribute__ ((unused)), void *arg)
+{
+  struct map *m = (struct map *) arg;
+  while (__atomic_load_n (&m->migrating, __ATOMIC_ACQUIRE))
+    exm_fault_pause ();
+  return 0;
+}
+
+/* Mark m migrating or not; migrating maps count in exm_io_guard so that
+ * the I/O wrappers wait for them (see io.c)
+ */
+static void
+migrating (struct map *m, int on)
+{
+  __atomic_store_n (&m->migrating, on, __ATOMIC_RELEASE);
+  __atomic_fetch_add (&exm_io_guard, on ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+/* Release the lock at every depth, for a wait or a long transfer that must
+ * not stall other exm calls. The caller holds the lock.
+ * OUTPUT (return value): the depth to give back to reacquire
+ */
+static int
+release ()
+{
+  int depth = lock.depth;
+  lock.depth = 1;
+  exm_unlock ();
+  return depth;
+}
+
+static void
+reacquire (int depth)
+{
+  exm_lock ();
+  lock.depth = depth;
+}
+
+/* Wait until the allocation m (any allocation when m is NULL) is no longer
+ * migrating without the lock, releasing the lock meanwhile. The caller holds
+ * the lock.
+ */
+void
+exm_demote_wait (struct map *m)
+{
+  while (moving && (!m || moving == m))
+    {
+      int depth = release ();
+      exm_fault_pause ();
+      reacquire (depth);
+    }
+}
+
+/* Copy the anonymous and demoted maps of this process to samples. The
+ * caller holds the lock.
+ */
+static void
+collect ()
+{
+  struct map *m, *tmp;
+  nsamples = 0;
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    if ((m->kind != EXM_ANON && m->kind != EXM_DEMOTED)
+        || m->pid != getpid () || nsamples == EXM_DEMOTE_SAMPLE)
+      continue;
+    samples[nsamples].addr = (uintptr_t) m->addr;
+    samples[nsamples].length = m->length;
+    samples[nsamples].refs = 0;
+    nsamples++;
+  }
+}
+
+/* Credit kB referenced bytes of the VMA [lo, hi) to overlapping samples */
+static void
+credit (uintptr_t lo, uintptr_t hi, size_t kb)
+{
+  uintptr_t a, b;
+  int i;
+  for (i = 0; i < nsamples; ++i)
+    {
+      a = samples[i].addr;
+      b = a + samples[i].length;
+      if (a < lo)
+        a = lo;
+      if (b > hi)
+        b = hi;
+      if (a < b)
+        samples[i].refs += (size_t) ((double) kb * 1024 * (b - a) / (hi - lo));
+    }
+}
+
+/* Count the referenced bytes of the samples from /proc/self/smaps, then
+ * clear the referenced bits. Runs without the lock.
+ */
+static void
+measure ()
+{
+  char buf[65536], *line, *nl;
+  size_t have = 0;
+  ssize_t n;
+  uintptr_t lo = 0, hi = 0;
+  int fd;
+
+  fd = open ("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  while ((n = read (fd, buf + have, sizeof (buf) - 1 - have)) > 0)
+    {
+      have += n;
+      buf[have] = 0;
+      line = buf;
+      while ((nl = strchr (line, '\n')))
+        {
+          *nl = 0;
+          if (strncmp (line, "Referenced:", 11) == 0)
+            {
+              if (hi > lo)
+                credit (lo, hi, (size_t) strtoull (line + 11, NULL, 10));
+            }
+          else if (line[0] >= '0' && line[0] <= 'f' && strchr (line, '-'))
+            {
+              char *e;
+              lo = (uintptr_t) strtoull (line, &e, 16);
+              hi = *e == '-' ? (uintptr_t) strtoull (e + 1, NULL, 16) : lo;
+            }
+          line = nl + 1;
+        }
+      have = buf + have - line;
+      memmove (buf, line, have);
+    }
+  close (fd);
+  fd = open ("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (fd >= 0)
+    {
+      if (write (fd, "1", 1) < 0)
+        syslog (LOG_CRIT, "exm unable to clear referenced bits\n");
+      close (fd);
+    }
+}
+
+/* Update the heat of the sampled maps that are still there. The caller holds
+ * the lock.
+ */
+static void
+heat ()
+{
+  struct map *m;
+  void *addr;
+  int i;
+  for (i = 0; i < nsamples; ++i)
+    {
+      addr = (void *) samples[i].addr;
+      HASH_FIND_PTR (flexmap, &addr, m);
+      if (m && m->length == samples[i].length
+          && (m->kind == EXM_ANON || m->kind == EXM_DEMOTED))
+        m->heat = 0.5 * m->heat
+          + 0.5 * (double) samples[i].refs / m->length;
+    }
+}
+
+/* Write [addr + off, addr + off + len) to fd at the same offset */
+static int
+write_run (int fd, char *addr, size_t off, size_t len)
+{
+  ssize_t n;
+  size_t done = 0;
+  while (done < len)
+    {
+      n = pwrite (fd, addr + off + done, len - done, (off_t) (off + done));
+      if (n < 0)
+        return -1;
+      done += n;
+    }
+  return 0;
+}
+
+/* Write the present (or swapped) pages of [addr, addr + length) to fd at the
+ * same offsets, skipping pages that were never touched (the file stays
+ * sparse there). Uses /proc/self/pagemap; pages it does not tell about are
+ * all written.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+copy_out (int fd, char *addr, size_t length)
+{
+  uint64_t e[512];
+  size_t page = page_size (), npages = (length + page - 1) / page;
+  size_t i, k, run = 0, start = 0;
+  int pm, j = 0;
+
+  pm = open ("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (pm < 0)
+    return -1;
+  for (i = 0; i < npages && j == 0; ++i)
+    {
+      if (i % 512 == 0)
+        {
+          k = npages - i < 512 ? npages - i : 512;
+          if (pread (pm, e, k * sizeof (uint64_t),
+                     (off_t) (((uintptr_t) addr / page + i)
+                              * sizeof (uint64_t)))
+              != (ssize_t) (k * sizeof (uint64_t)))
+            memset (e, 0xff, sizeof (e));
+        }
+      if ((e[i % 512] >> 62) != 0)
+        {
+          if (run == 0)
+            start = i;
+          run++;
+        }
+      else if (run > 0)
+        {
+          j = write_run (fd, addr, start * page, run * page);
+          run = 0;
+        }
+    }
+  if (j == 0 && run > 0)
+    j = write_run (fd, addr, start * page, length - start * page);
+  close (pm);
+  return j;
+}
+
+/* Move an anonymous allocation to a new backing file. Caller holds the lock,
+ * which is released while the data is written.
+ * OUTPUT (return value): 0 on success, -1 on error (m unchanged)
+ */
+int
+exm_demote_map (struct map *m)
+{
+  int fd, slot, depth, j;
+  void *p;
+
+  exm_demote_wait (NULL);
+  fd = exm_mkstemp (m, m->length, m->tier);
+  if (fd < 0)
+    return -1;
+  migrating (m, 1);
+  slot = exm_fault_register (m->addr, m->length, wait_migration, m);
+  if (slot < 0 || mprotect (m->addr, m->length, PROT_READ) < 0)
+    goto fail;
+  moving = m;
+  depth = release ();
+  j = copy_out (fd, (char *) m->addr, m->length);
+  reacquire (depth);
+  moving = NULL;
+  if (j < 0)
+    goto fail;
+  p = mmap (m->addr, m->length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            fd, 0);
+  if (p == MAP_FAILED)
+    goto fail;
+  close (fd);
+  m->kind = EXM_DEMOTED;
+  migrating (m, 0);
+  exm_fault_unregister (slot);
+#if defined(DEBUG) || defined(DEBUG1)
+  syslog (LOG_DEBUG, "demoted %p size %lu to %s\n", m->addr,
+          (unsigned long int) m->length, m->path);
+#endif
+  return 0;
+
+fail:
+  syslog (LOG_CRIT, "exm demotion of %p failed\n", m->addr);
+  mprotect (m->addr, m->length, PROT_READ | PROT_WRITE);
+  migrating (m, 0);
+  exm_fault_unregister (slot);
+  close (fd);
+  unlink (m->path);
+  exm_tier_release (m->tier, m->length);
+  m->path[0] = 0;
+  return -1;
+}
+
+/* Read the data extents of the (sparse) file fd into buf, length bytes
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+copy_in (int fd, char *buf, size_t length)
+{
+  off_t data, hole;
+  ssize_t n;
+  for (data = 0; (data = lseek (fd, data, SEEK_DATA)) >= 0
+       && (size_t) data < length; data = hole)
+    {
+      hole = lseek (fd, data, SEEK_HOLE);
+      if (hole < 0 || (size_t) hole > length)
+        hole = length;
+      while (data < hole)
+        {
+          n = pread (fd, buf + data, hole - data, data);
+          if (n <= 0)
+            return -1;
+          data += n;
+        }
+    }
+  return 0;
+}
+
+/* Move a demoted allocation back to anonymous memory. Caller holds the lock,
+ * which is released while the data is read.
+ * OUTPUT (return value): 0 on success, -1 on error (m unchanged)
+ */
+int
+exm_promote_map (struct map *m)
+{
+  size_t page = page_size (), len = ((m->length + page - 1) / page) * page;
+  char *tmp;
+  void *p;
+  int fd, slot = -1, depth, j;
+
+  exm_demote_wait (NULL);
+  fd = open (m->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  tmp = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+  if (tmp == MAP_FAILED)
+    {
+      close (fd);
+      return -1;
+    }
+  migrating (m, 1);
+  slot = exm_fault_register (m->addr, m->length, wait_migration, m);
+  if (slot < 0 || mprotect (m->addr, m->length, PROT_READ) < 0)
+    goto fail;
+  moving = m;
+  depth = release ();
+  j = copy_in (fd, tmp, m->length);
+  reacquire (depth);
+  moving = NULL;
+  if (j < 0)
+    goto fail;
+  p = mremap (tmp, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, m->addr);
+  if (p == MAP_FAILED)
+    goto fail;
+  close (fd);
+  exm_unlink (m);
+  m->path[0] = 0;
+  m->kind = EXM_ANON;
+  migrating (m, 0);
+  exm_fault_unregister (slot);
+#if defined(DEBUG) || defined(DEBUG1)
+  syslog (LOG_DEBUG, "promoted %p size %lu\n", m->addr,
+          (unsigned long int) m->length);
+#endif
+  return 0;
+
+fail:
+  syslog (LOG_CRIT, "exm promotion of %p failed\n", m->addr);
+  mprotect (m->addr, m->length, PROT_READ | PROT_WRITE);
+  migrating (m, 0);
+  exm_fault_unregister (slot);
+  munmap (tmp, len);
+  close (fd);
+  return -1;
+}
+
+/* One pass of the background thread, after measure. Caller holds the lock. */
+static void
+step ()
+{
+  struct map *m, *tmp, *pick = NULL;
+  size_t avail, headroom;
+  int under = exm_pressure_poll (&avail, &headroom);
+
+  heat ();
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    if (m->pid != getpid ())
+      continue;
+    if (under && m->kind == EXM_ANON && (!pick || m->heat < pick->heat))
+      pick = m;
+    else if (!under && m->kind == EXM_DEMOTED
+             && avail > 2 * headroom + m->length
+             && (!pick || m->heat > pick->heat))
+      pick = m;
+  }
+  if (!pick)
+    return;
+  if (pick->kind == EXM_ANON)
+    exm_demote_map (pick);
+  else
+    exm_promote_map (pick);
+}
+
+static void *
+demote_thread (void *arg __attribute__ ((unused)))
+{
+  struct timespec t;
+  for (;;)
+    {
+      t.tv_sec = exm_demote_interval / 1000;
+      t.tv_nsec = (exm_demote_interval % 1000) * 1000000L;
+      nanosleep (&t, NULL);
+      exm_lock ();
+      if (!exm_ready () || !exm_demote_mode)
+        {
+          running = 0;
+          exm_unlock ();
+          break;
+        }
+      collect ();
+      exm_unlock ();
+      measure ();
+      exm_lock ();
+      if (exm_ready ())
+        step ();
+      exm_unlock ();
+    }
+  return NULL;
+}
+
+/* Start the background thread if it is not running. Caller holds the lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+int
+exm_demote_start ()
+{
+  pthread_attr_t a;
+  if (running)
+    return 0;
+  if (exm_fault_init () < 0)
+    return -1;
+  pthread_attr_init (&a);
+  pthread_attr_setdetachstate (&a, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&thread, &a, demote_thread, NULL) != 0)
+    {
+      pthread_attr_destroy (&a);
+      syslog (LOG_CRIT, "exm unable to start demotion thread\n");
+      return -1;
+    }
+  pthread_attr_destroy (&a);
+  running = 1;
+  return 0;
+}
+
+/* In a forked child: the thread is gone, restart it if needed. Caller holds
+ * the lock.
+ */
+void
+exm_demote_atfork ()
+{
+  struct map *m, *tmp;
+  running = 0;
+  if (!exm_demote_mode)
+    return;
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    if (m->kind == EXM_ANON || m->kind == EXM_DEMOTED)
+      {
+        exm_demote_start ();
+        return;
+      }
+  }
+}
+
+/* API: Enable or disable demote mode
+ * INPUT j: 1 to start new large allocations as anonymous memory and migrate
+ *          them under memory pressure, 0 to stop (existing allocations stay
+ *          where they are), negative to leave the mode unchanged
+ * OUTPUT (return value): the demote mode in effect
+ */
+int
+exm_demote (int j)
+{
+  exm_lock ();
+  if (j >= 0)
+    exm_demote_mode = j > 0;
+  j = exm_demote_mode;
+  exm_unlock ();
+  return j;
+}
+
+/* API: Migrate an allocation made in demote mode now
+ * INPUT addr: exm-allocated pointer address
+ *       to_file: 1 to demote it to a backing file, 0 to promote it back to
+ *                anonymous memory
+ * OUTPUT (return value): 0 on success, -1 on error (including when the
+ *        allocation is not of the right kind)
+ */
+int
+exm_migrate (void *addr, int to_file)
+{
+  struct map *m;
+  int j = -1;
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (m)
+    exm_demote_wait (m);
+  if (m && m->pid == getpid () && exm_fault_init () == 0)
+    {
+      if (to_file && m->kind == EXM_ANON)
+        j = exm_demote_map (m);
+      else if (!to_file && m->kind == EXM_DEMOTED)
+        j = exm_promote_map (m);
+    }
+  exm_unlock ();
+  return j;
+}
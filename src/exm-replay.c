@@ -0,0 +1,562 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+ exm-replay: simulate or replay allocation traces (see trace.c)
+
+ Usage: exm-replay [-t thresholds] [-s] trace...
+        exm-replay -r [-w] [-n] trace
+
+ Without -r, each trace (one file per process) is simulated against a list
+ of thresholds: comma separated sizes with optional K, M, G suffixes, by
+ default the recorded threshold and powers of four from the smallest traced
+ size to the largest allocation. For each threshold the allocations at or
+ above it are assumed to go to backing files and the others to RAM, and the
+ table shows the peak RAM and backing file bytes, the bytes written to
+ backing files (each file page written back once, plus the data realloc
+ copies into files) and how many allocations go to files. The "recorded" row
+ is what the traced run did. -s adds a table of call sites (the keys of
+ site.c) with their allocation count, sizes and mean lifetime, longest lived
+ first.
+
+ With -r, the trace is executed: every allocation, realloc and free happens
+ again, in time order on one thread, with the sizes recorded and every new
+ page written once. Run it under libexm.so with the settings to evaluate, for
+ instance
+
+   EXM_THRESHOLD=256M LD_PRELOAD=./libexm.so ./exm-replay -r trace.1234
+
+ The run time, peak resident set and exm's peak backing file bytes are
+ reported. -w keeps the recorded pauses between events and -n does not
+ touch the pages. Forks are counted, not repeated.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "uthash.h"
+#include "libexm.h"
+#include "trace.h"
+
+#define MAXTHRESHOLDS 64
+
+struct trace
+{
+  struct trace_header h;
+  struct trace_event *ev;
+  size_t n;
+};
+
+/* A live allocation, by address */
+struct live
+{
+  uint64_t addr;
+  uint64_t size;
+  uint64_t birth;
+  uint64_t site;
+  int file;                     /* In a backing file (simulation) */
+  void *p;                      /* Replayed allocation */
+  UT_hash_handle hh;
+};
+
+/* Call site summary */
+struct site
+{
+  uint64_t key;
+  uint64_t n, bytes, max, lived, lifetime_ns;
+  UT_hash_handle hh;
+};
+
+struct result
+{
+  uint64_t ram, peak_ram, file, peak_file, written, to_file, allocs;
+};
+
+static size_t
+parse_size (const char *s)
+{
+  char *end;
+  double x = strtod (s, &end);
+  switch (*end)
+    {
+    case 'k':
+    case 'K':
+      x *= 1024.0;
+      break;
+    case 'm':
+    case 'M':
+      x *= 1024.0 * 1024.0;
+      break;
+    case 'g':
+    case 'G':
+      x *= 1024.0 * 1024.0 * 1024.0;
+      break;
+    case 't':
+    case 'T':
+      x *= 1024.0 * 1024.0 * 1024.0 * 1024.0;
+      break;
+    }
+  return (size_t) x;
+}
+
+static void
+human (char *s, size_t n, double x)
+{
+  const char *u = "BKMGTP";
+  while (x >= 1024 && u[1])
+    {
+      x /= 1024;
+      u++;
+    }
+  snprintf (s, n, *u == 'B' ? "%.0f%c" : "%.1f%c", x, *u);
+}
+
+static int
+by_time (const void *a, const void *b)
+{
+  const struct trace_event *x = a, *y = b;
+  return x->t < y->t ? -1 : x->t > y->t;
+}
+
+/* Read a trace file, events sorted by time
+ * OUTPUT (return value): 0 on success, -1 on error (reported)
+ */
+static int
+load (const char *path, struct trace *tr)
+{
+  struct trace_event *ev;
+  size_t cap = 4096;
+  FILE *f = fopen (path, "r");
+
+  memset (tr, 0, sizeof (struct trace));
+  if (!f)
+    {
+      perror (path);
+      return -1;
+    }
+  if (fread (&tr->h, sizeof (tr->h), 1, f) != 1
+      || tr->h.magic != EXM_TRACE_MAGIC
+      || tr->h.event_size != sizeof (struct trace_event))
+    {
+      fprintf (stderr, "%s: not an exm trace\n", path);
+      fclose (f);
+      return -1;
+    }
+  tr->ev = malloc (cap * sizeof (struct trace_event));
+  while (tr->ev && fread (&tr->ev[tr->n], sizeof (struct trace_event), 1, f)
+         == 1)
+    if (++tr->n == cap)
+      {
+        cap *= 2;
+        ev = realloc (tr->ev, cap * sizeof (struct trace_event));
+        if (!ev)
+          free (tr->ev);
+        tr->ev = ev;
+      }
+  fclose (f);
+  if (!tr->ev)
+    {
+      fprintf (stderr, "%s: out of memory\n", path);
+      return -1;
+    }
+/* Threads flush their events in blocks */
+  qsort (tr->ev, tr->n, sizeof (struct trace_event), by_time);
+  return 0;
+}
+
+static void
+charge (struct result *r, struct live *l, int sign)
+{
+  uint64_t *x = l->file ? &r->file : &r->ram;
+  if (sign > 0)
+    *x += l->size;
+  else
+    *x -= l->size;
+  if (r->ram > r->peak_ram)
+    r->peak_ram = r->ram;
+  if (r->file > r->peak_file)
+    r->peak_file = r->file;
+}
+
+/* Run the trace with allocations of at least threshold bytes in files, or
+ * where they were recorded for threshold 0
+ */
+static void
+simulate (const struct trace *tr, uint64_t threshold, struct result *r)
+{
+  struct live *lives = NULL, *l, *tmp;
+  const struct trace_event *e;
+  uint64_t addr;
+  size_t i;
+  int file;
+
+  memset (r, 0, sizeof (struct result));
+  for (i = 0; i < tr->n; ++i)
+    {
+      e = &tr->ev[i];
+      if (e->type == EXM_TRACE_FORK)
+        continue;
+      addr = e->type == EXM_TRACE_REALLOC ? e->old : e->addr;
+      HASH_FIND (hh, lives, &addr, sizeof (uint64_t), l);
+      if (l)
+        {
+          charge (r, l, -1);
+          HASH_DEL (lives, l);
+        }
+      if (e->type == EXM_TRACE_FREE)
+        {
+          free (l);
+          continue;
+        }
+      file = threshold ? e->size >= threshold : (e->flags & EXM_TRACE_EXM);
+      if (file)
+        {
+/* Data realloc moves into a file is written once more */
+          if (!l || !l->file)
+            r->written += e->size;
+          else if (e->size > l->size)
+            r->written += e->size - l->size;
+          if (!l)
+            r->to_file++;
+        }
+      if (!l)
+        {
+          l = calloc (1, sizeof (struct live));
+          if (!l)
+            break;
+          r->allocs++;
+        }
+      l->addr = e->addr;
+      l->size = e->size;
+      l->file = file;
+      HASH_ADD (hh, lives, addr, sizeof (uint64_t), l);
+      charge (r, l, 1);
+    }
+  HASH_ITER (hh, lives, l, tmp)
+  {
+    HASH_DEL (lives, l);
+    free (l);
+  }
+}
+
+static void
+row (const char *name, const struct result *r)
+{
+  char a[16], b[16], c[16];
+  human (a, sizeof (a), (double) r->peak_ram);
+  human (b, sizeof (b), (double) r->peak_file);
+  human (c, sizeof (c), (double) r->written);
+  printf ("%-12s %10s %10s %10s %8lu/%lu\n", name, a, b, c,
+          (unsigned long) r->to_file, (unsigned long) r->allocs);
+}
+
+static int
+by_lifetime (struct site *a, struct site *b)
+{
+  double x = a->lived ? (double) a->lifetime_ns / a->lived : 0;
+  double y = b->lived ? (double) b->lifetime_ns / b->lived : 0;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Call sites with their sizes and lifetimes, realloc chains counted as one
+ * allocation from the first malloc to the free
+ */
+static void
+sites (const struct trace *tr)
+{
+  struct live *lives = NULL, *l, *tmp;
+  struct site *s = NULL, *x, *y;
+  const struct trace_event *e;
+  char a[16], b[16];
+  uint64_t addr, end = tr->n ? tr->ev[tr->n - 1].t : 0;
+  size_t i;
+
+  for (i = 0; i < tr->n; ++i)
+    {
+      e = &tr->ev[i];
+      if (e->type == EXM_TRACE_FORK)
+        continue;
+      addr = e->type == EXM_TRACE_REALLOC ? e->old : e->addr;
+      HASH_FIND (hh, lives, &addr, sizeof (uint64_t), l);
+      if (l)
+        HASH_DEL (lives, l);
+      else if (e->type != EXM_TRACE_FREE)
+        {
+          l = calloc (1, sizeof (struct live));
+          if (!l)
+            break;
+          l->birth = e->t;
+          l->site = e->site;
+          HASH_FIND (hh, s, &e->site, sizeof (uint64_t), x);
+          if (!x && (x = calloc (1, sizeof (struct site))))
+            {
+              x->key = e->site;
+              HASH_ADD (hh, s, key, sizeof (uint64_t), x);
+            }
+          if (x)
+            {
+              x->n++;
+              x->bytes += e->size;
+            }
+        }
+      if (!l)
+        continue;
+      HASH_FIND (hh, s, &l->site, sizeof (uint64_t), x);
+      if (x && e->size > x->max)
+        x->max = e->size;
+      if (e->type == EXM_TRACE_FREE)
+        {
+          if (x)
+            {
+              x->lived++;
+              x->lifetime_ns += e->t - l->birth;
+            }
+          free (l);
+          continue;
+        }
+      l->addr = e->addr;
+      HASH_ADD (hh, lives, addr, sizeof (uint64_t), l);
+    }
+/* Still live at the end of the trace */
+  HASH_ITER (hh, lives, l, tmp)
+  {
+    HASH_FIND (hh, s, &l->site, sizeof (uint64_t), x);
+    if (x)
+      {
+        x->lived++;
+        x->lifetime_ns += end - l->birth;
+      }
+    HASH_DEL (lives, l);
+    free (l);
+  }
+  HASH_SORT (s, by_lifetime);
+  printf ("\n%-18s %8s %10s %10s %12s\n", "SITE", "ALLOCS", "MEAN", "MAX",
+          "LIFETIME_S");
+  HASH_ITER (hh, s, x, y)
+  {
+    human (a, sizeof (a), (double) x->bytes / x->n);
+    human (b, sizeof (b), (double) x->max);
+    printf ("%016llx   %8lu %10s %10s %12.3f\n", (unsigned long long) x->key,
+            (unsigned long) x->n, a, b,
+            x->lived ? x->lifetime_ns / 1e9 / x->lived : 0);
+    HASH_DEL (s, x);
+    free (x);
+  }
+}
+
+static int
+report (const char *path, const char *thresholds, int show_sites)
+{
+  uint64_t t[MAXTHRESHOLDS], max = 0;
+  struct result r;
+  struct trace tr;
+  char name[16], *list, *tok, *save;
+  size_t i;
+  int n = 0;
+
+  if (load (path, &tr) < 0)
+    return -1;
+  for (i = 0; i < tr.n; ++i)
+    if (tr.ev[i].size > max)
+      max = tr.ev[i].size;
+  if (thresholds)
+    {
+      list = strdup (thresholds);
+      for (tok = strtok_r (list, ",", &save); tok && n < MAXTHRESHOLDS;
+           tok = strtok_r (NULL, ",", &save))
+        if (parse_size (tok) > 0)
+          t[n++] = parse_size (tok);
+      free (list);
+    }
+  else
+    {
+      t[n++] = tr.h.threshold;
+      for (i = tr.h.min ? tr.h.min : 1; i <= max && n < MAXTHRESHOLDS;
+           i *= 4)
+        if (i != tr.h.threshold)
+          t[n++] = i;
+    }
+  printf ("%s: %s pid %d (parent %d), %lu events\n", path, tr.h.command,
+          (int) tr.h.pid, (int) tr.h.ppid, (unsigned long) tr.n);
+  printf ("%-12s %10s %10s %10s %13s\n", "THRESHOLD", "PEAK_RAM",
+          "PEAK_FILE", "WRITTEN", "TO_FILE/ALL");
+  simulate (&tr, 0, &r);
+  row ("recorded", &r);
+  for (i = 0; i < (size_t) n; ++i)
+    {
+      simulate (&tr, t[i], &r);
+      human (name, sizeof (name), (double) t[i]);
+      row (name, &r);
+    }
+  if (show_sites)
+    sites (&tr);
+  free (tr.ev);
+  return 0;
+}
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Write one byte in each page of [p + from, p + to) */
+static void
+touch (char *p, uint64_t from, uint64_t to)
+{
+  long page = sysconf (_SC_PAGESIZE);
+  uint64_t i;
+  for (i = from - from % page; i < to; i += page)
+    p[i > from ? i : from] = 1;
+}
+
+static int
+replay (const char *path, int wait, int dirty)
+{
+  struct live *lives = NULL, *l, *tmp;
+  const struct trace_event *e;
+  struct exm_stats s;
+  struct rusage u;
+  struct trace tr;
+  unsigned long forks = 0, done = 0, missing = 0;
+  uint64_t addr, old;
+  double start, d;
+  char a[16], b[16];
+  struct timespec ts;
+  size_t i;
+  void *p;
+
+  if (load (path, &tr) < 0)
+    return -1;
+  start = now ();
+  for (i = 0; i < tr.n; ++i)
+    {
+      e = &tr.ev[i];
+      if (wait && (d = e->t / 1e9 - (now () - start)) > 0)
+        {
+          ts.tv_sec = (time_t) d;
+          ts.tv_nsec = (long) ((d - ts.tv_sec) * 1e9);
+          nanosleep (&ts, NULL);
+        }
+      if (e->type == EXM_TRACE_FORK)
+        {
+          forks++;
+          continue;
+        }
+      addr = e->type == EXM_TRACE_REALLOC ? e->old : e->addr;
+      HASH_FIND (hh, lives, &addr, sizeof (uint64_t), l);
+      if (e->type == EXM_TRACE_FREE)
+        {
+          if (l)
+            {
+              HASH_DEL (lives, l);
+              free (l->p);
+              free (l);
+              done++;
+            }
+          else
+            missing++;
+          continue;
+        }
+      old = 0;
+      if (l)
+        {
+          HASH_DEL (lives, l);
+          old = l->size;
+          p = realloc (l->p, e->size);
+        }
+      else
+        {
+/* A realloc of a block too small to be traced starts a new chain */
+          l = calloc (1, sizeof (struct live));
+          p = e->type == EXM_TRACE_CALLOC ? calloc (1, e->size)
+            : e->type == EXM_TRACE_VALLOC ? valloc (e->size)
+            : malloc (e->size);
+        }
+      if (!l || !p)
+        {
+          fprintf (stderr, "allocation of %lu bytes failed at event %lu\n",
+                   (unsigned long) e->size, (unsigned long) i);
+          return -1;
+        }
+      if (dirty && e->size > old)
+        touch ((char *) p, old, e->size);
+      l->addr = e->addr;
+      l->size = e->size;
+      l->p = p;
+      HASH_ADD (hh, lives, addr, sizeof (uint64_t), l);
+      done++;
+    }
+  d = now () - start;
+  HASH_ITER (hh, lives, l, tmp)
+  {
+    HASH_DEL (lives, l);
+    free (l->p);
+    free (l);
+  }
+  getrusage (RUSAGE_SELF, &u);
+  memset (&s, 0, sizeof (s));
+  exm_stats (&s);
+  human (a, sizeof (a), (double) u.ru_maxrss * 1024);
+  human (b, sizeof (b), (double) s.peak_file_bytes);
+  printf ("%s: replayed %lu events in %.3f s (%lu frees of unknown blocks, "
+          "%lu forks skipped)\n", path, done, d, missing, forks);
+  printf ("peak resident %s, peak backing files %s, %lu exm allocations\n",
+          a, b, (unsigned long) s.allocations);
+  free (tr.ev);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *thresholds = NULL;
+  int c, run = 0, wait = 0, dirty = 1, show_sites = 0, status = 0;
+
+  while ((c = getopt (argc, argv, "t:srwn")) != -1)
+    switch (c)
+      {
+      case 't':
+        thresholds = optarg;
+        break;
+      case 's':
+        show_sites = 1;
+        break;
+      case 'r':
+        run = 1;
+        break;
+      case 'w':
+        wait = 1;
+        break;
+      case 'n':
+        dirty = 0;
+        break;
+      default:
+        optind = argc + 1;
+      }
+  if (optind >= argc || (run && optind != argc - 1))
+    {
+      fprintf (stderr, "usage: exm-replay [-t thresholds] [-s] trace...\n"
+               "       exm-replay -r [-w] [-n] trace\n");
+      return 1;
+    }
+  if (run)
+    return replay (argv[optind], wait, dirty) < 0;
+  for (; optind < argc; ++optind)
+    {
+      if (report (argv[optind], thresholds, show_sites) < 0)
+        status = 1;
+      if (optind < argc - 1)
+        printf ("\n");
+    }
+  return status;
+}
@@ -0,0 +1,337 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+ exm-top: live view of the processes using exm
+
+ Usage: exm-top [-d seconds] [-n iterations] [-m]
+
+ Lists every process with a monitor segment (see monitor.c; processes run
+ with EXM_MONITOR=1) with its exm allocations, how much of them is resident
+ and dirty, the page fault rate, the lock wait time and the call rates, then
+ the backing directories with the bytes their files occupy and the free
+ space left. -d sets the refresh interval (default 1 second), -n stops after
+ that many refreshes and -m also lists each process's allocations. Resident and dirty bytes and faults come
+ from /proc/<pid>/smaps and /proc/<pid>/stat, which needs the same user or
+ CAP_SYS_PTRACE; a dash means they could not be read.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "monitor.h"
+
+#define MAXPROC 256
+#define MAXDIRS 64
+
+struct proc
+{
+  struct monitor m;             /* Consistent copy of the segment */
+  uint64_t resident, dirty;     /* From smaps, -1 when unknown */
+  uint64_t minflt, majflt;      /* From stat, cumulative */
+};
+
+struct dir
+{
+  char path[EXM_MONITOR_PATH];
+  uint64_t used;                /* Allocated blocks of the listed files */
+  uint64_t avail;               /* statvfs */
+};
+
+/* Previous sample, for rates */
+static struct proc last[MAXPROC];
+static int nlast;
+
+static void
+human (char *s, size_t n, double x)
+{
+  const char *u = "BKMGTP";
+  while (x >= 1024 && u[1])
+    {
+      x /= 1024;
+      u++;
+    }
+  snprintf (s, n, *u == 'B' ? "%.0f%c" : "%.1f%c", x, *u);
+}
+
+/* Copy the segment of process pid
+ * OUTPUT (return value): 0 on success, -1 when it is missing or stale (and
+ *        then removed) or never stops changing
+ */
+static int
+snapshot (const char *path, int pid, struct monitor *out)
+{
+  struct monitor *m;
+  uint64_t s;
+  int fd, i;
+
+  if (kill (pid, 0) < 0 && errno == ESRCH)
+    {
+/* Killed before it could clean up */
+      unlink (path);
+      return -1;
+    }
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  m = mmap (NULL, sizeof (struct monitor), PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (m == MAP_FAILED)
+    return -1;
+  for (i = 0; i < 100; ++i)
+    {
+      s = __atomic_load_n (&m->seq, __ATOMIC_ACQUIRE);
+      if (s & 1)
+        {
+          usleep (100);
+          continue;
+        }
+      memcpy (out, m, sizeof (struct monitor));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&m->seq, __ATOMIC_RELAXED) == s)
+        break;
+    }
+  munmap (m, sizeof (struct monitor));
+  return i < 100 && out->magic == EXM_MONITOR_MAGIC && out->pid == pid
+    ? 0 : -1;
+}
+
+/* Sum Rss and dirty pages of the smaps entries inside the listed
+ * allocations
+ */
+static void
+smaps (struct proc *p)
+{
+  char path[64], line[512];
+  unsigned long long lo = 0, hi = 0, kb;
+  int in = 0, i, n;
+  FILE *f;
+
+  p->resident = p->dirty = (uint64_t) - 1;
+  snprintf (path, sizeof (path), "/proc/%d/smaps", (int) p->m.pid);
+  f = fopen (path, "r");
+  if (!f)
+    return;
+  p->resident = p->dirty = 0;
+  n = p->m.nmaps < EXM_MONITOR_MAPS ? p->m.nmaps : EXM_MONITOR_MAPS;
+  while (fgets (line, sizeof (line), f))
+    {
+      if (sscanf (line, "%llx-%llx ", &lo, &hi) == 2)
+        {
+          in = 0;
+          for (i = 0; i < n && !in; ++i)
+            in = lo >= p->m.maps[i].addr
+              && hi <= p->m.maps[i].addr + p->m.maps[i].length;
+        }
+      else if (in && sscanf (line, "Rss: %llu kB", &kb) == 1)
+        p->resident += kb * 1024;
+      else if (in && (sscanf (line, "Private_Dirty: %llu kB", &kb) == 1
+                      || sscanf (line, "Shared_Dirty: %llu kB", &kb) == 1))
+        p->dirty += kb * 1024;
+    }
+  fclose (f);
+}
+
+/* Page fault counters, fields 10 and 12 of /proc/<pid>/stat */
+static void
+faults (struct proc *p)
+{
+  char path[64], buf[1024], *s;
+  unsigned long long mn = 0, mj = 0;
+  FILE *f;
+  size_t n;
+
+  snprintf (path, sizeof (path), "/proc/%d/stat", (int) p->m.pid);
+  f = fopen (path, "r");
+  if (!f)
+    return;
+  n = fread (buf, 1, sizeof (buf) - 1, f);
+  fclose (f);
+  buf[n] = 0;
+/* The command name may hold spaces and parentheses, skip past the last ) */
+  s = strrchr (buf, ')');
+  if (s && sscanf (s + 2, "%*c %*d %*d %*d %*d %*d %*u %llu %*u %llu",
+                   &mn, &mj) == 2)
+    {
+      p->minflt = mn;
+      p->majflt = mj;
+    }
+}
+
+static struct proc *
+previous (int pid)
+{
+  int i;
+  for (i = 0; i < nlast; ++i)
+    if (last[i].m.pid == pid)
+      return &last[i];
+  return NULL;
+}
+
+/* Record the directory of a backing file and the blocks the file holds */
+static int
+account (struct dir *d, int nd, const char *file)
+{
+  char path[EXM_MONITOR_PATH], *s;
+  struct statvfs v;
+  struct stat st;
+  int i;
+
+  if (!*file || stat (file, &st) < 0)
+    return nd;
+  snprintf (path, sizeof (path), "%s", file);
+  s = strrchr (path, '/');
+  if (s == path)
+    s[1] = 0;
+  else if (s)
+    *s = 0;
+  for (i = 0; i < nd && strcmp (d[i].path, path); ++i);
+  if (i == nd)
+    {
+      if (nd == MAXDIRS)
+        return nd;
+      memset (&d[i], 0, sizeof (struct dir));
+      snprintf (d[i].path, sizeof (d[i].path), "%s", path);
+      if (statvfs (path, &v) == 0)
+        d[i].avail = (uint64_t) v.f_bavail * v.f_frsize;
+      nd++;
+    }
+  d[i].used += (uint64_t) st.st_blocks * 512;
+  return nd;
+}
+
+static void
+show (double interval, int maps)
+{
+  static struct proc cur[MAXPROC];
+  struct dir d[MAXDIRS];
+  char path[EXM_MONITOR_PATH + 64], a[16], r[16], w[16], u[16];
+  struct dirent *e;
+  struct proc *p, *q;
+  uint64_t calls;
+  int n = 0, nd = 0, i, j, pid;
+  DIR *dir;
+
+  dir = opendir (EXM_MONITOR_DIR);
+  if (!dir)
+    {
+      perror (EXM_MONITOR_DIR);
+      exit (1);
+    }
+  while ((e = readdir (dir)) && n < MAXPROC)
+    {
+      if (strncmp (e->d_name, EXM_MONITOR_PREFIX,
+                   strlen (EXM_MONITOR_PREFIX)))
+        continue;
+      pid = atoi (e->d_name + strlen (EXM_MONITOR_PREFIX));
+      snprintf (path, sizeof (path), "%s/%s", EXM_MONITOR_DIR, e->d_name);
+      if (pid <= 0 || snapshot (path, pid, &cur[n].m) < 0)
+        continue;
+      cur[n].minflt = cur[n].majflt = 0;
+      smaps (&cur[n]);
+      faults (&cur[n]);
+      n++;
+    }
+  closedir (dir);
+
+  printf ("\033[H\033[2J");
+  printf ("%7s %-16s %5s %9s %9s %9s %9s %9s %10s %10s\n", "PID", "COMMAND",
+          "MAPS", "ALLOC", "RES", "DIRTY", "MINFLT/s", "MAJFLT/s", "LOCKWAIT",
+          "CALLS/s");
+  for (i = 0; i < n; ++i)
+    {
+      p = &cur[i];
+      q = previous (p->m.pid);
+      human (a, sizeof (a), (double) p->m.stats.bytes_mapped);
+      if (p->resident == (uint64_t) - 1)
+        {
+          strcpy (r, "-");
+          strcpy (w, "-");
+        }
+      else
+        {
+          human (r, sizeof (r), (double) p->resident);
+          human (w, sizeof (w), (double) p->dirty);
+        }
+      calls = p->m.stats.allocations + p->m.stats.frees + p->m.stats.reallocs;
+      printf ("%7d %-16.16s %5d %9s %9s %9s %9.0f %9.0f %9.3fs %10.0f\n",
+              (int) p->m.pid, p->m.command, p->m.nmaps, a, r, w,
+              q ? (p->minflt - q->minflt) / interval : 0,
+              q ? (p->majflt - q->majflt) / interval : 0,
+              p->m.stats.lock_wait_ns / 1e9,
+              q ? (calls - q->m.stats.allocations - q->m.stats.frees
+                   - q->m.stats.reallocs) / interval : 0);
+      for (j = 0; j < p->m.nmaps && j < EXM_MONITOR_MAPS; ++j)
+        {
+          nd = account (d, nd, p->m.maps[j].path);
+          if (!maps)
+            continue;
+          human (a, sizeof (a), (double) p->m.maps[j].length);
+          printf ("%7s 0x%-14llx %9s tier %2d %s\n", "",
+                  (unsigned long long) p->m.maps[j].addr, a,
+                  (int) p->m.maps[j].tier, p->m.maps[j].path);
+        }
+    }
+  if (n == 0)
+    printf ("(no processes using exm)\n");
+
+  printf ("\n%-50s %9s %9s\n", "BACKING DIRECTORY", "USED", "AVAIL");
+  for (i = 0; i < nd; ++i)
+    {
+      human (u, sizeof (u), (double) d[i].used);
+      human (a, sizeof (a), (double) d[i].avail);
+      printf ("%-50.50s %9s %9s\n", d[i].path, u, a);
+    }
+  fflush (stdout);
+  memcpy (last, cur, sizeof (struct proc) * n);
+  nlast = n;
+}
+
+int
+main (int argc, char **argv)
+{
+  double interval = 1;
+  long iterations = -1, i;
+  int c, maps = 0;
+  struct timespec t;
+
+  while ((c = getopt (argc, argv, "d:n:m")) != -1)
+    switch (c)
+      {
+      case 'd':
+        interval = atof (optarg);
+        break;
+      case 'n':
+        iterations = atol (optarg);
+        break;
+      case 'm':
+        maps = 1;
+        break;
+      default:
+        fprintf (stderr, "usage: exm-top [-d seconds] [-n iterations] [-m]\n");
+        return 1;
+      }
+  if (interval <= 0)
+    interval = 1;
+  t.tv_sec = (time_t) interval;
+  t.tv_nsec = (long) ((interval - t.tv_sec) * 1e9);
+  for (i = 0; iterations < 0 || i < iterations; ++i)
+    {
+      if (i > 0)
+        nanosleep (&t, NULL);
+      show (interval, maps);
+    }
+  return 0;
+}
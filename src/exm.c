@@ -17,13 +17,14 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
-#include <omp.h>
 #include <sys/sendfile.h>
 
 #define uthash_malloc(sz) uthash_malloc_(sz)
 #define uthash_free(ptr, sz) uthash_free_(ptr)
 #include "uthash.h"
 #include "exm.h"
+#include "libexm.h"
+#include "trace.h"
 
 #ifndef TMPDIR
 #define TMPDIR "/tmp"
@@ -44,6 +45,7 @@ static pid_t (*exm_default_fork) (void);
 static void *uthash_malloc_ (size_t);
 static void uthash_free_ (void *);
 void freemap (struct map *);
+struct map *newmap (void);
 
 /* READY has three states:
  * -1 at startup, prior to initialization of anything
@@ -52,6 +54,24 @@ void freemap (struct map *);
  */
 static int READY = -1;
 
+/* The threshold for an allocation of size bytes, fixed or derived from
+ * memory pressure in auto mode (see pressure.c)
+ */
+static inline size_t
+threshold (size_t size)
+{
+  return exm_auto ? exm_threshold_auto_value (size) : exm_alloc_threshold;
+}
+
+/* Address space occupied by a map, more than its length for a reservation
+ * (see reserve.c)
+ */
+static size_t
+span (struct map *m)
+{
+  return m->reserved > m->length ? m->reserved : m->length;
+}
+
 /* NOTES
  *
  * Exm uses well-known methods to overload various memory allocation functions
@@ -82,26 +102,133 @@ static int READY = -1;
 static void
 exm_init ()
 {
-  char *endptr, *EXM_CHILD_COW, *EXM_THRESHOLD, *EXM_TMPDIR;
+  char *endptr, *EXM_CHILD_COW, *EXM_THRESHOLD, *EXM_TMPDIR, *EXM_TIER_POLICY;
+  char *EXM_STRIPE, *EXM_HEADROOM, *EXM_PSI_HIGH, *EXM_DEMOTE, *EXM_LEARN;
+  char *EXM_POLICY, *EXM_LAZY_ENV, *EXM_ZEROCOPY, *EXM_MONITOR, *EXM_TRACE;
+  char *EXM_PROFILE, *EXM_PAGER;
   if (READY < 0)
     {
-      omp_init_nest_lock (&lock);
       READY = 1;
       openlog ("exm", LOG_PERROR | LOG_PID, LOG_USER);
-      EXM_TMPDIR = getenv ("TMPDIR");
-      if( EXM_TMPDIR != NULL)
+      EXM_TMPDIR = getenv ("EXM_PATH");
+      if (EXM_TMPDIR == NULL)
+        EXM_TMPDIR = getenv ("TMPDIR");
+      if (EXM_TMPDIR == NULL || exm_tier_parse (EXM_TMPDIR) < 0)
+        EXM_TMPDIR = TMPDIR;
+      snprintf (exm_data_path, EXM_MAX_PATH_LEN, "%s", EXM_TMPDIR);
+      if (exm_ntiers == 0)
+        exm_tier_parse (exm_data_path);
+      EXM_TIER_POLICY = getenv ("EXM_TIER_POLICY");
+      if (EXM_TIER_POLICY != NULL)
         {
-          snprintf (exm_data_path, EXM_MAX_PATH_LEN, "%s", EXM_TMPDIR);
+          if (strcmp (EXM_TIER_POLICY, "roundrobin") == 0)
+            exm_tier_mode = EXM_TIER_ROUNDROBIN;
+          else if (strcmp (EXM_TIER_POLICY, "free") == 0)
+            exm_tier_mode = EXM_TIER_FREE;
+          else
+            exm_tier_mode = EXM_TIER_FILL;
+        }
+      EXM_POLICY = getenv ("EXM_POLICY");
+      if (EXM_POLICY != NULL)
+        exm_policy_load (EXM_POLICY);
+      EXM_STRIPE = getenv ("EXM_STRIPE");
+      if (EXM_STRIPE != NULL)
+        {
+          size_t page = (size_t) sysconf (_SC_PAGESIZE);
+          exm_stripe_size = exm_parse_size (EXM_STRIPE, NULL);
+          exm_stripe_size = ((exm_stripe_size + page - 1) / page) * page;
         }
-      else snprintf (exm_data_path, EXM_MAX_PATH_LEN, "%s", TMPDIR);
       EXM_THRESHOLD = getenv ("EXM_THRESHOLD");
-      if (EXM_THRESHOLD != NULL)
+      if (EXM_THRESHOLD != NULL && strcmp (EXM_THRESHOLD, "auto") == 0)
+        exm_auto = 1;
+      else if (EXM_THRESHOLD != NULL)
         {
           errno = 0;
           unsigned long _threshold = strtoul (EXM_THRESHOLD, &endptr, 0);
           if (errno == 0)
             exm_alloc_threshold = (size_t) _threshold;
         }
+      EXM_THRESHOLD = getenv ("EXM_THRESHOLD_MIN");
+      if (EXM_THRESHOLD != NULL)
+        exm_auto_min = exm_parse_size (EXM_THRESHOLD, NULL);
+      EXM_THRESHOLD = getenv ("EXM_THRESHOLD_MAX");
+      if (EXM_THRESHOLD != NULL)
+        exm_auto_max = exm_parse_size (EXM_THRESHOLD, NULL);
+      EXM_HEADROOM = getenv ("EXM_HEADROOM");
+      if (EXM_HEADROOM != NULL)
+        exm_auto_headroom = exm_parse_size (EXM_HEADROOM, NULL);
+      EXM_PSI_HIGH = getenv ("EXM_PSI_HIGH");
+      if (EXM_PSI_HIGH != NULL)
+        exm_psi_high = strtod (EXM_PSI_HIGH, NULL);
+      exm_pressure_init ();
+      EXM_DEMOTE = getenv ("EXM_DEMOTE");
+      if (EXM_DEMOTE != NULL)
+        exm_demote_mode = atoi (EXM_DEMOTE) > 0;
+      EXM_DEMOTE = getenv ("EXM_DEMOTE_INTERVAL");
+      if (EXM_DEMOTE != NULL && atol (EXM_DEMOTE) > 0)
+        exm_demote_interval = atol (EXM_DEMOTE);
+      EXM_LAZY_ENV = getenv ("EXM_LAZY");
+      if (EXM_LAZY_ENV != NULL)
+        exm_lazy_mode = atoi (EXM_LAZY_ENV) > 0;
+      EXM_LAZY_ENV = getenv ("EXM_LAZY_CHUNK");
+      if (EXM_LAZY_ENV != NULL && exm_parse_size (EXM_LAZY_ENV, NULL) > 0)
+        exm_lazy_chunk = exm_parse_size (EXM_LAZY_ENV, NULL);
+      EXM_PAGER = getenv ("EXM_PAGER");
+      if (EXM_PAGER != NULL && exm_parse_size (EXM_PAGER, NULL) > 0)
+        {
+          exm_pager_budget = exm_parse_size (EXM_PAGER, NULL);
+          exm_pager_mode = 1;
+        }
+      EXM_PAGER = getenv ("EXM_PAGER_CLUSTER");
+      if (EXM_PAGER != NULL && exm_parse_size (EXM_PAGER, NULL) > 0)
+        exm_pager_cluster = exm_parse_size (EXM_PAGER, NULL);
+      EXM_PAGER = getenv ("EXM_PAGER_RA");
+      if (EXM_PAGER != NULL)
+        exm_pager_ra = (size_t) atol (EXM_PAGER);
+      EXM_ZEROCOPY = getenv ("EXM_ZEROCOPY");
+      if (EXM_ZEROCOPY != NULL)
+        exm_zerocopy_min = exm_parse_size (EXM_ZEROCOPY, NULL);
+      EXM_MONITOR = getenv ("EXM_MONITOR");
+      if (EXM_MONITOR != NULL)
+        exm_monitor_mode = atoi (EXM_MONITOR) > 0;
+      EXM_MONITOR = getenv ("EXM_MONITOR_INTERVAL");
+      if (EXM_MONITOR != NULL && atol (EXM_MONITOR) > 0)
+        exm_monitor_interval = atol (EXM_MONITOR);
+      EXM_LEARN = getenv ("EXM_LEARN");
+      if (EXM_LEARN != NULL)
+        exm_learn_mode = atoi (EXM_LEARN) > 0;
+      EXM_LEARN = getenv ("EXM_LEARN_MIN");
+      if (EXM_LEARN != NULL)
+        exm_learn_min = exm_parse_size (EXM_LEARN, NULL);
+      EXM_LEARN = getenv ("EXM_LEARN_LIFETIME");
+      if (EXM_LEARN != NULL)
+        exm_learn_lifetime = strtod (EXM_LEARN, NULL);
+      EXM_LEARN = getenv ("EXM_LEARN_RATE");
+      if (EXM_LEARN != NULL)
+        exm_learn_rate = (double) exm_parse_size (EXM_LEARN, NULL);
+      EXM_LEARN = getenv ("EXM_LEARN_FILE");
+      if (EXM_LEARN != NULL)
+        snprintf (exm_learn_file, EXM_MAX_PATH_LEN, "%s", EXM_LEARN);
+      EXM_PROFILE = getenv ("EXM_PROFILE");
+      if (EXM_PROFILE != NULL && *EXM_PROFILE
+          && strlen (EXM_PROFILE) < EXM_MAX_PATH_LEN)
+        {
+          strcpy (exm_profile_path, EXM_PROFILE);
+          exm_profile_mode = 1;
+        }
+      EXM_PROFILE = getenv ("EXM_PROFILE_INTERVAL");
+      if (EXM_PROFILE != NULL && atol (EXM_PROFILE) > 0)
+        exm_profile_interval = atol (EXM_PROFILE);
+      EXM_TRACE = getenv ("EXM_TRACE_MIN");
+      if (EXM_TRACE != NULL)
+        exm_trace_min = exm_parse_size (EXM_TRACE, NULL);
+      EXM_TRACE = getenv ("EXM_TRACE");
+      if (EXM_TRACE != NULL && *EXM_TRACE
+          && strlen (EXM_TRACE) < EXM_MAX_PATH_LEN)
+        {
+          strcpy (exm_trace_path, EXM_TRACE);
+          exm_trace_start ();
+        }
       EXM_CHILD_COW = getenv ("EXM_CHILD_COW");
       if (EXM_CHILD_COW != NULL)
         {
@@ -117,6 +244,13 @@ exm_init ()
     exm_default_free = (void *(*)(void *)) dlsym (RTLD_NEXT, "free");
 }
 
+/* Is the library initialized and not yet finalized? */
+int
+exm_ready ()
+{
+  return READY > 0;
+}
+
 /* Exm finalization
  * Remove any left over allocations, but we don't destroy the lock--XXX
  */
@@ -128,27 +262,35 @@ exm_finalize ()
 #endif
   struct map *m, *tmp;
   pid_t pid;
-  omp_set_nest_lock (&lock);
+  if (exm_trace_mode)
+    exm_trace_finish ();
+  exm_lock ();
+  exm_demote_wait (NULL);
   READY = 0;
+  exm_site_finish ();
+  exm_monitor_finish ();
+  exm_profile_finish ();
   HASH_ITER (hh, flexmap, m, tmp)
   {
 #if defined(DEBUG) || defined(DEBUG1)
     syslog (LOG_DEBUG, "finalize unmap address %p of size %lu\n", m->addr,
             (unsigned long int) m->length);
 #endif
-    munmap (m->addr, m->length);
+    exm_snapshot_stop (m);
+    exm_pager_stop (m);
+    munmap (m->addr, span (m));
     pid = getpid ();
     if (pid == m->pid)
       {
 #if defined(DEBUG) || defined(DEBUG1)
         syslog (LOG_DEBUG, "finalize unlink %p:%s\n", m->addr, m->path);
 #endif
-        unlink (m->path);
+        exm_unlink (m);
         HASH_DEL (flexmap, m);
         freemap (m);
       }
   }
-  omp_unset_nest_lock (&lock);
+  exm_unlock ();
 #if defined(DEBUG) || defined(DEBUG1)
   syslog (LOG_DEBUG, "finalized\n");
 #endif
@@ -167,6 +309,19 @@ addr_sort (struct map *a, struct map *b)
   return j;
 }
 
+/* Widen the map address range for map m, just added to flexmap. Call with
+ * the lock held.
+ */
+void
+exm_map_range (struct map *m)
+{
+  uintptr_t a = (uintptr_t) m->addr;
+  if (a < exm_map_lo)
+    __atomic_store_n (&exm_map_lo, a, __ATOMIC_RELAXED);
+  if (a > exm_map_hi)
+    __atomic_store_n (&exm_map_hi, a, __ATOMIC_RELAXED);
+}
+
 /* simple utility wrapper for sendfile */
 ssize_t
 sendfile_loop (int out_fd, int in_fd, size_t count)
@@ -216,12 +371,116 @@ freemap (struct map *m)
 #endif
   if (m)
     {
+      exm_stripes_free (m);
+      exm_lazy_free (m);
       if (m->path)
         (*exm_default_free) (m->path);
       (*exm_default_free) (m);
     }
 }
 
+/* Allocate and free library-internal memory with the default allocator */
+void *
+exm_map_alloc (size_t size)
+{
+  if (!exm_default_malloc)
+    exm_default_malloc = (void *(*)(size_t)) dlsym (RTLD_NEXT, "malloc");
+  return (*exm_default_malloc) (size);
+}
+
+void
+exm_map_free (void *ptr)
+{
+  if (!exm_default_free)
+    exm_default_free = (void *(*)(void *)) dlsym (RTLD_NEXT, "free");
+  (*exm_default_free) (ptr);
+}
+
+/* newmap allocates a zeroed map structure with an empty path buffer */
+struct map *
+newmap ()
+{
+  struct map *m = (struct map *) exm_map_alloc (sizeof (struct map));
+  if (!m)
+    return NULL;
+  memset (m, 0, sizeof (struct map));
+  m->path = (char *) exm_map_alloc (EXM_MAX_PATH_LEN);
+  if (!m->path)
+    {
+      exm_map_free (m);
+      return NULL;
+    }
+  memset (m->path, 0, EXM_MAX_PATH_LEN);
+  m->cow = EXM_COW_UNSET;
+/* Publish allocations for exm-top, see monitor.c */
+  exm_monitor_start ();
+  exm_profile_start ();
+  return m;
+}
+
+/* Remove the backing file(s) of a map and release their tier space */
+void
+exm_unlink (struct map *m)
+{
+  if (m->kind == EXM_ANON || !m->path[0])
+    return;
+/* Mapped files belong to the caller, see mapfile.c */
+  if (m->mapped)
+    return;
+  if (m->shared)
+    {
+      exm_share_release (m);
+      return;
+    }
+  if (m->persist)
+    {
+/* Keep the files of persistent allocations, see persist.c */
+      exm_tier_release (m->tier, m->length);
+      return;
+    }
+  if (m->nstripes > 0)
+    {
+      exm_stripe_unlink (m);
+      return;
+    }
+  unlink (m->path);
+  exm_tier_release (m->tier, m->length);
+}
+
+/* Create a new backing file of the given length in the preferred tier if it
+ * has room (tier >= 0), otherwise in a tier selected for it, filling in
+ * m->path and m->tier. The caller holds the lock and has allocated m->path.
+ * OUTPUT (return value): open file descriptor or -1 on error (nothing left
+ * behind on disk)
+ */
+int
+exm_mkstemp (struct map *m, size_t length, int tier)
+{
+  int fd;
+  m->tier = exm_tier_prefer (tier, length);
+  if (m->tier < 0)
+    {
+      syslog (LOG_CRIT, "exm no tier has room for %lu bytes\n",
+              (unsigned long int) length);
+      errno = ENOSPC;
+      return -1;
+    }
+  snprintf (m->path, EXM_MAX_PATH_LEN, "%s/exm%ld_XXXXXX",
+            exm_tiers[m->tier].path, (long int) getpid ());
+  fd = mkostemp (m->path, O_RDWR | O_CREAT);
+  if (fd < 0)
+    return -1;
+  if (ftruncate (fd, length) < 0)
+    {
+      close (fd);
+      unlink (m->path);
+      return -1;
+    }
+  exm_tier_charge (m->tier, length);
+  EXM_PROBE3 (file__create, m->path, length, m->tier);
+  return fd;
+}
+
 /* Make sure uthash uses the default malloc and free functions. */
 void *
 uthash_malloc_ (size_t size)
@@ -239,25 +498,163 @@ uthash_free_ (void *ptr)
   (*exm_default_free) (ptr);
 }
 
+/* Apply creation-time hints to a new mapping */
+static void
+exm_apply_hints (struct map *m, const struct hints *h)
+{
+  m->advice = h->advice >= 0 ? h->advice : EXM_DEFAULT_ADVISE;
+  madvise (m->addr, m->length, m->advice);
+  if (h->hugepages == 1)
+    madvise (m->addr, m->length, MADV_HUGEPAGE);
+  else if (h->hugepages == 0)
+    madvise (m->addr, m->length, MADV_NOHUGEPAGE);
+  m->cow = h->cow;
+}
+
+/* Create a new exm mapping of size bytes, striped when exm_stripe_size is set
+ * and the size exceeds one stripe, anonymous in demote mode (see demote.c),
+ * paged in pager mode or with the compress hint (see pager.c) or only
+ * reserved in lazy mode (see lazy.c), following hints h (see policy.c). A
+ * preferred tier rules out striping, prefaulting rules out pager and lazy
+ * mode. The caller holds the lock and inserts the result into flexmap.
+ * OUTPUT (return value): new map or NULL on error
+ */
+static struct map *
+exm_map_new (size_t size, const struct hints *h)
+{
+  struct map *m;
+  int fd, populate = h->prefault == 1 ? MAP_POPULATE : 0;
+
+  m = newmap ();
+  if (!m)
+    return NULL;
+  m->length = size;
+  m->pid = getpid ();
+  if (exm_demote_mode)
+    {
+      m->kind = EXM_ANON;
+      m->tier = h->tier;
+      m->addr = mmap (NULL, m->length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+      if (m->addr == MAP_FAILED)
+        {
+          freemap (m);
+          return NULL;
+        }
+      exm_apply_hints (m, h);
+      exm_demote_start ();
+      return m;
+    }
+/* Without userfaultfd pager mode falls back to a file mapping */
+  if ((exm_pager_mode || h->compress == 1) && h->prefault != 1)
+    {
+      m->tier = h->tier;
+      m->advice = h->advice >= 0 ? h->advice : EXM_DEFAULT_ADVISE;
+      if (exm_pager_new (m, size, h->compress == 1) == 0)
+        {
+          m->cow = h->cow;
+          return m;
+        }
+    }
+/* and lazy mode without a free fault slot (see fault.c) */
+  if (exm_lazy_mode && h->prefault != 1)
+    {
+      m->tier = h->tier;
+      m->advice = h->advice >= 0 ? h->advice : EXM_DEFAULT_ADVISE;
+      if (exm_lazy_new (m, size) == 0)
+        {
+          m->cow = h->cow;
+          return m;
+        }
+    }
+  if (exm_stripe_size > 0 && size > exm_stripe_size && h->tier < 0)
+    {
+      if (exm_stripe_new (m, size) < 0)
+        {
+          freemap (m);
+          return NULL;
+        }
+      exm_apply_hints (m, h);
+      return m;
+    }
+  fd = exm_mkstemp (m, m->length, h->tier);
+  if (fd < 0)
+    {
+      freemap (m);
+      return NULL;
+    }
+  m->addr = mmap (NULL, m->length, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | populate, fd, 0);
+  close (fd);
+  if (m->addr == MAP_FAILED)
+    {
+      syslog (LOG_CRIT, "exm mmap failure\n");
+      exm_unlink (m);
+      freemap (m);
+      return NULL;
+    }
+  exm_apply_hints (m, h);
+  return m;
+}
+
+/* Decide where an allocation of size bytes by func (EXM_FUNC_*) goes, from
+ * the caller's learned call site (see site.c), the policy rules (see
+ * policy.c) and the thread's overrides (see local.c), in increasing order of
+ * precedence. Fills in the site key and hints.
+ * OUTPUT (return value): route for exm_alloc
+ */
+static inline __attribute__ ((always_inline)) int
+exm_route (size_t size, int func, uint64_t * key, struct hints *h)
+{
+  int route = -1, local;
+  *key = 0;
+  exm_hints_init (h);
+  if (READY < 1)
+    return -1;
+  if (exm_learn_mode)
+    route = exm_site_route (size, key);
+  if (exm_policy_active && exm_policy_match (size, func, h))
+    {
+      if (h->backend == EXM_BACKEND_HEAP)
+        route = 0;
+      else if (h->backend == EXM_BACKEND_EXM)
+        route = 1;
+    }
+  if (exm_local_users > 0 && (local = exm_local_route (size, h)) >= 0)
+    route = local;
+  return route;
+}
+
+/* Allocate size bytes following route: 1 for an exm mapping (with hints h),
+ * 0 for the default heap, -1 to follow the threshold. Allocations attributed
+ * to call site key are tracked (see site.c). When exm is not NULL, *exm is
+ * set to 1 for an exm mapping, 0 otherwise.
+ */
 void *
-malloc (size_t size)
+exm_alloc (size_t size, int route, uint64_t key, const struct hints *h,
+           int *exm)
 {
   struct map *m, *y;
   void *x;
-  int j;
-  int fd;
+  uint64_t t;
+
+  if (exm)
+    *exm = 0;
 
   if (!exm_default_malloc)
     exm_default_malloc = (void *(*)(size_t)) dlsym (RTLD_NEXT, "malloc");
 
-  if (size < exm_alloc_threshold || READY < 1)
+  if (READY < 1 || route == 0 || (route < 0 && size < threshold (size)))
     {
       x = (*exm_default_malloc) (size);
 #ifdef DEBUG1
       syslog (LOG_DEBUG, "malloc %p\n", x);
 #endif
       if (x)
-        return x;               // The usual malloc
+        {
+          exm_site_track (x, size, key);
+          return x;             // The usual malloc
+        }
       if (READY < 1)
         return NULL;            // malloc failed, not ready
     }
@@ -265,37 +662,17 @@ malloc (size_t size)
 /* If either size >= the threshold value and READY >= 1, or
  * we failed to malloc any size and READY >= 1, then try mmap.
  */
-  m = (struct map *) ((*exm_default_malloc) (sizeof (struct map)));
-  m->path = (char *) ((*exm_default_malloc) (EXM_MAX_PATH_LEN));
-  memset (m->path, 0, EXM_MAX_PATH_LEN);
-  omp_set_nest_lock (&lock);
-  snprintf (m->path, EXM_MAX_PATH_LEN, "%s/exm%ld_XXXXXX",
-            exm_data_path, (long int) getpid ());
-  m->length = size;
-  fd = mkostemp (m->path, O_RDWR | O_CREAT);
-  j = ftruncate (fd, m->length);
-  if (j < 0)
-    {
-      close (fd);
-      unlink (m->path);
-      freemap (m);
-      omp_unset_nest_lock (&lock);
-      return NULL;
-    }
-  m->addr = mmap (NULL, m->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (m->addr == MAP_FAILED)
+  t = exm_clock ();
+  exm_lock ();
+  m = exm_map_new (size, h);
+  if (!m)
     {
-      syslog (LOG_CRIT, "exm mmap failure\n");
-      close (fd);
-      unlink (m->path);
-      freemap (m);
-      omp_unset_nest_lock (&lock);
+      exm_unlock ();
       return NULL;
     }
-  madvise (m->addr, m->length, EXM_DEFAULT_ADVISE);
-  m->pid = getpid ();
   x = m->addr;
-  close (fd);
+  if (exm_profile_mode)
+    m->site = key ? key : exm_site_hash ();
 #if defined(DEBUG) || defined(DEBUG1)
   syslog (LOG_DEBUG, "malloc address %p, size %lu, file  %s\n",
           m->addr, (unsigned long int) m->length, m->path);
@@ -303,11 +680,11 @@ malloc (size_t size)
 /* Check to make sure that this address is not already in the hash. If it is,
  * then something is terribly wrong and we must bail.
  */
-  HASH_FIND_PTR (flexmap, m->addr, y);
+  HASH_FIND_PTR (flexmap, &m->addr, y);
   if (y)
     {
       munmap (m->addr, m->length);
-      unlink (m->path);
+      exm_unlink (m);
       freemap (m);
       x = NULL;
     }
@@ -315,11 +692,34 @@ malloc (size_t size)
     {
 //      HASH_ADD_PTR (flexmap, addr, m);
       HASH_ADD_INORDER (hh, flexmap, addr, sizeof (void *), m, addr_sort);
+      exm_map_range (m);
+      exm_stats_count (EXM_STAT_ALLOCS, 1);
+      if (exm)
+        *exm = 1;
+      EXM_PROBE3 (map, m->addr, m->length, m->kind);
     }
 #if defined(DEBUG) || defined(DEBUG1)
   syslog (LOG_DEBUG, "hash count = %u\n", HASH_COUNT (flexmap));
 #endif
-  omp_unset_nest_lock (&lock);
+  exm_unlock ();
+  exm_stats_time (EXM_OP_MALLOC, t);
+  exm_site_track (x, size, key);
+  return x;
+}
+
+void *
+malloc (size_t size)
+{
+  struct hints h;
+  uint64_t key;
+  int route, exm;
+  void *x;
+  EXM_PROBE1 (malloc__entry, size);
+  route = exm_route (size, EXM_FUNC_MALLOC, &key, &h);
+  x = exm_alloc (size, route, key, &h, &exm);
+  if (exm_trace_mode && x && size >= exm_trace_min)
+    exm_trace_event (EXM_TRACE_MALLOC, x, NULL, size, exm);
+  EXM_PROBE2 (malloc__return, x, size);
   return x;
 }
 
@@ -328,42 +728,61 @@ free (void *ptr)
 {
   struct map *m;
   pid_t pid;
+  uint64_t t;
   if (!ptr)
     return;
+  EXM_PROBE1 (free__entry, ptr);
   if (READY > 0)
     {
 #ifdef DEBUG1
       syslog (LOG_DEBUG, "free %p\n", ptr);
 #endif
-      omp_set_nest_lock (&lock);
+      if (exm_trace_mode)
+        exm_trace_event (EXM_TRACE_FREE, ptr, NULL, 0, -1);
+      if (exm_site_tracked (ptr))
+        exm_site_free (ptr);
+    }
+  if (READY > 0 && exm_maybe_map (ptr))
+    {
+      exm_lock ();
       HASH_FIND_PTR (flexmap, &ptr, m);
-/* Make sure a child process does not delete a parent mapping */
-      pid = getpid ();
+      if (m)
+        exm_demote_wait (m);
       if (m)
         {
+          t = exm_clock ();
+/* Make sure a child process does not delete a parent mapping */
+          pid = getpid ();
 #if defined(DEBUG) || defined(DEBUG1)
           syslog (LOG_DEBUG,
                   "free unmap address %p of size %lu %ld\n", ptr,
                   (unsigned long int) m->length, (long int) m->pid);
 #endif
-          munmap (ptr, m->length);
+          exm_snapshot_stop (m);
+          exm_pager_stop (m);
+          munmap (ptr, span (m));
+          EXM_PROBE2 (unmap, ptr, m->length);
           if (pid == m->pid)
             {
 #if defined(DEBUG) || defined(DEBUG1)
               syslog (LOG_DEBUG, "free unlink %p:%s\n", ptr, m->path);
 #endif
-              unlink (m->path);
+              exm_unlink (m);
               HASH_DEL (flexmap, m);
               freemap (m);
             }
-          omp_unset_nest_lock (&lock);
+          exm_unlock ();
+          exm_stats_count (EXM_STAT_FREES, 1);
+          exm_stats_time (EXM_OP_FREE, t);
+          EXM_PROBE2 (free__return, ptr, 1);
           return;
         }
-      omp_unset_nest_lock (&lock);
+      exm_unlock ();
     }
   if (!exm_default_free)
     exm_default_free = (void *(*)(void *)) dlsym (RTLD_NEXT, "free");
   (*exm_default_free) (ptr);
+  EXM_PROBE2 (free__return, ptr, 0);
 }
 
 /* valloc returns memory aligned to a page boundary.  Memory mapped flies are
@@ -373,30 +792,47 @@ free (void *ptr)
 void *
 valloc (size_t size)
 {
-  if (READY > 0 && size > exm_alloc_threshold)
+  struct hints h;
+  uint64_t key;
+  void *x;
+  int route, exm = 0;
+  EXM_PROBE1 (valloc__entry, size);
+  route = exm_route (size, EXM_FUNC_VALLOC, &key, &h);
+  if (READY > 0 && (route == 1 || (route < 0 && size > threshold (size))))
     {
 #if defined(DEBUG) || defined(DEBUG1)
       syslog (LOG_DEBUG, "valloc...handing off to exm malloc\n");
 #endif
-      return malloc (size);
+      x = exm_alloc (size, 1, key, &h, &exm);
+    }
+  else
+    {
+      if (!exm_default_valloc)
+        exm_default_valloc = (void *(*)(size_t)) dlsym (RTLD_NEXT, "valloc");
+      x = exm_default_valloc (size);
     }
-  if (!exm_default_valloc)
-    exm_default_valloc = (void *(*)(size_t)) dlsym (RTLD_NEXT, "valloc");
-  return exm_default_valloc (size);
+  if (exm_trace_mode && x && size >= exm_trace_min)
+    exm_trace_event (EXM_TRACE_VALLOC, x, NULL, size, exm);
+  EXM_PROBE2 (valloc__return, x, size);
+  return x;
 }
 
 /* Realloc is complicated in the case of fork. We have to protect parents from
  * wayward children and also maintain expected realloc behavior. See comments
- * below...
+ * below... Inlined into realloc so that call site keys (site.c) see the same
+ * frames as for malloc.
  */
-void *
-realloc (void *ptr, size_t size)
+static inline __attribute__ ((always_inline)) void *
+exm_realloc (void *ptr, size_t size)
 {
   struct map *m, *y;
-  int j, fd, child;
+  int j, fd;
   void *x;
   pid_t pid;
   size_t copylen;
+  uint64_t key = 0, t = 0;
+  int route = -1;
+  struct hints h;
 #ifdef DEBUG1
   syslog (LOG_DEBUG, "realloc\n");
 #endif
@@ -411,100 +847,224 @@ realloc (void *ptr, size_t size)
     }
 
   x = NULL;
+  fd = -1;
   if (!exm_default_realloc)
     exm_default_realloc =
       (void *(*)(void *, size_t)) dlsym (RTLD_NEXT, "realloc");
-  if (READY > 0)
+  if (READY > 0 && exm_maybe_map (ptr))
     {
-      omp_set_nest_lock (&lock);
+      exm_lock ();
       HASH_FIND_PTR (flexmap, &ptr, m);
+      if (m)
+        exm_demote_wait (m);
       if (m)
         {
 /* Remove the current file mapping, truncate the file, and return a new
  * file mapping to the truncated file. But don't allow a child process
  * to screw with the parent's mapping.
  */
-          munmap (ptr, m->length);
+          t = exm_clock ();
           pid = getpid ();
-          child = 0;
-          if (pid == m->pid)
-            {
-              HASH_DEL (flexmap, m);
-              m->length = size;
-              fd = open (m->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-            }
-          else
+          exm_snapshot_stop (m);
+          if (pid != m->pid || m->shared || m->mapped
+              || m->kind == EXM_PAGED)
             {
 /* Uh oh. We're in a child process. We need to copy this mapping and create a
  * new map entry unique to the child.  Also  need to copy old data up to min
  * (size, m->length). This can only happen if exm_child_cow = 0, see fork
- * below.
+ * below. Here is a rather unfortunate child copy... XXX use some kind of cow
+ * map?
+ * Allocations shared with other processes (see share.c) keep their size too,
+ * so their data moves the same way and this process detaches from them, as
+ * do mapped files (see mapfile.c), which exm must not resize, and paged
+ * allocations (see pager.c).
  */
+              if (!exm_default_memcpy)
+                exm_default_memcpy =
+                  (void *(*)(void *, const void *, size_t))
+                  dlsym (RTLD_NEXT, "memcpy");
               y = m;
-              child = 1;
-              m =
-                (struct map *) ((*exm_default_malloc) (sizeof (struct map)));
-              m->path = (char *) ((*exm_default_malloc) (EXM_MAX_PATH_LEN));
-              memset (m->path, 0, EXM_MAX_PATH_LEN);
-              snprintf (m->path, EXM_MAX_PATH_LEN, "%s/exm%ld_XXXXXX",
-                        exm_data_path, (long int) getpid ());
-              m->length = size;
+              exm_hints_init (&h);
+              h.cow = y->cow;
+              m = exm_map_new (size, &h);
+              if (!m)
+                {
+                  exm_unlock ();
+                  return NULL;
+                }
               copylen = m->length;
               if (y->length < copylen)
                 copylen = y->length;
-              fd = mkostemp (m->path, O_RDWR | O_CREAT);
+              exm_default_memcpy (m->addr, y->addr, copylen);
+              exm_pager_stop (y);
+              munmap (ptr, span (y));
+              if (pid == y->pid)
+                exm_unlink (y);
+              HASH_DEL (flexmap, y);
+              freemap (y);
             }
-          if (fd < 0)
+          else if (m->kind == EXM_ANON)
             {
-              omp_unset_nest_lock (&lock);
-              goto bail;
+              x = mremap (ptr, m->length, size, MREMAP_MAYMOVE);
+              if (x == MAP_FAILED)
+                {
+                  exm_unlock ();
+                  return NULL;
+                }
+              HASH_DEL (flexmap, m);
+              m->addr = x;
+              m->length = size;
             }
-          j = ftruncate (fd, m->length);
-          if (j < 0)
+          else if (m->reserved >= size)
             {
-              omp_unset_nest_lock (&lock);
-              goto bail;
+/* Commit in place within a reservation */
+              HASH_DEL (flexmap, m);
+              if (exm_reserve_commit (m, size) < 0)
+                {
+                  HASH_ADD_INORDER (hh, flexmap, addr, sizeof (void *), m,
+                                    addr_sort);
+                  exm_unlock ();
+                  return NULL;
+                }
+            }
+          else if (m->kind == EXM_LAZY)
+            {
+              HASH_DEL (flexmap, m);
+              if (exm_lazy_resize (m, size) < 0)
+                {
+                  HASH_ADD_INORDER (hh, flexmap, addr, sizeof (void *), m,
+                                    addr_sort);
+                  exm_unlock ();
+                  return NULL;
+                }
+            }
+          else
+            {
+              munmap (ptr, span (m));
+              m->reserved = 0;
+              HASH_DEL (flexmap, m);
+              if (m->nstripes > 0)
+                {
+                  if (exm_stripe_resize (m, size) < 0)
+                    {
+                      exm_unlock ();
+                      goto bail;
+                    }
+                }
+              else
+                {
+                  exm_tier_release (m->tier, m->length);
+                  exm_tier_charge (m->tier, size);
+                  m->length = size;
+                  fd = open (m->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+                  if (fd < 0)
+                    {
+                      exm_unlock ();
+                      goto bail;
+                    }
+                  j = ftruncate (fd, m->length);
+                  if (j < 0)
+                    {
+                      exm_unlock ();
+                      goto bail;
+                    }
+                  m->addr = mmap (NULL, m->length, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, fd, 0);
+                  close (fd);
+                  fd = -1;
+                  if (m->addr == MAP_FAILED)
+                    {
+                      exm_unlock ();
+                      goto bail;
+                    }
+                }
             }
-          m->addr =
-            mmap (NULL, m->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-/* Here is a rather unfortunate child copy... XXX use some kind of cow map? */
-          if (child)
-            exm_default_memcpy (m->addr, y->addr, copylen);
           m->pid = getpid ();
 /* Check for existence of the address in the hash. It must not already exist,
  * (after all we just removed it and we hold the lock)--if it does something
  * is terribly wrong and we bail.
  */
-          HASH_FIND_PTR (flexmap, m->addr, y);
+          HASH_FIND_PTR (flexmap, &m->addr, y);
           if (y)
             {
-              omp_unset_nest_lock (&lock);
+              exm_unlock ();
               munmap (m->addr, m->length);
               goto bail;
             }
 //          HASH_ADD_PTR (flexmap, addr, m);
           HASH_ADD_INORDER (hh, flexmap, addr, sizeof (void *), m, addr_sort);
+          exm_map_range (m);
           x = m->addr;
-          close (fd);
+          exm_persist_update (m);
+          if (exm_site_tracked (ptr))
+            exm_site_move (ptr, x, size);
 #if defined(DEBUG) || defined(DEBUG1)
           syslog (LOG_DEBUG, "realloc address %p size %lu\n", ptr,
                   (unsigned long int) m->length);
 #endif
-          omp_unset_nest_lock (&lock);
+          exm_unlock ();
+          exm_stats_count (EXM_STAT_REALLOCS, 1);
+          if (x != ptr)
+            exm_stats_count (EXM_STAT_MOVES, 1);
+          exm_stats_time (EXM_OP_REALLOC, t);
           return x;
         }
-      omp_unset_nest_lock (&lock);
+      exm_unlock ();
+    }
+  if (READY > 0)
+    route = exm_route (size, EXM_FUNC_REALLOC, &key, &h);
+/* A heap allocation grown by a call site that learned to use exm moves into
+ * an exm mapping.
+ */
+  if (route == 1)
+    {
+      x = exm_alloc (size, 1, 0, &h, NULL);
+      if (!x)
+        return NULL;
+      copylen = malloc_usable_size (ptr);
+      memcpy (x, ptr, copylen < size ? copylen : size);
+      if (exm_site_tracked (ptr))
+        exm_site_move (ptr, x, size);
+      else
+        exm_site_track (x, size, key);
+      (*exm_default_free) (ptr);
+      return x;
     }
   x = (*exm_default_realloc) (ptr, size);
+  if (x && READY > 0)
+    {
+      if (exm_site_tracked (ptr))
+        exm_site_move (ptr, x, size);
+      else
+        exm_site_track (x, size, key);
+    }
   return x;
 
 bail:
-  close (fd);
-  unlink (m->path);
+  if (fd >= 0)
+    close (fd);
+  exm_unlink (m);
   freemap (m);
   return NULL;
 }
 
+void *
+realloc (void *ptr, size_t size)
+{
+  size_t old = 0;
+  void *x;
+  EXM_PROBE2 (realloc__entry, ptr, size);
+/* NULL and zero size reallocs are traced as malloc and free */
+  if (exm_trace_mode && ptr && size)
+    old = exm_trace_size (ptr, NULL);
+  x = exm_realloc (ptr, size);
+  if (exm_trace_mode && x && ptr && size
+      && (size >= exm_trace_min || old >= exm_trace_min))
+    exm_trace_event (EXM_TRACE_REALLOC, x, ptr, size, -1);
+  EXM_PROBE3 (realloc__return, x, ptr, size);
+  return x;
+}
+
 #ifdef OSX
 // XXX reallocf is a Mac OSX/BSD-specific function.
 void *
@@ -531,17 +1091,33 @@ calloc (size_t count, size_t size)
 {
   void *x;
   size_t n = count * size;
-  if (READY > 0 && n > exm_alloc_threshold)
+  struct hints h;
+  uint64_t key;
+  int route, exm = 0;
+  EXM_PROBE2 (calloc__entry, count, size);
+  route = exm_route (n, EXM_FUNC_CALLOC, &key, &h);
+/* New exm mappings are zero-filled */
+  if (READY > 0 && (route == 1 || (route < 0 && n > threshold (n))))
     {
 #if defined(DEBUG) || defined(DEBUG1)
       syslog (LOG_DEBUG, "calloc...handing off to exm malloc\n");
 #endif
-      return malloc (n);
+      x = exm_alloc (n, 1, key, &h, &exm);
     }
-  if (!exm_hook)
-    exm_init ();
-  x = exm_hook (n);             //, NULL);
-  memset (x, 0, n);
+  else
+    {
+      if (!exm_hook)
+        exm_init ();
+      x = exm_hook (n);         //, NULL);
+      if (x)
+        {
+          memset (x, 0, n);
+          exm_site_track (x, n, key);
+        }
+    }
+  if (exm_trace_mode && x && n >= exm_trace_min)
+    exm_trace_event (EXM_TRACE_CALLOC, x, NULL, n, exm);
+  EXM_PROBE2 (calloc__return, x, n);
   return x;
 }
 
@@ -573,7 +1149,10 @@ memcpy (void *dest, const void *src, size_t n)
   if (!exm_default_memcpy)
     exm_default_memcpy =
       (void *(*)(void *, const void *, size_t)) dlsym (RTLD_NEXT, "memcpy");
-  omp_set_nest_lock (&lock);
+/* Most copies are not between maps: decide that without the lock */
+  if (!exm_maybe_map (src) || !exm_maybe_map (dest))
+    return (*exm_default_memcpy) (dest, src, n);
+  exm_lock ();
 /* XXX here we need to see if the src and dest lie within exm allocations.
  * right now, this only catches the niche/easy case of copying the whole
  * region.
@@ -582,21 +1161,29 @@ memcpy (void *dest, const void *src, size_t n)
   HASH_FIND_PTR (flexmap, &dest, DEST);
   if (!SRC || !DEST)
     {
-      omp_unset_nest_lock (&lock);
+      exm_unlock ();
       return (*exm_default_memcpy) (dest, src, n);
     }
-  if (SRC->length != n || DEST->length < n)
+  if (SRC->length != n || DEST->length < n || SRC->nstripes > 0
+      || DEST->nstripes > 0 || SRC->kind == EXM_ANON || DEST->kind == EXM_ANON
+      || SRC->kind == EXM_LAZY || DEST->kind == EXM_LAZY
+      || SRC->kind == EXM_PAGED || DEST->kind == EXM_PAGED || DEST->snap
+      || DEST->shared || SRC->mapped || DEST->mapped || SRC->migrating
+      || DEST->migrating)
     {
-      omp_unset_nest_lock (&lock);
+      exm_unlock ();
+      EXM_PROBE4 (memcpy__fast, dest, src, n, 0);
       return (*exm_default_memcpy) (dest, src, n);
     }
+  EXM_PROBE4 (memcpy__fast, dest, src, n, 1);
 #if defined(DEBUG) || defined(DEBUG1)
   syslog (LOG_DEBUG, "memcopy address %p src_addr %p of size %lu\n",
           SRC->addr, src, (unsigned long int) SRC->length);
 #endif
   src_fd = open (SRC->path, O_RDONLY);
   dest_fd = open (DEST->path, O_RDWR);
-  omp_unset_nest_lock (&lock);
+  exm_unlock ();
+  exm_stats_count (EXM_STAT_MEMCPY, 1);
   sendfile_loop (dest_fd, src_fd, n);
   close (dest_fd);
   close (src_fd);
@@ -613,31 +1200,107 @@ pid_t
 fork (void)
 {
   pid_t p;
+  uint64_t t;
+  int traced = exm_trace_mode;
   if (!exm_default_fork)
     exm_default_fork = (pid_t (*)(void)) dlsym (RTLD_NEXT, "fork");
+/* Hold the lock across fork so that no other thread (like the demotion
+ * thread) holds it in the child, and the pager's (see pager.c).
+ */
+  t = exm_clock ();
+  if (traced)
+    exm_trace_prepare ();
+  exm_lock ();
+  exm_demote_wait (NULL);
+  exm_pager_prepare ();
   p = exm_default_fork ();
-  if (exm_child_cow <= 0 || p > 0)
+  if (p != 0)
+    exm_pager_parent ();
+  else
+    exm_pager_child ();
+  exm_unlock ();
+  if (p > 0)
+    {
+      exm_stats_count (EXM_STAT_FORKS, 1);
+      exm_stats_time (EXM_OP_FORK, t);
+    }
+  if (traced)
+    {
+      if (p != 0)
+        exm_trace_parent (p);
+      else
+        exm_trace_child ();
+    }
+  if (p != 0)
     return p;
 
   /* forked child code follows ... */
   struct map *m, *tmp, *remap, *x;
-  int fd = 0;
+  int fd = 0, cow;
   pid_t q = getpid ();
-  omp_set_nest_lock (&lock);
+  exm_lock ();
   HASH_ITER (hh, flexmap, m, tmp)
   {
+    exm_snapshot_stop (m);
     if (q != m->pid)
+      exm_share_fork (m);
+/* Lazy allocations become ordinary ones, see lazy.c */
+    if (q != m->pid && m->kind == EXM_LAZY)
+      exm_lazy_fork (m);
+/* So do paged ones, see pager.c */
+    if (q != m->pid && m->kind == EXM_PAGED)
+      exm_pager_fork (m);
+    if (q != m->pid
+        && (m->kind == EXM_ANON || m->mapped == EXM_MAP_PRIVATE))
+      {
+/* Anonymous memory and private file mappings are copy on write across fork
+ * already.
+ */
+        m->pid = q;
+      }
+    else if (q != m->pid
+             && (cow = m->cow != EXM_COW_UNSET ? m->cow : exm_child_cow) > 0)
       {
-        remap = (struct map *) ((*exm_default_malloc) (sizeof (struct map)));
-        remap->path = (char *) ((*exm_default_malloc) (EXM_MAX_PATH_LEN));
-        memset (remap->path, 0, EXM_MAX_PATH_LEN);
+        remap = newmap ();
+        if (!remap)
+          {
+            syslog (LOG_CRIT, "warning: child unable to remap address %p",
+                    m->addr);
+            continue;
+          }
+        remap->cow = m->cow;
+/* Never copy a mapped file, see mapfile.c */
+        if (m->mapped)
+          cow = 1;
+/* A reservation needs a file of its own to commit in, see reserve.c */
+        else if (m->reserved > 0)
+          cow = 2;
+        remap->reserved = m->reserved;
+        if (m->nstripes > 0)
+          {
+            if (exm_stripe_fork (remap, m, cow) < 0)
+              {
+                syslog (LOG_CRIT, "fork (child) remap failure %p", m->addr);
+                freemap (remap);
+                continue;
+              }
+            remap->addr = m->addr;
+            remap->pid = q;
+            HASH_REPLACE_INORDER (hh, flexmap, addr, sizeof (void *),
+                                  remap, x, addr_sort);
+            exm_stats_count (EXM_STAT_REMAPS, 1);
+            EXM_PROBE3 (fork__remap, remap->addr, remap->length, cow);
+            if (x != NULL)
+              freemap (x);
+            continue;
+          }
 
-        switch (exm_child_cow)
+        switch (cow)
           {
           case 2:
-            snprintf (remap->path, EXM_MAX_PATH_LEN, "%s/exm%ld_XXXXXX",
-                      exm_data_path, (long int) getpid ());
-            fd = mkostemp (remap->path, O_RDWR | O_CREAT);
+            fd = exm_mkstemp (remap, m->length, m->tier);
+            if (fd < 0)
+              break;
             int src_fd = open (m->path, O_RDWR, S_IRUSR | S_IWUSR);     // check error XXX
 #if defined(DEBUG) || defined(DEBUG1)
             syslog (LOG_DEBUG, "child copying backing file for %p (%s -> %s)",
@@ -648,16 +1311,22 @@ fork (void)
             break;
           default:
             fd = open (m->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+            remap->tier = m->tier;
+            remap->persist = m->persist;
+            remap->mapped = m->mapped;
+            remap->offset = m->offset;
+            remap->privmap = 1;
             break;
           }
         if (fd >= 0)
           {
-            switch (exm_child_cow)
+            switch (cow)
               {
               case 2:
-                remap->addr =
-                  mmap (m->addr, m->length, PROT_READ | PROT_WRITE,
-                        MAP_FIXED | MAP_SHARED, fd, 0);
+/* The uncommitted part of a reservation stays PROT_NONE, as inherited */
+                remap->addr = m->length == 0 ? m->addr
+                  : mmap (m->addr, m->length, PROT_READ | PROT_WRITE,
+                          MAP_FIXED | MAP_SHARED, fd, 0);
 #if defined(DEBUG) || defined(DEBUG1)
                 syslog (LOG_DEBUG,
                         "child remapping address %p on private copy",
@@ -667,7 +1336,7 @@ fork (void)
               default:
                 remap->addr =
                   mmap (m->addr, m->length, PROT_READ | PROT_WRITE,
-                        MAP_FIXED | MAP_PRIVATE, fd, 0);
+                        MAP_FIXED | MAP_PRIVATE, fd, m->offset);
 #if defined(DEBUG) || defined(DEBUG1)
                 syslog (LOG_DEBUG,
                         "child remapping address %p as copy on write",
@@ -680,14 +1349,21 @@ fork (void)
             if (remap->addr == MAP_FAILED)
               {
                 syslog (LOG_CRIT, "fork (child) remap failure %p", m->addr);
+                freemap (remap);
               }
             else
               {
-                snprintf (remap->path, EXM_MAX_PATH_LEN, "%s", m->path);
+/* The duplicated backing file (exm_child_cow = 2) belongs to the child,
+ * otherwise the child refers to the parent's file.
+ */
+                if (cow != 2)
+                  snprintf (remap->path, EXM_MAX_PATH_LEN, "%s", m->path);
                 remap->length = m->length;
                 remap->pid = q;
                 HASH_REPLACE_INORDER (hh, flexmap, addr, sizeof (void *),
                                       remap, x, addr_sort);
+                exm_stats_count (EXM_STAT_REMAPS, 1);
+                EXM_PROBE3 (fork__remap, remap->addr, remap->length, cow);
 #if defined(DEBUG) || defined(DEBUG1)
                 syslog (LOG_DEBUG, "child replaced map %p", x->addr);
 #endif
@@ -703,6 +1379,9 @@ fork (void)
           }
       }
   }
-  omp_unset_nest_lock (&lock);
+  exm_demote_atfork ();
+  exm_monitor_atfork ();
+  exm_profile_atfork ();
+  exm_unlock ();
   return p;
 }
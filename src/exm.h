@@ -1,9 +1,113 @@
-#include <omp.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "uthash.h"
 
+/* USDT probes (provider exm) for perf, bpftrace and SystemTap, see the
+ * scripts in bpftrace/. A probe is a nop instruction plus an ELF note until
+ * a tracer attaches, so they stay in the build; without <sys/sdt.h> or with
+ * -DEXM_NO_PROBES they compile to nothing. Probes and arguments:
+ *   malloc__entry (size), malloc__return (addr, size), calloc__entry (count,
+ *   size), calloc__return (addr, bytes), valloc__entry/return as malloc,
+ *   realloc__entry (ptr, size), realloc__return (addr, ptr, size),
+ *   free__entry (ptr), free__return (ptr, exm), file__create (path, length,
+ *   tier), map (addr, length, kind), unmap (addr, length), fork__remap (addr,
+ *   length, cow), memcpy__fast (dest, src, n, taken), lock__acquire (),
+ *   lock__wait (ns)
+ */
+#if !defined(EXM_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define EXM_PROBES 1
+#endif
+#endif
+#ifdef EXM_PROBES
+#define EXM_PROBE0(name) DTRACE_PROBE (exm, name)
+#define EXM_PROBE1(name, a) DTRACE_PROBE1 (exm, name, a)
+#define EXM_PROBE2(name, a, b) DTRACE_PROBE2 (exm, name, a, b)
+#define EXM_PROBE3(name, a, b, c) DTRACE_PROBE3 (exm, name, a, b, c)
+#define EXM_PROBE4(name, a, b, c, d) DTRACE_PROBE4 (exm, name, a, b, c, d)
+#else
+#define EXM_PROBE0(name)
+#define EXM_PROBE1(name, a)
+#define EXM_PROBE2(name, a, b)
+#define EXM_PROBE3(name, a, b, c)
+#define EXM_PROBE4(name, a, b, c, d)
+#endif
+
 #define EXM_VERSION 0.1
 #define EXM_MAX_PATH_LEN 4096
 #define EXM_DEFAULT_ADVISE MADV_SEQUENTIAL
+#define EXM_MAX_TIERS 16
+
+/* Tier placement policies, see tier.c */
+#define EXM_TIER_FILL 0         /* fill first tier before spilling to the next */
+#define EXM_TIER_ROUNDROBIN 1   /* rotate through tiers */
+#define EXM_TIER_FREE 2         /* tier with the most free space (statvfs) */
+
+/* Reasons for auto threshold changes, see pressure.c */
+#define EXM_REASON_STATIC 0
+#define EXM_REASON_PLENTIFUL 1
+#define EXM_REASON_HEADROOM 2
+#define EXM_REASON_PSI 3
+#define EXM_REASON_RELIEVED 4
+#define EXM_REASON_UNKNOWN 5
+
+/* Kinds of exm allocations */
+#define EXM_FILE 0              /* file-backed mapping */
+#define EXM_ANON 1              /* anonymous memory (demote mode) */
+#define EXM_DEMOTED 2           /* anonymous allocation moved to a file */
+#define EXM_LAZY 3              /* file created on first touch (lazy.c) */
+#define EXM_PAGED 4             /* anonymous, paged to a file (pager.c) */
+
+/* Allocating functions, for policy rules (policy.c) */
+#define EXM_FUNC_MALLOC 1
+#define EXM_FUNC_CALLOC 2
+#define EXM_FUNC_REALLOC 4
+#define EXM_FUNC_VALLOC 8
+
+/* Allocation backends selected by hints */
+#define EXM_BACKEND_DEFAULT 0   /* follow the threshold */
+#define EXM_BACKEND_HEAP 1      /* default allocator */
+#define EXM_BACKEND_EXM 2       /* exm mapping */
+
+/* Event counters, see stats.c */
+#define EXM_STAT_ALLOCS 0       /* exm allocations created */
+#define EXM_STAT_FREES 1        /* exm allocations freed */
+#define EXM_STAT_REALLOCS 2     /* reallocs of exm allocations */
+#define EXM_STAT_MOVES 3        /* of which moved to a new address */
+#define EXM_STAT_FORKS 4        /* forks */
+#define EXM_STAT_REMAPS 5       /* allocations remapped in forked children */
+#define EXM_STAT_MEMCPY 6       /* memcpy done with sendfile */
+#define EXM_STAT_LOCK_WAITS 7   /* lock acquisitions that waited */
+#define EXM_STAT_LOCK_NS 8      /* nanoseconds spent waiting */
+#define EXM_STAT_COMPRESS_RAW 9 /* bytes written back compressed */
+#define EXM_STAT_COMPRESS_STORED 10     /* bytes they take on file */
+#define EXM_STAT_DECOMPRESS 11  /* clusters decompressed */
+#define EXM_STAT_DECOMPRESS_NS 12       /* nanoseconds spent decompressing */
+#define EXM_STAT_N 13
+
+/* Map fork mode not set, exm_child_cow applies */
+#define EXM_COW_UNSET -128
+
+/* Hints applied when an allocation is created, from policy rules */
+struct hints
+{
+  int backend;                  /* EXM_BACKEND_* */
+  int tier;                     /* Preferred tier index or -1 */
+  int advice;                   /* madvise advice or -1 for the default */
+  int hugepages;                /* 1 MADV_HUGEPAGE, 0 MADV_NOHUGEPAGE, -1 */
+  int prefault;                 /* 1 to populate the mapping at creation */
+  int compress;                 /* 1 to page compressed (pager.c), 0, -1 */
+  int cow;                      /* Fork mode or EXM_COW_UNSET */
+};
+
+/* One backing file of a striped allocation, see stripe.c */
+struct stripe
+{
+  char *path;                   /* File path */
+  size_t length;                /* File length */
+  int tier;                     /* Index into exm_tiers */
+};
 
 /* The map structure tracks the file mappings.  */
 struct map
@@ -12,17 +116,285 @@ struct map
   char *path;                   /* File path */
   size_t length;                /* Mapping length */
   pid_t pid;                    /* Process ID of owner (for fork) */
+  int tier;                     /* Index into exm_tiers of the backing file */
+  int nstripes;                 /* Number of stripes, 0 when not striped */
+  size_t stripe_size;           /* Stripe length */
+  struct stripe *stripes;       /* Stripe backing files in address order */
+  int kind;                     /* EXM_FILE, EXM_ANON, ... (above) */
+  int migrating;                /* Set while demote.c moves the allocation */
+  double heat;                  /* Decaying referenced fraction (demote.c) */
+  int cow;                      /* Fork mode or EXM_COW_UNSET (exm_child_cow) */
+  int advice;                   /* madvise advice given at creation */
+  unsigned char *chunks;        /* Materialized chunks bitmap (lazy.c) */
+  size_t chunk_size;            /* Lazy chunk length */
+  int slot;                     /* Fault slot of a lazy allocation */
+  size_t reserved;              /* Reserved address space (reserve.c) or 0 */
+  int persist;                  /* Backing file kept (persist.c) */
+  struct snap *snap;            /* Write tracking (snapshot.c) or NULL */
+  int shared;                   /* Published or attached (share.c) */
+  int share_fd;                 /* Open file holding the share lock */
+  int mapped;                   /* Mode of a mapped file (mapfile.c) or 0 */
+  off_t offset;                 /* Mapped file offset */
+  uint64_t site;                /* Call site key when profiling (profile.c) */
+  int privmap;                  /* Mapped copy on write: memory and file
+                                   differ (io.c) */
+  struct paged *paged;          /* Pager state (pager.c) or NULL */
   UT_hash_handle hh;            /* Make this thing uthash-hashable */
 };
 
+/* The tier structure describes one data directory. Tiers are listed in order
+ * of preference in exm_data_path, separated by colons like PATH, each with an
+ * optional capacity limit, for instance "/mnt/nvme@64G:/mnt/disk".
+ */
+struct tier
+{
+  char path[EXM_MAX_PATH_LEN - 64];     /* Directory, room left for file names */
+  size_t capacity;              /* Byte limit, zero means no limit */
+  size_t allocated;             /* Bytes currently allocated in this tier */
+  int pinned;                   /* Only used when asked for (policy rules) */
+};
+
 /* These global values can be changed using the basic API defined in api.c. */
 extern char exm_data_path[];
 extern size_t exm_alloc_threshold;
 extern int exm_child_cow;
+extern struct tier exm_tiers[];
+extern int exm_ntiers;
+extern int exm_tier_order[];
+extern int exm_nlisted;
+extern size_t exm_tier_total;
+extern size_t exm_tier_peak;
+extern int exm_tier_mode;
+extern size_t exm_stripe_size;
+extern int exm_auto;
+extern size_t exm_auto_min;
+extern size_t exm_auto_max;
+extern size_t exm_auto_headroom;
+extern double exm_psi_high;
+extern int exm_demote_mode;
+extern long exm_demote_interval;
+extern int exm_learn_mode;
+extern size_t exm_learn_min;
+extern double exm_learn_lifetime;
+extern double exm_learn_rate;
+extern char exm_learn_file[];
+extern int exm_policy_active;
+extern int exm_lazy_mode;
+extern size_t exm_zerocopy_min;
+extern int exm_monitor_mode;
+extern long exm_monitor_interval;
+extern size_t exm_lazy_chunk;
+extern int exm_pager_mode;
+extern size_t exm_pager_budget;
+extern size_t exm_pager_cluster;
+extern size_t exm_pager_ra;
 
 /* The global variable flexmap is a key-value list of addresses (keys) and file
- * paths (values). The recursive OpenMP lock is used widely in the library and
- * API functions.
+ * paths (values). The recursive lock is used widely in the library and API
+ * functions.
+ *
+ * The lock used to be an OpenMP nest lock, which put libgomp on every
+ * interposed call of the program, and programs linked to OpenMP BLAS ran
+ * into it from all their threads. It is now a plain mutex with an owner and
+ * a depth. The owner is the address of the thread-local exm_self: unlike a
+ * thread id it is the same in the child of a fork, which must release the
+ * lock its parent thread held across fork.
  */
-struct map *flexmap;
-omp_nest_lock_t lock;
+struct rlock
+{
+  pthread_mutex_t mutex;
+  const void *owner;            /* &exm_self of the holder, or NULL */
+  int depth;                    /* Recursion depth, written by the holder */
+};
+
+extern struct map *flexmap;
+extern struct rlock lock;
+extern __thread char exm_self __attribute__ ((tls_model ("initial-exec")));
+
+/* Lowest and highest map address so far. free, realloc and memcpy look up
+ * map start addresses (page aligned, they come from mmap); exm_maybe_map
+ * spares the lock to all other pointers. Only widened, see exm_map_range.
+ */
+extern uintptr_t exm_map_lo, exm_map_hi;
+
+static inline int
+exm_maybe_map (const void *p)
+{
+  uintptr_t a = (uintptr_t) p;
+  return (a & 4095) == 0 && a >= __atomic_load_n (&exm_map_lo, __ATOMIC_RELAXED)
+    && a <= __atomic_load_n (&exm_map_hi, __ATOMIC_RELAXED);
+}
+
+/* stats.c */
+uint64_t exm_clock (void);
+void exm_stats_count (int counter, uint64_t n);
+void exm_stats_time (int op, uint64_t start);
+void exm_lock_wait (void);
+
+/* Take and release the lock. Waiting for it is counted, see stats.c. */
+static inline void
+exm_lock (void)
+{
+  if (__atomic_load_n (&lock.owner, __ATOMIC_RELAXED) == &exm_self)
+    lock.depth++;
+  else
+    {
+      if (pthread_mutex_trylock (&lock.mutex))
+        exm_lock_wait ();
+      __atomic_store_n (&lock.owner, &exm_self, __ATOMIC_RELAXED);
+      lock.depth = 1;
+    }
+  EXM_PROBE0 (lock__acquire);
+}
+
+static inline void
+exm_unlock (void)
+{
+  if (--lock.depth == 0)
+    {
+      __atomic_store_n (&lock.owner, NULL, __ATOMIC_RELAXED);
+      pthread_mutex_unlock (&lock.mutex);
+    }
+}
+
+/* exm.c */
+int exm_ready (void);
+struct map *newmap (void);
+void freemap (struct map *m);
+int addr_sort (struct map *a, struct map *b);
+void exm_map_range (struct map *m);
+void *exm_alloc (size_t size, int route, uint64_t key, const struct hints *h,
+                 int *exm);
+int exm_mkstemp (struct map *m, size_t length, int tier);
+void exm_unlink (struct map *m);
+void *exm_map_alloc (size_t size);
+void exm_map_free (void *ptr);
+ssize_t sendfile_loop (int out_fd, int in_fd, size_t count);
+
+/* api.c */
+void exm_flag_hints (int flags, struct hints *h);
+
+/* tier.c, the caller holds the lock */
+size_t exm_parse_size (const char *s, const char *end);
+int exm_tier_parse (const char *spec);
+int exm_tier_select (size_t size);
+int exm_tier_prefer (int tier, size_t size);
+int exm_tier_find (const char *path);
+int exm_tier_memory (void);
+int exm_tier_next (int tier, size_t size);
+void exm_tier_charge (int tier, size_t size);
+void exm_tier_release (int tier, size_t size);
+
+/* pressure.c */
+void exm_pressure_init (void);
+size_t exm_threshold_auto_value (size_t size);
+void exm_pressure_state (size_t *threshold, int *why, size_t *limit,
+                         size_t *avail, double *psi, unsigned long *nchanges);
+int exm_pressure_poll (size_t *avail, size_t *headroom);
+
+/* fault.c */
+int exm_fault_init (void);
+int exm_fault_register (void *addr, size_t length,
+                        int (*fn) (void *, void *), void *arg);
+void exm_fault_unregister (int slot);
+int exm_fault_active (int slot);
+void exm_fault_pause (void);
+
+/* demote.c, the caller holds the lock */
+int exm_demote_start (void);
+void exm_demote_atfork (void);
+int exm_demote_map (struct map *m);
+void exm_demote_wait (struct map *m);
+int exm_promote_map (struct map *m);
+
+/* site.c */
+int exm_site_route (size_t size, uint64_t * key);
+void exm_site_track (void *addr, size_t length, uint64_t key);
+int exm_site_tracked (void *addr);
+void exm_site_free (void *addr);
+void exm_site_move (void *from, void *to, size_t length);
+void exm_site_finish (void);
+uint64_t exm_site_hash (void);
+
+/* policy.c */
+void exm_hints_init (struct hints *h);
+int exm_policy_match (size_t size, int func, struct hints *h);
+int exm_policy_load (const char *path);
+void exm_policy_resolve (void);
+int exm_policy_actions (const char *actions, struct hints *h);
+
+/* local.c, no locking on the allocation path */
+extern int exm_local_users;
+int exm_local_route (size_t size, struct hints *h);
+
+/* io.c */
+extern int exm_io_guard;
+
+/* lazy.c, the caller holds the lock */
+int exm_lazy_new (struct map *m, size_t length);
+int exm_lazy_resize (struct map *m, size_t length);
+int exm_lazy_settle (struct map *m);
+void exm_lazy_fork (struct map *m);
+void exm_lazy_free (struct map *m);
+int exm_lazy_touch (struct map *m, const void *addr, size_t length);
+
+/* lz.c */
+size_t exm_lz_compress (const void *src, size_t n, void *dst, size_t cap);
+ssize_t exm_lz_decompress (const void *src, size_t n, void *dst, size_t cap);
+
+/* pager.c, the caller holds the lock */
+int exm_pager_new (struct map *m, size_t length, int compress);
+int exm_pager_settle (struct map *m);
+void exm_pager_stop (struct map *m);
+void exm_pager_fork (struct map *m);
+void exm_pager_prepare (void);
+void exm_pager_parent (void);
+void exm_pager_child (void);
+
+/* reserve.c, the caller holds the lock */
+int exm_reserve_commit (struct map *m, size_t size);
+
+/* persist.c, the caller holds the lock */
+int exm_name_path (char *path, const char *name, int tier);
+void exm_persist_update (struct map *m);
+
+/* share.c, the caller holds the lock */
+void exm_share_release (struct map *m);
+void exm_share_fork (struct map *m);
+
+/* monitor.c */
+void exm_monitor_start (void);
+void exm_monitor_atfork (void);
+void exm_monitor_finish (void);
+
+/* profile.c */
+extern int exm_profile_mode;
+extern long exm_profile_interval;
+extern char exm_profile_path[];
+void exm_profile_start (void);
+void exm_profile_atfork (void);
+void exm_profile_finish (void);
+
+/* trace.c, not with the lock held */
+extern int exm_trace_mode;
+extern size_t exm_trace_min;
+extern char exm_trace_path[];
+void exm_trace_event (int type, void *addr, void *old, size_t size, int exm);
+size_t exm_trace_size (void *addr, int *exm);
+int exm_trace_start (void);
+void exm_trace_finish (void);
+void exm_trace_prepare (void);
+void exm_trace_parent (pid_t child);
+void exm_trace_child (void);
+
+/* snapshot.c, the caller holds the lock */
+void exm_snapshot_stop (struct map *m);
+void exm_snapshot_touch (struct map *m, const void *addr, size_t length);
+
+/* stripe.c, the caller holds the lock */
+int exm_stripe_new (struct map *m, size_t length);
+int exm_stripe_resize (struct map *m, size_t length);
+int exm_stripe_fork (struct map *remap, struct map *m, int cow);
+void exm_stripe_unlink (struct map *m);
+void exm_stripes_free (struct map *m);
+char *exm_stripe_paths (struct map *m);
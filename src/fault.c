@@ -0,0 +1,216 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Page fault dispatch
+ *
+ * Some exm features take over page faults on parts of the address space, for
+ * instance to hold writers off while an allocation migrates between anonymous
+ * memory and a backing file. They register the address range and a callback
+ * here. A SIGSEGV handler looks up the faulting address and calls the range's
+ * callback, which returns 0 to retry the faulting instruction or -1 to treat
+ * the fault as a real one.  Real faults go to the application's handler, or
+ * to the default action.
+ *
+ * The range table is a fixed array scanned without locks by the signal
+ * handler, so registration only publishes fully initialized slots.  The
+ * application may install its own SIGSEGV handler (R does), so sigaction and
+ * signal are interposed to keep ours in front.
+ */
+
+#define EXM_FAULT_SLOTS 4096
+
+struct fault_range
+{
+  char *lo, *hi;
+  int (*fn) (void *, void *);
+  void *arg;
+  int active;
+};
+
+static struct fault_range ranges[EXM_FAULT_SLOTS];
+static int installed = 0;
+static struct sigaction prev;
+static int (*exm_default_sigaction) (int, const struct sigaction *,
+                                     struct sigaction *);
+
+static void
+handler (int sig, siginfo_t * si, void *ctx)
+{
+  char *a = (char *) si->si_addr;
+  struct sigaction dfl;
+  int i;
+  for (i = 0; i < EXM_FAULT_SLOTS; ++i)
+    {
+      struct fault_range *r = &ranges[i];
+      if (__atomic_load_n (&r->active, __ATOMIC_ACQUIRE) == 1
+          && a >= r->lo && a < r->hi)
+        {
+          if ((*r->fn) (a, r->arg) == 0)
+            return;
+          break;
+        }
+    }
+/* Not ours: pass to the application's handler or take the default action
+ * when the faulting instruction is retried.
+ */
+  if (prev.sa_flags & SA_SIGINFO)
+    {
+      (*prev.sa_sigaction) (sig, si, ctx);
+      return;
+    }
+  if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN)
+    {
+      (*prev.sa_handler) (sig);
+      return;
+    }
+  memset (&dfl, 0, sizeof (dfl));
+  dfl.sa_handler = SIG_DFL;
+  (*exm_default_sigaction) (SIGSEGV, &dfl, NULL);
+}
+
+/* Our action for SIGSEGV: it runs on the alternate signal stack when the
+ * application's does (R handles C stack overflows there), with the
+ * application's mask, since it may chain to the application's handler.
+ */
+static void
+action (struct sigaction *sa)
+{
+  memset (sa, 0, sizeof (*sa));
+  sa->sa_sigaction = handler;
+  sa->sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER
+    | (prev.sa_flags & SA_ONSTACK);
+  sa->sa_mask = prev.sa_mask;
+}
+
+/* Install the SIGSEGV handler, once. The caller holds the lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+int
+exm_fault_init ()
+{
+  struct sigaction sa;
+  if (installed)
+    return 0;
+  if (!exm_default_sigaction)
+    exm_default_sigaction =
+      (int (*)(int, const struct sigaction *, struct sigaction *))
+      dlsym (RTLD_NEXT, "sigaction");
+  if ((*exm_default_sigaction) (SIGSEGV, NULL, &prev) < 0)
+    {
+      syslog (LOG_CRIT, "exm unable to install SIGSEGV handler\n");
+      return -1;
+    }
+  action (&sa);
+  if ((*exm_default_sigaction) (SIGSEGV, &sa, NULL) < 0)
+    {
+      syslog (LOG_CRIT, "exm unable to install SIGSEGV handler\n");
+      return -1;
+    }
+  installed = 1;
+  return 0;
+}
+
+/* Register a fault callback for [addr, addr + length). The callback runs in
+ * signal context and must be async-signal-safe.
+ * OUTPUT (return value): slot number for exm_fault_unregister or -1
+ */
+int
+exm_fault_register (void *addr, size_t length, int (*fn) (void *, void *),
+                    void *arg)
+{
+  int i, zero;
+  for (i = 0; i < EXM_FAULT_SLOTS; ++i)
+    {
+      zero = 0;
+      if (__atomic_load_n (&ranges[i].active, __ATOMIC_RELAXED) == 0
+          && __atomic_compare_exchange_n (&ranges[i].active, &zero, -1, 0,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+          ranges[i].lo = (char *) addr;
+          ranges[i].hi = (char *) addr + length;
+          ranges[i].fn = fn;
+          ranges[i].arg = arg;
+          __atomic_store_n (&ranges[i].active, 1, __ATOMIC_RELEASE);
+          return i;
+        }
+    }
+  syslog (LOG_CRIT, "exm fault range table full\n");
+  return -1;
+}
+
+void
+exm_fault_unregister (int slot)
+{
+  if (slot < 0 || slot >= EXM_FAULT_SLOTS)
+    return;
+  __atomic_store_n (&ranges[slot].active, 0, __ATOMIC_RELEASE);
+}
+
+/* Is slot still registered? Used by callbacks that wait for a range to be
+ * released.
+ */
+int
+exm_fault_active (int slot)
+{
+  return __atomic_load_n (&ranges[slot].active, __ATOMIC_ACQUIRE) == 1;
+}
+
+/* Async-signal-safe short sleep for callbacks that wait */
+void
+exm_fault_pause ()
+{
+  struct timespec t = { 0, 50000 };
+  nanosleep (&t, NULL);
+}
+
+/* Keep our SIGSEGV handler in front of any the application installs,
+ * remembering the application's handler to chain to and taking on its
+ * alternate stack flag and mask.
+ */
+int
+sigaction (int signum, const struct sigaction *act, struct sigaction *oldact)
+{
+  struct sigaction sa;
+  if (!exm_default_sigaction)
+    exm_default_sigaction =
+      (int (*)(int, const struct sigaction *, struct sigaction *))
+      dlsym (RTLD_NEXT, "sigaction");
+  if (signum != SIGSEGV || !installed)
+    return (*exm_default_sigaction) (signum, act, oldact);
+  if (oldact)
+    *oldact = prev;
+  if (act)
+    {
+      prev = *act;
+      action (&sa);
+      return (*exm_default_sigaction) (SIGSEGV, &sa, NULL);
+    }
+  return 0;
+}
+
+sighandler_t
+signal (int signum, sighandler_t h)
+{
+  struct sigaction sa, old;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = h;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+  if (sigaction (signum, &sa, &old) < 0)
+    return SIG_ERR;
+  return old.sa_handler;
+}
@@ -0,0 +1,349 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/sendfile.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Zero-copy file I/O
+ *
+ * Reading a large file into an exm allocation copies every byte into mapped
+ * pages, which the kernel later writes back to the backing file; writing the
+ * allocation out reads the backing file in through page faults first. Both
+ * pass over the data twice. The read, pread, fread, write, pwrite and fwrite
+ * wrappers below move the data between the caller's file and the backing
+ * file in the kernel instead (copy_file_range, or splice and sendfile for
+ * pipes and sockets), when the whole buffer lies in one exm allocation whose
+ * memory is a shared mapping of its backing file: the page cache is shared,
+ * so the allocation sees the data at once, partial pages included.
+ *
+ * Transfers smaller than exm_zerocopy_min (EXM_ZEROCOPY, default 1M, 0 turns
+ * zero-copy off) go to the plain system call without a lookup.
+ * Striped, anonymous, lazy and snapshot-tracked allocations, copy on write
+ * mappings (forked children, private mapped files) and read-only shared
+ * attachments are passed through too, as is any transfer the kernel refuses
+ * (an O_APPEND file, a file on another file system with older kernels);
+ * the plain system call also handles end of file.
+ *
+ * Before a plain system call the wrappers also make the buffer safe for the
+ * kernel, whose faults do not reach the fault dispatcher (see fault.c): the
+ * untouched chunks of a lazy allocation it covers are materialized, and the
+ * pages of a snapshot-tracked one it is read into are marked dirty and made
+ * writable (see snapshot.c), and reads into a migrating one wait until it
+ * is writable again (see demote.c), instead of the call failing with
+ * EFAULT. exm_io_guard counts the allocations that need this, so that the
+ * wrappers skip the lookup when there are none.
+ */
+
+size_t exm_zerocopy_min = (size_t) 1 << 20;
+int exm_io_guard = 0;
+/* Bytes moved, see exm_zerocopy_info */
+static size_t zerocopy_in, zerocopy_out;
+
+static ssize_t (*default_read) (int, void *, size_t);
+static ssize_t (*default_pread) (int, void *, size_t, off_t);
+static ssize_t (*default_write) (int, const void *, size_t);
+static ssize_t (*default_pwrite) (int, const void *, size_t, off_t);
+static size_t (*default_fread) (void *, size_t, size_t, FILE *);
+static size_t (*default_fwrite) (const void *, size_t, size_t, FILE *);
+
+/* Open the backing file of the allocation holding [buf, buf + count), if
+ * data may move through it, and find the offset of buf in it.
+ * INPUT to_memory: nonzero when the transfer writes the allocation
+ * OUTPUT (return value): open file descriptor or -1
+ */
+static int
+backing (const void *buf, size_t count, int to_memory, off_t * off)
+{
+  struct map *m, *tmp, *x = NULL;
+  int fd = -1;
+
+  if (count < exm_zerocopy_min || exm_zerocopy_min == 0 || !exm_ready ()
+      || (uintptr_t) buf < __atomic_load_n (&exm_map_lo, __ATOMIC_RELAXED))
+    return -1;
+  exm_lock ();
+/* flexmap is in address order */
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    if ((char *) m->addr > (char *) buf)
+      break;
+    x = m;
+  }
+  if (x && (char *) buf + count <= (char *) x->addr + x->length
+      && x->kind == EXM_FILE && x->nstripes == 0 && !x->snap && !x->privmap
+      && !x->migrating && x->path[0] && x->pid == getpid ()
+      && !(to_memory && x->shared
+           && (fcntl (x->share_fd, F_GETFL) & O_ACCMODE) == O_RDONLY))
+    {
+      *off = x->offset + ((char *) buf - (char *) x->addr);
+      fd = open (x->path, to_memory ? O_WRONLY : O_RDONLY);
+    }
+  exm_unlock ();
+  return fd;
+}
+
+/* Make [buf, buf + count) safe for a plain system call, see above
+ * INPUT to_memory: nonzero when the call writes the buffer
+ */
+static void
+prepare (const void *buf, size_t count, int to_memory)
+{
+  struct map *m, *tmp, *x = NULL;
+
+  if (count == 0 || __atomic_load_n (&exm_io_guard, __ATOMIC_RELAXED) == 0
+      || !exm_ready ()
+      || (uintptr_t) buf < __atomic_load_n (&exm_map_lo, __ATOMIC_RELAXED))
+    return;
+  exm_lock ();
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    if ((char *) m->addr > (char *) buf)
+      break;
+    x = m;
+  }
+  if (x && (char *) buf < (char *) x->addr + x->length)
+    {
+      if (x->migrating && to_memory)
+        exm_demote_wait (x);
+      else if (x->kind == EXM_LAZY)
+        exm_lazy_touch (x, buf, count);
+      else if (x->snap && to_memory)
+        exm_snapshot_touch (x, buf, count);
+    }
+  exm_unlock ();
+}
+
+/* Move count bytes from fd (at *pos, or its file position when pos is NULL)
+ * into the backing file out at off
+ * OUTPUT (return value): bytes moved, or -1 if the kernel refused
+ */
+static ssize_t
+copy_in (int fd, off_t * pos, int out, off_t off, size_t count)
+{
+  ssize_t s = copy_file_range (fd, pos, out, &off, count, 0);
+  if (s < 0 && !pos)
+    s = splice (fd, NULL, out, &off, count, 0);
+  if (s > 0)
+    __atomic_fetch_add (&zerocopy_in, (size_t) s, __ATOMIC_RELAXED);
+  return s;
+}
+
+/* Move count bytes from the backing file in at off to fd (at *pos, or its
+ * file position when pos is NULL)
+ * OUTPUT (return value): bytes moved, or -1 if the kernel refused
+ */
+static ssize_t
+copy_out (int in, off_t off, int fd, off_t * pos, size_t count)
+{
+  ssize_t s = copy_file_range (in, &off, fd, pos, count, 0);
+  if (s < 0 && !pos)
+    s = sendfile (fd, in, &off, count);
+  if (s > 0)
+    __atomic_fetch_add (&zerocopy_out, (size_t) s, __ATOMIC_RELAXED);
+  return s;
+}
+
+ssize_t
+read (int fd, void *buf, size_t count)
+{
+  off_t off;
+  ssize_t s = -1;
+  int b;
+  if (!default_read)
+    default_read = (ssize_t (*)(int, void *, size_t)) dlsym (RTLD_NEXT,
+                                                              "read");
+  b = backing (buf, count, 1, &off);
+  if (b >= 0)
+    {
+      s = copy_in (fd, NULL, b, off, count);
+      close (b);
+    }
+  if (s > 0)
+    return s;
+  prepare (buf, count, 1);
+  return default_read (fd, buf, count);
+}
+
+ssize_t
+pread (int fd, void *buf, size_t count, off_t offset)
+{
+  off_t off;
+  ssize_t s = -1;
+  int b;
+  if (!default_pread)
+    default_pread = (ssize_t (*)(int, void *, size_t, off_t))
+      dlsym (RTLD_NEXT, "pread");
+  b = backing (buf, count, 1, &off);
+  if (b >= 0)
+    {
+      s = copy_in (fd, &offset, b, off, count);
+      close (b);
+    }
+  if (s > 0)
+    return s;
+  prepare (buf, count, 1);
+  return default_pread (fd, buf, count, offset);
+}
+
+ssize_t
+write (int fd, const void *buf, size_t count)
+{
+  off_t off;
+  ssize_t s = -1;
+  int b;
+  if (!default_write)
+    default_write = (ssize_t (*)(int, const void *, size_t))
+      dlsym (RTLD_NEXT, "write");
+  b = backing (buf, count, 0, &off);
+  if (b >= 0)
+    {
+      s = copy_out (b, off, fd, NULL, count);
+      close (b);
+    }
+  if (s > 0)
+    return s;
+  prepare (buf, count, 0);
+  return default_write (fd, buf, count);
+}
+
+ssize_t
+pwrite (int fd, const void *buf, size_t count, off_t offset)
+{
+  off_t off;
+  ssize_t s = -1;
+  int b;
+  if (!default_pwrite)
+    default_pwrite = (ssize_t (*)(int, const void *, size_t, off_t))
+      dlsym (RTLD_NEXT, "pwrite");
+  b = backing (buf, count, 0, &off);
+  if (b >= 0)
+    {
+      s = copy_out (b, off, fd, &offset, count);
+      close (b);
+    }
+  if (s > 0)
+    return s;
+  prepare (buf, count, 0);
+  return default_pwrite (fd, buf, count, offset);
+}
+
+/* The stream wrappers move the data at the stream's position with the
+ * descriptor's position untouched, then seek the stream past it, which
+ * drops its buffer. Whatever is left (at the end of the file, say) goes
+ * through the default function, which also sets the stream's flags.
+ */
+size_t
+fread (void *ptr, size_t size, size_t nmemb, FILE * stream)
+{
+  off_t off, pos;
+  size_t total, done = 0;
+  ssize_t s;
+  int b;
+  if (!default_fread)
+    default_fread = (size_t (*)(void *, size_t, size_t, FILE *))
+      dlsym (RTLD_NEXT, "fread");
+  if (size == 0 || nmemb > (size_t) -1 / size)
+    return default_fread (ptr, size, nmemb, stream);
+  total = size * nmemb;
+  b = backing (ptr, total, 1, &off);
+  if (b < 0)
+    {
+      prepare (ptr, total, 1);
+      return default_fread (ptr, size, nmemb, stream);
+    }
+  flockfile (stream);
+  pos = ftello (stream);
+  while (pos >= 0 && done < total
+         && (s = copy_in (fileno (stream), &pos, b, off + done,
+                          total - done)) > 0)
+    done += (size_t) s;
+  close (b);
+  if (done > 0)
+    fseeko (stream, pos, SEEK_SET);
+  if (done < total)
+    done += default_fread ((char *) ptr + done, 1, total - done, stream);
+  funlockfile (stream);
+  return done / size;
+}
+
+size_t
+fwrite (const void *ptr, size_t size, size_t nmemb, FILE * stream)
+{
+  off_t off, pos = -1;
+  size_t total, done = 0;
+  ssize_t s;
+  int b;
+  if (!default_fwrite)
+    default_fwrite = (size_t (*)(const void *, size_t, size_t, FILE *))
+      dlsym (RTLD_NEXT, "fwrite");
+  if (size == 0 || nmemb > (size_t) -1 / size)
+    return default_fwrite (ptr, size, nmemb, stream);
+  total = size * nmemb;
+  b = backing (ptr, total, 0, &off);
+  if (b < 0)
+    {
+      prepare (ptr, total, 0);
+      return default_fwrite (ptr, size, nmemb, stream);
+    }
+  flockfile (stream);
+  if (fflush (stream) == 0)
+    pos = ftello (stream);
+  while (pos >= 0 && done < total
+         && (s = copy_out (b, off + done, fileno (stream), &pos,
+                           total - done)) > 0)
+    done += (size_t) s;
+  close (b);
+  if (done > 0)
+    fseeko (stream, pos, SEEK_SET);
+  if (done < total)
+    done += default_fwrite ((const char *) ptr + done, 1, total - done,
+                            stream);
+  funlockfile (stream);
+  return done / size;
+}
+
+/* API: Set/get the smallest transfer the I/O wrappers move in the kernel
+ * INPUT j: negative to query, zero to turn zero-copy I/O off, otherwise the
+ *          new minimum transfer size in bytes
+ * OUTPUT (return value): the minimum in effect, 0 when off
+ */
+size_t
+exm_zerocopy (ssize_t j)
+{
+  exm_lock ();
+  if (j >= 0)
+    exm_zerocopy_min = (size_t) j;
+  j = exm_zerocopy_min;
+  exm_unlock ();
+  return (size_t) j;
+}
+
+/* API: Bytes moved by zero-copy I/O
+ * OUTPUT in: bytes read into exm allocations (if not NULL)
+ *        out: bytes written from exm allocations (if not NULL)
+ *        (return value): total bytes moved
+ */
+size_t
+exm_zerocopy_info (size_t * in, size_t * out)
+{
+  size_t i = __atomic_load_n (&zerocopy_in, __ATOMIC_RELAXED);
+  size_t o = __atomic_load_n (&zerocopy_out, __ATOMIC_RELAXED);
+  if (in)
+    *in = i;
+  if (out)
+    *out = o;
+  return i + o;
+}
@@ -0,0 +1,322 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Lazy materialization
+ *
+ * Programs often allocate huge buffers and touch little of them, or touch
+ * them only much later. In lazy mode (EXM_LAZY=1 or exm_lazy) an allocation
+ * above the threshold only reserves PROT_NONE address space, listed in
+ * flexmap as kind EXM_LAZY, and registers the range with the fault
+ * dispatcher (see fault.c). The first access to each chunk of
+ * exm_lazy_chunk bytes (EXM_LAZY_CHUNK, default 64M) faults; the handler
+ * creates the backing file if this is the first touch of the allocation
+ * and maps the chunk's part of the file over the chunk with MAP_FIXED, then
+ * the access is retried. Untouched allocations never create a file.
+ *
+ * The handler takes the (recursive) lock, which is safe because faults are
+ * synchronous: the faulting thread is running application code, not exm
+ * code, unless it holds the lock itself. It looks the allocation up by
+ * address, so a fault on a freed allocation is a real fault.
+ *
+ * realloc keeps an allocation lazy while it has no file, otherwise it maps
+ * the whole file (unmaterialized chunks are holes in the sparse file) and
+ * the allocation becomes an ordinary file-backed one. Forked children do the
+ * same, see exm_lazy_fork.
+ *
+ * Faults raised inside the kernel never reach the handler: a system call
+ * given an untouched chunk fails with EFAULT. The read, pread, fread, write,
+ * pwrite and fwrite wrappers of io.c materialize the chunks of their buffer
+ * first (exm_lazy_touch); other system calls (readv, recv, ...) need the
+ * buffer touched from user space beforehand.
+ */
+
+int exm_lazy_mode = 0;
+size_t exm_lazy_chunk = (size_t) 1 << 26;
+
+#define CHUNK_SET(m, i) ((m)->chunks[(i) / 8] & (1 << ((i) % 8)))
+
+static size_t
+nchunks (struct map *m)
+{
+  return (m->length + m->chunk_size - 1) / m->chunk_size;
+}
+
+/* Materialize the chunk of allocation m containing addr. The caller holds
+ * the lock.
+ * OUTPUT (return value): 0 on success (including when another thread got
+ * there first), -1 on error
+ */
+static int
+touch (struct map *m, char *addr)
+{
+  size_t i = (size_t) (addr - (char *) m->addr) / m->chunk_size;
+  size_t off = i * m->chunk_size;
+  size_t len = m->length - off < m->chunk_size ? m->length - off
+    : m->chunk_size;
+  int fd;
+  void *p;
+
+  if (CHUNK_SET (m, i))
+    return 0;
+  if (!m->path[0])
+    fd = exm_mkstemp (m, m->length, m->tier);
+  else
+    fd = open (m->path, O_RDWR);
+  if (fd < 0)
+    return -1;
+  p = mmap ((char *) m->addr + off, len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, fd, (off_t) off);
+  close (fd);
+  if (p == MAP_FAILED)
+    return -1;
+  madvise (p, len, m->advice);
+  m->chunks[i / 8] |= 1 << (i % 8);
+  return 0;
+}
+
+/* Fault callback, arg is the allocation's address */
+static int
+lazy_fault (void *addr, void *arg)
+{
+  struct map *m;
+  int j = -1;
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &arg, m);
+  if (m && m->kind == EXM_LAZY && (char *) addr >= (char *) m->addr
+      && (char *) addr < (char *) m->addr + m->length)
+    j = touch (m, (char *) addr);
+  exm_unlock ();
+  return j;
+}
+
+/* Reserve a lazy allocation of length bytes for m. The caller holds the
+ * lock and has set m->tier and m->advice.
+ * OUTPUT (return value): 0 on success, -1 on error (m unchanged)
+ */
+int
+exm_lazy_new (struct map *m, size_t length)
+{
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  size_t chunk = ((exm_lazy_chunk + page - 1) / page) * page;
+  size_t n;
+  unsigned char *c;
+  void *p;
+  int slot;
+
+  if (chunk == 0)
+    chunk = page;
+  n = ((length + chunk - 1) / chunk + 7) / 8;
+  c = (unsigned char *) exm_map_alloc (n);
+  if (!c)
+    return -1;
+  memset (c, 0, n);
+  p = mmap (NULL, length, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    {
+      exm_map_free (c);
+      return -1;
+    }
+  if (exm_fault_init () < 0
+      || (slot = exm_fault_register (p, length, lazy_fault, p)) < 0)
+    {
+      munmap (p, length);
+      exm_map_free (c);
+      return -1;
+    }
+  m->kind = EXM_LAZY;
+  m->slot = slot;
+  m->length = length;
+  m->chunk_size = chunk;
+  m->chunks = c;
+  m->addr = p;
+  __atomic_fetch_add (&exm_io_guard, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Stop lazy handling of m, leaving it an ordinary allocation */
+static void
+unlazy (struct map *m, int kind)
+{
+  exm_fault_unregister (m->slot);
+  exm_map_free (m->chunks);
+  m->chunks = NULL;
+  m->kind = kind;
+  __atomic_fetch_sub (&exm_io_guard, 1, __ATOMIC_RELAXED);
+}
+
+/* Map all of m's backing file over addr (MAP_FIXED when addr is not NULL) */
+static void *
+map_file (struct map *m, void *addr)
+{
+  void *p;
+  int fd = open (m->path, O_RDWR);
+  if (fd < 0)
+    return MAP_FAILED;
+  p = mmap (addr, m->length, PROT_READ | PROT_WRITE,
+            MAP_SHARED | (addr ? MAP_FIXED : 0), fd, 0);
+  close (fd);
+  if (p != MAP_FAILED)
+    madvise (p, m->length, m->advice);
+  return p;
+}
+
+/* Resize the lazy allocation m (removed from flexmap by the caller) to
+ * length bytes, see above. The caller holds the lock.
+ * OUTPUT (return value): 0 on success, -1 on error (m unchanged)
+ */
+int
+exm_lazy_resize (struct map *m, size_t length)
+{
+  unsigned char *c;
+  size_t n, old = (nchunks (m) + 7) / 8;
+  void *p;
+  int slot;
+
+  if (!m->path[0])
+    {
+      n = (length + m->chunk_size - 1) / m->chunk_size;
+      n = (n + 7) / 8;
+      c = (unsigned char *) exm_map_alloc (n);
+      if (!c)
+        return -1;
+      memset (c, 0, n);
+      p = mremap (m->addr, m->length, length, MREMAP_MAYMOVE);
+      if (p == MAP_FAILED)
+        {
+          exm_map_free (c);
+          return -1;
+        }
+      slot = exm_fault_register (p, length, lazy_fault, p);
+      if (slot < 0)
+        {
+/* Put the reservation back where it was */
+          p = mremap (p, length, m->length, MREMAP_MAYMOVE | MREMAP_FIXED,
+                      m->addr);
+          exm_map_free (c);
+          return -1;
+        }
+      memcpy (c, m->chunks, old < n ? old : n);
+      exm_fault_unregister (m->slot);
+      exm_map_free (m->chunks);
+      m->chunks = c;
+      m->slot = slot;
+      m->addr = p;
+      m->length = length;
+      return 0;
+    }
+  if (truncate (m->path, length) < 0)
+    return -1;
+  exm_tier_release (m->tier, m->length);
+  exm_tier_charge (m->tier, length);
+  n = m->length;
+  m->length = length;
+  p = map_file (m, NULL);
+  if (p == MAP_FAILED)
+    {
+      m->length = n;
+      return -1;
+    }
+  munmap (m->addr, n);
+  m->addr = p;
+  unlazy (m, EXM_FILE);
+  return 0;
+}
+
+/* Turn the lazy allocation m into an ordinary file-backed one in place,
+ * creating its backing file if it has none yet. The caller holds the lock.
+ * OUTPUT (return value): 0 on success, -1 on error (m still lazy)
+ */
+int
+exm_lazy_settle (struct map *m)
+{
+  int fd;
+  if (!m->path[0])
+    {
+      fd = exm_mkstemp (m, m->length, m->tier);
+      if (fd < 0)
+        return -1;
+      close (fd);
+    }
+  if (map_file (m, m->addr) == MAP_FAILED)
+    return -1;
+  unlazy (m, EXM_FILE);
+  return 0;
+}
+
+/* In a forked child, turn the inherited lazy allocation m into an ordinary
+ * one: the whole backing file mapped over it when it has one (fork then
+ * remaps it according to the fork mode), or private anonymous memory when
+ * nothing was touched yet. The caller holds the lock.
+ */
+void
+exm_lazy_fork (struct map *m)
+{
+  if (m->path[0] && exm_lazy_settle (m) == 0)
+    return;
+  mmap (m->addr, m->length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  unlazy (m, EXM_ANON);
+}
+
+/* Materialize the chunks of the lazy allocation m that hold [addr, addr +
+ * length), for system calls that move data through them (see io.c). The
+ * caller holds the lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+int
+exm_lazy_touch (struct map *m, const void *addr, size_t length)
+{
+  char *a = (char *) m->addr, *p = (char *) addr, *end = p + length;
+  if (p < a)
+    p = a;
+  if (end > a + m->length)
+    end = a + m->length;
+  for (p = a + (size_t) (p - a) / m->chunk_size * m->chunk_size; p < end;
+       p += m->chunk_size)
+    if (touch (m, p) < 0)
+      return -1;
+  return 0;
+}
+
+/* Release lazy state when m is freed */
+void
+exm_lazy_free (struct map *m)
+{
+  if (m->kind == EXM_LAZY)
+    unlazy (m, EXM_LAZY);
+}
+
+/* API: Set/get lazy mode
+ * INPUT j: negative to query, zero to turn lazy mode off, one to turn it on
+ * OUTPUT (return value): 1 if lazy mode is on, 0 otherwise
+ * Existing allocations are not affected. read, pread, fread, write, pwrite
+ * and fwrite may be given untouched lazy memory; other system calls fail
+ * with EFAULT on it until the program touches it.
+ */
+int
+exm_lazy (int j)
+{
+  exm_lock ();
+  if (j >= 0)
+    exm_lazy_mode = j > 0;
+  j = exm_lazy_mode;
+  exm_unlock ();
+  return j;
+}
@@ -0,0 +1,171 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+ The exm API
+
+ Programs call these functions directly and link with the shim library
+ (-lexm_shim -ldl), which forwards each call to libexm.so when it is loaded
+ (normally with LD_PRELOAD, see the exm wrapper script) and otherwise falls
+ back to plain behavior: exm_malloc and friends use the default allocator and
+ the settings functions report nothing is set. See api.c and the files it
+ refers to for the details of each function.
+*/
+#ifndef LIBEXM_H
+#define LIBEXM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Hints for exm_malloc and exm_calloc, combined with | */
+#define EXM_SEQUENTIAL   0x0001 /* accessed sequentially (MADV_SEQUENTIAL) */
+#define EXM_RANDOM       0x0002 /* accessed randomly (MADV_RANDOM) */
+#define EXM_READ_MOSTLY  0x0004 /* read far more than written (read-ahead) */
+#define EXM_TEMPORARY    0x0008 /* short-lived scratch space (a tier on
+                                   tmpfs is preferred) */
+#define EXM_PREFAULT     0x0010 /* populate the mapping at creation */
+#define EXM_HUGEPAGES    0x0020 /* ask for transparent huge pages */
+#define EXM_NOHUGEPAGES  0x0040 /* ask for no transparent huge pages */
+#define EXM_COMPRESS     0x0080 /* page, compressing cold clusters on file */
+#define EXM_TIER(i)      ((((i) + 1) & 0xff) << 16) /* place in tier i */
+
+/* Tier placement policies for exm_tier_policy */
+#define EXM_TIER_FILL 0
+#define EXM_TIER_ROUNDROBIN 1
+#define EXM_TIER_FREE 2
+
+/* Explicit allocations, always out of core regardless of the threshold. The
+ * result may also be released with free() and resized with realloc().
+ */
+void *exm_malloc (size_t size, int flags);
+void *exm_calloc (size_t count, size_t size, int flags);
+void exm_free (void *ptr);
+
+/* Growable buffers: reserve address space for up to max_size bytes, then
+ * commit the usable size in place as the buffer grows, see reserve.c.
+ * realloc within the reservation also commits in place.
+ */
+void *exm_reserve (size_t max_size, int flags);
+int exm_commit (void *ptr, size_t size);
+
+/* Persistent allocations: keep an allocation's data under a name and map it
+ * back in a later run, see persist.c
+ */
+int exm_persist (void *addr, const char *name);
+void *exm_attach (const char *name);
+
+/* Sharing between processes: publish an allocation under a name and map it
+ * in other processes, see share.c
+ */
+int exm_publish (void *addr, const char *name, int mode);
+void *exm_attach_shared (const char *name, int readonly);
+
+/* Mapping existing files as allocations, see mapfile.c */
+#define EXM_MAP_PRIVATE 1       /* copy on write, the file never changes */
+#define EXM_MAP_SHARED 2        /* writes go to the file */
+void *exm_map_file (const char *path, off_t offset, size_t len, int mode);
+
+/* Snapshots: copy an allocation to a file, then update the copy with only
+ * the pages written since, see snapshot.c. Writes are tracked by write
+ * protection: read, pread and fread may fill a tracked allocation, other
+ * system calls writing into it fail with EFAULT.
+ */
+int exm_snapshot (void *addr, const char *dest);
+ssize_t exm_snapshot_incremental (void *addr);
+
+/* Statistics, see stats.c. Latency histograms are indexed by operation
+ * (EXM_OP_*) and bucket: bucket i counts calls that took less than 2^i
+ * nanoseconds and at least 2^(i-1), the last bucket all longer ones.
+ * Rpkg/src/rexm.c keeps a copy of struct exm_stats: change both together.
+ */
+#define EXM_OP_MALLOC 0         /* exm allocations (malloc, calloc, ...) */
+#define EXM_OP_FREE 1
+#define EXM_OP_REALLOC 2
+#define EXM_OP_FORK 3
+#define EXM_OPS 4
+#define EXM_STATS_BUCKETS 40
+
+struct exm_stats
+{
+  uint64_t allocations;         /* exm allocations created */
+  uint64_t frees;               /* exm allocations freed */
+  uint64_t reallocs;            /* reallocs of exm allocations */
+  uint64_t realloc_moves;       /* of which moved the data */
+  uint64_t forks;               /* forks */
+  uint64_t fork_remaps;         /* allocations remapped in forked children */
+  uint64_t memcpy_fast;         /* whole-allocation memcpy by sendfile */
+  uint64_t zerocopy_in;         /* bytes read by zero-copy I/O (io.c) */
+  uint64_t zerocopy_out;        /* bytes written by zero-copy I/O */
+  uint64_t compressed_raw;      /* bytes written back compressed (pager.c) */
+  uint64_t compressed_stored;   /* bytes they take on file */
+  uint64_t decompressions;      /* clusters decompressed on faults */
+  uint64_t decompress_ns;       /* time spent decompressing */
+  uint64_t lock_waits;          /* lock acquisitions that waited */
+  uint64_t lock_wait_ns;        /* time spent waiting */
+  uint64_t maps;                /* live allocations */
+  uint64_t bytes_mapped;        /* bytes in live allocations */
+  uint64_t file_bytes;          /* bytes in backing files in tiers */
+  uint64_t peak_file_bytes;     /* largest file_bytes so far */
+  uint64_t threshold;           /* allocation threshold in effect */
+  uint64_t threshold_reason;    /* why it last changed, the index of the
+                                   exm_threshold_reason string (0 static, 1
+                                   plentiful, 2 below headroom, 3 psi high,
+                                   4 relieved, 5 no memory information) */
+  uint64_t threshold_changes;   /* changes of the auto mode threshold */
+  uint64_t mem_limit;           /* memory limit at the last auto mode sample */
+  uint64_t mem_avail;           /* memory available then */
+  uint64_t mem_psi;             /* memory stall avg10 then, in hundredths of
+                                   a percent */
+  uint64_t latency[EXM_OPS][EXM_STATS_BUCKETS];
+};
+
+int exm_stats (struct exm_stats *s);
+void *exm_map_info (int i, size_t * length, size_t * resident, int *tier);
+
+/* Settings */
+double exm_version (void);
+size_t exm_threshold (size_t j);
+char *exm_path (char *path);
+int exm_cow (int j);
+int exm_tier_policy (int j);
+char *exm_tier_info (int i, size_t * allocated, size_t * capacity,
+                     size_t * avail);
+size_t exm_stripe (ssize_t j);
+int exm_threshold_auto (int on, size_t headroom);
+const char *exm_threshold_reason (void);
+int exm_demote (int j);
+int exm_migrate (void *addr, int to_file);
+int exm_policy (const char *path);
+size_t exm_threshold_local (ssize_t j);
+int exm_policy_push (size_t threshold, const char *actions);
+int exm_policy_pop (void);
+int exm_learn (int j);
+int exm_lazy (int j);
+size_t exm_zerocopy (ssize_t j);
+size_t exm_pager (ssize_t j);
+int exm_trace_file (const char *path);
+int exm_profile (int j);
+int exm_profile_report (const char *path);
+uint64_t exm_site_info (int i, unsigned long *n, double *lifetime,
+                        double *intensity);
+
+/* Allocations */
+char *exm_lookup (void *addr);
+size_t exm_size (void *addr);
+size_t exm_zerocopy_info (size_t * in, size_t * out);
+size_t exm_pager_info (size_t * in, size_t * out);
+int exm_madvise (void *addr, int advice);
+void exm_debug_list (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
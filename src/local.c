@@ -0,0 +1,165 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Thread-local overrides
+ *
+ * exm_threshold changes the threshold for the whole process. A thread can
+ * instead set its own threshold with exm_threshold_local, and push scoped
+ * policies with exm_policy_push that apply to its allocations until the
+ * matching exm_policy_pop, for instance for a library to send just its own
+ * large temporaries out of core:
+ *
+ *   exm_policy_push (64 << 20, "tier=/mnt/scratch advice=sequential");
+ *   ... allocate ...
+ *   exm_policy_pop ();
+ *
+ * A pushed scope carries a threshold (zero inherits the thread's current
+ * one) and optional actions in the policy file syntax (see policy.c), whose
+ * hints replace those of the policy rules. Thread-local settings take
+ * precedence over the policy rules and learned call sites.
+ *
+ * The state lives in initial-exec TLS and the allocation path reads it
+ * without locks. exm_local_users counts the threads that set anything, so
+ * processes that never do pay only for one global load per allocation.
+ */
+
+#define EXM_LOCAL_DEPTH 8
+
+struct scope
+{
+  size_t threshold;             /* Zero when not set */
+  int hinted;                   /* Actions were given */
+  struct hints h;
+};
+
+int exm_local_users = 0;
+static __thread struct scope scopes[EXM_LOCAL_DEPTH]
+  __attribute__ ((tls_model ("initial-exec")));
+static __thread int depth __attribute__ ((tls_model ("initial-exec")));
+static __thread size_t threshold __attribute__ ((tls_model ("initial-exec")));
+static __thread int counted __attribute__ ((tls_model ("initial-exec")));
+
+/* Keep exm_local_users up to date for this thread */
+static void
+count ()
+{
+  int active = threshold > 0 || depth > 0;
+  if (active && !counted)
+    __atomic_add_fetch (&exm_local_users, 1, __ATOMIC_RELAXED);
+  else if (!active && counted)
+    __atomic_sub_fetch (&exm_local_users, 1, __ATOMIC_RELAXED);
+  counted = active;
+}
+
+/* The thread's threshold in effect, zero when none */
+static size_t
+local_threshold ()
+{
+  return depth > 0 ? scopes[depth - 1].threshold : threshold;
+}
+
+/* Route an allocation of size bytes by this thread's overrides, replacing
+ * the hints in h when a scope with actions is in effect.
+ * OUTPUT (return value): route for exm_alloc, -1 when no override applies
+ */
+int
+exm_local_route (size_t size, struct hints *h)
+{
+  struct scope *s;
+  size_t t;
+  if (!counted)
+    return -1;
+  if (depth > 0)
+    {
+      s = &scopes[depth - 1];
+      if (s->hinted)
+        {
+          *h = s->h;
+          if (h->backend == EXM_BACKEND_HEAP)
+            return 0;
+          if (h->backend == EXM_BACKEND_EXM)
+            return 1;
+        }
+    }
+  t = local_threshold ();
+  if (t > 0)
+    return size >= t ? 1 : 0;
+  return -1;
+}
+
+/* API: Set/get this thread's threshold
+ * INPUT j: negative to query, zero to remove the thread's threshold (the
+ *          process threshold applies again), otherwise the thread's new
+ *          threshold in bytes
+ * OUTPUT (return value): the thread's threshold in effect, zero when none
+ * Scopes pushed with exm_policy_push keep their own thresholds.
+ */
+size_t
+exm_threshold_local (ssize_t j)
+{
+  if (j >= 0)
+    {
+      threshold = (size_t) j;
+      count ();
+    }
+  return local_threshold ();
+}
+
+/* API: Push a scoped policy for this thread
+ * INPUT t: threshold in bytes within the scope, zero to inherit the
+ *          thread's current threshold
+ *       actions: space-separated policy actions (see policy.c), for example
+ *                "backend=exm tier=/dev/shm", or NULL
+ * OUTPUT (return value): the new scope depth, or -1 on error (too many
+ *        scopes, or invalid actions)
+ */
+int
+exm_policy_push (size_t t, const char *actions)
+{
+  struct scope s;
+  int j = 0;
+  if (depth == EXM_LOCAL_DEPTH)
+    return -1;
+  memset (&s, 0, sizeof (s));
+  exm_hints_init (&s.h);
+  s.threshold = t > 0 ? t : local_threshold ();
+  if (actions)
+    {
+      exm_lock ();
+      j = exm_policy_actions (actions, &s.h);
+      exm_unlock ();
+      s.hinted = 1;
+    }
+  if (j < 0)
+    return -1;
+  scopes[depth++] = s;
+  count ();
+  return depth;
+}
+
+/* API: Pop the innermost scoped policy of this thread
+ * OUTPUT (return value): the remaining scope depth, or -1 if there was no
+ *        scope to pop
+ */
+int
+exm_policy_pop ()
+{
+  if (depth == 0)
+    return -1;
+  depth--;
+  count ();
+  return depth;
+}
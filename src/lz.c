@@ -0,0 +1,195 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* LZ codec
+ *
+ * A small LZ77 codec for compressed paging (see pager.c), in the LZ4 block
+ * format: a sequence is a token byte (literal count in the high nibble,
+ * match length minus 4 in the low one, 15 meaning more length bytes follow,
+ * each added until one is not 255), the literals, then a two-byte little
+ * endian match offset and the extra match length bytes. The last sequence
+ * has literals only. Matches are found with a 4096-entry hash table of
+ * 4-byte prefixes, without chains; the search skips ahead faster the longer
+ * it goes without a match, so incompressible data costs little.
+ *
+ * Speed matters more than ratio here: clusters are compressed by the pager
+ * thread when they are evicted, and decompressed while a thread waits on a
+ * fault.
+ */
+
+#define HASH_LOG 12
+#define MINMATCH 4
+#define LASTLITERALS 5          /* The last bytes are always literals */
+#define MFLIMIT 12              /* and no match starts this close to the end */
+
+static inline uint32_t
+read32 (const uint8_t * p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline unsigned
+hash (uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Write a length beyond the 15 of a token nibble */
+static inline uint8_t *
+length (uint8_t * op, size_t n)
+{
+  for (; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = (uint8_t) n;
+  return op;
+}
+
+/* Compress n bytes of src into at most cap bytes at dst
+ * OUTPUT (return value): compressed length, 0 if it would exceed cap
+ */
+size_t
+exm_lz_compress (const void *src, size_t n, void *dst, size_t cap)
+{
+  const uint8_t *in = (const uint8_t *) src, *ip = in, *anchor = in;
+  const uint8_t *end = in + n, *ref, *mp, *rp;
+  const uint8_t *limit = n > MFLIMIT ? end - MFLIMIT : in;
+  uint8_t *op = (uint8_t *) dst, *oend = op + cap, *token;
+  uint32_t table[1 << HASH_LOG], v;
+  size_t lit, mlen, miss = 0;
+  unsigned h;
+
+  memset (table, 0, sizeof (table));
+  while (ip < limit)
+    {
+      v = read32 (ip);
+      h = hash (v);
+      ref = in + table[h];
+      table[h] = (uint32_t) (ip - in);
+      if (ref >= ip || ip - ref > 65535 || read32 (ref) != v)
+        {
+          ip += 1 + (miss++ >> 6);
+          continue;
+        }
+      miss = 0;
+      for (mp = ip + MINMATCH, rp = ref + MINMATCH;
+           mp < end - LASTLITERALS && *mp == *rp; ++mp, ++rp);
+      lit = (size_t) (ip - anchor);
+      mlen = (size_t) (mp - ip) - MINMATCH;
+      if ((size_t) (oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1)
+        return 0;
+      token = op++;
+      if (lit >= 15)
+        {
+          *token = 15 << 4;
+          op = length (op, lit - 15);
+        }
+      else
+        *token = (uint8_t) (lit << 4);
+      memcpy (op, anchor, lit);
+      op += lit;
+      *op++ = (uint8_t) ((ip - ref) & 255);
+      *op++ = (uint8_t) ((ip - ref) >> 8);
+      if (mlen >= 15)
+        {
+          *token |= 15;
+          op = length (op, mlen - 15);
+        }
+      else
+        *token |= (uint8_t) mlen;
+      ip = anchor = mp;
+    }
+  lit = (size_t) (end - anchor);
+  if ((size_t) (oend - op) < 1 + lit / 255 + 1 + lit)
+    return 0;
+  token = op++;
+  if (lit >= 15)
+    {
+      *token = 15 << 4;
+      op = length (op, lit - 15);
+    }
+  else
+    *token = (uint8_t) (lit << 4);
+  memcpy (op, anchor, lit);
+  op += lit;
+  return (size_t) (op - (uint8_t *) dst);
+}
+
+/* Read a length beyond the 15 of a token nibble
+ * OUTPUT (return value): 0 on success, -1 past the end of the input
+ */
+static inline int
+more (const uint8_t ** ip, const uint8_t * iend, size_t *n)
+{
+  unsigned b;
+  do
+    {
+      if (*ip >= iend)
+        return -1;
+      b = *(*ip)++;
+      *n += b;
+    }
+  while (b == 255);
+  return 0;
+}
+
+/* Decompress n bytes of src into at most cap bytes at dst
+ * OUTPUT (return value): decompressed length, -1 if src is corrupt
+ */
+ssize_t
+exm_lz_decompress (const void *src, size_t n, void *dst, size_t cap)
+{
+  const uint8_t *ip = (const uint8_t *) src, *iend = ip + n, *m;
+  uint8_t *op = (uint8_t *) dst, *oend = op + cap;
+  size_t lit, mlen, off;
+  unsigned t;
+
+  while (ip < iend)
+    {
+      t = *ip++;
+      lit = t >> 4;
+      if (lit == 15 && more (&ip, iend, &lit) < 0)
+        return -1;
+      if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op))
+        return -1;
+      memcpy (op, ip, lit);
+      op += lit;
+      ip += lit;
+      if (ip == iend)
+        break;
+      if (iend - ip < 2)
+        return -1;
+      off = (size_t) ip[0] | (size_t) ip[1] << 8;
+      ip += 2;
+      if (off == 0 || off > (size_t) (op - (uint8_t *) dst))
+        return -1;
+      mlen = t & 15;
+      if (mlen == 15 && more (&ip, iend, &mlen) < 0)
+        return -1;
+      mlen += MINMATCH;
+      if (mlen > (size_t) (oend - op))
+        return -1;
+      m = op - off;
+/* Overlapping matches repeat the last off bytes */
+      if (off >= mlen)
+        memcpy (op, m, mlen);
+      else
+        for (t = 0; t < mlen; ++t)
+          op[t] = m[t];
+      op += mlen;
+    }
+  return (ssize_t) (op - (uint8_t *) dst);
+}
@@ -0,0 +1,137 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define uthash_malloc(sz) exm_map_alloc(sz)
+#define uthash_free(ptr, sz) exm_map_free(ptr)
+#include "uthash.h"
+#include "exm.h"
+#include "libexm.h"
+#include "trace.h"
+
+/* Mapping existing files
+ *
+ * Reading a large data file into a malloc buffer copies every byte into
+ * memory that exm then writes back out to a backing file of its own.
+ * exm_map_file maps (part of) the file itself instead and registers the
+ * mapping in flexmap like any other allocation, so the result can be handed
+ * to code that frees or reallocs it:
+ *
+ *   x = (double *) exm_map_file ("data.bin", 0, 0, EXM_MAP_PRIVATE);
+ *
+ * With EXM_MAP_PRIVATE the mapping is copy on write: writes stay in memory
+ * and the file, which only needs to be readable, never changes. With
+ * EXM_MAP_SHARED writes go to the file, as with exm's own backing files.
+ *
+ * The file belongs to the caller: exm never truncates or removes it (see
+ * exm_unlink), free only unmaps it, and realloc moves the data to a new
+ * ordinary allocation. Forked children see a private mapping the way fork
+ * leaves it, and a shared one as exm_child_cow says, except that a value of
+ * 2 maps the file copy on write rather than copying it. Mapped files are
+ * not charged to a tier and cannot be persisted, published or striped.
+ */
+
+/* API: Map an existing file as an exm allocation
+ * INPUT path: file path
+ *       offset: start of the mapped part in the file, a multiple of the page
+ *               size
+ *       len: bytes to map, or 0 for the rest of the file
+ *       mode: EXM_MAP_PRIVATE (copy on write) or EXM_MAP_SHARED (writes go to
+ *             the file), see libexm.h
+ * OUTPUT (return value): address of the mapping, or NULL on error (errno
+ *        EINVAL for a bad offset or mode, or a range beyond the end of the
+ *        file)
+ * Release it with free.
+ */
+void *
+exm_map_file (const char *path, off_t offset, size_t len, int mode)
+{
+  struct stat st;
+  struct map *m, *y;
+  void *p = NULL;
+  int fd;
+
+  if (!exm_ready ())
+    {
+      errno = EAGAIN;
+      return NULL;
+    }
+  if (!path || strlen (path) >= EXM_MAX_PATH_LEN || offset < 0
+      || offset % sysconf (_SC_PAGESIZE) != 0
+      || (mode != EXM_MAP_PRIVATE && mode != EXM_MAP_SHARED))
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  fd = open (path, mode == EXM_MAP_SHARED ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return NULL;
+    }
+  if (len == 0 && st.st_size > offset)
+    len = (size_t) (st.st_size - offset);
+  if (len == 0 || offset > st.st_size || len > (size_t) (st.st_size - offset))
+    {
+      close (fd);
+      errno = EINVAL;
+      return NULL;
+    }
+  m = newmap ();
+  if (!m)
+    {
+      close (fd);
+      return NULL;
+    }
+  strcpy (m->path, path);
+  m->length = len;
+  m->offset = offset;
+  m->mapped = mode;
+  m->privmap = mode == EXM_MAP_PRIVATE;
+  m->pid = getpid ();
+  m->tier = -1;
+  m->kind = EXM_FILE;
+  m->advice = EXM_DEFAULT_ADVISE;
+  m->addr = mmap (NULL, len, PROT_READ | PROT_WRITE,
+                  mode == EXM_MAP_SHARED ? MAP_SHARED : MAP_PRIVATE, fd,
+                  offset);
+  close (fd);
+  if (m->addr == MAP_FAILED)
+    {
+      freemap (m);
+      return NULL;
+    }
+  madvise (m->addr, m->length, m->advice);
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &m->addr, y);
+  if (y)
+    {
+      munmap (m->addr, m->length);
+      freemap (m);
+    }
+  else
+    {
+      HASH_ADD_INORDER (hh, flexmap, addr, sizeof (void *), m, addr_sort);
+      exm_map_range (m);
+      p = m->addr;
+    }
+  exm_unlock ();
+  if (exm_trace_mode && p && len >= exm_trace_min)
+    exm_trace_event (EXM_TRACE_MALLOC, p, NULL, len, 1);
+  return p;
+}
@@ -0,0 +1,188 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "uthash.h"
+#include "exm.h"
+#include "monitor.h"
+
+/* Monitor segment
+ *
+ * Each process with exm allocations publishes what exm-top needs in a small
+ * file in /dev/shm named exm-monitor.<pid> (layout in monitor.h): the
+ * exm_stats counters and a table of its allocations with their backing
+ * files. A background thread, started with the first allocation, refreshes
+ * the segment once a second (EXM_MONITOR_INTERVAL milliseconds); the
+ * allocation paths do nothing extra. Readers retry while seq is odd or
+ * changes under them.
+ *
+ * Everything that costs the target per page (resident and dirty bytes,
+ * faults) exm-top reads from /proc instead, when it looks. The thread still
+ * takes the lock at each refresh, so the segment is off unless EXM_MONITOR=1
+ * turns it on. The segment is created exclusively, replacing only a stale
+ * one of our own; it is removed at exit, and exm-top skips the ones left by
+ * processes that died.
+ */
+
+int exm_monitor_mode = 0;
+long exm_monitor_interval = 1000;
+static struct monitor *seg;
+static char seg_path[64];
+static int running;
+static pthread_t thread;
+
+/* Create this process's segment. Caller holds the lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+create (void)
+{
+  struct stat st;
+  int fd;
+  void *p;
+  snprintf (seg_path, sizeof (seg_path), "%s/%s%d", EXM_MONITOR_DIR,
+            EXM_MONITOR_PREFIX, (int) getpid ());
+/* Left by an earlier process of ours with the same pid */
+  if (lstat (seg_path, &st) == 0 && st.st_uid == getuid ())
+    unlink (seg_path);
+  fd = open (seg_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW,
+             S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return -1;
+  if (ftruncate (fd, sizeof (struct monitor)) < 0)
+    {
+      close (fd);
+      unlink (seg_path);
+      return -1;
+    }
+  p = mmap (NULL, sizeof (struct monitor), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+  close (fd);
+  if (p == MAP_FAILED)
+    {
+      unlink (seg_path);
+      return -1;
+    }
+  seg = (struct monitor *) p;
+  seg->pid = (int32_t) getpid ();
+  snprintf (seg->command, sizeof (seg->command), "%s",
+            program_invocation_short_name);
+  __atomic_store_n (&seg->magic, EXM_MONITOR_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Refresh the segment. Caller holds the lock. */
+static void
+update (void)
+{
+  struct map *m, *tmp;
+  struct monitor_map *x;
+  int i = 0;
+  __atomic_fetch_add (&seg->seq, 1, __ATOMIC_ACQ_REL);
+  exm_stats (&seg->stats);
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    if (i < EXM_MONITOR_MAPS)
+      {
+        x = &seg->maps[i];
+        x->addr = (uint64_t) (uintptr_t) m->addr;
+        x->length = m->length;
+        x->tier = m->tier;
+        x->kind = m->kind;
+        snprintf (x->path, sizeof (x->path), "%s",
+                  m->nstripes > 0 ? m->stripes[0].path : m->path);
+      }
+    i++;
+  }
+  seg->nmaps = i;
+  seg->updated_ns = exm_clock ();
+  __atomic_fetch_add (&seg->seq, 1, __ATOMIC_ACQ_REL);
+}
+
+static void *
+monitor_thread (void *arg __attribute__ ((unused)))
+{
+  struct timespec t;
+  for (;;)
+    {
+      exm_lock ();
+      if (!exm_ready () || !seg)
+        {
+          running = 0;
+          exm_unlock ();
+          break;
+        }
+      update ();
+      exm_unlock ();
+      t.tv_sec = exm_monitor_interval / 1000;
+      t.tv_nsec = (exm_monitor_interval % 1000) * 1000000L;
+      nanosleep (&t, NULL);
+    }
+  return NULL;
+}
+
+/* Create the segment and start the thread, unless monitoring is off or they
+ * exist already. Takes the lock.
+ */
+void
+exm_monitor_start (void)
+{
+  pthread_attr_t a;
+  if (running || !exm_monitor_mode)
+    return;
+  exm_lock ();
+  if (!running && (seg || create () == 0))
+    {
+      pthread_attr_init (&a);
+      pthread_attr_setdetachstate (&a, PTHREAD_CREATE_DETACHED);
+      if (pthread_create (&thread, &a, monitor_thread, NULL) == 0)
+        running = 1;
+      else
+        syslog (LOG_CRIT, "exm unable to start monitor thread\n");
+      pthread_attr_destroy (&a);
+    }
+  exm_unlock ();
+}
+
+/* In a forked child: the segment and thread are the parent's. Leave the
+ * segment to it and start over if there are allocations. Caller holds the
+ * lock.
+ */
+void
+exm_monitor_atfork (void)
+{
+  if (!seg)
+    return;
+  munmap (seg, sizeof (struct monitor));
+  seg = NULL;
+  running = 0;
+  if (flexmap)
+    exm_monitor_start ();
+}
+
+/* Remove the segment at exit. Caller holds the lock. */
+void
+exm_monitor_finish (void)
+{
+  if (!seg || seg->pid != getpid ())
+    return;
+  unlink (seg_path);
+  munmap (seg, sizeof (struct monitor));
+  seg = NULL;
+}
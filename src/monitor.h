@@ -0,0 +1,43 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+ Layout of the per-process monitor segment, shared by libexm.so (monitor.c)
+ and exm-top (exm-top.c)
+*/
+#ifndef EXM_MONITOR_H
+#define EXM_MONITOR_H
+
+#include <stdint.h>
+#include "libexm.h"
+
+#define EXM_MONITOR_DIR "/dev/shm"
+#define EXM_MONITOR_PREFIX "exm-monitor."
+#define EXM_MONITOR_MAGIC 0x32304e4f4d4d5845ULL  /* "EXMMON02" */
+#define EXM_MONITOR_MAPS 256
+#define EXM_MONITOR_PATH 240
+
+struct monitor_map
+{
+  uint64_t addr;                /* Allocation address */
+  uint64_t length;              /* Allocation length */
+  int32_t tier;                 /* Tier index or -1 */
+  int32_t kind;                 /* EXM_FILE, EXM_ANON, ... (exm.h) */
+  char path[EXM_MONITOR_PATH];  /* Backing file (first stripe), truncated */
+};
+
+struct monitor
+{
+  uint64_t magic;               /* EXM_MONITOR_MAGIC once initialized */
+  uint64_t seq;                 /* Odd while the fields below are written */
+  int32_t pid;                  /* Owner */
+  int32_t nmaps;                /* Allocations, possibly more than listed */
+  uint64_t updated_ns;          /* CLOCK_MONOTONIC time of the last update */
+  char command[64];             /* Program name */
+  struct exm_stats stats;       /* See stats.c */
+  struct monitor_map maps[EXM_MONITOR_MAPS];
+};
+
+#endif
@@ -0,0 +1,1090 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/userfaultfd.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* User-space pager
+ *
+ * File-backed allocations leave residency to the kernel page cache, which
+ * does not know how much RAM the process should use and reads ahead and
+ * evicts as it would for files. In pager mode (EXM_PAGER=budget or
+ * exm_pager) allocations above the threshold are private anonymous memory,
+ * listed in flexmap as kind EXM_PAGED, registered with userfaultfd and
+ * backed by a file opened with O_DIRECT. A pager thread serves their faults
+ * a cluster of exm_pager_cluster bytes (EXM_PAGER_CLUSTER, default 64K) at a
+ * time, a page for allocations with MADV_RANDOM advice:
+ *
+ *  - a missing page: the cluster is read from the file if it was ever
+ *    written back, zero filled otherwise, and installed write-protected with
+ *    UFFDIO_COPY (writable right away when the fault was a write). A fault
+ *    on the cluster after the last one read reads ahead a window that
+ *    doubles up to exm_pager_ra clusters (EXM_PAGER_RA, default 16), never
+ *    for allocations with MADV_RANDOM advice;
+ *  - a write to a protected page: the cluster is marked dirty and
+ *    referenced, and unprotected.
+ *
+ * Before clusters come in, a CLOCK hand sweeps the paged allocations until
+ * they fit in exm_pager_budget bytes of RAM: a referenced cluster loses its
+ * bit (a dirty one is protected again so that the next write sets it), a
+ * dirty one is protected, written back and dropped with MADV_DONTNEED, a
+ * clean one is just dropped. Only fills and writes set the referenced bit,
+ * reads of resident clusters are invisible from user space. Reads and write
+ * backs go through io_uring in batches, or pread/pwrite when io_uring is not
+ * available.
+ *
+ * The pager has its own mutex and never takes the exm lock, so threads
+ * holding the lock may fault on paged memory. Its reads and writes are
+ * direct system calls: the wrappers of io.c may take the lock. A paged allocation becomes an
+ * ordinary file-backed one (exm_pager_settle) where the file must hold the
+ * data: persist, publish and snapshot, and in forked children, which get a
+ * copy of the file with their resident clusters written into it since
+ * userfaultfd registrations do not survive fork. realloc moves a paged
+ * allocation to a new one.
+ *
+ * Allocations with the compress hint (policy.c, EXM_COMPRESS) are paged even
+ * when pager mode is off, always a full cluster at a time, and store the
+ * clusters they write back compressed with the LZ codec of lz.c. Each
+ * cluster keeps its own slot in the file, at the same offset as in memory,
+ * and the page index (stored) records how many bytes of it are used: 0 for
+ * a cluster of zeros, which is never written, the cluster length for one
+ * that did not compress by at least a page, which is written as is, or the
+ * compressed length, written padded to whole pages for O_DIRECT. The rest of
+ * the slot is released with FALLOC_FL_PUNCH_HOLE, so the file only takes the
+ * compressed size on disk. Faults read the used part of the slot and
+ * decompress it; exm_stats reports the bytes compressed and stored, and the
+ * time spent decompressing. Settling first rewrites every cluster
+ * uncompressed.
+ */
+
+int exm_pager_mode = 0;
+size_t exm_pager_budget = (size_t) 1 << 30;
+size_t exm_pager_cluster = (size_t) 1 << 16;
+size_t exm_pager_ra = 16;
+
+#define RA_MAX 32               /* Largest readahead window, in clusters */
+#define BATCH (RA_MAX + 1)      /* Transfers per io_uring submission */
+
+/* Cluster state bits */
+#define RESIDENT 1
+#define DIRTY 2
+#define REFERENCED 4
+#define ONFILE 8                /* Written back at least once */
+
+struct paged
+{
+  char *addr;
+  size_t length;                /* Page-rounded allocation length */
+  size_t cluster;               /* Cluster length */
+  size_t n;                     /* Number of clusters */
+  int fd;                       /* Backing file */
+  int advice;                   /* madvise advice given at creation */
+  size_t expect;                /* Cluster after the last one read */
+  size_t ra;                    /* Readahead window in clusters */
+  unsigned char *state;         /* Cluster state bits */
+  int compress;                 /* Clusters are compressed on file */
+  uint32_t *stored;             /* Bytes of each slot used, when compressed */
+  struct paged *prev, *next;
+};
+
+/* One read or write of a cluster */
+struct xfer
+{
+  int write;
+  int fd;
+  char *buf;
+  size_t len;
+  off_t off;
+};
+
+struct ring
+{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_len, cq_len, sqes_len;
+};
+
+static pthread_mutex_t pager_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct paged *regions;
+static struct paged *hand_region;       /* CLOCK hand */
+static size_t hand;
+static int uffd = -1, running = 0, broken = 0;
+static size_t cluster;          /* exm_pager_cluster when the pager started */
+static size_t resident, paged_in, paged_out;
+static char *bounce;            /* BATCH clusters of read buffers */
+static char *packed;            /* BATCH clusters of compressed data */
+static struct ring ring = {.fd = -1 };
+static pthread_t thread;
+
+/* Set up an io_uring of BATCH entries with raw system calls
+ * OUTPUT (return value): 0 on success, -1 when io_uring is not available
+ */
+static int
+ring_init (void)
+{
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset (&p, 0, sizeof (p));
+  ring.fd = (int) syscall (SYS_io_uring_setup, BATCH, &p);
+  if (ring.fd < 0)
+    return -1;
+  ring.sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring.cq_len > ring.sq_len)
+        ring.sq_len = ring.cq_len;
+      ring.cq_len = 0;
+    }
+  ring.sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring.sq_map = mmap (NULL, ring.sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  ring.cq_map = ring.cq_len == 0 ? ring.sq_map
+    : mmap (NULL, ring.cq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes = (struct io_uring_sqe *) mmap (NULL, ring.sqes_len,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE,
+                                            ring.fd, IORING_OFF_SQES);
+  if (ring.sq_map == MAP_FAILED || ring.cq_map == MAP_FAILED
+      || ring.sqes == MAP_FAILED)
+    {
+      close (ring.fd);
+      ring.fd = -1;
+      return -1;
+    }
+  sq = (char *) ring.sq_map;
+  cq = (char *) ring.cq_map;
+  ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+  ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+}
+
+static void
+ring_close (void)
+{
+  if (ring.fd < 0)
+    return;
+  munmap (ring.sqes, ring.sqes_len);
+  if (ring.cq_len > 0)
+    munmap (ring.cq_map, ring.cq_len);
+  munmap (ring.sq_map, ring.sq_len);
+  close (ring.fd);
+  ring.fd = -1;
+}
+
+/* Move a whole transfer with pread or pwrite
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+sync_xfer (struct xfer *x)
+{
+  size_t done = 0;
+  ssize_t s = -1;
+  while (done < x->len)
+    {
+      if (x->write)
+        s = syscall (SYS_pwrite64, x->fd, x->buf + done, x->len - done,
+                     x->off + done);
+      else
+        s = syscall (SYS_pread64, x->fd, x->buf + done, x->len - done,
+                     x->off + done);
+      if (s < 0 && errno == EINTR)
+        continue;
+      if (s <= 0)
+        break;
+      done += (size_t) s;
+    }
+/* Reads past the end of the file are zeros */
+  if (!x->write && done < x->len && s == 0)
+    {
+      memset (x->buf + done, 0, x->len - done);
+      done = x->len;
+    }
+  return done == x->len ? 0 : -1;
+}
+
+/* Move n (at most BATCH) transfers, together through io_uring when
+ * possible. Short or failed ones are finished with pread/pwrite.
+ * OUTPUT (return value): 0 on success, -1 if any transfer failed
+ */
+static int
+transfer (struct xfer *x, int n)
+{
+  struct io_uring_sqe *e;
+  struct io_uring_cqe *c;
+  unsigned tail, head, i;
+  int k, done = 0, j = 0;
+  char redo[BATCH];
+
+  if (n <= 0)
+    return 0;
+  memset (redo, 1, sizeof (redo));
+  if (ring.fd >= 0)
+    {
+      tail = *ring.sq_tail;
+      for (k = 0; k < n; ++k)
+        {
+          i = (tail + k) & *ring.sq_mask;
+          e = &ring.sqes[i];
+          memset (e, 0, sizeof (*e));
+          e->opcode = x[k].write ? IORING_OP_WRITE : IORING_OP_READ;
+          e->fd = x[k].fd;
+          e->addr = (uint64_t) (uintptr_t) x[k].buf;
+          e->len = (uint32_t) x[k].len;
+          e->off = (uint64_t) x[k].off;
+          e->user_data = (uint64_t) k;
+          ring.sq_array[i] = i;
+        }
+      __atomic_store_n (ring.sq_tail, tail + n, __ATOMIC_RELEASE);
+      if (syscall (SYS_io_uring_enter, ring.fd, n, n, IORING_ENTER_GETEVENTS,
+                   NULL, 0) >= 0)
+        while (done < n)
+          {
+            head = *ring.cq_head;
+            if (head == __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE))
+              {
+                if (syscall (SYS_io_uring_enter, ring.fd, 0, 1,
+                             IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                    && errno != EINTR)
+                  break;
+                continue;
+              }
+            c = &ring.cqes[head & *ring.cq_mask];
+            if (c->user_data < (uint64_t) n
+                && c->res == (int32_t) x[c->user_data].len)
+              redo[c->user_data] = 0;
+            __atomic_store_n (ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            done++;
+          }
+      if (done < n)
+        {
+/* Something is wrong with the ring, stop using it */
+          syslog (LOG_CRIT, "exm pager io_uring failure, using pread\n");
+          ring_close ();
+        }
+    }
+  for (k = 0; k < n; ++k)
+    if (redo[k] && sync_xfer (&x[k]) < 0)
+      j = -1;
+  return j;
+}
+
+static size_t
+clen (struct paged *r, size_t c)
+{
+  size_t off = c * r->cluster;
+  return r->length - off < r->cluster ? r->length - off : r->cluster;
+}
+
+static void
+protect (struct paged *r, size_t c, int wp)
+{
+  struct uffdio_writeprotect w;
+  w.range.start = (uintptr_t) (r->addr + c * r->cluster);
+  w.range.len = clen (r, c);
+  w.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+  ioctl (uffd, UFFDIO_WRITEPROTECT, &w);
+}
+
+static void
+wake (uintptr_t addr)
+{
+  struct uffdio_range w;
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  w.start = addr & ~(page - 1);
+  w.len = page;
+  ioctl (uffd, UFFDIO_WAKE, &w);
+}
+
+/* Round n up to whole pages */
+static size_t
+span (size_t n)
+{
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  return ((n + page - 1) / page) * page;
+}
+
+/* Compress cluster c of r into buf (a cluster long) for writing back
+ * OUTPUT (return value): the bytes of the slot it takes, 0 when it is all
+ * zeros and clen (r, c) when it does not compress (the cluster is written
+ * from memory then)
+ */
+static size_t
+pack (struct paged *r, size_t c, char *buf)
+{
+  size_t len = clen (r, c), page = (size_t) sysconf (_SC_PAGESIZE), k, n;
+  const uint64_t *w = (const uint64_t *) (r->addr + c * r->cluster);
+
+  for (k = 0; k < len / sizeof (uint64_t) && w[k] == 0; ++k);
+  if (k == len / sizeof (uint64_t))
+    n = 0;
+  else
+    {
+      n = len > page ? exm_lz_compress (w, len, buf, len - page) : 0;
+      if (n == 0)
+        n = len;
+    }
+  exm_stats_count (EXM_STAT_COMPRESS_RAW, len);
+  exm_stats_count (EXM_STAT_COMPRESS_STORED, span (n));
+  return n;
+}
+
+/* Decompress cluster c of r from buf into dst */
+static void
+unpack (struct paged *r, size_t c, const char *buf, char *dst)
+{
+  size_t len = clen (r, c);
+  uint64_t t = exm_clock ();
+  if (exm_lz_decompress (buf, r->stored[c], dst, len) != (ssize_t) len)
+    {
+      syslog (LOG_CRIT, "exm pager corrupt compressed cluster\n");
+      memset (dst, 0, len);
+    }
+  exm_stats_count (EXM_STAT_DECOMPRESS, 1);
+  exm_stats_count (EXM_STAT_DECOMPRESS_NS, exm_clock () - t);
+}
+
+/* Record that cluster c of r now takes n bytes of its slot, releasing the
+ * file blocks it used beyond them
+ */
+static void
+record (struct paged *r, size_t c, size_t n)
+{
+  size_t was = r->state[c] & ONFILE ? span (r->stored[c]) : 0;
+  if (was > span (n))
+    fallocate (r->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+               (off_t) (c * r->cluster + span (n)), (off_t) (was - span (n)));
+  r->stored[c] = (uint32_t) n;
+}
+
+/* Drop the clusters picked by evict, writing back the dirty ones first */
+static void
+flush (struct paged **r, size_t *c, int n)
+{
+  struct xfer x[BATCH];
+  size_t size[BATCH];
+  int k, w = 0;
+  for (k = 0; k < n; ++k)
+    if (r[k]->state[c[k]] & DIRTY)
+      {
+        x[w].write = 1;
+        x[w].fd = r[k]->fd;
+        x[w].buf = r[k]->addr + c[k] * r[k]->cluster;
+        x[w].len = size[k] = clen (r[k], c[k]);
+        x[w].off = (off_t) (c[k] * r[k]->cluster);
+        if (r[k]->compress)
+          {
+            size[k] = pack (r[k], c[k], packed + w * cluster);
+            if (size[k] < x[w].len)
+              {
+                x[w].buf = packed + w * cluster;
+                x[w].len = span (size[k]);
+              }
+          }
+        if (x[w].len > 0)
+          w++;
+      }
+  if (transfer (x, w) < 0)
+    syslog (LOG_CRIT, "exm pager write back failure\n");
+  for (k = 0; k < n; ++k)
+    {
+      if (r[k]->state[c[k]] & DIRTY)
+        {
+          paged_out += span (size[k]);
+          if (r[k]->compress)
+            record (r[k], c[k], size[k]);
+          r[k]->state[c[k]] |= ONFILE;
+        }
+      r[k]->state[c[k]] &= ~(DIRTY | RESIDENT);
+      madvise (r[k]->addr + c[k] * r[k]->cluster, clen (r[k], c[k]),
+               MADV_DONTNEED);
+    }
+}
+
+/* Sweep the CLOCK hand until need more bytes fit in the budget. The caller
+ * holds pager_lock.
+ */
+static void
+evict (size_t need)
+{
+  struct paged *r, *pick[BATCH];
+  size_t c, at[BATCH], steps = 0, total = 0;
+  size_t budget = __atomic_load_n (&exm_pager_budget, __ATOMIC_RELAXED);
+  unsigned char *s;
+  int n = 0;
+
+  for (r = regions; r; r = r->next)
+    total += r->n;
+/* Two full turns clear every referenced bit and evict the rest */
+  while (resident + need > budget && steps++ < 2 * total + 1)
+    {
+      if (!hand_region)
+        {
+          hand_region = regions;
+          hand = 0;
+        }
+      r = hand_region;
+      c = hand;
+      if (++hand >= r->n)
+        {
+          hand_region = r->next;
+          hand = 0;
+        }
+      s = &r->state[c];
+      if (!(*s & RESIDENT))
+        continue;
+      if (*s & REFERENCED)
+        {
+          *s &= ~REFERENCED;
+          if (*s & DIRTY)
+            protect (r, c, 1);
+          continue;
+        }
+      if (*s & DIRTY)
+        protect (r, c, 1);
+      resident -= clen (r, c);
+      pick[n] = r;
+      at[n] = c;
+      if (++n == BATCH)
+        {
+          flush (pick, at, n);
+          n = 0;
+        }
+    }
+  flush (pick, at, n);
+}
+
+/* Serve a missing page in cluster c of r, with readahead. The caller holds
+ * pager_lock.
+ */
+static void
+fill (struct paged *r, size_t c, int write)
+{
+  struct xfer x[BATCH];
+  struct uffdio_copy cp;
+  size_t k, n, len, s, bytes = 0, max;
+  size_t budget = __atomic_load_n (&exm_pager_budget, __ATOMIC_RELAXED);
+  int w = 0, e;
+
+  max = exm_pager_ra < RA_MAX ? exm_pager_ra : RA_MAX;
+  if (r->advice == MADV_RANDOM)
+    r->ra = 0;
+  else if (c > 0 && c == r->expect)
+    r->ra = r->ra == 0 ? 1 : (2 * r->ra < max ? 2 * r->ra : max);
+  else
+    r->ra = 0;
+/* Read ahead up to the next resident cluster, within half the budget */
+  for (n = 1; n <= r->ra && c + n < r->n
+       && !(r->state[c + n] & RESIDENT)
+       && (n + 1) * r->cluster <= budget / 2; ++n);
+  for (k = 0; k < n; ++k)
+    bytes += clen (r, c + k);
+  evict (bytes);
+  for (k = 0; k < n; ++k)
+    {
+      len = s = clen (r, c + k);
+      if (r->compress && (r->state[c + k] & ONFILE))
+        s = r->stored[c + k];
+      if ((r->state[c + k] & ONFILE) && s > 0)
+        {
+          x[w].write = 0;
+          x[w].fd = r->fd;
+          x[w].buf = s < len ? packed + k * cluster : bounce + k * cluster;
+          x[w].len = span (s);
+          x[w].off = (off_t) ((c + k) * r->cluster);
+          paged_in += x[w].len;
+          w++;
+        }
+      else
+        memset (bounce + k * cluster, 0, len);
+    }
+  if (transfer (x, w) < 0)
+    syslog (LOG_CRIT, "exm pager read failure\n");
+  if (r->compress)
+    for (k = 0; k < n; ++k)
+      if ((r->state[c + k] & ONFILE) && r->stored[c + k] > 0
+          && r->stored[c + k] < clen (r, c + k))
+        unpack (r, c + k, packed + k * cluster, bounce + k * cluster);
+/* Readahead first: the copy into the faulting cluster wakes the faulting
+ * thread
+ */
+  for (k = n; k-- > 0;)
+    {
+      cp.dst = (uintptr_t) (r->addr + (c + k) * r->cluster);
+      cp.src = (uintptr_t) (bounce + k * cluster);
+      cp.len = clen (r, c + k);
+      cp.mode = k == 0 && write ? 0 : UFFDIO_COPY_MODE_WP;
+      cp.copy = 0;
+      if (ioctl (uffd, UFFDIO_COPY, &cp) < 0)
+        {
+/* EEXIST: the pages are there already (but nobody was woken) */
+          e = errno;
+          if (k == 0)
+            wake (cp.dst);
+          if (e != EEXIST)
+            continue;
+        }
+      r->state[c + k] |= RESIDENT | REFERENCED;
+      if (k == 0 && write)
+        r->state[c] |= DIRTY;
+      resident += cp.len;
+    }
+  r->expect = c + n;
+}
+
+/* Serve one fault at addr. The caller holds pager_lock. */
+static void
+serve (uintptr_t addr, uint64_t flags)
+{
+  struct paged *r;
+  size_t c;
+  for (r = regions; r; r = r->next)
+    if (addr >= (uintptr_t) r->addr && addr < (uintptr_t) r->addr + r->length)
+      break;
+/* A freed or settled allocation: let the access retry on whatever is there */
+  if (!r)
+    {
+      wake (addr);
+      return;
+    }
+  c = (addr - (uintptr_t) r->addr) / r->cluster;
+  if (flags & UFFD_PAGEFAULT_FLAG_WP)
+    {
+      if (r->state[c] & RESIDENT)
+        {
+          r->state[c] |= DIRTY | REFERENCED;
+          protect (r, c, 0);
+        }
+      else
+        wake (addr);
+    }
+  else if (r->state[c] & RESIDENT)
+    wake (addr);
+  else
+    fill (r, c, (flags & UFFD_PAGEFAULT_FLAG_WRITE) != 0);
+}
+
+static void *
+pager_thread (void *arg __attribute__ ((unused)))
+{
+  struct uffd_msg msg[16];
+  struct pollfd p;
+  ssize_t k;
+  int i;
+  for (;;)
+    {
+      p.fd = uffd;
+      p.events = POLLIN;
+      p.revents = 0;
+      if (poll (&p, 1, -1) < 0 && errno != EINTR)
+        break;
+      pthread_mutex_lock (&pager_lock);
+      k = syscall (SYS_read, uffd, msg, sizeof (msg));
+      for (i = 0; i < k / (ssize_t) sizeof (msg[0]); ++i)
+        if (msg[i].event == UFFD_EVENT_PAGEFAULT)
+          serve ((uintptr_t) msg[i].arg.pagefault.address,
+                 msg[i].arg.pagefault.flags);
+      pthread_mutex_unlock (&pager_lock);
+    }
+  return NULL;
+}
+
+/* Open the userfaultfd, the io_uring and start the pager thread if it is
+ * not running. The caller holds pager_lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+start (void)
+{
+  struct uffdio_api api;
+  pthread_attr_t a;
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+
+  if (running)
+    return 0;
+  if (broken)
+    return -1;
+  if (!bounce)
+    {
+      cluster = ((exm_pager_cluster + page - 1) / page) * page;
+      if (cluster == 0)
+        cluster = page;
+      bounce = (char *) mmap (NULL, BATCH * cluster, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (bounce == MAP_FAILED)
+        {
+          bounce = NULL;
+          return -1;
+        }
+    }
+/* Not UFFD_USER_MODE_ONLY: system calls like read() into paged memory fault
+ * in the kernel and must be served too.
+ */
+  uffd = (int) syscall (SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  memset (&api, 0, sizeof (api));
+  api.api = UFFD_API;
+  api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+  if (uffd < 0 || ioctl (uffd, UFFDIO_API, &api) < 0
+      || !(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP))
+    {
+      syslog (LOG_CRIT, "exm pager needs userfaultfd with write protection, "
+              "using file mappings\n");
+      if (uffd >= 0)
+        close (uffd);
+      uffd = -1;
+      broken = 1;
+      return -1;
+    }
+  if (ring.fd < 0)
+    ring_init ();
+  pthread_attr_init (&a);
+  pthread_attr_setdetachstate (&a, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&thread, &a, pager_thread, NULL) != 0)
+    {
+      pthread_attr_destroy (&a);
+      syslog (LOG_CRIT, "exm unable to start pager thread\n");
+      close (uffd);
+      uffd = -1;
+      return -1;
+    }
+  pthread_attr_destroy (&a);
+  running = 1;
+  return 0;
+}
+
+/* Forget r: unlink it from the list and release its state. The caller holds
+ * pager_lock.
+ */
+static void
+drop (struct paged *r)
+{
+  size_t c;
+  for (c = 0; c < r->n; ++c)
+    if (r->state[c] & RESIDENT)
+      resident -= clen (r, c);
+  if (hand_region == r)
+    {
+      hand_region = r->next;
+      hand = 0;
+    }
+  if (r->prev)
+    r->prev->next = r->next;
+  else
+    regions = r->next;
+  if (r->next)
+    r->next->prev = r->prev;
+  close (r->fd);
+  exm_map_free (r->stored);
+  exm_map_free (r->state);
+  exm_map_free (r);
+}
+
+/* Write the clusters of r that are resident or compressed on file into fd
+ * (r's own file or a copy of it) uncompressed, leaving the resident ones
+ * resident, and protected when fd is r's file. The caller holds pager_lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+expand (struct paged *r, int fd)
+{
+  struct xfer x;
+  size_t c, s;
+  int j = 0;
+  for (c = 0; c < r->n; ++c)
+    {
+      x.fd = r->fd;
+      x.off = (off_t) (c * r->cluster);
+      s = r->stored[c];
+      if (r->state[c] & RESIDENT)
+        {
+          if (fd == r->fd)
+            protect (r, c, 1);
+          x.buf = r->addr + c * r->cluster;
+        }
+      else if ((r->state[c] & ONFILE) && s > 0 && s < clen (r, c))
+        {
+          x.write = 0;
+          x.buf = packed;
+          x.len = span (s);
+          if (sync_xfer (&x) < 0)
+            {
+              j = -1;
+              continue;
+            }
+          unpack (r, c, packed, bounce);
+          x.buf = bounce;
+        }
+      else
+        continue;               /* Zeros (a hole) or uncompressed already */
+      x.write = 1;
+      x.fd = fd;
+      x.len = clen (r, c);
+      if (sync_xfer (&x) < 0)
+        j = -1;
+      else if (fd == r->fd)
+        {
+          paged_out += x.len;
+          record (r, c, x.len);
+          r->state[c] = (r->state[c] & ~DIRTY) | ONFILE;
+        }
+    }
+  return j;
+}
+
+/* Write back the dirty clusters of r, leaving them resident and protected.
+ * The caller holds pager_lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+writeback (struct paged *r)
+{
+  struct xfer x[BATCH];
+  size_t c, picked[BATCH];
+  int n = 0, k, j = 0;
+  if (r->compress)
+    return expand (r, r->fd);
+  for (c = 0; c <= r->n; ++c)
+    {
+      if (n == BATCH || (c == r->n && n > 0))
+        {
+          if (transfer (x, n) < 0)
+            j = -1;
+          for (k = 0; k < n; ++k)
+            {
+              r->state[picked[k]] = (r->state[picked[k]] & ~DIRTY) | ONFILE;
+              paged_out += x[k].len;
+            }
+          n = 0;
+        }
+      if (c == r->n || !(r->state[c] & DIRTY))
+        continue;
+      protect (r, c, 1);
+      x[n].write = 1;
+      x[n].fd = r->fd;
+      x[n].buf = r->addr + c * r->cluster;
+      x[n].len = clen (r, c);
+      x[n].off = (off_t) (c * r->cluster);
+      picked[n++] = c;
+    }
+  return j;
+}
+
+/* Create a paged allocation of length bytes for m, compressed on file when
+ * compress is set. The caller holds the lock and has set m->tier and
+ * m->advice.
+ * OUTPUT (return value): 0 on success, -1 on error (nothing left behind, the
+ * caller may fall back to a file mapping)
+ */
+int
+exm_pager_new (struct map *m, size_t length, int compress)
+{
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  struct uffdio_register reg;
+  struct paged *r;
+  int fd, made = 0;
+
+  pthread_mutex_lock (&pager_lock);
+  if (start () < 0)
+    {
+      pthread_mutex_unlock (&pager_lock);
+      return -1;
+    }
+  r = (struct paged *) exm_map_alloc (sizeof (struct paged));
+  if (!r)
+    goto fail;
+  memset (r, 0, sizeof (struct paged));
+  r->length = ((length + page - 1) / page) * page;
+/* Random access gains nothing from reading more than the faulting page,
+ * unless the page alone would not compress much
+ */
+  r->cluster = m->advice == MADV_RANDOM && !compress ? page : cluster;
+  r->n = (r->length + r->cluster - 1) / r->cluster;
+  r->advice = m->advice;
+  r->fd = -1;
+  r->addr = MAP_FAILED;
+  r->state = (unsigned char *) exm_map_alloc (r->n);
+  if (!r->state)
+    goto fail;
+  memset (r->state, 0, r->n);
+  if (compress)
+    {
+      r->compress = 1;
+      r->stored = (uint32_t *) exm_map_alloc (r->n * sizeof (uint32_t));
+      if (!r->stored)
+        goto fail;
+      memset (r->stored, 0, r->n * sizeof (uint32_t));
+      if (!packed)
+        packed = (char *) mmap (NULL, BATCH * cluster, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (packed == MAP_FAILED)
+        {
+          packed = NULL;
+          goto fail;
+        }
+    }
+  fd = exm_mkstemp (m, length, m->tier);
+  if (fd < 0)
+    goto fail;
+  made = 1;
+/* Whole pages on file, for O_DIRECT */
+  if (ftruncate (fd, (off_t) r->length) == 0)
+    r->fd = open (m->path, O_RDWR | O_DIRECT);
+  if (r->fd < 0)
+    r->fd = fd;
+  else
+    close (fd);
+  r->addr = (char *) mmap (NULL, r->length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                           0);
+  if (r->addr == MAP_FAILED)
+    goto fail;
+  reg.range.start = (uintptr_t) r->addr;
+  reg.range.len = r->length;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+  if (ioctl (uffd, UFFDIO_REGISTER, &reg) < 0)
+    goto fail;
+  r->next = regions;
+  if (regions)
+    regions->prev = r;
+  regions = r;
+  pthread_mutex_unlock (&pager_lock);
+  m->kind = EXM_PAGED;
+  m->paged = r;
+  m->length = length;
+  m->addr = r->addr;
+  return 0;
+
+fail:
+  pthread_mutex_unlock (&pager_lock);
+  if (r)
+    {
+      if (r->addr != MAP_FAILED)
+        munmap (r->addr, r->length);
+      if (r->fd >= 0)
+        close (r->fd);
+      exm_map_free (r->stored);
+      exm_map_free (r->state);
+      exm_map_free (r);
+    }
+  if (made)
+    {
+      unlink (m->path);
+      exm_tier_release (m->tier, length);
+    }
+  m->path[0] = 0;
+  return -1;
+}
+
+/* Stop paging m before it is unmapped */
+void
+exm_pager_stop (struct map *m)
+{
+  struct uffdio_range range;
+  struct paged *r = m->paged;
+  if (m->kind != EXM_PAGED || !r)
+    return;
+  pthread_mutex_lock (&pager_lock);
+  range.start = (uintptr_t) r->addr;
+  range.len = r->length;
+  ioctl (uffd, UFFDIO_UNREGISTER, &range);
+  drop (r);
+  pthread_mutex_unlock (&pager_lock);
+  m->paged = NULL;
+}
+
+/* Turn the paged allocation m into an ordinary file-backed one in place.
+ * The caller holds the lock.
+ * OUTPUT (return value): 0 on success, -1 on error (m still paged)
+ */
+int
+exm_pager_settle (struct map *m)
+{
+  struct paged *r = m->paged;
+  void *p = MAP_FAILED;
+  int fd;
+
+  pthread_mutex_lock (&pager_lock);
+  if (writeback (r) == 0 && (fd = open (m->path, O_RDWR)) >= 0)
+    {
+/* Faults blocked on the old mapping are woken by the pager and retry on
+ * this one.
+ */
+      p = mmap (r->addr, m->length, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+      close (fd);
+    }
+  if (p == MAP_FAILED)
+    {
+      pthread_mutex_unlock (&pager_lock);
+      return -1;
+    }
+  drop (r);
+  pthread_mutex_unlock (&pager_lock);
+  madvise (p, m->length, m->advice);
+  m->paged = NULL;
+  m->kind = EXM_FILE;
+  return 0;
+}
+
+/* Before fork, with the lock held: keep the pager's state still */
+void
+exm_pager_prepare (void)
+{
+  pthread_mutex_lock (&pager_lock);
+}
+
+void
+exm_pager_parent (void)
+{
+  pthread_mutex_unlock (&pager_lock);
+}
+
+/* In a forked child: there is no pager thread and the userfaultfd does not
+ * cover the child's memory; paged allocations are settled by exm_pager_fork.
+ */
+void
+exm_pager_child (void)
+{
+  pthread_mutex_init (&pager_lock, NULL);
+  if (uffd >= 0)
+    close (uffd);
+  uffd = -1;
+  ring_close ();
+  running = 0;
+}
+
+/* In a forked child, turn the inherited paged allocation m into a file-backed
+ * one of the child's: a copy of the backing file with the resident clusters,
+ * which hold the child's copy of the data, written over it. The caller holds
+ * the lock.
+ */
+void
+exm_pager_fork (struct map *m)
+{
+  char from[EXM_MAX_PATH_LEN];
+  struct paged *r = m->paged;
+  struct xfer x;
+  int src, fd;
+  size_t c;
+  void *p = MAP_FAILED;
+
+  snprintf (from, sizeof (from), "%s", m->path);
+  src = open (from, O_RDONLY);
+  fd = src < 0 ? -1 : exm_mkstemp (m, m->length, m->tier);
+  if (fd >= 0)
+    {
+      sendfile_loop (fd, src, m->length);
+      if (r->compress && expand (r, fd) == 0)
+        ftruncate (fd, (off_t) m->length);
+      for (c = 0; c < r->n && !r->compress; ++c)
+        if (r->state[c] & RESIDENT)
+          {
+            x.write = 1;
+            x.fd = fd;
+            x.buf = r->addr + c * r->cluster;
+            x.len = clen (r, c);
+            x.off = (off_t) (c * r->cluster);
+            if (x.off + x.len > m->length)
+              x.len = m->length - x.off;
+            sync_xfer (&x);
+          }
+      p = mmap (r->addr, m->length, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+      close (fd);
+    }
+  if (src >= 0)
+    close (src);
+  if (p == MAP_FAILED)
+    {
+/* Keep what is resident as anonymous memory */
+      syslog (LOG_CRIT, "warning: child unable to copy paged address %p",
+              m->addr);
+      if (fd >= 0)
+        {
+          unlink (m->path);
+          exm_tier_release (m->tier, m->length);
+        }
+      m->path[0] = 0;
+      m->kind = EXM_ANON;
+    }
+  else
+    {
+      madvise (p, m->length, m->advice);
+      m->kind = EXM_FILE;
+    }
+  drop (r);
+  m->paged = NULL;
+  m->pid = getpid ();
+}
+
+/* API: Set/get pager mode and its RAM budget
+ * INPUT j: negative to query, zero to turn pager mode off, otherwise the
+ *          most RAM in bytes paged allocations may use
+ * OUTPUT (return value): the budget in effect, 0 when pager mode is off
+ * Existing allocations stay paged (or not), a new budget applies to them
+ * from the next fault.
+ */
+size_t
+exm_pager (ssize_t j)
+{
+  exm_lock ();
+  if (j > 0)
+    __atomic_store_n (&exm_pager_budget, (size_t) j, __ATOMIC_RELAXED);
+  if (j >= 0)
+    exm_pager_mode = j > 0;
+  j = exm_pager_mode ? (ssize_t) exm_pager_budget : 0;
+  exm_unlock ();
+  return (size_t) j;
+}
+
+/* API: Pager activity
+ * OUTPUT in: bytes read from backing files by the pager (if not NULL)
+ *        out: bytes written back (if not NULL)
+ *        (return value): bytes of paged allocations resident in memory
+ */
+size_t
+exm_pager_info (size_t * in, size_t * out)
+{
+  size_t r;
+  pthread_mutex_lock (&pager_lock);
+  if (in)
+    *in = paged_in;
+  if (out)
+    *out = paged_out;
+  r = resident;
+  pthread_mutex_unlock (&pager_lock);
+  return r;
+}
@@ -0,0 +1,313 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define uthash_malloc(sz) exm_map_alloc(sz)
+#define uthash_free(ptr, sz) exm_map_free(ptr)
+#include "uthash.h"
+#include "exm.h"
+#include "trace.h"
+
+/* Persistent allocations
+ *
+ * Backing files normally live only as long as their allocations. exm_persist
+ * gives an allocation's backing file a stable name instead and keeps it when
+ * the allocation is freed or the program exits, so a later run can map it
+ * back with exm_attach rather than rebuilding the data:
+ *
+ *   x = exm_malloc (size, 0);  ... build ...  exm_persist (x, "index");
+ *   (next run)  x = exm_attach ("index");
+ *
+ * A plain name lives in the allocation's tier directory (exm_attach searches
+ * the tier directories in order), a name with a slash is a path. The data
+ * file is the backing file itself, renamed (so it must stay on the same file
+ * system); a small header file next to it, named with a .exm suffix, records
+ * the data size and the address it was mapped at, with a checksum of both.
+ * exm_attach maps the data file back shared, at the same address when that
+ * is free, in constant time and without reading the data. Tier directories
+ * may be shared, so both files must be ours, writable only by us, and are
+ * never followed through symbolic links.
+ *
+ * Persistent maps are never unlinked by exm (see exm_unlink). Changes through
+ * the mapping go to the file; realloc keeps the header up to date.
+ * exm_persist (addr, NULL) makes the allocation temporary again.
+ */
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define EXM_PERSIST_MAGIC "EXMPERS1"
+
+struct header
+{
+  char magic[8];
+  uint64_t length;              /* Data file size */
+  uint64_t addr;                /* Preferred address */
+  uint64_t check;               /* FNV-1a of the fields above */
+};
+
+static uint64_t
+checksum (const struct header *h)
+{
+  const unsigned char *p = (const unsigned char *) h;
+  uint64_t x = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < offsetof (struct header, check); ++i)
+    x = (x ^ p[i]) * 1099511628211ULL;
+  return x;
+}
+
+/* Is the open file fd a regular file of ours that no one else may write?
+ * Tier directories are often shared, like /tmp.
+ */
+static int
+owned (int fd)
+{
+  struct stat st;
+  return fstat (fd, &st) == 0 && S_ISREG (st.st_mode)
+    && st.st_uid == getuid () && !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/* Write the header of the persistent map m next to its data file
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+write_header (struct map *m)
+{
+  char path[EXM_MAX_PATH_LEN];
+  struct header h;
+  int fd, j;
+  j = snprintf (path, sizeof (path), "%s.exm", m->path);
+  if (j < 0 || (size_t) j >= sizeof (path))
+    return -1;
+  memset (&h, 0, sizeof (h));
+  memcpy (h.magic, EXM_PERSIST_MAGIC, 8);
+  h.length = m->length;
+  h.addr = (uint64_t) (uintptr_t) m->addr;
+  h.check = checksum (&h);
+  fd = open (path, O_WRONLY | O_CREAT | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return -1;
+  if (!owned (fd) || ftruncate (fd, 0) < 0)
+    {
+      close (fd);
+      errno = EACCES;
+      return -1;
+    }
+  j = write (fd, &h, sizeof (h)) == sizeof (h) ? 0 : -1;
+  close (fd);
+  return j;
+}
+
+/* Path of the file named name: in tier directory tier for a plain name,
+ * name itself when it has a slash. Leaves room for a 4-character suffix.
+ * OUTPUT (return value): 0 on success, -1 if the path is too long
+ */
+int
+exm_name_path (char *path, const char *name, int tier)
+{
+  int n;
+  if (strchr (name, '/') || tier < 0 || tier >= exm_ntiers)
+    n = snprintf (path, EXM_MAX_PATH_LEN - 4, "%s", name);
+  else
+    n = snprintf (path, EXM_MAX_PATH_LEN - 4, "%s/%s",
+                  exm_tiers[tier].path, name);
+  return n < EXM_MAX_PATH_LEN - 4 ? 0 : -1;
+}
+
+/* Bring the header of a persistent map up to date after it was resized or
+ * moved. The caller holds the lock.
+ */
+void
+exm_persist_update (struct map *m)
+{
+  if (m->persist)
+    write_header (m);
+}
+
+/* API: Keep an allocation's data under a name across runs
+ * INPUT addr: exm allocation address
+ *       name: name to keep it under (see above), or NULL to make the
+ *             allocation temporary again
+ * OUTPUT (return value): 0 on success, -1 on error (errno EINVAL when addr
+ *        is not a file-backed, unstriped allocation of this process, or
+ *        EXDEV when name is on another file system than the backing file)
+ */
+int
+exm_persist (void *addr, const char *name)
+{
+  char path[EXM_MAX_PATH_LEN];
+  struct map *m;
+  int j = -1;
+
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (m && m->kind == EXM_LAZY && m->pid == getpid ())
+    exm_lazy_settle (m);
+  if (m && m->kind == EXM_PAGED && m->pid == getpid ())
+    exm_pager_settle (m);
+  if (!m || m->pid != getpid () || m->kind != EXM_FILE || m->nstripes > 0
+      || m->shared || m->mapped || (name && !name[0]))
+    {
+      errno = EINVAL;
+      goto done;
+    }
+  if (m->persist)
+    {
+      snprintf (path, sizeof (path), "%s.exm", m->path);
+      unlink (path);
+      m->persist = 0;
+    }
+  if (!name)
+    {
+      j = 0;
+      goto done;
+    }
+  if (exm_name_path (path, name, m->tier) < 0)
+    {
+      errno = ENAMETOOLONG;
+      goto done;
+    }
+  if (strcmp (path, m->path) != 0 && rename (m->path, path) < 0)
+    goto done;
+  strcpy (m->path, path);
+  m->persist = 1;
+  j = write_header (m);
+done:
+  exm_unlock ();
+  return j;
+}
+
+/* API: Map a persistent allocation back
+ * INPUT name: name given to exm_persist
+ * OUTPUT (return value): address of the allocation, the one it had when
+ *        persisted if that is free, or NULL on error (errno ENOENT when no
+ *        valid header is found, EACCES when the header or data file is not
+ *        ours or others may write it, EIO when the data does not match it)
+ * The result is an ordinary exm allocation that stays persistent; free
+ * unmaps it and keeps the files.
+ */
+void *
+exm_attach (const char *name)
+{
+  char path[EXM_MAX_PATH_LEN];
+  struct header h;
+  struct stat st;
+  struct map *m, *y;
+  void *p = NULL;
+  size_t n = 0;
+  int fd, i, tier = -1;
+
+  if (!exm_ready ())
+    {
+      errno = EAGAIN;
+      return NULL;
+    }
+  if (!name || !name[0])
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  exm_lock ();
+  fd = -1;
+  for (i = strchr (name, '/') ? -1 : 0; i < exm_ntiers && fd < 0; ++i)
+    {
+      if (exm_name_path (path, name, i) < 0)
+        break;
+      strcat (path, ".exm");
+      fd = open (path, O_RDONLY | O_NOFOLLOW);
+      tier = i;
+      if (i < 0)
+        break;
+    }
+  if (fd < 0)
+    {
+      errno = ENOENT;
+      goto done;
+    }
+  if (!owned (fd))
+    {
+      close (fd);
+      errno = EACCES;
+      goto done;
+    }
+  i = read (fd, &h, sizeof (h)) == sizeof (h);
+  close (fd);
+  if (!i || memcmp (h.magic, EXM_PERSIST_MAGIC, 8) != 0
+      || h.check != checksum (&h) || h.length == 0)
+    {
+      errno = ENOENT;
+      goto done;
+    }
+  path[strlen (path) - 4] = 0;
+  fd = open (path, O_RDWR | O_NOFOLLOW);
+  if (fd < 0)
+    goto done;
+  if (!owned (fd))
+    {
+      close (fd);
+      errno = EACCES;
+      goto done;
+    }
+  if (fstat (fd, &st) < 0 || (uint64_t) st.st_size != h.length)
+    {
+      close (fd);
+      errno = EIO;
+      goto done;
+    }
+  m = newmap ();
+  if (!m)
+    {
+      close (fd);
+      goto done;
+    }
+  strcpy (m->path, path);
+  m->length = h.length;
+  m->pid = getpid ();
+  m->tier = tier;
+  m->kind = EXM_FILE;
+  m->persist = 1;
+  m->advice = EXM_DEFAULT_ADVISE;
+  m->addr = mmap ((void *) (uintptr_t) h.addr, m->length,
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+                  fd, 0);
+  if (m->addr == MAP_FAILED)
+    m->addr = mmap (NULL, m->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                    0);
+  close (fd);
+  HASH_FIND_PTR (flexmap, &m->addr, y);
+  if (m->addr == MAP_FAILED || y)
+    {
+      if (m->addr != MAP_FAILED)
+        munmap (m->addr, m->length);
+      freemap (m);
+      goto done;
+    }
+  madvise (m->addr, m->length, m->advice);
+  exm_tier_charge (m->tier, m->length);
+  HASH_ADD_INORDER (hh, flexmap, addr, sizeof (void *), m, addr_sort);
+  exm_map_range (m);
+  p = m->addr;
+  n = m->length;
+done:
+  exm_unlock ();
+  if (exm_trace_mode && p && n >= exm_trace_min)
+    exm_trace_event (EXM_TRACE_MALLOC, p, NULL, n, 1);
+  return p;
+}
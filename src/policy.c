@@ -0,0 +1,406 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Declarative allocation policy
+ *
+ * A policy file (EXM_POLICY, or loaded with the exm_policy API function)
+ * lists rules, one per line, each a sequence of key=value words. Blank lines
+ * and text following '#' are ignored. For example:
+ *
+ *   # 1-8 GB in tmpfs, accessed randomly
+ *   size=1G-8G      tier=/dev/shm   advice=random
+ *   # anything larger on NVMe, read sequentially, never prefaulted
+ *   size=8G-        tier=/mnt/nvme  advice=sequential prefault=off
+ *   # R's big temporaries stay on the heap
+ *   exe=R func=calloc size=100M-    backend=heap
+ *
+ * Match keys (all given keys must match, missing ones match anything):
+ * size=LO-HI   allocation size in [LO, HI), either bound may be omitted and
+ *              accepts K, M, G or T suffixes; size=LO means LO and up
+ * exe=NAME     program name (rules for other programs are dropped at load)
+ * func=LIST    comma-separated list of malloc, calloc, realloc, valloc
+ *
+ * Actions:
+ * backend=     exm (a mapping regardless of the threshold), heap (the
+ *              default allocator regardless of the threshold) or default
+ * tier=DIR     directory for the backing file, added as a pinned tier (see
+ *              tier.c) when it is not in the data path
+ * advice=      normal, random, sequential or willneed (madvise)
+ * hugepages=   on or off (MADV_HUGEPAGE, MADV_NOHUGEPAGE)
+ * prefault=    on or off (MAP_POPULATE)
+ * compress=    on or off: page the allocation, storing its evicted clusters
+ *              compressed (see pager.c)
+ * cow=         fork mode of the allocation: shared, cow or duplicate (or 0,
+ *              1, 2 as with exm_cow)
+ *
+ * The first matching rule applies. Rules only affect new allocations.
+ *
+ * Loading uses only read(2) into a static buffer and static rule tables, it
+ * never allocates memory, so it is safe at initialization and from within
+ * the interposed functions. Rules are matched without the lock: a reload
+ * bumps a sequence counter around its update and readers retry when the
+ * counter changed under them.
+ */
+
+#define EXM_MAX_RULES 64
+#define EXM_POLICY_MAX 65536    /* largest policy file */
+
+struct rule
+{
+  size_t lo, hi;                /* Size range [lo, hi), hi 0 means no limit */
+  int funcs;                    /* EXM_FUNC_* mask, 0 matches any function */
+  char tier[EXM_MAX_PATH_LEN - 64];     /* Tier directory or empty */
+  struct hints h;
+};
+
+int exm_policy_active = 0;
+static struct rule rules[EXM_MAX_RULES];
+static int nrules = 0;
+static unsigned long seq = 0;
+static struct rule staged[EXM_MAX_RULES];
+static char text[EXM_POLICY_MAX];
+static char policy_path[EXM_MAX_PATH_LEN] = "";
+
+void
+exm_hints_init (struct hints *h)
+{
+  h->backend = EXM_BACKEND_DEFAULT;
+  h->tier = -1;
+  h->advice = -1;
+  h->hugepages = -1;
+  h->prefault = -1;
+  h->compress = -1;
+  h->cow = EXM_COW_UNSET;
+}
+
+/* Find the first rule matching an allocation of size bytes by func (one of
+ * EXM_FUNC_*), copying its hints to h.
+ * OUTPUT (return value): 1 when a rule matched, 0 otherwise
+ */
+int
+exm_policy_match (size_t size, int func, struct hints *h)
+{
+  unsigned long s;
+  int i, n, found;
+  do
+    {
+      s = __atomic_load_n (&seq, __ATOMIC_ACQUIRE);
+      found = 0;
+      n = __atomic_load_n (&nrules, __ATOMIC_RELAXED);
+      for (i = 0; i < n && i < EXM_MAX_RULES; ++i)
+        {
+          struct rule *r = &rules[i];
+          if (size >= r->lo && (r->hi == 0 || size < r->hi)
+              && (r->funcs == 0 || (r->funcs & func)))
+            {
+              *h = r->h;
+              found = 1;
+              break;
+            }
+        }
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while ((s & 1) || s != __atomic_load_n (&seq, __ATOMIC_RELAXED));
+  return found;
+}
+
+/* Is v (of length n) the word w? */
+static int
+word (const char *v, size_t n, const char *w)
+{
+  return strlen (w) == n && strncmp (v, w, n) == 0;
+}
+
+static int
+on_off (const char *v, size_t n)
+{
+  if (word (v, n, "on") || word (v, n, "1") || word (v, n, "yes"))
+    return 1;
+  if (word (v, n, "off") || word (v, n, "0") || word (v, n, "no"))
+    return 0;
+  return -2;
+}
+
+/* Parse one key=value word into rule r.
+ * OUTPUT (return value): 0 on success, -1 on error, 1 when the rule does not
+ * apply to this program
+ */
+static int
+parse_word (struct rule *r, const char *k, size_t kn, const char *v,
+            size_t vn)
+{
+  const char *dash, *c, *e;
+  int j;
+
+  if (word (k, kn, "size"))
+    {
+      dash = memchr (v, '-', vn);
+      if (!dash)
+        {
+          r->lo = exm_parse_size (v, v + vn);
+          return 0;
+        }
+      r->lo = dash > v ? exm_parse_size (v, dash) : 0;
+      r->hi = dash + 1 < v + vn ? exm_parse_size (dash + 1, v + vn) : 0;
+      return 0;
+    }
+  if (word (k, kn, "exe"))
+    return word (v, vn, program_invocation_short_name) ? 0 : 1;
+  if (word (k, kn, "func"))
+    {
+      for (c = v; c < v + vn; c = e + 1)
+        {
+          e = memchr (c, ',', v + vn - c);
+          if (!e)
+            e = v + vn;
+          if (word (c, e - c, "malloc"))
+            r->funcs |= EXM_FUNC_MALLOC;
+          else if (word (c, e - c, "calloc"))
+            r->funcs |= EXM_FUNC_CALLOC;
+          else if (word (c, e - c, "realloc"))
+            r->funcs |= EXM_FUNC_REALLOC;
+          else if (word (c, e - c, "valloc"))
+            r->funcs |= EXM_FUNC_VALLOC;
+          else
+            return -1;
+        }
+      return 0;
+    }
+  if (word (k, kn, "backend"))
+    {
+      if (word (v, vn, "exm"))
+        r->h.backend = EXM_BACKEND_EXM;
+      else if (word (v, vn, "heap"))
+        r->h.backend = EXM_BACKEND_HEAP;
+      else if (word (v, vn, "default"))
+        r->h.backend = EXM_BACKEND_DEFAULT;
+      else
+        return -1;
+      return 0;
+    }
+  if (word (k, kn, "tier"))
+    {
+      if (vn == 0 || vn >= sizeof (r->tier))
+        return -1;
+      memcpy (r->tier, v, vn);
+      r->tier[vn] = 0;
+      return 0;
+    }
+  if (word (k, kn, "advice"))
+    {
+      if (word (v, vn, "normal"))
+        r->h.advice = MADV_NORMAL;
+      else if (word (v, vn, "random"))
+        r->h.advice = MADV_RANDOM;
+      else if (word (v, vn, "sequential"))
+        r->h.advice = MADV_SEQUENTIAL;
+      else if (word (v, vn, "willneed"))
+        r->h.advice = MADV_WILLNEED;
+      else
+        return -1;
+      return 0;
+    }
+  if (word (k, kn, "hugepages"))
+    return (r->h.hugepages = on_off (v, vn)) < 0 ? -1 : 0;
+  if (word (k, kn, "prefault"))
+    return (r->h.prefault = on_off (v, vn)) < 0 ? -1 : 0;
+  if (word (k, kn, "compress"))
+    return (r->h.compress = on_off (v, vn)) < 0 ? -1 : 0;
+  if (word (k, kn, "cow"))
+    {
+      j = -1;
+      if (word (v, vn, "shared") || word (v, vn, "0"))
+        j = 0;
+      else if (word (v, vn, "cow") || word (v, vn, "1"))
+        j = 1;
+      else if (word (v, vn, "duplicate") || word (v, vn, "2"))
+        j = 2;
+      if (j < 0)
+        return -1;
+      r->h.cow = j;
+      return 0;
+    }
+  return -1;
+}
+
+/* Parse text (n bytes) into staged.
+ * OUTPUT (return value): number of rules or -1 on error
+ */
+static int
+parse (char *t, size_t n)
+{
+  char *p = t, *end = t + n, *eol, *w, *we, *eq;
+  int line = 0, nr = 0, j;
+  struct rule *r;
+
+  while (p < end)
+    {
+      line++;
+      eol = memchr (p, '\n', end - p);
+      if (!eol)
+        eol = end;
+      w = memchr (p, '#', eol - p);
+      if (w)
+        *w = 0;
+      else
+        *eol = 0;
+      if (nr == EXM_MAX_RULES)
+        {
+          syslog (LOG_CRIT, "exm policy: more than %d rules\n", EXM_MAX_RULES);
+          return -1;
+        }
+      r = &staged[nr];
+      memset (r, 0, sizeof (struct rule));
+      exm_hints_init (&r->h);
+      j = 0;
+      w = p;
+      while (j == 0 && *w)
+        {
+          w += strspn (w, " \t\r");
+          if (!*w)
+            break;
+          we = w + strcspn (w, " \t\r");
+          eq = memchr (w, '=', we - w);
+          if (!eq)
+            j = -1;
+          else
+            j = parse_word (r, w, eq - w, eq + 1, we - eq - 1);
+          w = we;
+        }
+      if (j < 0)
+        {
+          syslog (LOG_CRIT, "exm policy: syntax error on line %d\n", line);
+          return -1;
+        }
+/* Keep rules for this program that say something */
+      if (j == 0 && w > p + strspn (p, " \t\r"))
+        nr++;
+      p = eol + 1;
+    }
+  return nr;
+}
+
+/* Resolve the tier directories of the rules to tier indices. Called after
+ * loading and whenever the data path changes. The caller holds the lock.
+ */
+void
+exm_policy_resolve ()
+{
+  int i;
+  __atomic_add_fetch (&seq, 1, __ATOMIC_ACQ_REL);
+  for (i = 0; i < nrules; ++i)
+    {
+      rules[i].h.tier = rules[i].tier[0] ? exm_tier_find (rules[i].tier) : -1;
+      if (rules[i].tier[0] && rules[i].h.tier < 0)
+        syslog (LOG_CRIT, "exm policy: no room for tier %s\n", rules[i].tier);
+    }
+  __atomic_add_fetch (&seq, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Load the policy file at path, replacing the rules in effect. An empty path
+ * removes all rules. The caller holds the lock.
+ * OUTPUT (return value): number of rules in effect, or -1 on error (rules
+ * unchanged)
+ */
+int
+exm_policy_load (const char *path)
+{
+  ssize_t k;
+  size_t n = 0;
+  int fd, nr = 0;
+
+  if (path && path[0])
+    {
+      fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        {
+          syslog (LOG_CRIT, "exm policy: unable to open %s\n", path);
+          return -1;
+        }
+      while ((k = read (fd, text + n, sizeof (text) - n)) > 0)
+        n += (size_t) k;
+      close (fd);
+      if (k < 0 || n == sizeof (text))
+        {
+          syslog (LOG_CRIT, "exm policy: unable to read %s\n", path);
+          return -1;
+        }
+      nr = parse (text, n);
+      if (nr < 0)
+        return -1;
+    }
+  if (path && path != policy_path)
+    snprintf (policy_path, sizeof (policy_path), "%s", path);
+  __atomic_add_fetch (&seq, 1, __ATOMIC_ACQ_REL);
+  memcpy (rules, staged, nr * sizeof (struct rule));
+  __atomic_store_n (&nrules, nr, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&seq, 1, __ATOMIC_ACQ_REL);
+  exm_policy_resolve ();
+  exm_policy_active = nr > 0;
+  return nr;
+}
+
+/* Parse a list of action words (as in a rule, without match keys) into h,
+ * resolving any tier directory. The caller holds the lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+int
+exm_policy_actions (const char *actions, struct hints *h)
+{
+  struct rule r;
+  const char *w = actions, *we, *eq;
+
+  memset (&r, 0, sizeof (r));
+  exm_hints_init (&r.h);
+  while (w && *w)
+    {
+      w += strspn (w, " \t\r\n");
+      if (!*w)
+        break;
+      we = w + strcspn (w, " \t\r\n");
+      eq = memchr (w, '=', we - w);
+      if (!eq || (eq - w == 4 && strncmp (w, "size", 4) == 0)
+          || (eq - w == 3 && strncmp (w, "exe", 3) == 0)
+          || (eq - w == 4 && strncmp (w, "func", 4) == 0)
+          || parse_word (&r, w, eq - w, eq + 1, we - eq - 1) != 0)
+        return -1;
+      w = we;
+    }
+  if (r.tier[0] && (r.h.tier = exm_tier_find (r.tier)) < 0)
+    return -1;
+  *h = r.h;
+  return 0;
+}
+
+/* API: Load or reload the allocation policy
+ * INPUT path: policy file to load, NULL to reload the current one, or "" to
+ *             remove all rules
+ * OUTPUT (return value): number of rules in effect, or -1 on error (the rules
+ *        in effect are unchanged)
+ */
+int
+exm_policy (const char *path)
+{
+  int j;
+  exm_lock ();
+  j = exm_policy_load (path ? path : policy_path);
+  exm_unlock ();
+  return j;
+}
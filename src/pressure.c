@@ -0,0 +1,345 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Memory-pressure-driven allocation threshold
+ *
+ * In auto mode (EXM_THRESHOLD=auto or exm_threshold_auto) the threshold is
+ * not a fixed number but is derived from the memory available to the
+ * process:
+ *
+ * limit, used   cgroup v2 memory.max and memory.current when the process is
+ *               in a cgroup with a limit, otherwise MemTotal and
+ *               MemTotal - MemAvailable from /proc/meminfo
+ * psi           the "some avg10" stall percentage from the cgroup's
+ *               memory.pressure file or /proc/pressure/memory
+ * headroom      bytes to keep free, EXM_HEADROOM (default 10% of limit)
+ *
+ * Normally the threshold is half of the memory left above the headroom,
+ * clamped to [exm_auto_min, exm_auto_max] (EXM_THRESHOLD_MIN, default 64 MB,
+ * and EXM_THRESHOLD_MAX, default unlimited), so large objects stay in RAM
+ * when it is plentiful. The state switches to "pressure" when available
+ * memory falls below the headroom or psi exceeds EXM_PSI_HIGH (default 10),
+ * dropping the threshold to exm_auto_min; it switches back only once the
+ * available memory exceeds twice the headroom and psi falls below half of
+ * EXM_PSI_HIGH (hysteresis).
+ *
+ * The memory figures are sampled at most once every exm_auto_interval
+ * nanoseconds, and only by allocations of at least exm_auto_min bytes.
+ * Sampling uses plain read() calls into stack buffers; nothing here
+ * allocates memory.
+ */
+
+int exm_auto = 0;
+size_t exm_auto_min = (size_t) 1 << 26;         /* 64 MB floor */
+size_t exm_auto_max = SIZE_MAX;
+size_t exm_auto_headroom = 0;                   /* zero means 10% of limit */
+double exm_psi_high = 10.0;
+long exm_auto_interval = 100000000L;            /* 100 ms */
+
+static size_t effective = SIZE_MAX;
+static int pressure = 0;
+static int reason = EXM_REASON_STATIC;
+static unsigned long changes = 0;
+static long long last_sample = 0;
+static int sampling = 0;
+static char cgroup_dir[EXM_MAX_PATH_LEN - 64] = "";
+static size_t last_limit = 0, last_avail = 0;
+static double last_psi = 0;
+
+static const char *reasons[] = {
+  "static threshold",
+  "memory plentiful",
+  "available memory below headroom",
+  "memory pressure stall (psi) high",
+  "pressure relieved",
+  "no memory information"
+};
+
+/* Read a small file into buf, returning the number of bytes read or -1 */
+static ssize_t
+read_file (const char *path, char *buf, size_t len)
+{
+  ssize_t n;
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  n = read (fd, buf, len - 1);
+  close (fd);
+  if (n < 0)
+    return -1;
+  buf[n] = 0;
+  return n;
+}
+
+/* Parse the value following key in a /proc/meminfo-style buffer */
+static size_t
+meminfo_value (const char *buf, const char *key)
+{
+  const char *p = strstr (buf, key);
+  if (!p)
+    return 0;
+  return (size_t) strtoull (p + strlen (key), NULL, 10) * 1024;
+}
+
+/* Locate the process's cgroup v2 directory, once */
+static void
+find_cgroup ()
+{
+  char buf[4096], *p, *e;
+  if (read_file ("/proc/self/cgroup", buf, sizeof (buf)) < 0)
+    return;
+  p = strstr (buf, "0::");
+  if (!p || (p != buf && p[-1] != '\n'))
+    return;
+  p += 3;
+  e = strchrnul (p, '\n');
+  *e = 0;
+  snprintf (cgroup_dir, sizeof (cgroup_dir), "/sys/fs/cgroup%s",
+            strcmp (p, "/") == 0 ? "" : p);
+}
+
+/* Sample limit, available memory and psi. Returns -1 if nothing is known. */
+static int
+sample (size_t *limit, size_t *avail, double *psi)
+{
+  char buf[4096], path[EXM_MAX_PATH_LEN];
+  size_t max = 0, cur = 0;
+  char *p;
+
+  *limit = *avail = 0;
+  *psi = 0;
+  if (cgroup_dir[0])
+    {
+      snprintf (path, sizeof (path), "%s/memory.max", cgroup_dir);
+      if (read_file (path, buf, sizeof (buf)) > 0 && buf[0] != 'm')
+        max = (size_t) strtoull (buf, NULL, 10);
+      snprintf (path, sizeof (path), "%s/memory.current", cgroup_dir);
+      if (max > 0 && read_file (path, buf, sizeof (buf)) > 0)
+        cur = (size_t) strtoull (buf, NULL, 10);
+      snprintf (path, sizeof (path), "%s/memory.pressure", cgroup_dir);
+      if (read_file (path, buf, sizeof (buf)) > 0
+          && (p = strstr (buf, "some avg10=")))
+        *psi = strtod (p + 11, NULL);
+    }
+  if (max > 0)
+    {
+      *limit = max;
+      *avail = cur < max ? max - cur : 0;
+    }
+  if (read_file ("/proc/meminfo", buf, sizeof (buf)) > 0)
+    {
+      size_t total = meminfo_value (buf, "MemTotal:");
+      size_t available = meminfo_value (buf, "MemAvailable:");
+/* A cgroup limit above physical memory is no limit at all */
+      if (*limit == 0 || total < *limit)
+        {
+          *limit = total;
+          *avail = available;
+        }
+      else if (available < *avail)
+        *avail = available;
+    }
+  if (!cgroup_dir[0] || *psi == 0)
+    {
+      if (read_file ("/proc/pressure/memory", buf, sizeof (buf)) > 0
+          && (p = strstr (buf, "some avg10=")))
+        *psi = strtod (p + 11, NULL);
+    }
+  return *limit > 0 ? 0 : -1;
+}
+
+static long long
+nanotime ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC_COARSE, &t);
+  return (long long) t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* Reasons describe threshold changes, so only apply in auto mode. The
+ * pressure state itself is also used by demotion (see demote.c).
+ */
+static void
+set_reason (int r)
+{
+  if (exm_auto && r != reason)
+    {
+      reason = r;
+      changes++;
+    }
+}
+
+/* Recompute the effective threshold from a fresh sample */
+static void
+update ()
+{
+  size_t limit, avail, headroom, t;
+  double psi;
+
+  if (sample (&limit, &avail, &psi) < 0)
+    {
+      effective = exm_alloc_threshold;
+      set_reason (EXM_REASON_UNKNOWN);
+      return;
+    }
+  last_limit = limit;
+  last_avail = avail;
+  last_psi = psi;
+  headroom = exm_auto_headroom > 0 ? exm_auto_headroom : limit / 10;
+  if (!pressure)
+    {
+      if (avail < headroom)
+        {
+          pressure = 1;
+          set_reason (EXM_REASON_HEADROOM);
+        }
+      else if (psi > exm_psi_high)
+        {
+          pressure = 1;
+          set_reason (EXM_REASON_PSI);
+        }
+    }
+  else if (avail > 2 * headroom && psi < exm_psi_high / 2)
+    {
+      pressure = 0;
+      set_reason (EXM_REASON_RELIEVED);
+    }
+  if (pressure)
+    {
+      effective = exm_auto_min;
+      return;
+    }
+  t = (avail - headroom) / 2;
+  if (t < exm_auto_min)
+    t = exm_auto_min;
+  if (t > exm_auto_max)
+    t = exm_auto_max;
+  effective = t;
+  if (reason != EXM_REASON_RELIEVED)
+    set_reason (EXM_REASON_PLENTIFUL);
+}
+
+/* Initialize auto mode, called from exm_init */
+void
+exm_pressure_init ()
+{
+  find_cgroup ();
+  if (exm_auto)
+    update ();
+}
+
+/* The threshold to apply to an allocation of size bytes. Cheap unless a new
+ * sample is due, and then only one thread samples while the others use the
+ * previous value.
+ */
+size_t
+exm_threshold_auto_value (size_t size)
+{
+  long long t;
+  if (size < exm_auto_min)
+    return SIZE_MAX;
+  t = nanotime ();
+  if (t - __atomic_load_n (&last_sample, __ATOMIC_RELAXED) > exm_auto_interval
+      && !__atomic_exchange_n (&sampling, 1, __ATOMIC_ACQUIRE))
+    {
+      update ();
+      __atomic_store_n (&last_sample, t, __ATOMIC_RELAXED);
+      __atomic_store_n (&sampling, 0, __ATOMIC_RELEASE);
+    }
+  return effective;
+}
+
+/* Take a fresh sample (unless another thread is sampling) and report whether
+ * memory is under pressure, along with the available memory and headroom.
+ */
+int
+exm_pressure_poll (size_t *avail, size_t *headroom)
+{
+  if (!__atomic_exchange_n (&sampling, 1, __ATOMIC_ACQUIRE))
+    {
+      update ();
+      __atomic_store_n (&last_sample, nanotime (), __ATOMIC_RELAXED);
+      __atomic_store_n (&sampling, 0, __ATOMIC_RELEASE);
+    }
+  *avail = last_avail;
+  *headroom = exm_auto_headroom > 0 ? exm_auto_headroom : last_limit / 10;
+  return pressure;
+}
+
+/* Report the auto mode state, used by the API and statistics: the threshold
+ * in effect, why it last changed (EXM_REASON_*), the last memory sample and
+ * the number of changes. Any output pointer may be NULL.
+ */
+void
+exm_pressure_state (size_t *threshold, int *why, size_t *limit,
+                    size_t *avail, double *psi, unsigned long *nchanges)
+{
+  if (threshold)
+    *threshold = exm_auto ? effective : exm_alloc_threshold;
+  if (why)
+    *why = reason;
+  if (limit)
+    *limit = last_limit;
+  if (avail)
+    *avail = last_avail;
+  if (psi)
+    *psi = last_psi;
+  if (nchanges)
+    *nchanges = changes;
+}
+
+/* API: Enable or disable the memory-pressure-driven threshold
+ * INPUT on: 1 to enable auto mode, 0 to disable it (the threshold reverts to
+ *           the fixed exm_threshold value), negative to leave it unchanged
+ *       headroom: bytes of memory to keep free, zero leaves it unchanged
+ * OUTPUT (return value): 1 if auto mode is on, 0 otherwise
+ */
+int
+exm_threshold_auto (int on, size_t headroom)
+{
+  exm_lock ();
+  if (headroom > 0)
+    exm_auto_headroom = headroom;
+  if (on > 0)
+    {
+      exm_auto = 1;
+      pressure = 0;
+      update ();
+      last_sample = nanotime ();
+    }
+/* Leaving auto mode is a change, staying out of it is not */
+  else if (on == 0 && exm_auto)
+    {
+      exm_auto = 0;
+      reason = EXM_REASON_STATIC;
+      changes++;
+    }
+  on = exm_auto;
+  exm_unlock ();
+  return on;
+}
+
+/* API: Why the threshold last changed
+ * OUTPUT (return value): static string describing the reason (do not free)
+ */
+const char *
+exm_threshold_reason ()
+{
+  return reasons[reason];
+}
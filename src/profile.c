@@ -0,0 +1,620 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#define uthash_malloc(sz) exm_map_alloc(sz)
+#define uthash_free(ptr, sz) exm_map_free(ptr)
+#include "uthash.h"
+#include "exm.h"
+
+/* Access heatmap profiler
+ *
+ * Which parts of which allocations does a job actually use? In profile mode
+ * (EXM_PROFILE=path or exm_profile) a background thread samples every
+ * allocation in flexmap every exm_profile_interval milliseconds
+ * (EXM_PROFILE_INTERVAL, default 1000). Each allocation is cut into
+ * EXM_PROFILE_BINS equal bins, and each sample adds, per bin, the pages that
+ * are
+ *
+ * resident  present in memory (/proc/self/pagemap)
+ * written   soft-dirty, written since the previous sample; the thread clears
+ *           the soft-dirty bits of the process after each sample
+ * accessed  not idle since the previous sample, from idle page tracking
+ *           (/sys/kernel/mm/page_idle/bitmap, which with the page frame
+ *           numbers in pagemap needs CAP_SYS_ADMIN); without it, written
+ *           stands in for accessed, and pages becoming resident when the
+ *           kernel has no soft-dirty bits either
+ *
+ * The report, written at exit to path.<pid> and on demand by
+ * exm_profile_report, lists each allocation, live or freed, with its call
+ * site (the key site.c learns by), size, kind, how much of it was resident,
+ * accessed and written on average, a heat strip with one character per bin,
+ * and a suggested policy rule (see policy.c): hot allocations belong on the
+ * heap, allocations touched in a few places want advice=random, ones swept
+ * from front to back advice=sequential. `exm --profile program` runs a
+ * program this way and prints the report.
+ *
+ * Like the demotion thread, the thread copies the allocations under the
+ * lock and samples them without it, at a pagemap read per allocation; idle
+ * tracking adds a bitmap read and write per group of 64 page frames. Clearing soft-dirty bits makes the next write to each
+ * page take a minor fault. Idle tracking and demote.c's referenced bits see
+ * the same hardware bits, so with both on each sees the accesses since the
+ * other last looked.
+ */
+
+#define EXM_PROFILE_BINS 64
+#define EXM_PROFILE_KEEP 256    /* freed allocations kept for the report */
+#define PM_PRESENT (1ULL << 63)
+#define PM_SOFT_DIRTY (1ULL << 55)
+#define PM_PFN ((1ULL << 55) - 1)
+
+struct prof
+{
+  void *addr;                   /* Allocation address, hash key */
+  size_t length;
+  uint64_t site;
+  int kind;
+  int tier;
+  double birth, death;          /* Seconds, death 0 while live */
+  unsigned long samples;
+  uint64_t resident[EXM_PROFILE_BINS];  /* Page samples per bin */
+  uint64_t accessed[EXM_PROFILE_BINS];
+  uint64_t written[EXM_PROFILE_BINS];
+  uint64_t last[EXM_PROFILE_BINS];      /* Resident pages at the last sample */
+  double centroid;              /* Centre of the last sample's accesses */
+  unsigned long forward, backward;      /* Moves of the centroid */
+  int seen;                     /* Still in flexmap at the last sample */
+  UT_hash_handle hh;
+};
+
+/* An allocation sampled without the lock */
+struct shot
+{
+  void *addr;
+  size_t length;
+  uint64_t resident[EXM_PROFILE_BINS];
+  uint64_t written[EXM_PROFILE_BINS];
+  uint64_t hit[EXM_PROFILE_BINS];
+};
+
+int exm_profile_mode = 0;
+long exm_profile_interval = 1000;
+char exm_profile_path[EXM_MAX_PATH_LEN] = "";
+
+static struct prof *live = NULL;
+static struct prof *freed[EXM_PROFILE_KEEP];
+static int nfreed = 0, nextfreed = 0;
+static int running = 0;
+static int idle_fd = -1;        /* page_idle bitmap, when usable */
+static int soft_dirty = 1;      /* Clearing soft-dirty bits works */
+static int probed = 0;
+static struct shot *shots;      /* Sampled without the lock, or NULL */
+static size_t nshots;
+static pthread_t thread;
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Keep a freed allocation for the report, dropping the oldest */
+static void
+retire (struct prof *p)
+{
+  HASH_DEL (live, p);
+  p->death = now ();
+  if (nfreed == EXM_PROFILE_KEEP)
+    exm_map_free (freed[nextfreed]);
+  else
+    nfreed++;
+  freed[nextfreed] = p;
+  nextfreed = (nextfreed + 1) % EXM_PROFILE_KEEP;
+}
+
+/* Clear the soft-dirty bits of the process
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+clear_soft_dirty ()
+{
+  int fd = open ("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC), j = -1;
+  if (fd >= 0)
+    {
+      j = write (fd, "4", 1) == 1 ? 0 : -1;
+      close (fd);
+    }
+  return j;
+}
+
+/* Which access bits can we see? Idle page tracking needs page frame numbers
+ * in pagemap and a writable bitmap; soft-dirty bits must reappear on a page
+ * written after clearing them.
+ */
+static void
+probe (int pm)
+{
+  static volatile char c;
+  uint64_t e = 0;
+  off_t off;
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  c = 1;
+  off = (off_t) ((uintptr_t) & c / page * sizeof (uint64_t));
+  if (clear_soft_dirty () == 0)
+    c = 2;
+  if (pread (pm, &e, sizeof (e), off) != sizeof (e) || !(e & PM_PRESENT))
+    {
+      soft_dirty = 0;
+      return;
+    }
+  soft_dirty = (e & PM_SOFT_DIRTY) != 0;
+  if (e & PM_PFN)
+    idle_fd = open ("/sys/kernel/mm/page_idle/bitmap", O_RDWR | O_CLOEXEC);
+}
+
+/* Accumulates the idle bits of one 64-frame group of the bitmap */
+struct group
+{
+  uint64_t word;                /* Group index, pfn / 64 */
+  uint64_t bits;                /* Idle bits as read */
+  uint64_t mark;                /* Frames to mark idle again */
+  int valid;
+};
+
+static void
+flush_group (struct group *g)
+{
+  if (g->valid && g->mark)
+    if (pwrite (idle_fd, &g->mark, sizeof (uint64_t),
+                (off_t) (g->word * sizeof (uint64_t))) < 0)
+      {
+        close (idle_fd);
+        idle_fd = -1;
+      }
+  g->valid = 0;
+  g->mark = 0;
+}
+
+/* Was frame pfn accessed since it was last marked idle? Marks it again. */
+static int
+accessed (struct group *g, uint64_t pfn)
+{
+  if (!g->valid || g->word != pfn / 64)
+    {
+      flush_group (g);
+      if (idle_fd < 0)
+        return 0;
+      g->word = pfn / 64;
+      if (pread (idle_fd, &g->bits, sizeof (uint64_t),
+                 (off_t) (g->word * sizeof (uint64_t))) != sizeof (uint64_t))
+        g->bits = 0;
+      g->valid = 1;
+    }
+  g->mark |= 1ULL << (pfn % 64);
+  return !(g->bits >> (pfn % 64) & 1);
+}
+
+/* Count the pages of s: resident, written and accessed per bin. Runs without
+ * the lock.
+ */
+static void
+measure (struct shot *s, int pm)
+{
+  uint64_t e[512], x;
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  size_t npages = (s->length + page - 1) / page, i, k = 0;
+  struct group g;
+  int b;
+
+  memset (&g, 0, sizeof (g));
+  for (i = 0; i < npages; ++i)
+    {
+      if (i % 512 == 0)
+        {
+          k = npages - i < 512 ? npages - i : 512;
+          if (pread (pm, e, k * sizeof (uint64_t),
+                     (off_t) (((uintptr_t) s->addr / page + i)
+                              * sizeof (uint64_t))) !=
+              (ssize_t) (k * sizeof (uint64_t)))
+            break;
+        }
+      x = e[i % 512];
+      if (!(x & PM_PRESENT))
+        continue;
+      b = (int) (i * EXM_PROFILE_BINS / npages);
+      s->resident[b]++;
+      if (soft_dirty && (x & PM_SOFT_DIRTY))
+        s->written[b]++;
+      if (idle_fd >= 0 && (x & PM_PFN) ? accessed (&g, x & PM_PFN)
+          : soft_dirty && (x & PM_SOFT_DIRTY))
+        s->hit[b]++;
+    }
+  flush_group (&g);
+}
+
+/* Add the sample s to p. Without access bits, pages that became resident
+ * since the last sample count as accessed. The caller holds the lock.
+ */
+static void
+add (struct prof *p, struct shot *s)
+{
+  double sum = 0, touched = 0, c;
+  int b;
+
+  for (b = 0; b < EXM_PROFILE_BINS; ++b)
+    {
+      if (idle_fd < 0 && !soft_dirty && s->resident[b] > p->last[b])
+        s->hit[b] = s->resident[b] - p->last[b];
+      p->last[b] = s->resident[b];
+      p->resident[b] += s->resident[b];
+      p->written[b] += s->written[b];
+      p->accessed[b] += s->hit[b];
+      touched += s->hit[b];
+      sum += (b + 0.5) * s->hit[b];
+    }
+  p->samples++;
+/* Track where the accesses are centred, for sequential sweeps */
+  if (touched > 0)
+    {
+      c = sum / touched / EXM_PROFILE_BINS;
+      if (p->samples > 1 && c > p->centroid + 1.0 / EXM_PROFILE_BINS)
+        p->forward++;
+      else if (p->samples > 1 && c < p->centroid - 1.0 / EXM_PROFILE_BINS)
+        p->backward++;
+      p->centroid = c;
+    }
+}
+
+/* Bring live up to date with flexmap and copy its allocations to shots. The
+ * caller holds the lock.
+ */
+static void
+collect ()
+{
+  struct prof *p, *tmp;
+  struct map *m, *mt;
+
+  nshots = 0;
+  HASH_ITER (hh, live, p, tmp)
+  {
+    p->seen = 0;
+  }
+  HASH_ITER (hh, flexmap, m, mt)
+  {
+    if (m->pid != getpid () || m->migrating)
+      continue;
+    HASH_FIND_PTR (live, &m->addr, p);
+/* A realloc in place starts over */
+    if (p && p->length != m->length)
+      {
+        retire (p);
+        p = NULL;
+      }
+    if (!p)
+      {
+        p = (struct prof *) exm_map_alloc (sizeof (struct prof));
+        if (!p)
+          continue;
+        memset (p, 0, sizeof (struct prof));
+        p->addr = m->addr;
+        p->length = m->length;
+        p->site = m->site;
+        p->tier = m->tier;
+        p->birth = now ();
+        HASH_ADD_PTR (live, addr, p);
+      }
+    p->kind = m->kind;
+    p->seen = 1;
+  }
+  HASH_ITER (hh, live, p, tmp)
+  {
+    if (!p->seen)
+      retire (p);
+  }
+  if (!live)
+    return;
+  shots = (struct shot *) exm_map_alloc (HASH_COUNT (live)
+                                         * sizeof (struct shot));
+  if (!shots)
+    return;
+  HASH_ITER (hh, live, p, tmp)
+  {
+    memset (&shots[nshots], 0, sizeof (struct shot));
+    shots[nshots].addr = p->addr;
+    shots[nshots].length = p->length;
+    nshots++;
+  }
+}
+
+/* Sample the shots, then clear the soft-dirty bits. Runs without the lock;
+ * an allocation freed meanwhile just reads as not resident.
+ */
+static void
+sample ()
+{
+  size_t i;
+  int pm;
+
+  pm = open ("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+  if (pm < 0)
+    return;
+  if (!probed)
+    {
+      probe (pm);
+      probed = 1;
+    }
+  for (i = 0; i < nshots; ++i)
+    measure (&shots[i], pm);
+  close (pm);
+  if (soft_dirty && clear_soft_dirty () < 0)
+    soft_dirty = 0;
+}
+
+/* Add the shots to the allocations still live, after sample. The caller
+ * holds the lock.
+ */
+static void
+step ()
+{
+  struct prof *p;
+  size_t i;
+
+  for (i = 0; i < nshots; ++i)
+    {
+      HASH_FIND_PTR (live, &shots[i].addr, p);
+      if (p && p->length == shots[i].length)
+        add (p, &shots[i]);
+    }
+  exm_map_free (shots);
+  shots = NULL;
+  nshots = 0;
+}
+
+static void *
+profile_thread (void *arg __attribute__ ((unused)))
+{
+  struct timespec t;
+  for (;;)
+    {
+      t.tv_sec = exm_profile_interval / 1000;
+      t.tv_nsec = (exm_profile_interval % 1000) * 1000000L;
+      nanosleep (&t, NULL);
+      exm_lock ();
+      if (!exm_ready () || !exm_profile_mode)
+        {
+          running = 0;
+          exm_unlock ();
+          break;
+        }
+      collect ();
+      exm_unlock ();
+      sample ();
+      exm_lock ();
+      step ();
+      exm_unlock ();
+    }
+  return NULL;
+}
+
+/* Start the background thread if it is not running. Takes the lock. */
+void
+exm_profile_start (void)
+{
+  pthread_attr_t a;
+  if (running || !exm_profile_mode)
+    return;
+  exm_lock ();
+  if (!running)
+    {
+      pthread_attr_init (&a);
+      pthread_attr_setdetachstate (&a, PTHREAD_CREATE_DETACHED);
+      if (pthread_create (&thread, &a, profile_thread, NULL) == 0)
+        running = 1;
+      else
+        syslog (LOG_CRIT, "exm unable to start profiler thread\n");
+      pthread_attr_destroy (&a);
+    }
+  exm_unlock ();
+}
+
+/* In a forked child: the thread and the samples are the parent's. Start
+ * over if there are allocations. Caller holds the lock.
+ */
+void
+exm_profile_atfork (void)
+{
+  struct prof *p, *tmp;
+  running = 0;
+  probed = 0;
+  exm_map_free (shots);
+  shots = NULL;
+  nshots = 0;
+  HASH_ITER (hh, live, p, tmp)
+  {
+    HASH_DEL (live, p);
+    exm_map_free (p);
+  }
+  for (; nfreed > 0; --nfreed)
+    exm_map_free (freed[nfreed - 1]);
+  nextfreed = 0;
+  if (exm_profile_mode && flexmap)
+    exm_profile_start ();
+}
+
+static void
+human (char *s, size_t n, double x)
+{
+  const char *u = "BKMGTP";
+  while (x >= 1024 && u[1])
+    {
+      x /= 1024;
+      u++;
+    }
+  snprintf (s, n, *u == 'B' ? "%.0f%c" : "%.1f%c", x, *u);
+}
+
+static const char *
+kind_name (int kind)
+{
+  switch (kind)
+    {
+    case EXM_ANON:
+      return "anonymous";
+    case EXM_DEMOTED:
+      return "demoted";
+    case EXM_LAZY:
+      return "lazy";
+    case EXM_PAGED:
+      return "paged";
+    default:
+      return "file";
+    }
+}
+
+/* Report one allocation */
+static void
+describe (FILE * f, struct prof *p, double t)
+{
+  const char *scale = " .:-=+*#%@";
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  size_t npages = (p->length + page - 1) / page;
+  uint64_t res = 0, acc = 0, wr = 0, pages;
+  double r, a, w, h;
+  char size[16], strip[EXM_PROFILE_BINS + 1];
+  int b, cover = 0;
+
+  for (b = 0; b < EXM_PROFILE_BINS; ++b)
+    {
+      res += p->resident[b];
+      acc += p->accessed[b];
+      wr += p->written[b];
+      cover += p->accessed[b] > 0;
+/* Pages in bin b */
+      pages = (uint64_t) ((b + 1) * npages / EXM_PROFILE_BINS)
+        - (uint64_t) (b * npages / EXM_PROFILE_BINS);
+      h = pages && p->samples ? (double) p->accessed[b]
+        / (pages * p->samples) : 0;
+      strip[b] = scale[h > 0 && h < 0.1 ? 1 : (int) (h * 9 + 0.5)];
+    }
+  strip[EXM_PROFILE_BINS] = 0;
+  r = p->samples ? (double) res / (npages * p->samples) : 0;
+  a = p->samples ? (double) acc / (npages * p->samples) : 0;
+  w = p->samples ? (double) wr / (npages * p->samples) : 0;
+  human (size, sizeof (size), (double) p->length);
+  fprintf (f, "%p %s %s site %016llx %s %.1fs, %lu samples\n", p->addr,
+           size, kind_name (p->kind), (unsigned long long) p->site,
+           p->death > 0 ? "freed after" : "live", (p->death > 0 ? p->death :
+                                                   t) - p->birth,
+           p->samples);
+  fprintf (f, "  resident %.1f%% accessed %.1f%% written %.1f%%, "
+           "accessed in %d/%d bins\n", 100 * r, 100 * a, 100 * w, cover,
+           EXM_PROFILE_BINS);
+  fprintf (f, "  heat [%s]\n", strip);
+  fprintf (f, "  suggest size=%s- ", size);
+  if (!p->samples || acc == 0)
+    fprintf (f, "backend=exm advice=normal  # never seen in use\n");
+  else if (a >= 0.5)
+    fprintf (f, "backend=heap advice=willneed  # hot\n");
+  else if (p->forward >= 2 && p->forward >= 3 * p->backward)
+    fprintf (f, "backend=exm advice=sequential  # swept front to back\n");
+  else if (cover < EXM_PROFILE_BINS / 4)
+    fprintf (f, "backend=exm advice=random  # used in a few places\n");
+  else
+    fprintf (f, "backend=exm advice=normal\n");
+}
+
+/* Write the report. Caller holds the lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+report (const char *path)
+{
+  char name[EXM_MAX_PATH_LEN + 16];
+  struct prof *p, *tmp;
+  double t = now ();
+  FILE *f;
+  int i;
+
+  snprintf (name, sizeof (name), "%s.%d", path, (int) getpid ());
+  f = fopen (name, "w");
+  if (!f)
+    return -1;
+  fprintf (f, "# exm heatmap of %s (pid %d), sampled every %ld ms, "
+           "accessed from %s\n", program_invocation_short_name,
+           (int) getpid (), exm_profile_interval,
+           idle_fd >= 0 ? "idle page tracking" : soft_dirty ?
+           "soft-dirty (written) bits" :
+           "pages becoming resident (no access bits)");
+  fprintf (f, "# heat: accessed share of each 1/%d of the allocation, "
+           "' ' none to '@' all\n\n", EXM_PROFILE_BINS);
+  HASH_ITER (hh, live, p, tmp) describe (f, p, t);
+  for (i = 0; i < nfreed; ++i)
+    describe (f, freed[(nextfreed - nfreed + i + EXM_PROFILE_KEEP)
+                       % EXM_PROFILE_KEEP], t);
+  return fclose (f) == 0 ? 0 : -1;
+}
+
+/* At exit, write the report. Caller holds the lock. */
+void
+exm_profile_finish (void)
+{
+  if (exm_profile_path[0] && (live || nfreed))
+    report (exm_profile_path);
+}
+
+/* API: Enable or disable the access profiler
+ * INPUT j: 1 to start sampling, 0 to stop, negative to leave it unchanged
+ * OUTPUT (return value): the profile mode in effect
+ * Samples taken so far are kept either way.
+ */
+int
+exm_profile (int j)
+{
+  exm_lock ();
+  if (j >= 0)
+    exm_profile_mode = j > 0;
+  j = exm_profile_mode;
+  exm_unlock ();
+  if (j)
+    exm_profile_start ();
+  return j;
+}
+
+/* API: Write the access heatmap report now
+ * INPUT path: report file prefix, the report goes to path.<pid>; NULL for
+ *       EXM_PROFILE
+ * OUTPUT (return value): 0 on success, -1 on error (errno EINVAL when there
+ *        is no path)
+ */
+int
+exm_profile_report (const char *path)
+{
+  int j;
+  if (!path)
+    path = exm_profile_path;
+  if (!*path || strlen (path) >= EXM_MAX_PATH_LEN)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  exm_lock ();
+  j = report (path);
+  exm_unlock ();
+  return j;
+}
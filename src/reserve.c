@@ -0,0 +1,178 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define uthash_malloc(sz) exm_map_alloc(sz)
+#define uthash_free(ptr, sz) exm_map_free(ptr)
+#include "uthash.h"
+#include "exm.h"
+#include "trace.h"
+
+/* Growable reservations
+ *
+ * Buffers that grow by appending (column builders, log buffers, R vectors
+ * extended with c()) pay for every realloc with a move and a copy because
+ * the mapping cannot grow in place. exm_reserve instead reserves max_size
+ * bytes of PROT_NONE address space up front, backed by an empty sparse file,
+ * and exm_commit extends (or shrinks) the usable part in place: it truncates
+ * the file to the new size and maps the new pages of it at the end of the
+ * committed part, so the address never changes and nothing is copied.
+ *
+ * A reservation is an ordinary file-backed map whose reserved field holds
+ * the size of the whole range and whose length is the committed size. The
+ * pointer may be passed to free, and to realloc, which commits in place when
+ * the new size fits in the reservation and otherwise moves the allocation to
+ * a new ordinary mapping like any other. A forked child that remaps its
+ * allocations (exm_child_cow > 0) gets a copy of the file, whatever the copy
+ * on write setting, so that it can go on committing in place.
+ */
+
+static size_t
+page_round (size_t n)
+{
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  return ((n + page - 1) / page) * page;
+}
+
+/* Commit size bytes of the reservation m in place. The caller holds the
+ * lock.
+ * OUTPUT (return value): 0 on success, -1 on error (errno set, m unchanged)
+ */
+int
+exm_reserve_commit (struct map *m, size_t size)
+{
+  size_t from = page_round (m->length), to = page_round (size);
+  void *p;
+  int fd;
+
+  if (size > m->reserved)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+  fd = open (m->path, O_RDWR);
+  if (fd < 0)
+    return -1;
+  if (ftruncate (fd, size) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  if (to > from)
+    {
+      p = mmap ((char *) m->addr + from, to - from, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, (off_t) from);
+      if (p == MAP_FAILED)
+        {
+          ftruncate (fd, m->length);
+          close (fd);
+          return -1;
+        }
+      madvise (p, to - from, m->advice);
+    }
+  else if (to < from)
+/* Give the released pages back to the reservation */
+    mmap ((char *) m->addr + to, from - to, PROT_NONE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  close (fd);
+  exm_tier_release (m->tier, m->length);
+  exm_tier_charge (m->tier, size);
+  m->length = size;
+  return 0;
+}
+
+/* API: Reserve address space for a buffer that grows in place
+ * INPUT max_size: largest size the buffer may grow to, in bytes
+ *       flags: hints from libexm.h, as for exm_malloc (EXM_PREFAULT is
+ *              ignored)
+ * OUTPUT (return value): address of the reservation, with nothing committed
+ *        yet (see exm_commit), or NULL on error (errno set)
+ */
+void *
+exm_reserve (size_t max_size, int flags)
+{
+  struct hints h;
+  struct map *m;
+  void *p;
+  int fd;
+
+  if (!exm_ready ())
+    {
+      errno = EAGAIN;
+      return NULL;
+    }
+  if (max_size == 0)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  exm_flag_hints (flags, &h);
+  m = newmap ();
+  if (!m)
+    return NULL;
+  m->pid = getpid ();
+  m->reserved = page_round (max_size);
+  m->advice = h.advice >= 0 ? h.advice : EXM_DEFAULT_ADVISE;
+  m->cow = h.cow;
+  exm_lock ();
+  fd = exm_mkstemp (m, 0, h.tier);
+  if (fd < 0)
+    {
+      exm_unlock ();
+      freemap (m);
+      return NULL;
+    }
+  close (fd);
+  m->addr = mmap (NULL, m->reserved, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (m->addr == MAP_FAILED)
+    {
+      exm_unlink (m);
+      exm_unlock ();
+      freemap (m);
+      return NULL;
+    }
+  HASH_ADD_INORDER (hh, flexmap, addr, sizeof (void *), m, addr_sort);
+  exm_map_range (m);
+  p = m->addr;
+  exm_unlock ();
+/* Traced at the reserved size, which is what the free reports */
+  if (exm_trace_mode && max_size >= exm_trace_min)
+    exm_trace_event (EXM_TRACE_MALLOC, p, NULL, page_round (max_size), 1);
+  return p;
+}
+
+/* API: Set the usable size of a reservation in place
+ * INPUT ptr: address returned by exm_reserve
+ *       size: new usable size in bytes, at most the reserved size; growing
+ *             adds zero-filled bytes, shrinking discards the tail
+ * OUTPUT (return value): 0 on success, -1 on error (errno EINVAL when ptr
+ *        is not a reservation of this process, ENOMEM when size exceeds
+ *        it)
+ */
+int
+exm_commit (void *ptr, size_t size)
+{
+  struct map *m;
+  int j = -1;
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &ptr, m);
+  if (!m || m->reserved == 0 || m->pid != getpid ())
+    errno = EINVAL;
+  else if ((j = exm_reserve_commit (m, size)) == 0)
+    exm_persist_update (m);
+  exm_unlock ();
+  return j;
+}
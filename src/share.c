@@ -0,0 +1,240 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define uthash_malloc(sz) exm_map_alloc(sz)
+#define uthash_free(ptr, sz) exm_map_free(ptr)
+#include "uthash.h"
+#include "exm.h"
+#include "trace.h"
+
+/* Sharing allocations between processes
+ *
+ * Fork shares exm allocations with children only. exm_publish gives an
+ * allocation's backing file a name that unrelated processes on the host pass
+ * to exm_attach_shared to map the same data, without copying it:
+ *
+ *   producer:  x = exm_malloc (size, 0); ... exm_publish (x, "frame", 0640);
+ *   consumer:  y = exm_attach_shared ("frame", 1);  n = exm_size (y);
+ *
+ * Names follow exm_persist (see persist.c): a plain name lives in the
+ * allocation's tier directory and exm_attach_shared searches the tier
+ * directories in order, a name with a slash is a path.
+ *
+ * Every process using a shared allocation, publisher included, keeps the
+ * file open with a shared flock, and the kernel counts the users: on free
+ * (or exit) a user tries to convert its lock to an exclusive one, which only
+ * succeeds for the last user, and that user removes the file. Locks of
+ * crashed processes go away with them, so the count stays right. Attaching
+ * checks that the name still refers to the locked file, so it cannot pick up
+ * a file the last user is removing.
+ *
+ * Writes through read-write mappings are seen by all users at once. Shared
+ * allocations do not change size: realloc moves the data to a new private
+ * allocation and detaches. Forked children do not take part in the count;
+ * their copies never remove the file.
+ */
+
+/* Open the file at path and take a shared lock on it, making sure path
+ * still names it afterwards.
+ * OUTPUT (return value): file descriptor or -1 on error (errno set)
+ */
+static int
+open_locked (const char *path, int flags)
+{
+  struct stat a, b;
+  int fd = open (path, flags);
+  if (fd < 0)
+    return -1;
+  if (flock (fd, LOCK_SH) < 0 || fstat (fd, &a) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  if (stat (path, &b) < 0 || a.st_ino != b.st_ino || a.st_dev != b.st_dev)
+    {
+      close (fd);
+      errno = ENOENT;
+      return -1;
+    }
+  return fd;
+}
+
+/* Detach the shared map m: remove its file if this is the last user. The
+ * caller holds the lock.
+ */
+void
+exm_share_release (struct map *m)
+{
+  if (!m->shared)
+    return;
+  if (flock (m->share_fd, LOCK_EX | LOCK_NB) == 0)
+    unlink (m->path);
+  close (m->share_fd);
+  m->shared = 0;
+  exm_tier_release (m->tier, m->length);
+}
+
+/* In a forked child, keep the inherited shared map m out of the count: the
+ * lock belongs to the open file shared with the parent, so the child only
+ * closes its descriptor and never removes the file.
+ */
+void
+exm_share_fork (struct map *m)
+{
+  if (!m->shared)
+    return;
+  close (m->share_fd);
+  m->shared = 0;
+  m->persist = 1;
+}
+
+/* API: Publish an allocation under a name for other processes
+ * INPUT addr: exm allocation address
+ *       name: name to publish it under (see above)
+ *       mode: file permissions for other users (like 0640), or 0 to leave
+ *             them owner-only
+ * OUTPUT (return value): 0 on success, -1 on error (errno EINVAL when addr
+ *        is not a file-backed, unstriped, unpublished and not persistent
+ *        allocation of this process, EEXIST when the name is taken)
+ * The allocation stays usable; free detaches from it.
+ */
+int
+exm_publish (void *addr, const char *name, int mode)
+{
+  char path[EXM_MAX_PATH_LEN];
+  struct map *m;
+  int fd, j = -1;
+
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (m && m->kind == EXM_LAZY && m->pid == getpid ())
+    exm_lazy_settle (m);
+  if (m && m->kind == EXM_PAGED && m->pid == getpid ())
+    exm_pager_settle (m);
+  if (!m || m->pid != getpid () || m->kind != EXM_FILE || m->nstripes > 0
+      || m->shared || m->persist || m->mapped || m->reserved > 0 || !name
+      || !name[0])
+    {
+      errno = EINVAL;
+      goto done;
+    }
+  if (exm_name_path (path, name, m->tier) < 0)
+    {
+      errno = ENAMETOOLONG;
+      goto done;
+    }
+/* link fails when the name is taken, unlike rename */
+  if (link (m->path, path) < 0)
+    goto done;
+  fd = open_locked (path, O_RDWR);
+  if (fd < 0)
+    {
+      unlink (path);
+      goto done;
+    }
+  unlink (m->path);
+  strcpy (m->path, path);
+  if (mode)
+    fchmod (fd, (mode_t) mode);
+  m->share_fd = fd;
+  m->shared = 1;
+  j = 0;
+done:
+  exm_unlock ();
+  return j;
+}
+
+/* API: Map an allocation published by another process
+ * INPUT name: name given to exm_publish
+ *       readonly: nonzero to map it read-only
+ * OUTPUT (return value): address of the shared allocation (see exm_size for
+ *        its length), or NULL on error (errno ENOENT when nothing is
+ *        published under name)
+ * Release it with free.
+ */
+void *
+exm_attach_shared (const char *name, int readonly)
+{
+  char path[EXM_MAX_PATH_LEN];
+  struct stat st;
+  struct map *m, *y;
+  void *p = NULL;
+  size_t n = 0;
+  int fd = -1, i, tier = -1;
+
+  if (!exm_ready ())
+    {
+      errno = EAGAIN;
+      return NULL;
+    }
+  if (!name || !name[0])
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+  exm_lock ();
+  for (i = strchr (name, '/') ? -1 : 0; i < exm_ntiers && fd < 0; ++i)
+    {
+      if (exm_name_path (path, name, i) < 0)
+        break;
+      fd = open_locked (path, readonly ? O_RDONLY : O_RDWR);
+      tier = i;
+      if (i < 0)
+        break;
+    }
+  if (fd < 0)
+    goto done;
+  m = newmap ();
+  if (!m || fstat (fd, &st) < 0 || st.st_size == 0)
+    {
+      close (fd);
+      freemap (m);
+      errno = ENOENT;
+      goto done;
+    }
+  strcpy (m->path, path);
+  m->length = (size_t) st.st_size;
+  m->pid = getpid ();
+  m->tier = tier;
+  m->kind = EXM_FILE;
+  m->advice = EXM_DEFAULT_ADVISE;
+  m->addr = mmap (NULL, m->length, readonly ? PROT_READ
+                  : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  HASH_FIND_PTR (flexmap, &m->addr, y);
+  if (m->addr == MAP_FAILED || y)
+    {
+      if (m->addr != MAP_FAILED)
+        munmap (m->addr, m->length);
+      close (fd);
+      freemap (m);
+      goto done;
+    }
+  madvise (m->addr, m->length, m->advice);
+  m->share_fd = fd;
+  m->shared = 1;
+  exm_tier_charge (m->tier, m->length);
+  HASH_ADD_INORDER (hh, flexmap, addr, sizeof (void *), m, addr_sort);
+  exm_map_range (m);
+  p = m->addr;
+  n = m->length;
+done:
+  exm_unlock ();
+  if (exm_trace_mode && p && n >= exm_trace_min)
+    exm_trace_event (EXM_TRACE_MALLOC, p, NULL, n, 1);
+  return p;
+}
@@ -0,0 +1,117 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libexm.h"
+
+/* Linkable API shim, built as libexm_shim.a
+ *
+ * Programs that include libexm.h and link with -lexm_shim -ldl call the exm
+ * API functions by name. Each shim function looks up the real one in
+ * libexm.so on first use and forwards to it. Without libexm.so the shim
+ * falls back to the default allocator and neutral results, so the program
+ * still runs.
+ *
+ * The shim may be linked into the executable (its definitions then come
+ * first in symbol lookup) or into a shared library, so the lookup tries the
+ * default scope and, if that finds the shim itself, the objects after it.
+ */
+
+static void *
+resolve (const char *name, void *self)
+{
+  void *f = dlsym (RTLD_DEFAULT, name);
+  if (f == self)
+    f = dlsym (RTLD_NEXT, name);
+  return f == self ? NULL : f;
+}
+
+#define SHIM(ret, name, params, args, fallback)                         \
+  ret name params                                                       \
+  {                                                                     \
+    static ret (*f) params;                                             \
+    if (!f)                                                             \
+      f = (ret (*) params) resolve (#name, (void *) name);              \
+    if (!f)                                                             \
+      return fallback;                                                  \
+    return (*f) args;                                                   \
+  }
+
+SHIM (void *, exm_malloc, (size_t size, int flags), (size, flags),
+      calloc (1, size))
+SHIM (void *, exm_calloc, (size_t count, size_t size, int flags),
+      (count, size, flags), calloc (count, size))
+/* Without libexm.so a reservation is a plain allocation of its full size */
+SHIM (void *, exm_reserve, (size_t max_size, int flags), (max_size, flags),
+      malloc (max_size))
+SHIM (int, exm_commit, (void *ptr, size_t size), (ptr, size), 0)
+SHIM (int, exm_persist, (void *addr, const char *name), (addr, name), -1)
+SHIM (void *, exm_attach, (const char *name), (name), NULL)
+SHIM (int, exm_publish, (void *addr, const char *name, int mode),
+      (addr, name, mode), -1)
+SHIM (void *, exm_attach_shared, (const char *name, int readonly),
+      (name, readonly), NULL)
+SHIM (void *, exm_map_file, (const char *path, off_t offset, size_t len,
+                              int mode), (path, offset, len, mode), NULL)
+SHIM (int, exm_snapshot, (void *addr, const char *dest), (addr, dest), -1)
+SHIM (ssize_t, exm_snapshot_incremental, (void *addr), (addr), -1)
+SHIM (double, exm_version, (void), (), 0)
+SHIM (size_t, exm_threshold, (size_t j), (j), 0)
+SHIM (char *, exm_path, (char *path), (path), NULL)
+SHIM (int, exm_cow, (int j), (j), -1)
+SHIM (int, exm_tier_policy, (int j), (j), -1)
+SHIM (char *, exm_tier_info, (int i, size_t * allocated, size_t * capacity,
+                              size_t * avail), (i, allocated, capacity, avail),
+      NULL)
+SHIM (size_t, exm_stripe, (ssize_t j), (j), 0)
+SHIM (int, exm_threshold_auto, (int on, size_t headroom), (on, headroom), 0)
+SHIM (const char *, exm_threshold_reason, (void), (), "exm not loaded")
+SHIM (int, exm_demote, (int j), (j), 0)
+SHIM (int, exm_migrate, (void *addr, int to_file), (addr, to_file), -1)
+SHIM (int, exm_policy, (const char *path), (path), -1)
+SHIM (size_t, exm_threshold_local, (ssize_t j), (j), 0)
+SHIM (int, exm_policy_push, (size_t threshold, const char *actions),
+      (threshold, actions), -1)
+SHIM (int, exm_policy_pop, (void), (), -1)
+SHIM (int, exm_learn, (int j), (j), 0)
+SHIM (int, exm_lazy, (int j), (j), 0)
+SHIM (size_t, exm_zerocopy, (ssize_t j), (j), 0)
+SHIM (size_t, exm_pager, (ssize_t j), (j), 0)
+SHIM (int, exm_trace_file, (const char *path), (path), -1)
+SHIM (int, exm_profile, (int j), (j), 0)
+SHIM (int, exm_profile_report, (const char *path), (path), -1)
+SHIM (uint64_t, exm_site_info, (int i, unsigned long *n, double *lifetime,
+                                double *intensity), (i, n, lifetime,
+                                                     intensity), 0)
+SHIM (char *, exm_lookup, (void *addr), (addr), NULL)
+SHIM (size_t, exm_size, (void *addr), (addr), 0)
+SHIM (int, exm_stats, (struct exm_stats * s), (s), -1)
+SHIM (void *, exm_map_info, (int i, size_t * length, size_t * resident,
+                             int *tier), (i, length, resident, tier), NULL)
+SHIM (size_t, exm_zerocopy_info, (size_t * in, size_t * out), (in, out), 0)
+SHIM (size_t, exm_pager_info, (size_t * in, size_t * out), (in, out), 0)
+SHIM (int, exm_madvise, (void *addr, int advice), (addr, advice), -1)
+
+void
+exm_free (void *ptr)
+{
+  free (ptr);
+}
+
+void
+exm_debug_list ()
+{
+  static void (*f) (void);
+  if (!f)
+    f = (void (*)(void)) resolve ("exm_debug_list", (void *) exm_debug_list);
+  if (f)
+    (*f) ();
+}
@@ -0,0 +1,470 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define uthash_malloc(sz) exm_map_alloc(sz)
+#define uthash_free(ptr, sz) exm_map_free(ptr)
+#include "uthash.h"
+#include "exm.h"
+
+/* Call-site-aware routing
+ *
+ * Size alone is a poor predictor of where an allocation belongs: a huge
+ * temporary that lives a few milliseconds is best left in RAM, while a
+ * moderately sized table that lives for hours is better off in a file. In
+ * learning mode (EXM_LEARN=1 or exm_learn) every malloc, calloc or realloc of
+ * at least exm_learn_min bytes (EXM_LEARN_MIN, default 64M) is attributed to
+ * its call site, a hash of the short backtrace leading to it. Return
+ * addresses are hashed relative to the base of the object containing them
+ * along with the object's file name, so the hash is stable across runs
+ * despite address space randomization.
+ *
+ * Each site keeps running averages of
+ *
+ * lifetime   seconds from allocation to free
+ * intensity  bytes touched per second of lifetime, the allocation's resident
+ *            pages (mincore) at free time divided by its lifetime
+ *
+ * Once a site has been seen EXM_SITE_WARM times, its allocations go to an exm
+ * mapping when they are long lived (lifetime >= exm_learn_lifetime seconds,
+ * EXM_LEARN_LIFETIME, default 1) and not intensely used (intensity below
+ * exm_learn_rate bytes per second, EXM_LEARN_RATE, default 256M), and to the
+ * default heap otherwise, regardless of the threshold. Sites not yet warm
+ * follow the threshold as usual.
+ *
+ * The table is saved on exit (and when learning is turned off) to
+ * exm_learn_file, EXM_LEARN_FILE, by default "exm_sites.UID.PROGRAM" in the
+ * first data directory (call sites only mean something to one program, and
+ * other users must not be able to steer it), and loaded on first use, so
+ * that repeated runs of a program start warm. A table is only loaded from a
+ * regular file of ours that no one else may write, and saved through a
+ * private temporary file. Only the process that loaded the table saves it,
+ * forked children do not.
+ */
+
+#define EXM_SITE_DEPTH 6        /* backtrace frames captured */
+#define EXM_SITE_SKIP 3         /* our own frames at the top */
+#define EXM_SITE_WARM 2         /* observations before a site is trusted */
+#define EXM_SITE_MAGIC "EXMSITE1"
+
+int exm_learn_mode = 0;
+size_t exm_learn_min = (size_t) 1 << 26;
+double exm_learn_lifetime = 1.0;
+double exm_learn_rate = (double) (1 << 28);
+char exm_learn_file[EXM_MAX_PATH_LEN] = "";
+
+/* A call site and what was learned about it */
+struct site
+{
+  uint64_t key;                 /* Backtrace hash, hash key */
+  unsigned long n;              /* Number of allocations observed */
+  double lifetime;              /* Mean lifetime in seconds */
+  double intensity;             /* Mean touched bytes per second */
+  UT_hash_handle hh;
+};
+
+/* A live allocation attributed to a site */
+struct live
+{
+  void *addr;                   /* Address, hash key */
+  size_t length;
+  uint64_t key;
+  double birth;
+  UT_hash_handle hh;
+};
+
+/* On-disk record, following the EXM_SITE_MAGIC header */
+struct site_record
+{
+  uint64_t key;
+  uint64_t n;
+  double lifetime;
+  double intensity;
+};
+
+static struct site *sites = NULL;
+static struct live *lives = NULL;
+static char *live_lo = NULL, *live_hi = NULL;
+static int loaded = 0;
+static pid_t owner = 0;
+static __thread int busy __attribute__ ((tls_model ("initial-exec")));
+
+static double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* FNV-1a */
+static uint64_t
+fnv (uint64_t h, const void *p, size_t n)
+{
+  const unsigned char *c = (const unsigned char *) p;
+  size_t i;
+  for (i = 0; i < n; ++i)
+    {
+      h ^= c[i];
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+/* Hash the caller's backtrace, skipping our own skip frames at the top.
+ * backtrace and dladdr may allocate on first use, which busy routes around.
+ */
+static uint64_t __attribute__ ((noinline))
+site_key (int skip)
+{
+  void *frames[EXM_SITE_DEPTH + EXM_SITE_SKIP + 1];
+  uint64_t h = 14695981039346656037ULL, off;
+  const char *name;
+  Dl_info info;
+  int i, n;
+
+  n = backtrace (frames, EXM_SITE_DEPTH + skip);
+  for (i = skip; i < n; ++i)
+    {
+      off = (uint64_t) (uintptr_t) frames[i];
+      if (dladdr (frames[i], &info) && info.dli_fbase)
+        {
+          off -= (uint64_t) (uintptr_t) info.dli_fbase;
+          name = info.dli_fname ? strrchr (info.dli_fname, '/') : NULL;
+          name = name ? name + 1 : info.dli_fname;
+          if (name)
+            h = fnv (h, name, strlen (name));
+        }
+      h = fnv (h, &off, sizeof (off));
+    }
+  return h;
+}
+
+/* Fold one observation into site s */
+static void
+observe (struct site *s, double lifetime, double intensity)
+{
+  double w;
+  s->n++;
+  w = s->n < 16 ? 1.0 / s->n : 1.0 / 16;
+  s->lifetime += w * (lifetime - s->lifetime);
+  s->intensity += w * (intensity - s->intensity);
+}
+
+static struct site *
+find_site (uint64_t key, int create)
+{
+  struct site *s;
+  HASH_FIND (hh, sites, &key, sizeof (key), s);
+  if (s || !create)
+    return s;
+  s = (struct site *) exm_map_alloc (sizeof (struct site));
+  if (!s)
+    return NULL;
+  memset (s, 0, sizeof (struct site));
+  s->key = key;
+  HASH_ADD (hh, sites, key, sizeof (s->key), s);
+  return s;
+}
+
+/* Load the saved table, once. The caller holds the lock. */
+static void
+load ()
+{
+  struct site_record r;
+  struct site *s;
+  struct stat st;
+  char magic[8];
+  int fd;
+
+  if (loaded)
+    return;
+  loaded = 1;
+  owner = getpid ();
+  if (!exm_learn_file[0])
+    snprintf (exm_learn_file, EXM_MAX_PATH_LEN, "%s/exm_sites.%u.%s",
+              exm_nlisted > 0 ? exm_tiers[exm_tier_order[0]].path
+              : exm_data_path, (unsigned) getuid (),
+              program_invocation_short_name);
+  fd = open (exm_learn_file, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0)
+    return;
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && st.st_uid == getuid ()
+      && !(st.st_mode & (S_IWGRP | S_IWOTH))
+      && read (fd, magic, sizeof (magic)) == sizeof (magic)
+      && memcmp (magic, EXM_SITE_MAGIC, sizeof (magic)) == 0)
+    {
+      while (read (fd, &r, sizeof (r)) == sizeof (r))
+        {
+          s = find_site (r.key, 1);
+          if (!s)
+            break;
+          s->n = (unsigned long) r.n;
+          s->lifetime = r.lifetime;
+          s->intensity = r.intensity;
+        }
+    }
+  close (fd);
+}
+
+/* Bytes of [addr, addr + length) resident in memory */
+static size_t
+resident (void *addr, size_t length)
+{
+  unsigned char vec[4096];
+  size_t page = (size_t) sysconf (_SC_PAGESIZE), total = 0, i, n, len;
+  char *p = (char *) ((uintptr_t) addr & ~(page - 1));
+  char *end = (char *) addr + length;
+
+  while (p < end)
+    {
+      len = (size_t) (end - p);
+      if (len > sizeof (vec) * page)
+        len = sizeof (vec) * page;
+      n = (len + page - 1) / page;
+      if (mincore (p, len, vec) < 0)
+        return 0;
+      for (i = 0; i < n; ++i)
+        total += vec[i] & 1;
+      p += n * page;
+    }
+  total *= page;
+  return total < length ? total : length;
+}
+
+/* Record the end of live allocation l and forget it */
+static void
+retire (struct live *l)
+{
+  struct site *s = find_site (l->key, 1);
+  double life = now () - l->birth;
+  if (s)
+    observe (s, life, resident (l->addr, l->length) / (life > 1e-6 ? life :
+                                                          1e-6));
+  HASH_DEL (lives, l);
+  exm_map_free (l);
+}
+
+/* Decide where an allocation of size bytes made by the caller of malloc,
+ * calloc or realloc belongs, returning the site key in *key (zero when the
+ * allocation is not attributed).
+ * OUTPUT (return value): 1 for an exm mapping, 0 for the default heap, -1 to
+ * follow the threshold
+ */
+int
+exm_site_route (size_t size, uint64_t * key)
+{
+  struct site *s;
+  int route = -1;
+  *key = 0;
+  if (!exm_learn_mode || size < exm_learn_min || busy)
+    return -1;
+  busy = 1;
+  *key = site_key (EXM_SITE_SKIP);
+  exm_lock ();
+  load ();
+  s = find_site (*key, 0);
+  if (s && s->n >= EXM_SITE_WARM)
+    route = s->lifetime >= exm_learn_lifetime
+      && s->intensity < exm_learn_rate ? 1 : 0;
+  exm_unlock ();
+  busy = 0;
+  return route;
+}
+
+/* The call site key of the allocation being traced (see trace.c), one frame
+ * further down than exm_site_route, so that both give the same keys
+ */
+uint64_t __attribute__ ((noinline))
+exm_site_hash (void)
+{
+  uint64_t key;
+  if (busy)
+    return 0;
+  busy = 1;
+  key = site_key (EXM_SITE_SKIP + 1);
+  busy = 0;
+  return key;
+}
+
+/* Start tracking an allocation attributed to site key */
+void
+exm_site_track (void *addr, size_t length, uint64_t key)
+{
+  struct live *l;
+  if (!key || !addr)
+    return;
+  l = (struct live *) exm_map_alloc (sizeof (struct live));
+  if (!l)
+    return;
+  l->addr = addr;
+  l->length = length;
+  l->key = key;
+  l->birth = now ();
+  exm_lock ();
+  HASH_ADD_PTR (lives, addr, l);
+  if (!live_lo || (char *) addr < live_lo)
+    live_lo = (char *) addr;
+  if ((char *) addr + length > live_hi)
+    live_hi = (char *) addr + length;
+  exm_unlock ();
+}
+
+/* Is addr possibly a tracked allocation? Cheap enough to call from free. */
+int
+exm_site_tracked (void *addr)
+{
+  return lives != NULL && (char *) addr >= live_lo && (char *) addr < live_hi;
+}
+
+/* An allocation is about to be freed (while still mapped) */
+void
+exm_site_free (void *addr)
+{
+  struct live *l;
+  exm_lock ();
+  HASH_FIND_PTR (lives, &addr, l);
+  if (l)
+    retire (l);
+  if (!lives)
+    live_lo = live_hi = NULL;
+  exm_unlock ();
+}
+
+/* A tracked allocation moved or changed size (realloc) */
+void
+exm_site_move (void *from, void *to, size_t length)
+{
+  struct live *l;
+  exm_lock ();
+  HASH_FIND_PTR (lives, &from, l);
+  if (l)
+    {
+      HASH_DEL (lives, l);
+      l->addr = to;
+      l->length = length;
+      HASH_ADD_PTR (lives, addr, l);
+      if ((char *) to < live_lo)
+        live_lo = (char *) to;
+      if ((char *) to + length > live_hi)
+        live_hi = (char *) to + length;
+    }
+  exm_unlock ();
+}
+
+/* Write the table to exm_learn_file, replacing it atomically. The caller
+ * holds the lock.
+ */
+static int
+save ()
+{
+  char tmp[EXM_MAX_PATH_LEN + 16];
+  struct site_record r;
+  struct site *s, *t;
+  int fd, j = 0;
+
+  if (!loaded || owner != getpid ())
+    return 0;
+  snprintf (tmp, sizeof (tmp), "%s.XXXXXX", exm_learn_file);
+  fd = mkostemp (tmp, O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (write (fd, EXM_SITE_MAGIC, 8) != 8)
+    j = -1;
+  HASH_ITER (hh, sites, s, t)
+  {
+    r.key = s->key;
+    r.n = s->n;
+    r.lifetime = s->lifetime;
+    r.intensity = s->intensity;
+    if (j == 0 && write (fd, &r, sizeof (r)) != sizeof (r))
+      j = -1;
+  }
+  close (fd);
+  if (j < 0 || rename (tmp, exm_learn_file) < 0)
+    {
+      syslog (LOG_CRIT, "exm unable to save call site table %s\n",
+              exm_learn_file);
+      unlink (tmp);
+      return -1;
+    }
+  return 0;
+}
+
+/* At exit, count allocations still live as lasting until now and save the
+ * table, unless learning was turned off (which saved it already). The caller
+ * holds the lock.
+ */
+void
+exm_site_finish ()
+{
+  struct live *l, *t;
+  HASH_ITER (hh, lives, l, t) retire (l);
+  live_lo = live_hi = NULL;
+  if (exm_learn_mode)
+    save ();
+}
+
+/* API: Set/get call-site learning
+ * INPUT j: negative to query, zero to stop learning (saving the table), one
+ *          to start
+ * OUTPUT (return value): 1 if learning is on, 0 otherwise
+ */
+int
+exm_learn (int j)
+{
+  exm_lock ();
+  if (j == 0 && exm_learn_mode)
+    save ();
+  if (j >= 0)
+    exm_learn_mode = j > 0;
+  if (exm_learn_mode)
+    load ();
+  j = exm_learn_mode;
+  exm_unlock ();
+  return j;
+}
+
+/* API: What was learned about the call sites
+ * INPUT i: site index, in no particular order
+ * OUTPUT: n, lifetime and intensity as above (pointers may be NULL)
+ *         (return value): site key or 0 when i is out of range
+ */
+uint64_t
+exm_site_info (int i, unsigned long *n, double *lifetime, double *intensity)
+{
+  struct site *s;
+  uint64_t key = 0;
+  exm_lock ();
+  for (s = sites; s && i > 0; s = (struct site *) s->hh.next, --i);
+  if (s && i == 0)
+    {
+      key = s->key;
+      if (n)
+        *n = s->n;
+      if (lifetime)
+        *lifetime = s->lifetime;
+      if (intensity)
+        *intensity = s->intensity;
+    }
+  exm_unlock ();
+  return key;
+}
@@ -0,0 +1,309 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Snapshots
+ *
+ * exm_snapshot (addr, dest) writes a point-in-time copy of an allocation to
+ * the file dest: a reflink (FICLONE) of the backing file where the file
+ * system supports it, otherwise a copy. It then starts tracking writes to
+ * the allocation, and each exm_snapshot_incremental (addr) brings dest up to
+ * date by writing only the pages written since the previous snapshot, which
+ * makes frequent checkpoints of large, slowly changing data cheap.
+ *
+ * Writes are tracked with write-protect faults through the fault dispatcher
+ * (see fault.c): after a snapshot the allocation is read-only, and the first
+ * write to each page faults, marks the page dirty in a bitmap and makes the
+ * page writable again. (Soft-dirty bits from /proc/self/pagemap would avoid
+ * the faults but need a kernel option and reset the bits of the whole
+ * process.) An incremental snapshot write-protects each dirty page again
+ * before copying it, so writes during the snapshot are not lost, but the
+ * copy is only a consistent point in time if writers pause during it.
+ *
+ * Faults raised inside the kernel never reach the handler, so a system call
+ * writing into a protected page fails with EFAULT. The read, pread and fread
+ * wrappers of io.c mark the pages of their buffer dirty and writable first
+ * (exm_snapshot_touch); other system calls (readv, recv, ...) need the pages
+ * written from user space beforehand, or tracking stopped.
+ *
+ * Tracking ends with exm_snapshot (addr, NULL), and when the allocation is
+ * freed or resized. Anonymous allocations (demote mode) are not supported,
+ * since migration write-protects them too; lazy ones are materialized first.
+ */
+
+struct snap
+{
+  char *dest;                   /* Snapshot file */
+  size_t page;                  /* Page size */
+  size_t npages;                /* Pages in the allocation */
+  unsigned long *dirty;         /* Pages written since the last snapshot */
+  char *addr;                   /* Allocation address */
+  int slot;                     /* Fault slot */
+};
+
+#define WORD_BITS (8 * sizeof (unsigned long))
+#define DIRTY(s, i) (__atomic_load_n (&(s)->dirty[(i) / WORD_BITS], \
+                                      __ATOMIC_RELAXED) \
+                     & (1UL << ((i) % WORD_BITS)))
+
+/* Fault callback: mark the written page dirty and let the write through.
+ * Runs in signal context, arg is the allocation's struct snap.
+ */
+static int
+snap_fault (void *addr, void *arg)
+{
+  struct snap *s = (struct snap *) arg;
+  size_t i = (size_t) ((char *) addr - s->addr) / s->page;
+  if (i >= s->npages)
+    return -1;
+  __atomic_fetch_or (&s->dirty[i / WORD_BITS], 1UL << (i % WORD_BITS),
+                     __ATOMIC_RELAXED);
+  return mprotect (s->addr + i * s->page, s->page, PROT_READ | PROT_WRITE)
+    == 0 ? 0 : -1;
+}
+
+/* Write length bytes at addr to fd at offset off
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+write_out (int fd, const char *addr, size_t length, off_t off)
+{
+  ssize_t s;
+  while (length > 0)
+    {
+      s = pwrite (fd, addr, length, off);
+      if (s < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      addr += s;
+      off += s;
+      length -= (size_t) s;
+    }
+  return 0;
+}
+
+/* Stop tracking writes to m, if it is tracked, while it is still mapped.
+ * The caller holds the lock.
+ */
+void
+exm_snapshot_stop (struct map *m)
+{
+  struct snap *s = m->snap;
+  if (!s)
+    return;
+  exm_fault_unregister (s->slot);
+  mprotect (m->addr, m->length, PROT_READ | PROT_WRITE);
+  exm_map_free (s->dest);
+  exm_map_free (s->dirty);
+  exm_map_free (s);
+  m->snap = NULL;
+  __atomic_fetch_sub (&exm_io_guard, 1, __ATOMIC_RELAXED);
+}
+
+/* Mark the pages of the tracked allocation m that hold [addr, addr +
+ * length) dirty and make them writable, for system calls that write them
+ * (see io.c). The caller holds the lock.
+ */
+void
+exm_snapshot_touch (struct map *m, const void *addr, size_t length)
+{
+  struct snap *s = m->snap;
+  char *p = (char *) addr, *end = p + length;
+  size_t i, k;
+  if (p < s->addr)
+    p = s->addr;
+  if (end > s->addr + m->length)
+    end = s->addr + m->length;
+  if (p >= end)
+    return;
+  i = (size_t) (p - s->addr) / s->page;
+  k = (size_t) (end - s->addr + s->page - 1) / s->page;
+  for (; i < k; ++i)
+    __atomic_fetch_or (&s->dirty[i / WORD_BITS], 1UL << (i % WORD_BITS),
+                       __ATOMIC_RELAXED);
+  i = (size_t) (p - s->addr) / s->page;
+  mprotect (s->addr + i * s->page, (k - i) * s->page, PROT_READ | PROT_WRITE);
+}
+
+/* Start tracking writes to m into a new struct snap for dest
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+track (struct map *m, const char *dest)
+{
+  struct snap *s = (struct snap *) exm_map_alloc (sizeof (struct snap));
+  size_t n;
+  if (!s)
+    return -1;
+  memset (s, 0, sizeof (struct snap));
+  s->page = (size_t) sysconf (_SC_PAGESIZE);
+  s->npages = (m->length + s->page - 1) / s->page;
+  s->addr = (char *) m->addr;
+  n = (s->npages + WORD_BITS - 1) / WORD_BITS * sizeof (unsigned long);
+  s->dirty = (unsigned long *) exm_map_alloc (n);
+  s->dest = (char *) exm_map_alloc (strlen (dest) + 1);
+  if (!s->dirty || !s->dest)
+    goto fail;
+  memset (s->dirty, 0, n);
+  strcpy (s->dest, dest);
+  if (exm_fault_init () < 0)
+    goto fail;
+  s->slot = exm_fault_register (m->addr, m->length, snap_fault, s);
+  if (s->slot < 0)
+    goto fail;
+  if (mprotect (m->addr, m->length, PROT_READ) < 0)
+    {
+      exm_fault_unregister (s->slot);
+      goto fail;
+    }
+  m->snap = s;
+  __atomic_fetch_add (&exm_io_guard, 1, __ATOMIC_RELAXED);
+  return 0;
+fail:
+  exm_map_free (s->dirty);
+  exm_map_free (s->dest);
+  exm_map_free (s);
+  return -1;
+}
+
+/* API: Snapshot an allocation
+ * INPUT addr: exm allocation address
+ *       dest: snapshot file path (created or replaced), or NULL to stop
+ *             tracking writes
+ * OUTPUT (return value): 0 on success, -1 on error (errno EINVAL when addr
+ *        is not an exm allocation of this process or is anonymous)
+ * After a snapshot, exm_snapshot_incremental updates dest in place. Until
+ * tracking stops, the allocation's pages are read-only to the kernel until
+ * the program writes them: read, pread and fread may fill it, other system
+ * calls writing into it fail with EFAULT.
+ */
+int
+exm_snapshot (void *addr, const char *dest)
+{
+  struct map *m;
+  int fd, src, j = -1;
+
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (!m || m->pid != getpid () || m->kind == EXM_ANON
+      || m->kind == EXM_DEMOTED)
+    {
+      errno = EINVAL;
+      goto done;
+    }
+  exm_snapshot_stop (m);
+  if (!dest)
+    {
+      j = 0;
+      goto done;
+    }
+  if (m->kind == EXM_LAZY && exm_lazy_settle (m) < 0)
+    goto done;
+  if (m->kind == EXM_PAGED && exm_pager_settle (m) < 0)
+    goto done;
+  fd = open (dest, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    goto done;
+/* Track writes from before the copy starts, so none is missed */
+  if (track (m, dest) < 0)
+    {
+      close (fd);
+      goto done;
+    }
+/* Reflink or copy a single backing file, otherwise copy from memory */
+  src = m->nstripes > 0 || m->mapped ? -1 : open (m->path, O_RDONLY);
+  if (src >= 0 && ioctl (fd, FICLONE, src) == 0)
+    j = 0;
+  else if (src >= 0
+           && sendfile_loop (fd, src, m->length) == (ssize_t) m->length)
+    j = 0;
+  else if (ftruncate (fd, 0) == 0)
+    j = write_out (fd, (const char *) m->addr, m->length, 0);
+  if (src >= 0)
+    close (src);
+  close (fd);
+  if (j < 0)
+    exm_snapshot_stop (m);
+done:
+  exm_unlock ();
+  return j;
+}
+
+/* API: Update the snapshot of an allocation with the pages written since
+ * the previous snapshot
+ * INPUT addr: exm allocation address given to exm_snapshot
+ * OUTPUT (return value): number of pages written to the snapshot file, or
+ *        -1 on error (errno EINVAL when no snapshot of addr is tracked)
+ */
+ssize_t
+exm_snapshot_incremental (void *addr)
+{
+  struct map *m;
+  struct snap *s;
+  size_t i, k, n = 0;
+  ssize_t j = -1;
+  int fd;
+
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (!m || !m->snap || m->pid != getpid ())
+    {
+      errno = EINVAL;
+      goto done;
+    }
+  s = m->snap;
+  fd = open (s->dest, O_WRONLY);
+  if (fd < 0)
+    goto done;
+  for (i = 0; i < s->npages;)
+    {
+      if (!DIRTY (s, i))
+        {
+          i = i % WORD_BITS == 0 && s->dirty[i / WORD_BITS] == 0
+            ? i + WORD_BITS : i + 1;
+          continue;
+        }
+/* Copy the run of dirty pages [i, k), clearing their bits and
+ * write-protecting them first so that later writes fault again.
+ */
+      for (k = i; k < s->npages && DIRTY (s, k); ++k)
+        __atomic_fetch_and (&s->dirty[k / WORD_BITS],
+                            ~(1UL << (k % WORD_BITS)), __ATOMIC_RELAXED);
+      mprotect (s->addr + i * s->page, (k - i) * s->page, PROT_READ);
+      if (write_out (fd, s->addr + i * s->page,
+                     (k < s->npages ? k * s->page : m->length) - i * s->page,
+                     (off_t) (i * s->page)) < 0)
+        {
+          close (fd);
+          goto done;
+        }
+      n += k - i;
+      i = k;
+    }
+  close (fd);
+  j = (ssize_t) n;
+done:
+  exm_unlock ();
+  return j;
+}
@@ -0,0 +1,206 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "uthash.h"
+#include "exm.h"
+#include "libexm.h"
+
+/* Statistics
+ *
+ * exm_stats fills a struct exm_stats (see libexm.h) with event counters,
+ * the bytes in live allocations and backing files, the time spent waiting
+ * for the lock, the threshold in effect and why it last changed (see
+ * pressure.c), and latency histograms of the malloc, free, realloc and fork
+ * calls that involve exm mappings. exm_map_info walks the allocations and
+ * reports how much of each is resident (mincore).
+ *
+ * Events are counted on the allocation paths, so counting must be cheap:
+ * each thread adds to one of EXM_STATS_STRIPES cache-line aligned counter
+ * blocks, picked round robin on its first event, with relaxed atomic adds
+ * that rarely contend; exm_stats sums the blocks. Only calls that reach exm
+ * are timed, calls passed to the default allocator cost nothing extra.
+ */
+
+#define EXM_STATS_STRIPES 16
+
+struct counters
+{
+  uint64_t n[EXM_STAT_N];
+  uint64_t latency[EXM_OPS][EXM_STATS_BUCKETS];
+} __attribute__ ((aligned (64)));
+
+static struct counters stripes[EXM_STATS_STRIPES];
+static __thread int stripe = -1;
+static int nthreads;
+
+static struct counters *
+mine (void)
+{
+  if (stripe < 0)
+    stripe = __atomic_fetch_add (&nthreads, 1, __ATOMIC_RELAXED)
+      % EXM_STATS_STRIPES;
+  return &stripes[stripe];
+}
+
+/* Monotonic clock in nanoseconds */
+uint64_t
+exm_clock (void)
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000ULL + (uint64_t) t.tv_nsec;
+}
+
+/* Add n to counter (EXM_STAT_*) */
+void
+exm_stats_count (int counter, uint64_t n)
+{
+  __atomic_fetch_add (&mine ()->n[counter], n, __ATOMIC_RELAXED);
+}
+
+/* Record an operation (EXM_OP_*) that started at time start (exm_clock) */
+void
+exm_stats_time (int op, uint64_t start)
+{
+  uint64_t ns = exm_clock () - start;
+  int b = ns ? 64 - __builtin_clzll (ns) : 0;
+  if (b >= EXM_STATS_BUCKETS)
+    b = EXM_STATS_BUCKETS - 1;
+  __atomic_fetch_add (&mine ()->latency[op][b], 1, __ATOMIC_RELAXED);
+}
+
+/* Slow path of exm_lock: block on the lock and account for the wait */
+void
+exm_lock_wait (void)
+{
+  uint64_t t = exm_clock (), ns;
+  pthread_mutex_lock (&lock.mutex);
+  ns = exm_clock () - t;
+  exm_stats_count (EXM_STAT_LOCK_WAITS, 1);
+  exm_stats_count (EXM_STAT_LOCK_NS, ns);
+  EXM_PROBE1 (lock__wait, ns);
+}
+
+/* API: Collect statistics
+ * OUTPUT s: filled in, see libexm.h
+ *        (return value): 0 on success, -1 on error (errno EINVAL when s is
+ *        NULL)
+ */
+int
+exm_stats (struct exm_stats *s)
+{
+  uint64_t n[EXM_STAT_N];
+  struct map *m, *tmp;
+  size_t in, out, t, limit, avail;
+  unsigned long changes;
+  double psi;
+  int i, j, k, why;
+
+  if (!s)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  memset (s, 0, sizeof (struct exm_stats));
+  memset (n, 0, sizeof (n));
+  for (i = 0; i < EXM_STATS_STRIPES; ++i)
+    {
+      for (j = 0; j < EXM_STAT_N; ++j)
+        n[j] += __atomic_load_n (&stripes[i].n[j], __ATOMIC_RELAXED);
+      for (j = 0; j < EXM_OPS; ++j)
+        for (k = 0; k < EXM_STATS_BUCKETS; ++k)
+          s->latency[j][k] +=
+            __atomic_load_n (&stripes[i].latency[j][k], __ATOMIC_RELAXED);
+    }
+  s->allocations = n[EXM_STAT_ALLOCS];
+  s->frees = n[EXM_STAT_FREES];
+  s->reallocs = n[EXM_STAT_REALLOCS];
+  s->realloc_moves = n[EXM_STAT_MOVES];
+  s->forks = n[EXM_STAT_FORKS];
+  s->fork_remaps = n[EXM_STAT_REMAPS];
+  s->memcpy_fast = n[EXM_STAT_MEMCPY];
+  s->lock_waits = n[EXM_STAT_LOCK_WAITS];
+  s->lock_wait_ns = n[EXM_STAT_LOCK_NS];
+  s->compressed_raw = n[EXM_STAT_COMPRESS_RAW];
+  s->compressed_stored = n[EXM_STAT_COMPRESS_STORED];
+  s->decompressions = n[EXM_STAT_DECOMPRESS];
+  s->decompress_ns = n[EXM_STAT_DECOMPRESS_NS];
+  exm_zerocopy_info (&in, &out);
+  s->zerocopy_in = in;
+  s->zerocopy_out = out;
+  exm_lock ();
+  exm_pressure_state (&t, &why, &limit, &avail, &psi, &changes);
+  s->threshold = t;
+  s->threshold_reason = why;
+  s->threshold_changes = changes;
+  s->mem_limit = limit;
+  s->mem_avail = avail;
+  s->mem_psi = (uint64_t) (psi * 100 + 0.5);
+  HASH_ITER (hh, flexmap, m, tmp)
+  {
+    s->maps++;
+    s->bytes_mapped += m->length;
+  }
+  s->file_bytes = exm_tier_total;
+  s->peak_file_bytes = exm_tier_peak;
+  exm_unlock ();
+  return 0;
+}
+
+/* API: Describe an allocation
+ * INPUT i: allocation index, in address order
+ * OUTPUT: length, resident bytes (mincore) and tier index (-1 for none) of
+ *         the allocation (pointers may be NULL)
+ *         (return value): allocation address or NULL when i is out of range
+ * exm_lookup gives the backing file of the address.
+ */
+void *
+exm_map_info (int i, size_t *length, size_t *resident, int *tier)
+{
+  struct map *m;
+  size_t page = (size_t) sysconf (_SC_PAGESIZE), r, k, n, j;
+  unsigned char vec[4096];
+  void *p = NULL;
+
+  exm_lock ();
+  for (m = flexmap; m && i > 0; m = (struct map *) m->hh.next, --i);
+  if (m && i == 0)
+    {
+      p = m->addr;
+      if (length)
+        *length = m->length;
+      if (tier)
+        *tier = m->tier;
+      if (resident)
+        {
+/* mincore in slices to keep the vector on the stack */
+          r = 0;
+          for (k = 0; k < m->length; k += n * page)
+            {
+              n = (m->length - k + page - 1) / page;
+              if (n > sizeof (vec))
+                n = sizeof (vec);
+              if (mincore ((char *) m->addr + k, n * page, vec) < 0)
+                break;
+              for (j = 0; j < n; ++j)
+                r += vec[j] & 1;
+            }
+          *resident = r * page < m->length ? r * page : m->length;
+        }
+    }
+  exm_unlock ();
+  return p;
+}
@@ -0,0 +1,325 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Striped allocations
+ *
+ * When exm_stripe_size is nonzero, allocations larger than one stripe are
+ * composed of several backing files of exm_stripe_size bytes each (the last
+ * one may be shorter), placed round-robin across the tiers with room. The
+ * stripe files are mapped with MAP_FIXED into one reserved contiguous address
+ * range, so the allocation looks like any other to the program, while
+ * sequential access is spread over several devices.
+ *
+ * For a striped map m, m->nstripes > 0 and m->stripes lists the backing
+ * files in address order. m->path holds a copy of the first stripe's path.
+ * All functions here assume that the caller holds the lock.
+ */
+
+size_t exm_stripe_size = 0;
+
+/* Length of stripe i of an allocation of length bytes and stripe size s */
+static size_t
+stripe_length (size_t length, size_t s, int i)
+{
+  size_t off = (size_t) i * s;
+  return length - off < s ? length - off : s;
+}
+
+/* Create backing files so that m->stripes covers length bytes, reusing and
+ * resizing m's existing stripes and unlinking surplus ones.
+ * OUTPUT (return value): 0 on success, -1 on error (m is unchanged except for
+ * the sizes of existing stripe files)
+ */
+static int
+stripe_layout (struct map *m, size_t length)
+{
+  struct stripe *s;
+  int i, fd, tier, n;
+  size_t len, stripe = m->stripe_size > 0 ? m->stripe_size : exm_stripe_size;
+
+  n = (int) ((length + stripe - 1) / stripe);
+  s = (struct stripe *) exm_map_alloc (n * sizeof (struct stripe));
+  if (!s)
+    return -1;
+  memset (s, 0, n * sizeof (struct stripe));
+  tier = m->nstripes > 0 ? m->stripes[m->nstripes - 1].tier : -1;
+  for (i = 0; i < n; ++i)
+    {
+      len = stripe_length (length, stripe, i);
+      if (i < m->nstripes)
+        {
+          s[i] = m->stripes[i];
+          m->stripes[i].path = NULL;
+          if (s[i].length != len && truncate (s[i].path, len) == 0)
+            {
+              exm_tier_release (s[i].tier, s[i].length);
+              exm_tier_charge (s[i].tier, len);
+              s[i].length = len;
+            }
+          continue;
+        }
+      s[i].path = (char *) exm_map_alloc (EXM_MAX_PATH_LEN);
+      tier = s[i].path ? exm_tier_next (tier, len) : -1;
+      if (tier < 0)
+        goto bail;
+      snprintf (s[i].path, EXM_MAX_PATH_LEN, "%s/exm%ld_XXXXXX",
+                exm_tiers[tier].path, (long int) getpid ());
+      fd = mkostemp (s[i].path, O_RDWR | O_CREAT);
+      if (fd < 0)
+        goto bail;
+      if (ftruncate (fd, len) < 0)
+        {
+          close (fd);
+          unlink (s[i].path);
+          goto bail;
+        }
+      close (fd);
+      s[i].length = len;
+      s[i].tier = tier;
+      exm_tier_charge (tier, len);
+    }
+  for (i = n; i < m->nstripes; ++i)
+    {
+      unlink (m->stripes[i].path);
+      exm_tier_release (m->stripes[i].tier, m->stripes[i].length);
+    }
+  exm_stripes_free (m);
+  m->stripes = s;
+  m->nstripes = n;
+  m->stripe_size = stripe;
+  snprintf (m->path, EXM_MAX_PATH_LEN, "%s", s[0].path);
+  return 0;
+
+bail:
+  syslog (LOG_CRIT, "exm unable to create stripe %d\n", i);
+  for (n = i, i = 0; i <= n; ++i)
+    {
+      if (i < m->nstripes)
+        {
+          m->stripes[i].path = s[i].path;
+          continue;
+        }
+      if (s[i].path && s[i].length > 0)
+        {
+          unlink (s[i].path);
+          exm_tier_release (s[i].tier, s[i].length);
+        }
+      exm_map_free (s[i].path);
+    }
+  exm_map_free (s);
+  return -1;
+}
+
+/* Map the stripe files of m into one contiguous range.
+ * INPUT addr: NULL to reserve a new range, otherwise the (already mapped)
+ *       address range to replace with MAP_FIXED
+ *       flags: MAP_SHARED or MAP_PRIVATE
+ *       paths: stripe file paths, normally those of m
+ * OUTPUT (return value): the address or MAP_FAILED
+ */
+static void *
+stripe_mmap (struct map *m, void *addr, int flags, struct stripe *paths)
+{
+  int i, fd;
+  char *base, *p;
+
+  if (addr == NULL)
+    addr = mmap (NULL, m->length, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED)
+    return MAP_FAILED;
+  base = (char *) addr;
+  for (i = 0; i < m->nstripes; ++i)
+    {
+      fd = open (paths[i].path, O_RDWR);
+      if (fd < 0)
+        break;
+      p = mmap (base + (size_t) i * m->stripe_size, m->stripes[i].length,
+                PROT_READ | PROT_WRITE, MAP_FIXED | flags, fd, 0);
+      close (fd);
+      if (p == MAP_FAILED)
+        break;
+    }
+  if (i < m->nstripes)
+    {
+      syslog (LOG_CRIT, "exm stripe mmap failure %d\n", i);
+      munmap (addr, m->length);
+      return MAP_FAILED;
+    }
+  return addr;
+}
+
+/* Create a new striped mapping of length bytes for m.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+int
+exm_stripe_new (struct map *m, size_t length)
+{
+  m->length = length;
+  if (stripe_layout (m, length) < 0)
+    return -1;
+  m->addr = stripe_mmap (m, NULL, MAP_SHARED, m->stripes);
+  if (m->addr == MAP_FAILED)
+    {
+      exm_stripe_unlink (m);
+      return -1;
+    }
+  return 0;
+}
+
+/* Resize the (unmapped) striped allocation m to length bytes and map it.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+int
+exm_stripe_resize (struct map *m, size_t length)
+{
+  if (stripe_layout (m, length) < 0)
+    return -1;
+  m->length = length;
+  m->addr = stripe_mmap (m, NULL, MAP_SHARED, m->stripes);
+  return m->addr == MAP_FAILED ? -1 : 0;
+}
+
+/* Remap the parent's striped mapping m in a forked child at the same address
+ * as remap, using the exm_child_cow setting (see fork in exm.c).
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+int
+exm_stripe_fork (struct map *remap, struct map *m, int cow)
+{
+  int i, fd, src_fd;
+  void *p;
+
+  remap->length = m->length;
+  remap->stripe_size = m->stripe_size;
+  remap->nstripes = 0;
+  if (cow != 2)
+    {
+      p = stripe_mmap (m, m->addr, MAP_PRIVATE, m->stripes);
+      if (p == MAP_FAILED)
+        return -1;
+      remap->stripes = (struct stripe *)
+        exm_map_alloc (m->nstripes * sizeof (struct stripe));
+      if (!remap->stripes)
+        return -1;
+      for (i = 0; i < m->nstripes; ++i)
+        {
+          remap->stripes[i] = m->stripes[i];
+          remap->stripes[i].path = (char *) exm_map_alloc (EXM_MAX_PATH_LEN);
+          if (remap->stripes[i].path)
+            snprintf (remap->stripes[i].path, EXM_MAX_PATH_LEN, "%s",
+                      m->stripes[i].path);
+        }
+      remap->nstripes = m->nstripes;
+      snprintf (remap->path, EXM_MAX_PATH_LEN, "%s", m->path);
+      return 0;
+    }
+/* Duplicate each stripe file (possibly in a different tier), then map the
+ * copies over the parent's address range.
+ */
+  if (stripe_layout (remap, m->length) < 0)
+    return -1;
+  for (i = 0; i < m->nstripes; ++i)
+    {
+      fd = open (remap->stripes[i].path, O_RDWR);
+      src_fd = open (m->stripes[i].path, O_RDONLY);
+      if (fd >= 0 && src_fd >= 0)
+        sendfile_loop (fd, src_fd, m->stripes[i].length);
+      if (fd >= 0)
+        close (fd);
+      if (src_fd >= 0)
+        close (src_fd);
+    }
+  p = stripe_mmap (remap, m->addr, MAP_SHARED, remap->stripes);
+  if (p == MAP_FAILED)
+    {
+      exm_stripe_unlink (remap);
+      return -1;
+    }
+  return 0;
+}
+
+/* Unlink all stripe files of m and release their tier space */
+void
+exm_stripe_unlink (struct map *m)
+{
+  int i;
+  for (i = 0; i < m->nstripes; ++i)
+    {
+      unlink (m->stripes[i].path);
+      exm_tier_release (m->stripes[i].tier, m->stripes[i].length);
+    }
+}
+
+/* Free the stripe list of m (not the files) */
+void
+exm_stripes_free (struct map *m)
+{
+  int i;
+  if (!m->stripes)
+    return;
+  for (i = 0; i < m->nstripes; ++i)
+    exm_map_free (m->stripes[i].path);
+  exm_map_free (m->stripes);
+  m->stripes = NULL;
+  m->nstripes = 0;
+}
+
+/* Colon-separated list of the stripe file paths of m, strdup-style allocated
+ * for the caller to free.
+ */
+char *
+exm_stripe_paths (struct map *m)
+{
+  int i;
+  size_t n = 0;
+  char *p;
+  for (i = 0; i < m->nstripes; ++i)
+    n += strlen (m->stripes[i].path) + 1;
+  p = (char *) malloc (n + 1);
+  if (!p)
+    return NULL;
+  p[0] = 0;
+  for (i = 0; i < m->nstripes; ++i)
+    {
+      if (i > 0)
+        strcat (p, ":");
+      strcat (p, m->stripes[i].path);
+    }
+  return p;
+}
+
+/* API: Set/get the stripe size
+ * INPUT j: negative to query, zero to disable striping, otherwise the new
+ *          stripe size in bytes (rounded up to a multiple of the page size)
+ * OUTPUT (return value): the stripe size in effect
+ */
+size_t
+exm_stripe (ssize_t j)
+{
+  size_t page = (size_t) sysconf (_SC_PAGESIZE);
+  exm_lock ();
+  if (j >= 0)
+    exm_stripe_size = (((size_t) j + page - 1) / page) * page;
+  j = exm_stripe_size;
+  exm_unlock ();
+  return (size_t) j;
+}
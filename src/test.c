@@ -7,17 +7,108 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <string.h>
-#include <dlfcn.h>
 #include <signal.h>
+#include <pthread.h>
 
-void
-check_error ()
+#include "libexm.h"
+#include "monitor.h"
+#include "trace.h"
+
+/* More than the fault dispatcher's slots (see fault.c) */
+#define MANY 4100
+
+static volatile int writing;
+
+/* Wait for a child killed by a signal, which left its monitor segment
+ * behind (see monitor.c)
+ */
+static void
+reap (pid_t p)
+{
+  char path[64];
+  waitpid (p, NULL, 0);
+  snprintf (path, sizeof (path), "%s/%s%d", EXM_MONITOR_DIR,
+            EXM_MONITOR_PREFIX, (int) p);
+  unlink (path);
+}
+
+/* Keep writing to an allocation while the main thread migrates it */
+static void *
+writer (void *x)
+{
+  do
+    ((volatile char *) x)[4096] = 1;
+  while (writing);
+  return NULL;
+}
+
+/* One thread of the thread-local override test: allocate size bytes a few
+ * times under its own threshold (zero for none) or a pushed heap scope, and
+ * count allocations that did not land where expected.
+ */
+struct job
+{
+  size_t threshold;
+  int push;
+  size_t size;
+  int expect_exm;
+  int fails;
+};
+
+
+static void *
+local_job (void *arg)
+{
+  struct job *job = (struct job *) arg;
+  char *path;
+  void *x;
+  int j;
+  if (job->threshold > 0)
+    exm_threshold_local (job->threshold);
+  if (job->push)
+    exm_policy_push (0, "backend=heap");
+  for (j = 0; j < 20; ++j)
+    {
+      x = malloc (job->size);
+      path = exm_lookup (x);
+      if ((path != NULL) != job->expect_exm)
+        job->fails++;
+      free (path);
+      free (x);
+    }
+  if (job->push && exm_policy_pop () != 0)
+    job->fails++;
+  exm_threshold_local (0);
+  return NULL;
+}
+
+/* One thread of the concurrency test: allocations, copies and frees on and
+ * off exm from several threads at once, counting corrupted data
+ */
+static void *
+churn_job (void *arg)
 {
-  char *derror;
-  if ((derror = dlerror ()) == NULL)
-    return;
-  fprintf (stderr, "%s\n", derror);
-  _exit (1);
+  struct job *job = (struct job *) arg;
+  char *a, *b, *s, small[256];
+  int j;
+  for (j = 0; j < 50; ++j)
+    {
+      a = exm_malloc (job->size, 0);
+      b = exm_malloc (job->size, 0);
+      memset (a, j, job->size);
+      memcpy (b, a, job->size);
+      if (posix_memalign ((void **) &s, 4096, sizeof (small)) != 0)
+        return NULL;
+      memset (small, j + 1, sizeof (small));
+      memcpy (s, small, sizeof (small));
+      if (b[job->size - 1] != (char) j || s[sizeof (small) - 1] != j + 1)
+        job->fails++;
+      free (s);
+      free (a);
+      b = realloc (b, 2 * job->size);
+      free (b);
+    }
+  return NULL;
 }
 
 int
@@ -29,35 +120,52 @@ main (int argc, void **argv)
   char *path;
   size_t SIZE = 1000000;
   void *x1, *x2, *x3;
+  pid_t p;
+  size_t allocated, capacity;
+  FILE *f;
+  int on_exm = 0;
+  struct job jobs[4] = {
+    {100000, 0, 500000, 1, 0},  /* low thread threshold: exm */
+    {1000000000, 0, 2000000, 0, 0},     /* high thread threshold: heap */
+    {0, 1, 2000000, 0, 0},      /* pushed heap scope */
+    {0, 0, 2000000, 1, 0}       /* process threshold */
+  };
+  struct job churn[4];
+  pthread_t threads[4];
+  pthread_t thread;
+  struct monitor *mon;
+  struct trace_header th;
+  struct trace_event ev[5];
+  char line[256];
+  char buf[64];
+  struct exm_stats stats;
+  uint64_t frees;
+  size_t paged_in, paged_out;
+  int fds[2];
+  void **many;
 
-  size_t (*set_threshold) (size_t);
-  int (*exm_madvise) (void *, int);
-  int (*exm_cow) (int);
-  char *(*exm_path) (char *);
-  void (*exm_debug_list) (void);
-  void *handle;
-  handle = dlopen (NULL, RTLD_LAZY);
-  if (!handle)
-    return 2;
-  set_threshold = (size_t (*)(size_t)) dlsym (handle, "exm_threshold");
-  check_error ();
-  exm_madvise = (int (*)(void *, int)) dlsym (handle, "exm_madvise");
-  check_error ();
-  exm_cow = (int (*)(int)) dlsym (handle, "exm_cow");
-  check_error ();
-  exm_path = (char *(*)(char *)) dlsym (handle, "exm_path");
-  check_error ();
-  exm_debug_list = (void (*)(void)) dlsym (handle, "exm_debug_list");
-  check_error ();
-  dlclose (handle);
-
-  printf ("> initial threshold %lu\n", (*set_threshold) (0));
-  printf ("> set_threshold() %lu\n", (*set_threshold) (SIZE));
-
-  path = (*exm_path) (NULL);
+  printf ("> initial threshold %lu\n", exm_threshold (0));
+  printf ("> exm_threshold_auto(1, 0) %d\n", exm_threshold_auto (1, 0));
+  printf ("> auto threshold %lu (%s)\n", exm_threshold (0),
+          exm_threshold_reason ());
+  printf ("> exm_threshold() %lu\n", exm_threshold (SIZE));
+  if (exm_threshold_auto (-1, 0) != 0 || exm_threshold (0) != SIZE)
+    {
+      fprintf (stderr, "setting a threshold did not leave auto mode\n");
+      return 1;
+    }
+  exm_stats (&stats);
+  if (stats.threshold != SIZE || stats.threshold_reason != 0
+      || stats.threshold_changes == 0)
+    {
+      fprintf (stderr, "threshold missing from the statistics\n");
+      return 1;
+    }
+
+  path = exm_path (NULL);
   printf ("> exm_path(NULL) %s\n", path);
   free (path);
-  path = (*exm_path) ("/tmp");
+  path = exm_path ("/tmp");
   printf ("> exm_path(\"/tmp\") %s\n", path);
 
   printf ("> malloc below threshold\n");
@@ -68,7 +176,30 @@ main (int argc, void **argv)
   printf ("> malloc above threshold\n");
   x = malloc (SIZE + 1);
   memcpy (x, (const void *) y, strlen (y));
-  printf ("> exm_madvise(x, 1) = %d\n", (*exm_madvise) ((void *) x, 1));
+  printf ("> exm_madvise(x, 1) = %d\n", exm_madvise ((void *) x, 1));
+  free (x);
+
+
+  printf ("> exm_malloc below threshold with hints\n");
+  x = exm_malloc (1000, EXM_RANDOM | EXM_PREFAULT);
+  path = exm_lookup (x);
+  printf ("> exm_lookup(x) %s\n", path);
+  if (!path)
+    {
+      fprintf (stderr, "exm_malloc did not go out of core\n");
+      return 1;
+    }
+  free (path);
+  memcpy (x, (const void *) y, strlen (y));
+  x = realloc (x, 2000);
+  exm_free (x);
+  x = exm_calloc (10, 100, EXM_SEQUENTIAL);
+  for (j = 0; j < 1000; ++j)
+    if (((char *) x)[j] != 0)
+      {
+        fprintf (stderr, "exm_calloc memory not zeroed\n");
+        return 1;
+      }
   free (x);
 
 
@@ -106,10 +237,691 @@ main (int argc, void **argv)
   free (x3);
 
 
+  printf ("> fill-first tiers spill to the second tier\n");
+  path = exm_path ("/tmp@1500000:/dev/shm");
+  x1 = malloc (SIZE + 1);
+  x2 = malloc (2 * SIZE);
+  for (j = 0; (path = exm_tier_info (j, &allocated, &capacity, NULL));
+       ++j)
+    {
+      printf ("> tier %d %s allocated %lu capacity %lu\n", j, path,
+              allocated, capacity);
+      free (path);
+    }
+  path = exm_lookup (x2);
+  if (strncmp (path, "/dev/shm/", 9) != 0)
+    {
+      fprintf (stderr, "second allocation not in second tier: %s\n", path);
+      return 1;
+    }
+  free (path);
+/* Reordering the tiers must not confuse the accounting of live allocations */
+  path = exm_path ("/dev/shm:/tmp");
+  free (x1);
+  free (x2);
+  for (j = 0; (path = exm_tier_info (j, &allocated, NULL, NULL)); ++j)
+    {
+      free (path);
+      if (allocated != 0)
+        {
+          fprintf (stderr, "tier %d accounting drifted: %lu\n", j,
+                   allocated);
+          return 1;
+        }
+    }
+  path = exm_path ("/tmp");
+
+
+  printf ("> striped malloc + realloc across two directories\n");
+  path = exm_path ("/tmp:/dev/shm");
+  printf ("> exm_stripe(%lu) %lu\n", SIZE / 4, exm_stripe (SIZE / 4));
+  x = malloc (SIZE + 1);
+  memset (x, 7, SIZE + 1);
+  path = exm_lookup (x);
+  printf ("> exm_lookup(x) %s\n", path);
+  free (path);
+  printf ("> exm_madvise(x, 1) = %d\n", exm_madvise ((void *) x, 1));
+  x = realloc (x, 2 * SIZE);
+  for (j = 0; j < SIZE + 1; ++j)
+    if (((char *) x)[j] != 7)
+      {
+        fprintf (stderr, "striped realloc lost data at %d\n", j);
+        return 1;
+      }
+  memset (x, 8, 2 * SIZE);
+  fflush (stdout);
+  p = fork ();
+  if (p == 0)                   // child
+    {
+      memset (x, 9, 2 * SIZE);
+      free (x);
+      exit (0);
+    }
+  waitpid (p, &status, 0);
+  if (((char *) x)[2 * SIZE - 1] != 8)
+    {
+      fprintf (stderr, "striped copy on write fork changed parent data\n");
+      return 1;
+    }
+  free (x);
+  exm_stripe (0);
+  path = exm_path ("/tmp");
+
+
+  printf ("> demote mode: anonymous allocation demoted and promoted\n");
+  exm_demote (1);
+  x = malloc (SIZE + 1);
+  memset (x, 3, SIZE + 1);
+  if ((path = exm_lookup (x)) != NULL)
+    {
+      fprintf (stderr, "demote mode allocation is file-backed: %s\n", path);
+      return 1;
+    }
+  writing = 1;
+  pthread_create (&thread, NULL, writer, x);
+  printf ("> exm_migrate(x, 1) = %d\n", exm_migrate (x, 1));
+  path = exm_lookup (x);
+  printf ("> demoted to %s\n", path);
+  free (path);
+  printf ("> exm_migrate(x, 0) = %d\n", exm_migrate (x, 0));
+  writing = 0;
+  pthread_join (thread, NULL);
+  for (j = 0; j < SIZE + 1; ++j)
+    if (((char *) x)[j] != (j == 4096 ? 1 : 3))
+      {
+        fprintf (stderr, "migration lost data at %d\n", j);
+        return 1;
+      }
+  free (x);
+  exm_demote (0);
+
+
+  printf ("> lazy mode: backing file created on first touch\n");
+  exm_lazy (1);
+  x = malloc (SIZE * 4);
+  x = realloc (x, SIZE * 2);
+  if ((path = exm_lookup (x)) != NULL)
+    {
+      fprintf (stderr, "untouched lazy allocation has a file: %s\n", path);
+      return 1;
+    }
+  ((char *) x)[SIZE] = 7;
+  path = exm_lookup (x);
+  printf ("> touched: %s\n", path);
+  on_exm = path != NULL;
+  free (path);
+  x = realloc (x, SIZE * 8);
+  if (!on_exm || ((char *) x)[SIZE] != 7 || ((char *) x)[SIZE * 7] != 0)
+    {
+      fprintf (stderr, "lazy allocation not materialized\n");
+      return 1;
+    }
+  free (x);
+/* More lazy allocations than fault slots: the rest are mapped eagerly */
+  many = (void **) malloc (MANY * sizeof (void *));
+  for (j = 0, status = 1; j < MANY; ++j)
+    status = (many[j] = malloc (SIZE * 2)) != NULL && status;
+  if (!status)
+    {
+      fprintf (stderr, "lazy malloc failed with the fault table full\n");
+      return 1;
+    }
+  for (j = 4; j < MANY; ++j)
+    free (many[j]);
+  f = fopen ("/tmp/exm_test_lazy", "w");
+  for (j = 0; j < SIZE; ++j)
+    fputc ('a' + j % 26, f);
+  fclose (f);
+  x = malloc (SIZE * 4);
+  j = open ("/tmp/exm_test_lazy", O_RDONLY);
+  status = pread (j, (char *) x + SIZE * 2, SIZE, 0) == SIZE
+    && pread (j, many[0], SIZE, 0) == SIZE;
+  close (j);
+  unlink ("/tmp/exm_test_lazy");
+  if (!status || ((char *) x)[SIZE * 2 + 27] != 'b'
+      || ((char *) many[0])[27] != 'b')
+    {
+      fprintf (stderr, "read into a lazy allocation failed\n");
+      return 1;
+    }
+  free (x);
+  for (j = 0; j < 4; ++j)
+    free (many[j]);
+  free (many);
+  exm_lazy (0);
+
+
+  printf ("> pager mode: writes beyond a 2M budget go to the backing file\n");
+/* A live lazy allocation makes the I/O wrappers take the lock */
+  exm_lazy (1);
+  x2 = malloc (SIZE * 2);
+  exm_lazy (0);
+  exm_pager (2000000);
+  x = malloc (SIZE * 8);
+  for (j = 0; j < SIZE * 8; j += 1000)
+    ((char *) x)[j] = (char) (j / 1000);
+/* read() into a cluster that was written back: a fault in the kernel */
+  if (pipe (fds) == 0)
+    {
+      write (fds[1], "pager", 5);
+      read (fds[0], (char *) x + 1, 5);
+      close (fds[0]);
+      close (fds[1]);
+    }
+  x1 = (void *) exm_pager_info (&paged_in, &paged_out);
+  printf ("> resident %lu, in %lu, out %lu\n", (size_t) x1, paged_in,
+          paged_out);
+  if (paged_out == 0)
+    printf ("> pager not available, file mapping\n");
+  else if ((size_t) x1 > 2000000)
+    {
+      fprintf (stderr, "pager over its budget\n");
+      return 1;
+    }
+  for (j = 0; j < SIZE * 8; j += 1000)
+    if (((char *) x)[j] != (char) (j / 1000))
+      {
+        fprintf (stderr, "paged allocation lost data at %d\n", j);
+        return 1;
+      }
+  if (memcmp ((char *) x + 1, "pager", 5) != 0)
+    {
+      fprintf (stderr, "read() into paged allocation failed\n");
+      return 1;
+    }
+/* realloc copies evicted clusters in with the lock held */
+  x = realloc (x, SIZE * 16);
+  for (j = 0; j < SIZE * 8; j += 1000)
+    if (((char *) x)[j] != (char) (j / 1000))
+      {
+        fprintf (stderr, "paged realloc lost data at %d\n", j);
+        return 1;
+      }
+  free (x);
+  free (x2);
+  exm_pager (0);
+
+
+  printf ("> compressed paging: cold clusters stored compressed\n");
+  x = exm_malloc (SIZE * 8, EXM_COMPRESS);
+  for (j = 0; j < SIZE * 8; j += 1000)
+    ((char *) x)[j] = (char) (j / 1000);
+  for (j = 0; j < SIZE * 8; j += 1000)
+    if (((char *) x)[j] != (char) (j / 1000))
+      {
+        fprintf (stderr, "compressed allocation lost data at %d\n", j);
+        return 1;
+      }
+  exm_stats (&stats);
+  printf ("> %lu bytes stored in %lu, %lu decompressions in %.3fs\n",
+          (unsigned long) stats.compressed_raw,
+          (unsigned long) stats.compressed_stored,
+          (unsigned long) stats.decompressions, stats.decompress_ns / 1e9);
+  if (stats.compressed_raw == 0)
+    printf ("> pager not available, file mapping\n");
+  else if (stats.compressed_stored * 4 > stats.compressed_raw
+           || stats.decompressions == 0)
+    {
+      fprintf (stderr, "sparse data did not compress\n");
+      return 1;
+    }
+/* Snapshots settle the allocation: the file must hold the data as is */
+  j = exm_snapshot (x, "/tmp/exm_test_snapshot");
+  f = fopen ("/tmp/exm_test_snapshot", "r");
+  if (j == 0 && f)
+    {
+      fseek (f, 7000, SEEK_SET);
+      j = fgetc (f) != 7
+        || ((char *) x)[SIZE * 4 / 1000 * 1000] != (char) (SIZE * 4 / 1000);
+    }
+  if (f)
+    fclose (f);
+  unlink ("/tmp/exm_test_snapshot");
+  if (j != 0)
+    {
+      fprintf (stderr, "compressed allocation settled wrong\n");
+      return 1;
+    }
+  free (x);
+
+
+  printf ("> growable reservation committed in place\n");
+  x = exm_reserve (SIZE * 16, EXM_SEQUENTIAL);
+  x1 = x;
+  for (j = 1; j <= 4 && x == x1; ++j)
+    {
+      if (exm_commit (x, SIZE * j) != 0)
+        {
+          fprintf (stderr, "exm_commit(x, %lu) failed\n", SIZE * j);
+          return 1;
+        }
+      ((char *) x)[SIZE * j - 1] = j;
+    }
+  x = realloc (x, SIZE * 8);
+  printf ("> exm_commit(x, %lu) = %d\n", SIZE * 32, exm_commit (x, SIZE * 32));
+  if (x != x1 || ((char *) x)[SIZE * 3 - 1] != 3 || ((char *) x)[SIZE * 8 - 1])
+    {
+      fprintf (stderr, "reservation moved or lost data\n");
+      return 1;
+    }
+/* Forked children keep committing in place, empty reservations too */
+  x2 = exm_reserve (SIZE, 0);
+  fflush (stdout);
+  p = fork ();
+  if (p == 0)
+    exit (realloc (x, SIZE * 12) != x1 || ((char *) x)[SIZE * 3 - 1] != 3
+          || exm_commit (x2, SIZE) != 0);
+  waitpid (p, &status, 0);
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0
+      || exm_size (x) != SIZE * 8)
+    {
+      fprintf (stderr, "reservation not committed in place in the child\n");
+      return 1;
+    }
+  free (x2);
+  x = realloc (x, SIZE * 32);
+  if (((char *) x)[SIZE * 4 - 1] != 4)
+    {
+      fprintf (stderr, "reservation lost data when moved\n");
+      return 1;
+    }
+  free (x);
+
+
+  printf ("> persistent allocation attached after free\n");
+  x = exm_malloc (SIZE, 0);
+  memset (x, 5, SIZE);
+  x1 = x;
+  j = exm_persist (x, "exm_test_persist");
+  free (x);
+  x = exm_attach ("exm_test_persist");
+  path = exm_lookup (x);
+  printf ("> exm_persist() = %d, attached %s at %s address\n", j, path,
+          x == x1 ? "the same" : "another");
+  free (path);
+  if (!x || ((char *) x)[SIZE - 1] != 5)
+    {
+      fprintf (stderr, "persistent allocation lost\n");
+      return 1;
+    }
+  exm_persist (x, NULL);
+  free (x);
+  if (exm_attach ("exm_test_persist") != NULL)
+    {
+      fprintf (stderr, "temporary allocation still attachable\n");
+      return 1;
+    }
+
+
+  printf ("> snapshot and incremental snapshot\n");
+  x = exm_malloc (SIZE * 4, 0);
+  memset (x, 1, SIZE * 4);
+  j = exm_snapshot (x, "/tmp/exm_test_snapshot");
+  ((char *) x)[10] = 2;
+  ((char *) x)[SIZE * 2] = 3;
+  ((char *) x)[SIZE * 2 + 1] = 3;
+  printf ("> exm_snapshot() = %d, pages written incrementally: %ld\n", j,
+          (long) exm_snapshot_incremental (x));
+  f = fopen ("/tmp/exm_test_snapshot", "r");
+  fseek (f, SIZE * 2, SEEK_SET);
+  j = fgetc (f);
+  fseek (f, 10, SEEK_SET);
+  j = j == 3 && fgetc (f) == 2;
+  fclose (f);
+  if (!j || exm_snapshot_incremental (x) != 0)
+    {
+      fprintf (stderr, "incremental snapshot missed writes\n");
+      return 1;
+    }
+  j = open ("/tmp/exm_test_snapshot", O_RDONLY);
+  status = read (j, (char *) x + SIZE, 4096) == 4096
+    && ((char *) x)[SIZE + 10] == 2 && exm_snapshot_incremental (x) > 0;
+  close (j);
+  if (!status)
+    {
+      fprintf (stderr, "read into a tracked allocation failed\n");
+      return 1;
+    }
+  unlink ("/tmp/exm_test_snapshot");
+  free (x);
+
+
+  printf ("> allocation published to another process\n");
+  x = exm_malloc (SIZE, 0);
+  memset (x, 0, SIZE);
+  printf ("> exm_publish() = %d\n", exm_publish (x, "exm_test_shared", 0));
+  p = fork ();
+  if (p == 0)
+    {
+      x1 = exm_attach_shared ("exm_test_shared", 0);
+      if (!x1 || exm_size (x1) != SIZE)
+        exit (1);
+      strcpy ((char *) x1 + SIZE / 2, "from the other process");
+      free (x1);
+      exit (0);
+    }
+  waitpid (p, &status, 0);
+  printf ("> hello %s\n", (char *) x + SIZE / 2);
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0
+      || strcmp ((char *) x + SIZE / 2, "from the other process") != 0)
+    {
+      fprintf (stderr, "shared allocation not seen by the other process\n");
+      return 1;
+    }
+  free (x);
+  if (access ("/tmp/exm_test_shared", F_OK) == 0)
+    {
+      fprintf (stderr, "shared allocation file left behind\n");
+      return 1;
+    }
+
+  printf ("> existing file mapped as an allocation\n");
+  f = fopen ("/tmp/exm_test_mapped", "w");
+  for (j = 0; j < SIZE; ++j)
+    fputc ('a', f);
+  fclose (f);
+  x = exm_map_file ("/tmp/exm_test_mapped", 0, 0, EXM_MAP_PRIVATE);
+  if (!x || exm_size (x) != SIZE || ((char *) x)[SIZE - 1] != 'a')
+    {
+      fprintf (stderr, "exm_map_file failed\n");
+      return 1;
+    }
+  ((char *) x)[0] = 'b';
+  p = fork ();
+  if (p == 0)
+    exit (((char *) x)[0] == 'b' ? 0 : 1);
+  waitpid (p, &status, 0);
+  x = realloc (x, 2 * SIZE);
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0 || !x
+      || ((char *) x)[0] != 'b' || ((char *) x)[SIZE - 1] != 'a')
+    {
+      fprintf (stderr, "private mapped file lost data\n");
+      return 1;
+    }
+  free (x);
+  x = exm_map_file ("/tmp/exm_test_mapped", 4096, 4096, EXM_MAP_SHARED);
+  if (x)
+    {
+      ((char *) x)[0] = 'c';
+      free (x);
+    }
+  f = fopen ("/tmp/exm_test_mapped", "r");
+  j = fgetc (f);
+  fseek (f, 4096, SEEK_SET);
+  status = fgetc (f);
+  fseek (f, 0, SEEK_END);
+  printf ("> mapped file bytes %c %c, size %ld\n", j, status, ftell (f));
+  if (j != 'a' || status != 'c' || ftell (f) != SIZE)
+    {
+      fprintf (stderr, "mapped file changed unexpectedly\n");
+      return 1;
+    }
+  fclose (f);
+  unlink ("/tmp/exm_test_mapped");
+
+  printf ("> zero-copy read and write of an allocation\n");
+  f = fopen ("/tmp/exm_test_io", "w");
+  for (j = 0; j < 2 * SIZE; ++j)
+    fputc ('a' + j % 26, f);
+  fclose (f);
+  x = exm_malloc (2 * SIZE, 0);
+  j = open ("/tmp/exm_test_io", O_RDONLY);
+  status = read (j, x, 2 * SIZE) == 2 * SIZE && ((char *) x)[27] == 'b';
+  close (j);
+  ((char *) x)[0] = 'z';
+  f = fopen ("/tmp/exm_test_io", "r+");
+  status = status && fwrite (x, 1, 2 * SIZE, f) == 2 * SIZE;
+  fclose (f);
+  f = fopen ("/tmp/exm_test_io", "r");
+  status = status && fgetc (f) == 'z';
+  fclose (f);
+  exm_zerocopy_info (&allocated, &capacity);
+  printf ("> zero-copy bytes in %lu out %lu\n", allocated, capacity);
+  if (!status || allocated < 2 * SIZE || capacity < 2 * SIZE)
+    {
+      fprintf (stderr, "zero-copy I/O failed\n");
+      return 1;
+    }
+  free (x);
+  unlink ("/tmp/exm_test_io");
+
+  printf ("> statistics\n");
+  x = exm_malloc (SIZE, 0);
+  memset (x, 1, SIZE);
+  x = realloc (x, 2 * SIZE);
+  exm_stats (&stats);
+  for (j = 0, status = 0; j < EXM_STATS_BUCKETS; ++j)
+    status += stats.latency[EXM_OP_MALLOC][j];
+  printf ("> %lu allocations, %lu reallocs, %lu maps of %lu bytes\n",
+          (unsigned long) stats.allocations, (unsigned long) stats.reallocs,
+          (unsigned long) stats.maps, (unsigned long) stats.bytes_mapped);
+  for (j = 0; (x1 = exm_map_info (j, &allocated, &capacity, NULL)); ++j)
+    if (x1 == x)
+      break;
+  if (stats.allocations < 1 || stats.reallocs < 1 || status < 1
+      || stats.bytes_mapped < 2 * SIZE || x1 != x || allocated != 2 * SIZE
+      || capacity < SIZE)
+    {
+      fprintf (stderr, "statistics missing\n");
+      return 1;
+    }
+  frees = stats.frees;
+  free (x);
+  exm_stats (&stats);
+  if (stats.frees != frees + 1)
+    {
+      fprintf (stderr, "free not counted\n");
+      return 1;
+    }
+
+  printf ("> monitor segment\n");
+  x = exm_malloc (SIZE, 0);
+  snprintf (buf, sizeof (buf), "%s/%s%d", EXM_MONITOR_DIR, EXM_MONITOR_PREFIX,
+            (int) getpid ());
+  j = open (buf, O_RDONLY);
+  mon = j < 0 ? MAP_FAILED : mmap (NULL, sizeof (struct monitor), PROT_READ,
+                                   MAP_SHARED, j, 0);
+  if (j >= 0)
+    close (j);
+  status = 0;
+/* Wait for the monitor thread to list the allocation */
+  for (j = 0; mon != MAP_FAILED && j < 50 && !status; ++j)
+    {
+      usleep (100000);
+      for (p = 0; p < mon->nmaps && p < EXM_MONITOR_MAPS; ++p)
+        if (mon->maps[p].addr == (uint64_t) (uintptr_t) x)
+          status = mon->maps[p].length == SIZE;
+    }
+  if (mon == MAP_FAILED || mon->magic != EXM_MONITOR_MAGIC
+      || mon->pid != getpid () || !status)
+    {
+      fprintf (stderr, "allocation not in the monitor segment %s\n", buf);
+      return 1;
+    }
+  printf ("> %s lists %d allocations of %s\n", buf, mon->nmaps,
+          mon->command);
+  munmap (mon, sizeof (struct monitor));
+  free (x);
+
+  printf ("> allocation trace\n");
+  if (exm_trace_file ("/tmp/exm_test_trace") < 0)
+    {
+      fprintf (stderr, "exm_trace_file failed\n");
+      return 1;
+    }
+  x = malloc (4 * SIZE);
+  x1 = realloc (x, 8 * SIZE);
+  free (x1);
+  x2 = exm_malloc (4 * SIZE, 0);
+  free (x2);
+  exm_trace_file (NULL);
+  snprintf (buf, sizeof (buf), "/tmp/exm_test_trace.%d", (int) getpid ());
+  f = fopen (buf, "r");
+  if (!f || fread (&th, sizeof (th), 1, f) != 1
+      || th.magic != EXM_TRACE_MAGIC || th.pid != getpid ()
+      || fread (ev, sizeof (struct trace_event), 5, f) != 5
+      || fread (&th, 1, 1, f) != 0)
+    {
+      fprintf (stderr, "bad trace %s\n", buf);
+      return 1;
+    }
+  fclose (f);
+  unlink (buf);
+  if (ev[0].type != EXM_TRACE_MALLOC || ev[0].addr != (uintptr_t) x
+      || ev[0].size != 4 * SIZE || !(ev[0].flags & EXM_TRACE_EXM)
+      || !(ev[2].flags & EXM_TRACE_EXM)
+      || !ev[0].site || ev[1].type != EXM_TRACE_REALLOC
+      || ev[1].old != (uintptr_t) x || ev[1].addr != (uintptr_t) x1
+      || ev[1].size != 8 * SIZE || ev[2].type != EXM_TRACE_FREE
+      || ev[2].addr != (uintptr_t) x1 || ev[2].t < ev[0].t
+      || ev[3].type != EXM_TRACE_MALLOC || ev[3].addr != (uintptr_t) x2
+      || !(ev[3].flags & EXM_TRACE_EXM) || ev[4].type != EXM_TRACE_FREE
+      || ev[4].addr != (uintptr_t) x2)
+    {
+      fprintf (stderr, "unexpected trace events\n");
+      return 1;
+    }
+  printf ("> traced malloc, realloc, exm_malloc and free from site %llx\n",
+          (unsigned long long) ev[0].site);
+
+  printf ("> access heatmap profile\n");
+  exm_profile (1);
+  x = malloc (4 * SIZE);
+  memset (x, 1, 4 * SIZE);
+/* Wait for a sample (one per second) */
+  sleep (2);
+  j = exm_profile_report ("/tmp/exm_test_profile");
+  exm_profile (0);
+  snprintf (buf, sizeof (buf), "%p ", x);
+  snprintf (line, sizeof (line), "/tmp/exm_test_profile.%d", (int) getpid ());
+  f = j < 0 ? NULL : fopen (line, "r");
+  status = 0;
+  while (f && fgets (line, sizeof (line), f))
+    {
+      if (strncmp (line, buf, strlen (buf)) == 0)
+        status = 1;
+      else if (status == 1 && strstr (line, "resident 100.0%"))
+        status = 2;
+    }
+  if (f)
+    fclose (f);
+  if (status != 2)
+    {
+      fprintf (stderr, "allocation %p missing from the profile\n", x);
+      return 1;
+    }
+  snprintf (line, sizeof (line), "/tmp/exm_test_profile.%d", (int) getpid ());
+  unlink (line);
+  free (x);
+
+  printf ("> concurrent allocation, copy and free from 4 threads\n");
+  exm_stats (&stats);
+  frees = stats.frees;
+  for (j = 0; j < 4; ++j)
+    {
+      churn[j].size = SIZE;
+      churn[j].fails = 0;
+      pthread_create (&threads[j], NULL, churn_job, &churn[j]);
+    }
+  for (j = 0, status = 0; j < 4; ++j)
+    {
+      pthread_join (threads[j], NULL);
+      status += churn[j].fails;
+    }
+  exm_stats (&stats);
+  if (status > 0 || stats.frees - frees != 4 * 50 * 2)
+    {
+      fprintf (stderr, "concurrent use: %d bad copies, %lu exm frees\n",
+               status, (unsigned long) (stats.frees - frees));
+      return 1;
+    }
+
+
+  printf ("> policy rules: backend and tier by size range and function\n");
+  f = fopen ("/tmp/exm_test_policy", "w");
+  fprintf (f, "# test policy\n"
+           "size=500K-2M func=malloc backend=heap\n"
+           "size=100K-500K tier=/dev/shm backend=exm advice=random\n");
+  fclose (f);
+  printf ("> exm_policy() = %d\n", exm_policy ("/tmp/exm_test_policy"));
+  unlink ("/tmp/exm_test_policy");
+  x = malloc (SIZE + 1);
+  if ((path = exm_lookup (x)) != NULL)
+    {
+      fprintf (stderr, "heap rule ignored: %s\n", path);
+      return 1;
+    }
+  free (x);
+  x = calloc (SIZE + 1, 1);
+  path = exm_lookup (x);
+  printf ("> calloc above threshold (no rule): %s\n", path);
+  free (path);
+  free (x);
+  x = malloc (200000);
+  path = exm_lookup (x);
+  printf ("> malloc below threshold (tier rule): %s\n", path);
+  if (!path || strncmp (path, "/dev/shm/", 9) != 0)
+    {
+      fprintf (stderr, "tier rule ignored\n");
+      return 1;
+    }
+  free (path);
+  free (x);
+  if (exm_policy ("") != 0)
+    {
+      fprintf (stderr, "policy not cleared\n");
+      return 1;
+    }
+
+
+  printf ("> thread-local thresholds and scopes in concurrent threads\n");
+  for (j = 0; j < 4; ++j)
+    pthread_create (&threads[j], NULL, local_job, &jobs[j]);
+  for (j = 0; j < 4; ++j)
+    {
+      pthread_join (threads[j], NULL);
+      printf ("> thread %d misplaced allocations: %d\n", j, jobs[j].fails);
+      if (jobs[j].fails > 0)
+        return 1;
+    }
+
+
+  printf ("> call-site learning: short-lived allocations move to the heap\n");
+/* Start cold, from a private table (see the test target in the Makefile) */
+  if (getenv ("EXM_LEARN_FILE"))
+    unlink (getenv ("EXM_LEARN_FILE"));
+  exm_learn (1);
+  status = 0;
+  for (j = 0; j < 3; ++j)
+    {
+      x = malloc ((size_t) 1 << 26);
+      path = exm_lookup (x);
+      printf ("> allocation %d: %s\n", j, path ? path : "heap");
+      on_exm = path != NULL;
+      if (j == 0 && !on_exm && getenv ("EXM_LEARN_FILE"))
+        status = 1;
+      free (x);
+      free (path);
+    }
+  exm_learn (0);
+  if (getenv ("EXM_LEARN_FILE"))
+    unlink (getenv ("EXM_LEARN_FILE"));
+  if (status)
+    {
+      fprintf (stderr, "cold call site did not follow the threshold\n");
+      return 1;
+    }
+  if (on_exm)
+    {
+      fprintf (stderr, "short-lived call site still allocates with exm\n");
+      return 1;
+    }
+
+
   printf ("> malloc above threshold + copy on write fork\n");
   x = malloc (SIZE + 1);
   memcpy (x, (const void *) y, strlen (y));
-  pid_t p = fork ();
+  p = fork ();
   if (p == 0)                   // child
     {
       sprintf (x, "child");
@@ -122,12 +934,12 @@ main (int argc, void **argv)
     }
   sleep (1);
   kill (p, SIGTERM);
+  reap (p);
 // If you comment out free(x) above, then the allocation in the child leaks
 // above because finalize not run when process is terminated by a signal with
 // no registered handler.  Also illustrate that child writes are COW.
   printf ("> hello from parent process address %p, value: %s\n", x, (char *) x);
   free (x);
-  wait (0);
 
 
 // This test is just as above but using a shared writable map between
@@ -147,9 +959,9 @@ main (int argc, void **argv)
     }
   sleep (1);
   kill (p, SIGTERM);
+  reap (p);
   printf ("> hello from parent process address %p, value: %s\n", x, (char *) x);
   free (x);
-  wait (0);
 
 // This test is just as above but using sendfile to copy backing file
 // in the child.
@@ -167,9 +979,9 @@ main (int argc, void **argv)
     }
   sleep (1);
   kill (p, SIGTERM);
+  reap (p);
   printf ("> hello from parent process address %p, value: %s\n", x, (char *) x);
   free (x);
-  wait (0);
 
   printf ("> test complete\n");
   return 0;
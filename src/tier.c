@@ -0,0 +1,362 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/statvfs.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include "uthash.h"
+#include "exm.h"
+
+/* Tiered data placement
+ *
+ * The data path is an ordered, colon-separated list of directories, each with
+ * an optional byte capacity following an '@' character and accepting K, M, G
+ * or T suffixes, for example:
+ *
+ *   /mnt/optane@64G:/mnt/nvme0:/mnt/nvme1
+ *
+ * New backing files are placed in a tier chosen by exm_tier_mode:
+ * EXM_TIER_FILL        the first tier with room (capacity and file system)
+ * EXM_TIER_ROUNDROBIN  the next tier with room after the last one used
+ * EXM_TIER_FREE        the tier with room and the most statvfs free space
+ *
+ * Policy rules (see policy.c) may name directories that are not listed in the
+ * data path. Those are added as pinned tiers, which only receive allocations
+ * that ask for them.
+ *
+ * A tier index names a directory for the life of the process: allocations,
+ * policy rules and thread scopes keep indices, so a new data path (exm_path)
+ * does not move tiers around. Directories it lists keep their index, new ones
+ * take free entries, and ones it drops become pinned tiers, still holding
+ * their allocations. exm_tier_order lists the data path tiers in order, for
+ * placement. Dropped tiers with nothing allocated are reused when the table
+ * is full.
+ *
+ * Nothing here may allocate memory, these functions are used from within the
+ * interposed malloc. All functions assume that the caller holds the lock.
+ */
+
+struct tier exm_tiers[EXM_MAX_TIERS];
+int exm_ntiers = 0;
+int exm_tier_order[EXM_MAX_TIERS];      /* Data path tiers, in order */
+int exm_nlisted = 0;            /* Entries in exm_tier_order */
+int exm_tier_mode = EXM_TIER_FILL;
+size_t exm_tier_total = 0;      /* Bytes allocated in all tiers */
+size_t exm_tier_peak = 0;       /* Largest exm_tier_total so far */
+static int tier_next = 0;
+
+/* Parse a byte count like 100, 64K, 2G ending at or before end (or at the
+ * end of the string when end is NULL)
+ */
+size_t
+exm_parse_size (const char *s, const char *end)
+{
+  char *e;
+  unsigned long long v;
+  errno = 0;
+  v = strtoull (s, &e, 0);
+  if (errno != 0 || e == s)
+    return 0;
+  if (end == NULL)
+    end = e + strlen (e);
+  if (e < end)
+    switch (*e)
+      {
+      case 'T': case 't':
+        v <<= 10;               /* fall through */
+      case 'G': case 'g':
+        v <<= 10;               /* fall through */
+      case 'M': case 'm':
+        v <<= 10;               /* fall through */
+      case 'K': case 'k':
+        v <<= 10;
+      }
+  return (size_t) v;
+}
+
+/* Parse a tier specification into exm_tiers.
+ * INPUT spec: colon-separated list of dir[@capacity] entries
+ * OUTPUT (return value): number of tiers, or -1 on error (tiers unchanged)
+ * Allocated byte counts are retained for directories that remain listed.
+ */
+int
+exm_tier_parse (const char *spec)
+{
+  struct tier t[EXM_MAX_TIERS];
+  int slot[EXM_MAX_TIERS], used[EXM_MAX_TIERS];
+  const char *p, *q, *at;
+  size_t len;
+  int i, j, n = 0, ntiers = exm_ntiers;
+
+  memset (t, 0, sizeof (t));
+  memset (used, 0, sizeof (used));
+  p = spec;
+  while (p && *p)
+    {
+      q = strchrnul (p, ':');
+      at = memchr (p, '@', q - p);
+      len = (at ? at : q) - p;
+      if (len > 0)
+        {
+          if (n == EXM_MAX_TIERS || len >= sizeof (t[n].path))
+            return -1;
+          memcpy (t[n].path, p, len);
+          if (at)
+            t[n].capacity = exm_parse_size (at + 1, q);
+          n++;
+        }
+      p = *q ? q + 1 : q;
+    }
+  if (n == 0)
+    return -1;
+/* Known directories keep their entries, new ones take the next free entry,
+ * then unused dropped ones
+ */
+  for (i = 0; i < n; ++i)
+    for (slot[i] = -1, j = 0; j < exm_ntiers && slot[i] < 0; ++j)
+      if (strcmp (t[i].path, exm_tiers[j].path) == 0)
+        used[slot[i] = j] = 1;
+  for (i = 0; i < n; ++i)
+    if (slot[i] < 0)
+      {
+        if (ntiers < EXM_MAX_TIERS)
+          slot[i] = ntiers++;
+        else
+          for (j = 0; j < exm_ntiers && slot[i] < 0; ++j)
+            if (!used[j] && exm_tiers[j].allocated == 0)
+              slot[i] = j;
+        if (slot[i] < 0)
+          return -1;
+        used[slot[i]] = 1;
+      }
+  for (j = 0; j < exm_ntiers; ++j)
+    if (!used[j])
+      exm_tiers[j].pinned = 1;
+  for (i = 0; i < n; ++i)
+    {
+      if (slot[i] >= exm_ntiers || strcmp (t[i].path, exm_tiers[slot[i]].path))
+        t[i].allocated = 0;
+      else
+        t[i].allocated = exm_tiers[slot[i]].allocated;
+      exm_tiers[slot[i]] = t[i];
+      exm_tier_order[i] = slot[i];
+    }
+  exm_ntiers = ntiers;
+  exm_nlisted = n;
+  tier_next = 0;
+  return n;
+}
+
+/* Free bytes available to unprivileged users in a tier's file system */
+static size_t
+tier_avail (int i)
+{
+  struct statvfs s;
+  if (statvfs (exm_tiers[i].path, &s) != 0)
+    return 0;
+  return (size_t) s.f_bavail * s.f_frsize;
+}
+
+/* Does an allocation of size bytes fit in tier i? */
+static int
+tier_fits (int i, size_t size, size_t *avail)
+{
+  struct tier *t = &exm_tiers[i];
+  if (t->pinned)
+    return 0;
+  if (t->capacity > 0 && t->allocated + size > t->capacity)
+    return 0;
+  *avail = tier_avail (i);
+  return *avail >= size;
+}
+
+/* Select a tier for a new backing file of the given size.
+ * OUTPUT (return value): tier index, or -1 if no tier has room
+ */
+int
+exm_tier_select (size_t size)
+{
+  int i, k, best = -1;
+  size_t avail, most = 0;
+
+  if (exm_nlisted == 1)
+    return tier_fits (exm_tier_order[0], size, &avail) ? exm_tier_order[0]
+      : -1;
+  switch (exm_tier_mode)
+    {
+    case EXM_TIER_ROUNDROBIN:
+      for (k = 0; k < exm_nlisted; ++k)
+        {
+          i = exm_tier_order[(tier_next + k) % exm_nlisted];
+          if (tier_fits (i, size, &avail))
+            {
+              tier_next = (tier_next + k + 1) % exm_nlisted;
+              return i;
+            }
+        }
+      break;
+    case EXM_TIER_FREE:
+      for (k = 0; k < exm_nlisted; ++k)
+        if (tier_fits (i = exm_tier_order[k], size, &avail) && avail > most)
+          {
+            most = avail;
+            best = i;
+          }
+      return best;
+    default:
+      for (k = 0; k < exm_nlisted; ++k)
+        if (tier_fits (i = exm_tier_order[k], size, &avail))
+          return i;
+    }
+  return -1;
+}
+
+/* Select tier i for a new backing file of the given size if it has room,
+ * even when pinned, otherwise any tier as exm_tier_select does.
+ */
+int
+exm_tier_prefer (int i, size_t size)
+{
+  struct tier *t;
+  if (i < 0 || i >= exm_ntiers)
+    return exm_tier_select (size);
+  t = &exm_tiers[i];
+  if ((t->capacity == 0 || t->allocated + size <= t->capacity)
+      && tier_avail (i) >= size)
+    return i;
+  return exm_tier_select (size);
+}
+
+/* Find the tier for directory path, adding it as a pinned tier if it is not
+ * in the data path.
+ * OUTPUT (return value): tier index or -1 when the tier table is full
+ */
+int
+exm_tier_find (const char *path)
+{
+  int i;
+  for (i = 0; i < exm_ntiers; ++i)
+    if (strcmp (exm_tiers[i].path, path) == 0)
+      return i;
+  if (exm_ntiers == EXM_MAX_TIERS || strlen (path) >= sizeof (exm_tiers[0].path))
+    return -1;
+  memset (&exm_tiers[exm_ntiers], 0, sizeof (struct tier));
+  strcpy (exm_tiers[exm_ntiers].path, path);
+  exm_tiers[exm_ntiers].pinned = 1;
+  return exm_ntiers++;
+}
+
+/* The first tier in the data path on a memory file system (tmpfs or ramfs)
+ * OUTPUT (return value): tier index or -1 if there is none
+ */
+int
+exm_tier_memory ()
+{
+  struct statfs s;
+  int i, k;
+  for (k = 0; k < exm_nlisted; ++k)
+    if (statfs (exm_tiers[i = exm_tier_order[k]].path, &s) == 0
+        && (s.f_type == TMPFS_MAGIC || s.f_type == RAMFS_MAGIC))
+      return i;
+  return -1;
+}
+
+/* Select the next tier in the data path after the given one (cyclically, -1
+ * to start at the first tier) with room for size bytes regardless of
+ * exm_tier_mode. Used to spread stripes across devices.
+ * OUTPUT (return value): tier index, or -1 if no tier has room
+ */
+int
+exm_tier_next (int tier, size_t size)
+{
+  int i, k, at = -1;
+  size_t avail;
+  for (k = 0; k < exm_nlisted; ++k)
+    if (exm_tier_order[k] == tier)
+      at = k;
+  for (k = 1; k <= exm_nlisted; ++k)
+    {
+      i = exm_tier_order[(at + k) % exm_nlisted];
+      if (tier_fits (i, size, &avail))
+        return i;
+    }
+  return -1;
+}
+
+/* Account for bytes added to or removed from a tier's backing files */
+void
+exm_tier_charge (int tier, size_t size)
+{
+  if (tier < 0 || tier >= exm_ntiers)
+    return;
+  exm_tiers[tier].allocated += size;
+  exm_tier_total += size;
+  if (exm_tier_total > exm_tier_peak)
+    exm_tier_peak = exm_tier_total;
+}
+
+void
+exm_tier_release (int tier, size_t size)
+{
+  if (tier < 0 || tier >= exm_ntiers)
+    return;
+  if (exm_tiers[tier].allocated < size)
+    size = exm_tiers[tier].allocated;
+  exm_tiers[tier].allocated -= size;
+  exm_tier_total -= size < exm_tier_total ? size : exm_tier_total;
+}
+
+/* API: Set/get the tier placement policy
+ * INPUT j: one of EXM_TIER_FILL (0), EXM_TIER_ROUNDROBIN (1), EXM_TIER_FREE
+ *          (2), or a negative value to leave the policy unchanged
+ * OUTPUT (return value): the policy in effect
+ */
+int
+exm_tier_policy (int j)
+{
+  exm_lock ();
+  if (j >= EXM_TIER_FILL && j <= EXM_TIER_FREE)
+    exm_tier_mode = j;
+  j = exm_tier_mode;
+  exm_unlock ();
+  return j;
+}
+
+/* API: Report tier usage
+ * INPUT i: tier index, 0 <= i < number of tiers
+ * OUTPUT allocated: bytes currently allocated by this process in the tier
+ *        capacity:  configured capacity limit in bytes (zero means none)
+ *        avail:     free space in the tier's file system
+ * Any of the output pointers may be NULL.
+ * (return value): strdup copy of the tier directory that the caller must
+ *        free, or NULL if i is out of range.
+ */
+char *
+exm_tier_info (int i, size_t * allocated, size_t * capacity, size_t * avail)
+{
+  char *p = NULL;
+  exm_lock ();
+  if (i >= 0 && i < exm_ntiers)
+    {
+      if (allocated)
+        *allocated = exm_tiers[i].allocated;
+      if (capacity)
+        *capacity = exm_tiers[i].capacity;
+      if (avail)
+        *avail = tier_avail (i);
+      p = strndup (exm_tiers[i].path, sizeof (exm_tiers[i].path));
+    }
+  exm_unlock ();
+  return p;
+}
@@ -0,0 +1,380 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uthash.h"
+#include "exm.h"
+#include "trace.h"
+
+/* Allocation trace recorder
+ *
+ * Choosing a threshold and advice for a job is easier with a record of what
+ * it allocates. With EXM_TRACE=path (or exm_trace_file) every malloc, calloc,
+ * valloc and realloc of at least exm_trace_min bytes (EXM_TRACE_MIN, default
+ * 1M), wherever it ends up, the free of such an allocation, and fork are
+ * written to path.<pid> as fixed size events (layout in trace.h): time,
+ * thread, size, addresses, the call site hash (the key site.c learns by) and
+ * whether the allocation is an exm mapping. Allocations made through the API
+ * (exm_malloc, exm_reserve, exm_attach, exm_map_file, ...) count as malloc
+ * or calloc events of exm mappings. Lifetimes and realloc chains follow from
+ * the addresses. exm-replay simulates a trace against other
+ * thresholds or replays it under libexm.so.
+ *
+ * Recording must not serialize the threads it watches: each thread appends
+ * to its own ring of EXM_TRACE_RING events, published with a release store
+ * of the head. Rings are written to the file under a mutex, by their thread
+ * when full and for all threads at fork, exit or when tracing stops. Rings of
+ * threads that exit are flushed and reused. Locking order: the trace mutex
+ * before the exm lock, never the other way round. Forked children trace to
+ * their own file, with the parent's pid in the header.
+ */
+
+#define EXM_TRACE_RING 4096     /* events per ring, a power of two */
+
+struct ring
+{
+  struct trace_event ev[EXM_TRACE_RING];
+  uint64_t head;                /* Next event, written by the owner */
+  uint64_t tail;                /* Next event to flush, under flush_lock */
+  int used;                     /* Claimed by a thread */
+  uint32_t tid;
+  struct ring *next;
+};
+
+int exm_trace_mode = 0;
+size_t exm_trace_min = (size_t) 1 << 20;
+char exm_trace_path[EXM_MAX_PATH_LEN] = "";
+
+static struct ring *rings;
+static __thread struct ring *mine __attribute__ ((tls_model ("initial-exec")));
+static __thread int busy __attribute__ ((tls_model ("initial-exec")));
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static int keyed;
+static int fd = -1;
+static uint64_t start_ns;
+
+/* Write the unflushed events of ring r. Caller holds flush_lock. */
+static void
+drain (struct ring *r)
+{
+  uint64_t h = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE), t = r->tail, n;
+  const char *p;
+  ssize_t s;
+  size_t len;
+
+  while (t < h)
+    {
+      n = EXM_TRACE_RING - (t & (EXM_TRACE_RING - 1));
+      if (n > h - t)
+        n = h - t;
+      p = (const char *) &r->ev[t & (EXM_TRACE_RING - 1)];
+      len = n * sizeof (struct trace_event);
+      while (fd >= 0 && len > 0)
+        {
+          s = write (fd, p, len);
+          if (s < 0 && errno == EINTR)
+            continue;
+          if (s <= 0)
+            {
+              syslog (LOG_CRIT, "exm unable to write trace %s\n",
+                      exm_trace_path);
+              close (fd);
+              fd = -1;
+              break;
+            }
+          p += s;
+          len -= (size_t) s;
+        }
+      t += n;
+    }
+  __atomic_store_n (&r->tail, t, __ATOMIC_RELEASE);
+}
+
+static void
+drain_all (void)
+{
+  struct ring *r;
+  for (r = __atomic_load_n (&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    drain (r);
+}
+
+/* Thread exit: flush the thread's ring and give it up */
+static void
+release (void *p)
+{
+  struct ring *r = (struct ring *) p;
+  pthread_mutex_lock (&flush_lock);
+  drain (r);
+  pthread_mutex_unlock (&flush_lock);
+  mine = NULL;
+  __atomic_store_n (&r->used, 0, __ATOMIC_RELEASE);
+}
+
+/* A ring for this thread, reusing one given up by an exited thread */
+static struct ring *
+claim (void)
+{
+  struct ring *r;
+  int zero;
+  for (r = __atomic_load_n (&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    {
+      zero = 0;
+      if (__atomic_compare_exchange_n (&r->used, &zero, 1, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        break;
+    }
+  if (!r)
+    {
+      r = mmap (NULL, sizeof (struct ring), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (r == MAP_FAILED)
+        return NULL;
+      r->used = 1;
+      r->next = __atomic_load_n (&rings, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n (&rings, &r->next, r, 1,
+                                           __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED));
+    }
+  r->tid = (uint32_t) syscall (SYS_gettid);
+  pthread_setspecific (ring_key, r);
+  mine = r;
+  return r;
+}
+
+/* Open path.<pid> and write its header. Caller holds flush_lock.
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+static int
+create (pid_t ppid)
+{
+  char path[EXM_MAX_PATH_LEN + 16];
+  struct trace_header h;
+
+  snprintf (path, sizeof (path), "%s.%d", exm_trace_path, (int) getpid ());
+  fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  memset (&h, 0, sizeof (h));
+  h.magic = EXM_TRACE_MAGIC;
+  h.event_size = sizeof (struct trace_event);
+  h.pid = (int32_t) getpid ();
+  h.ppid = (int32_t) ppid;
+  h.start_ns = start_ns;
+  h.threshold = exm_alloc_threshold;
+  h.min = exm_trace_min;
+  snprintf (h.command, sizeof (h.command), "%s",
+            program_invocation_short_name);
+  if (write (fd, &h, sizeof (h)) != sizeof (h))
+    {
+      close (fd);
+      fd = -1;
+      unlink (path);
+      return -1;
+    }
+  return 0;
+}
+
+/* Append an event to this thread's ring */
+static void
+record (int type, void *addr, void *old, size_t size, uint64_t site,
+        int flags)
+{
+  struct ring *r = mine ? mine : claim ();
+  struct trace_event *e;
+  uint64_t h;
+
+  if (!r)
+    return;
+  h = r->head;
+  if (h - __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE) >= EXM_TRACE_RING)
+    {
+      pthread_mutex_lock (&flush_lock);
+      drain (r);
+      pthread_mutex_unlock (&flush_lock);
+    }
+  e = &r->ev[h & (EXM_TRACE_RING - 1)];
+  e->t = exm_clock () - start_ns;
+  e->addr = (uint64_t) (uintptr_t) addr;
+  e->old = (uint64_t) (uintptr_t) old;
+  e->size = size;
+  e->site = site;
+  e->tid = r->tid;
+  e->type = (uint16_t) type;
+  e->flags = (uint16_t) flags;
+  __atomic_store_n (&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+/* Size of the allocation at addr, an exm mapping (*exm set) or a heap block;
+ * for a reservation (reserve.c), the reserved size. Heap blocks that cannot be exm mappings (see exm_maybe_map) are sized
+ * without the lock.
+ */
+size_t
+exm_trace_size (void *addr, int *exm)
+{
+  struct map *m;
+  size_t n = 0;
+  if (!exm_maybe_map (addr))
+    {
+      if (exm)
+        *exm = 0;
+      return malloc_usable_size (addr);
+    }
+  exm_lock ();
+  HASH_FIND_PTR (flexmap, &addr, m);
+  if (m)
+    n = m->reserved > 0 ? m->reserved : m->length;
+  exm_unlock ();
+  if (exm)
+    *exm = m != NULL;
+  return m ? n : malloc_usable_size (addr);
+}
+
+/* Record an event. exm is 1 when addr is an exm mapping, 0 when it is not,
+ * -1 to look it up. For EXM_TRACE_FREE, pass the address before it is freed;
+ * frees of blocks smaller than exm_trace_min are dropped. For EXM_TRACE_FORK,
+ * old is the child pid. noinline keeps the call site hash stable (site.c).
+ */
+void __attribute__ ((noinline))
+exm_trace_event (int type, void *addr, void *old, size_t size, int exm)
+{
+  uint64_t site = 0;
+  if (!exm_trace_mode || busy || fd < 0)
+    return;
+  busy = 1;
+  if (type == EXM_TRACE_FREE)
+    {
+      size = exm_trace_size (addr, &exm);
+      if (size < exm_trace_min)
+        {
+          busy = 0;
+          return;
+        }
+    }
+  else if (type != EXM_TRACE_FORK)
+    {
+      if (exm < 0)
+        exm_trace_size (addr, &exm);
+      site = exm_site_hash ();
+    }
+  record (type, addr, old, size, site, exm ? EXM_TRACE_EXM : 0);
+  busy = 0;
+}
+
+/* Start tracing to exm_trace_path
+ * OUTPUT (return value): 0 on success, -1 on error
+ */
+int
+exm_trace_start (void)
+{
+  int j = 0;
+  pthread_mutex_lock (&flush_lock);
+  if (!keyed)
+    keyed = pthread_key_create (&ring_key, release) == 0;
+  if (fd < 0)
+    {
+      start_ns = exm_clock ();
+      j = keyed ? create (0) : -1;
+    }
+  exm_trace_mode = fd >= 0;
+  pthread_mutex_unlock (&flush_lock);
+  if (j < 0)
+    syslog (LOG_CRIT, "exm unable to start trace %s\n", exm_trace_path);
+  return j;
+}
+
+/* Stop tracing, flushing all rings. Not with the exm lock held. */
+void
+exm_trace_finish (void)
+{
+  pthread_mutex_lock (&flush_lock);
+  exm_trace_mode = 0;
+  drain_all ();
+  if (fd >= 0)
+    close (fd);
+  fd = -1;
+  pthread_mutex_unlock (&flush_lock);
+}
+
+/* Before fork: flush, and hold the mutex across fork so that the child does
+ * not inherit it locked by another thread
+ */
+void
+exm_trace_prepare (void)
+{
+  pthread_mutex_lock (&flush_lock);
+  drain_all ();
+}
+
+/* After fork in the parent: child is the new process, or -1 */
+void
+exm_trace_parent (pid_t child)
+{
+  pthread_mutex_unlock (&flush_lock);
+  if (child > 0)
+    exm_trace_event (EXM_TRACE_FORK, NULL, (void *) (uintptr_t) child, 0,
+                     0);
+}
+
+/* After fork in the child: drop the parent's unflushed events (still in the
+ * parent's rings) and the rings of threads that do not exist here, and trace
+ * to a file of our own
+ */
+void
+exm_trace_child (void)
+{
+  struct ring *r;
+  for (r = rings; r; r = r->next)
+    {
+      r->tail = r->head;
+      if (r != mine)
+        r->used = 0;
+    }
+  if (mine)
+    mine->tid = (uint32_t) syscall (SYS_gettid);
+  if (fd >= 0)
+    {
+      close (fd);
+      fd = -1;
+      create (getppid ());
+    }
+  exm_trace_mode = fd >= 0;
+  pthread_mutex_unlock (&flush_lock);
+}
+
+/* API: Start or stop tracing
+ * INPUT path: trace file prefix, events go to path.<pid>; NULL to stop
+ *       tracing
+ * OUTPUT (return value): 0 on success, -1 on error (errno from open)
+ * A trace in progress is flushed and closed first.
+ */
+int
+exm_trace_file (const char *path)
+{
+  exm_trace_finish ();
+  if (!path)
+    return 0;
+  if (strlen (path) >= EXM_MAX_PATH_LEN)
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  snprintf (exm_trace_path, EXM_MAX_PATH_LEN, "%s", path);
+  return exm_trace_start ();
+}
@@ -0,0 +1,57 @@
+/*
+  ___  _  ______ ___
+ / _ \| |/_/ __ `__ \
+/  __/>  </ / / / / /
+\___/_/|_/_/ /_/ /_/
+
+ Allocation trace file format, shared by libexm.so (trace.c) and
+ exm-replay (exm-replay.c)
+*/
+#ifndef EXM_TRACE_H
+#define EXM_TRACE_H
+
+#include <stdint.h>
+
+#define EXM_TRACE_MAGIC 0x31304352544d5845ULL   /* "EXMTRC01" */
+
+/* Event types */
+#define EXM_TRACE_MALLOC 0
+#define EXM_TRACE_CALLOC 1
+#define EXM_TRACE_VALLOC 2
+#define EXM_TRACE_REALLOC 3
+#define EXM_TRACE_FREE 4
+#define EXM_TRACE_FORK 5
+
+/* Event flags */
+#define EXM_TRACE_EXM 1         /* The allocation is an exm mapping */
+
+/* A trace file starts with a header, followed by events in the order they
+ * were flushed: ordered within a thread, interleaved in blocks across
+ * threads (sort by time).
+ */
+struct trace_header
+{
+  uint64_t magic;               /* EXM_TRACE_MAGIC */
+  uint32_t event_size;          /* sizeof (struct trace_event) */
+  int32_t pid;                  /* Traced process */
+  int32_t ppid;                 /* Parent, for forked children */
+  uint32_t pad;
+  uint64_t start_ns;            /* CLOCK_MONOTONIC time of event time 0 */
+  uint64_t threshold;           /* exm threshold when tracing started */
+  uint64_t min;                 /* Smallest allocation traced */
+  char command[64];             /* Program name */
+};
+
+struct trace_event
+{
+  uint64_t t;                   /* Nanoseconds since start_ns */
+  uint64_t addr;                /* Allocation (new address for realloc) */
+  uint64_t old;                 /* Old address (realloc), child pid (fork) */
+  uint64_t size;                /* Bytes (new size for realloc) */
+  uint64_t site;                /* Call site hash (see site.c), 0 if unknown */
+  uint32_t tid;                 /* Thread id */
+  uint16_t type;                /* EXM_TRACE_MALLOC, ... */
+  uint16_t flags;               /* EXM_TRACE_EXM */
+};
+
+#endif